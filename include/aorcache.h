@@ -0,0 +1,160 @@
+/**
+ * @file aorcache.h Definitions for the AoRCache class
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// AoRCache is an in-process cache of registration data read from, or
+/// written to, the memcached cluster.
+///
+///
+
+#ifndef AORCACHE_H__
+#define AORCACHE_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "memcachedstore.h"
+
+class Statistic;
+
+namespace RegData {
+
+  /// @class RegData::AoRCache
+  ///
+  /// A size-bounded, sharded cache of deserialized AoRs keyed by AoR ID.
+  ///
+  /// Entries live for a short TTL, so another node's writes are visible
+  /// here after at most that long.  Each entry keeps the memcached CAS
+  /// value it was read with, so a write through a stale cached copy is
+  /// rejected by memcached.  The store then invalidates the entry and the
+  /// caller's retry reads a fresh copy.
+  ///
+  /// Entries stored after a successful write have the new CAS memcached
+  /// returned, so the writer can update the AoR again without re-reading.
+  class AoRCache
+  {
+  public:
+    /// Counters, totalled across all shards.
+    struct Stats
+    {
+      /// Lookups answered from the cache.
+      uint64_t hits;
+
+      /// Lookups that weren't in the cache, or whose entry had expired.
+      uint64_t misses;
+
+      /// Entries dropped because a write through them was rejected.
+      uint64_t stale;
+
+      /// Entries currently in the cache.
+      uint64_t entries;
+    };
+
+    /// Constructor.
+    AoRCache(size_t max_entries,
+             ///< maximum number of AoRs to cache
+             int ttl_ms,
+             ///< how long an entry may be used for
+             Statistic* statistic = NULL,
+             ///< if not NULL, counters are reported here; not owned
+             int num_shards = DEFAULT_SHARDS);
+             ///< number of independently locked shards
+    ~AoRCache();
+
+    /// Look up an AoR, returning a copy (including its CAS) for the caller
+    /// to own, or NULL if there is no usable entry.
+    MemcachedAoR* get(const std::string& aor_id);
+
+    /// Cache a copy of an AoR, replacing any existing entry.
+    void put(const std::string& aor_id, const MemcachedAoR& aor_data);
+
+    /// Drop any entry for an AoR because a write through it was rejected.
+    void invalidate(const std::string& aor_id);
+
+    /// Drop every entry.
+    void clear();
+
+    /// Get the current values of the counters.
+    Stats stats();
+
+    /// Default number of shards.
+    static const int DEFAULT_SHARDS = 16;
+
+    /// How often (in milliseconds) the counters are reported.
+    static const int REPORT_INTERVAL_MS = 1000;
+
+  private:
+    struct Entry
+    {
+      MemcachedAoR aor_data;
+      uint64_t expiry_ms;
+      std::list<std::string>::iterator lru;
+    };
+
+    struct Shard
+    {
+      pthread_mutex_t lock;
+      std::map<std::string, Entry> entries;
+
+      /// AoR IDs, most recently used first.
+      std::list<std::string> lru;
+
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t stale;
+    };
+
+    Shard& shard_for(const std::string& aor_id);
+    void erase(Shard& shard, std::map<std::string, Entry>::iterator i);
+    void maybe_report(uint64_t now_ms);
+    static uint64_t now_ms();
+
+    std::vector<Shard*> _shards;
+    size_t _max_entries_per_shard;
+    int _ttl_ms;
+
+    Statistic* _statistic;
+    pthread_mutex_t _report_lock;
+    volatile uint64_t _next_report_ms;
+  };
+
+} // namespace RegData
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * @file aorcodec.h Binary encoding of registration data records.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// AoRCodec converts AoR objects to and from the compact binary format
+/// used to hold registration data in the memcached cluster.
+///
+
+#ifndef AORCODEC_H__
+#define AORCODEC_H__
+
+#include <string>
+#include <stdint.h>
+
+#include "regdata.h"
+
+namespace RegData {
+
+  /// @class RegData::AoRCodec
+  ///
+  /// Encodes and decodes AoR records.
+  ///
+  /// A record starts with a five byte header - three magic bytes, a version
+  /// byte and a flags byte.  The body that follows holds the bindings, with
+  /// every integer encoded as a base-128 varint and every string as a varint
+  /// length followed by the raw bytes.  Bodies larger than
+  /// COMPRESS_THRESHOLD bytes are deflated if that makes them smaller.
+  ///
+  /// Records written before the format was versioned (which start with a
+  /// native-endian binding count and hold NUL-terminated strings) are still
+  /// accepted by decode().
+  class AoRCodec
+  {
+  public:
+    /// Encode the bindings in the AoR, replacing the contents of out.
+    static void encode(AoR* aor_data, std::string& out);
+
+    /// Decode a record, adding the bindings it holds to aor_data.  The
+    /// record is read directly from the supplied buffer, so this may be
+    /// passed the value buffer returned by the memcached client.  Returns
+    /// false if the record is malformed, in which case aor_data may hold
+    /// a partial set of bindings.
+    static bool decode(const char* data, size_t length, AoR* aor_data);
+
+    /// Current version of the record format.
+    static const uint8_t VERSION = 1;
+
+    /// Flag set in the header if the body is deflated.
+    static const uint8_t FLAG_COMPRESSED = 0x01;
+
+    /// Size (in bytes) above which encode() tries compressing the body.
+    static const size_t COMPRESS_THRESHOLD = 1024;
+
+    /// Largest body decode() is prepared to inflate.
+    static const size_t MAX_BODY_LENGTH = 1024 * 1024;
+
+  private:
+    static const size_t HEADER_LENGTH = 5;
+    static const char MAGIC[3];
+
+    static void encode_body(AoR* aor_data, std::string& out);
+    static bool decode_body(const char* data, size_t length, AoR* aor_data);
+    static bool decode_legacy(const char* data, size_t length, AoR* aor_data);
+  };
+
+} // namespace RegData
+
+#endif
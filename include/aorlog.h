@@ -0,0 +1,171 @@
+/**
+ * @file aorlog.h Definitions for the AoRLog class
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// AoRLog keeps a copy of the local store's registration data in a
+/// memory-mapped file, so it survives a restart.
+///
+
+#ifndef AORLOG_H__
+#define AORLOG_H__
+
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "regdata.h"
+
+namespace RegData {
+
+  /// @class RegData::AoRLog
+  ///
+  /// An append-only log of AoR records in a memory-mapped file.
+  ///
+  /// Every write appends a record holding the AoR ID and the AoR encoded by
+  /// AoRCodec, superseding any earlier record for the same AoR.  An AoR with
+  /// no bindings is written as a record with an empty value.  The file is
+  /// grown by doubling as needed, and once most of it is taken up by
+  /// superseded or expired records the live ones are copied to a new file
+  /// which replaces the old one.
+  ///
+  /// Opening a log only reads the record headers, which carry the binding
+  /// expiry times, to build an index of where each AoR's latest record is.
+  /// Records are decoded when they are read.  Each header is checksummed
+  /// along with the AoR ID, and the value has its own checksum, checked
+  /// when it is read.
+  ///
+  /// Records are written straight into the mapping and left for the kernel
+  /// to write back, so they survive the process exiting or crashing, but
+  /// not necessarily the machine crashing.
+  class AoRLog
+  {
+  public:
+    /// Called for each AoR in the log, with its earliest binding expiry
+    /// time.
+    typedef std::function<void(const std::string&, int)> LoadCallback;
+
+    /// Opens (creating if necessary) and maps the log file, and indexes the
+    /// records in it.  If the file can't be used an error is logged and the
+    /// log does nothing.
+    AoRLog(const std::string& path);
+    virtual ~AoRLog();
+
+    /// Calls the callback for each AoR in the log.
+    void load(LoadCallback callback);
+
+    /// Appends a record for the AoR.
+    void write(const std::string& aor_id, AoR* aor_data);
+
+    /// Adds the bindings in the AoR's latest record to aor_data.  Returns
+    /// false if there is no record or it is corrupt.
+    bool read(const std::string& aor_id, AoR* aor_data);
+
+    /// Compacts the log if it has grown to more than COMPACT_FACTOR times
+    /// the size of its live records, dropping records that have expired
+    /// by the given time.
+    void maybe_compact(int now);
+
+    /// Removes all the records from the log.
+    void clear();
+
+    /// Initial size of the file, and the size below which it is never
+    /// compacted.
+    static const size_t INITIAL_SIZE = 1024 * 1024;
+
+    static const size_t COMPACT_FACTOR = 2;
+
+  private:
+    struct RecordHeader
+    {
+      uint32_t magic;
+      uint32_t key_length;
+      uint32_t value_length;
+
+      /// The earliest and latest binding expiry times.
+      int32_t next_expiry;
+      int32_t last_expiry;
+
+      uint32_t value_checksum;
+
+      /// Checksum of the header fields above and the key.
+      uint32_t header_checksum;
+    };
+
+    struct Location
+    {
+      size_t offset;
+      size_t length;
+    };
+
+    typedef std::unordered_map<std::string, Location> Index;
+
+    static char* map_file(const std::string& path,
+                          int flags,
+                          size_t min_size,
+                          int* fd,
+                          size_t* size);
+    void scan();
+    bool reserve(size_t length);
+    bool check_header(size_t offset, size_t* length);
+    const RecordHeader* header(size_t offset);
+
+    static size_t record_length(size_t key_length, size_t value_length);
+    static uint32_t header_checksum(const RecordHeader* hdr, const char* key);
+    static uint32_t checksum(uint32_t hash, const void* data, size_t length);
+
+    static const char FILE_MAGIC[8];
+    static const uint32_t RECORD_MAGIC = 0x524f4121;
+
+    std::string _path;
+    int _fd;
+    char* _base;
+    size_t _size;
+
+    /// Offset at which the next record is written.
+    size_t _used;
+
+    /// Total length of the records in the index.
+    size_t _live;
+
+    Index _index;
+    pthread_mutex_t _lock;
+  };
+
+} // namespace RegData
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @file aorwriter.h Definitions for the AoRWriter class
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// AoRWriter applies read-modify-write updates to AoRs in a store,
+/// combining concurrent updates to the same AoR.
+///
+
+#ifndef AORWRITER_H__
+#define AORWRITER_H__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "regdata.h"
+
+class Statistic;
+
+namespace RegData {
+
+  /// @class RegData::AoRWriter
+  ///
+  /// Serializes updates to each AoR within this process.
+  ///
+  /// The first thread to update an AoR does the read-modify-write.  Updates
+  /// to the same AoR from other threads meanwhile are queued, and once the
+  /// write finishes the first of them applies all the queued updates with a
+  /// single read-modify-write.  So concurrent updates on this node never
+  /// conflict with each other, and a burst of them costs one read and one
+  /// write.
+  ///
+  /// Writes can still conflict with other nodes' writes.  These are retried
+  /// up to max_attempts times in all, re-reading the AoR each time, after a
+  /// random delay that doubles with each attempt.
+  class AoRWriter
+  {
+  public:
+    /// Makes a change to an AoR.  May be called more than once if the
+    /// write has to be retried, so should not depend on what was there
+    /// before beyond what is in the AoR passed in.
+    typedef std::function<void(AoR*)> Update;
+
+    /// Counters, since the writer was created.
+    struct Stats
+    {
+      /// Successful writes.
+      uint64_t writes;
+
+      /// Updates applied by another thread's write.
+      uint64_t coalesced;
+
+      /// Writes rejected because another node changed the AoR.
+      uint64_t conflicts;
+
+      /// Reads repeated after a conflict.
+      uint64_t retries;
+
+      /// Updates that couldn't be written.
+      uint64_t failures;
+    };
+
+    AoRWriter(Store* store,
+              Statistic* statistic = NULL,
+              ///< if not NULL, counters are reported here; not owned
+              int max_attempts = DEFAULT_MAX_ATTEMPTS);
+    ~AoRWriter();
+
+    /// Apply an update to an AoR, returning the AoR as written (for the
+    /// caller to own), or NULL if it couldn't be read or written.
+    AoR* update(const std::string& aor_id, Update update);
+
+    /// Get the current values of the counters.
+    Stats stats();
+
+    static const int DEFAULT_MAX_ATTEMPTS = 8;
+
+    /// The longest delay (in microseconds) before the second attempt.  This
+    /// doubles for each attempt after that, up to MAX_BACKOFF_US.
+    static const int BASE_BACKOFF_US = 1000;
+    static const int MAX_BACKOFF_US = 32000;
+
+    /// How often (in milliseconds) the counters are reported.
+    static const int REPORT_INTERVAL_MS = 1000;
+
+  private:
+    /// An update waiting to be applied.
+    struct Pending
+    {
+      Update update;
+      pthread_cond_t cond;
+
+      /// Set when this update's thread is to do the next write.
+      bool lead;
+
+      /// Set once the update has been written (or failed), along with the
+      /// result.
+      bool done;
+      AoR* aor_data;
+    };
+
+    /// The updates queued for an AoR.
+    struct Queue
+    {
+      Queue() : busy(false) {}
+
+      /// Whether a write is in progress.
+      bool busy;
+      std::vector<Pending*> pending;
+    };
+
+    AoR* write(const std::string& aor_id,
+               const std::vector<Pending*>& batch,
+               Stats& stats);
+    void maybe_report();
+
+    Store* _store;
+    Statistic* _statistic;
+    int _max_attempts;
+
+    pthread_mutex_t _lock;
+    std::unordered_map<std::string, Queue> _queues;
+    Stats _stats;
+    uint64_t _next_report_ms;
+  };
+
+} // namespace RegData
+
+#endif
@@ -47,9 +47,13 @@ extern "C" {
 
 #include <string>
 #include <vector>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "callservices.h"
 #include "sessioncase.h"
+#include "statistic.h"
 
 
 /// Short-lived data structure holding the details of a calculated target.
@@ -64,15 +68,19 @@ struct target
 };
 typedef std::list<target> target_list;
 
-/// The AS chain.
+class AsChainTable;
+
+/// The AS chain: the application servers to invoke, in order, for one
+/// served user and session case.
+///
+/// The chain is shared by the transactions making up its AS hops, and is
+/// reference counted so it lives as long as the last of them.  While it
+/// lives, it is registered in an AsChainTable under the ODI tokens it
+/// gives to its application servers, so that requests coming back from
+/// them carry on down the chain without another lookup of the iFCs.
 class AsChain
 {
 public:
-  AsChain(const SessionCase& session_case,
-          std::string served_user,
-          std::vector<std::string> application_servers);
-  ~AsChain();
-
   /// Disposition of a request. Suggests what to do next.
   enum Disposition {
     /// The request has been completely handled. Processing should
@@ -91,23 +99,196 @@ public:
     Next
   };
 
-  Disposition on_initial_request(CallServices* call_services,
-                                 UASTransaction* uas_data,
-                                 pjsip_msg* msg,
-                                 pjsip_tx_data* tdata,
-                                 target** target);
-
   std::string to_string() const;
   std::string served_user() const;
   const SessionCase& session_case() const;
-  bool complete() const;
 
+  /// @returns the number of application servers in the chain.
+  size_t size() const { return _application_servers.size(); };
+
+  friend class AsChainLink;
+  friend class AsChainTable;
 
 private:
-  bool is_mmtel(CallServices* call_services);
+  AsChain(AsChainTable* as_chain_table,
+          const SessionCase& session_case,
+          const std::string& served_user,
+          const std::vector<std::string>& application_servers);
+  ~AsChain();
+
+  /// Increments the reference count.
+  void inc_ref();
+
+  /// Decrements the reference count, deleting the chain if it reaches
+  /// zero.
+  void dec_ref();
+
+  AsChainTable* _as_chain_table;
+  int _refs;
 
   const SessionCase& _session_case;
   std::string _served_user;
   std::vector<std::string> _application_servers; //< List of application server URIs.
+
+  /// ODI tokens, one for each application server.  A request coming
+  // back from an application server carries its token, and resumes the
+  // chain at the next application server.
+  std::vector<std::string> _odi_tokens;
 };
 
+
+/// A position in an AS chain: the chain, and the index of the next
+/// application server to invoke.
+///
+/// A set link holds a reference to its chain, which each copy of the link
+/// takes for itself and gives up when it is destroyed, reassigned or
+/// released.
+class AsChainLink
+{
+public:
+  AsChainLink() :
+    _as_chain(NULL),
+    _index(0)
+  {
+  }
+
+  AsChainLink(const AsChainLink& to_copy) :
+    _as_chain(to_copy._as_chain),
+    _index(to_copy._index)
+  {
+    if (_as_chain != NULL)
+    {
+      _as_chain->inc_ref();
+    }
+  }
+
+  AsChainLink& operator=(const AsChainLink& to_copy)
+  {
+    if (&to_copy != this)
+    {
+      // Take the new reference before dropping the old one, in case they
+      // are to the same chain.
+      if (to_copy._as_chain != NULL)
+      {
+        to_copy._as_chain->inc_ref();
+      }
+      release();
+      _as_chain = to_copy._as_chain;
+      _index = to_copy._index;
+    }
+    return *this;
+  }
+
+  ~AsChainLink()
+  {
+    release();
+  }
+
+  /// Creates an AS chain, registered in the given table, and returns a
+  /// link to its start.
+  static AsChainLink create_as_chain(AsChainTable* as_chain_table,
+                                     const SessionCase& session_case,
+                                     const std::string& served_user,
+                                     const std::vector<std::string>& application_servers);
+
+  /// @returns true if the link refers to a chain.
+  bool is_set() const { return _as_chain != NULL; };
+
+  /// @returns true if there are no application servers left to invoke.
+  bool complete() const { return (_as_chain == NULL) || (_index >= _as_chain->size()); };
+
+  /// Drops the reference to the chain, and unsets the link.
+  void release();
+
+  const SessionCase& session_case() const { return _as_chain->session_case(); };
+  std::string served_user() const { return _as_chain->served_user(); };
+  std::string to_string() const;
+
+  AsChain::Disposition on_initial_request(CallServices* call_services,
+                                          UASTransaction* uas_data,
+                                          pjsip_msg* msg,
+                                          pjsip_tx_data* tdata,
+                                          target** target);
+
+  friend class AsChainTable;
+
+private:
+  /// Takes over a reference to the chain that the caller already holds.
+  AsChainLink(AsChain* as_chain, size_t index) :
+    _as_chain(as_chain),
+    _index(index)
+  {
+  }
+
+  target* as_target(pjsip_uri* as_uri, pjsip_tx_data* tdata);
+
+  AsChain* _as_chain;
+  size_t _index;
+};
+
+
+/// Registry of live AS chains, keyed by ODI token.
+class AsChainTable
+{
+public:
+  /// Counters.
+  struct Stats
+  {
+    /// Chains currently registered.
+    uint64_t chains;
+
+    /// Chains created, in total.
+    uint64_t created;
+
+    /// Application servers in the chains created, in total.
+    uint64_t application_servers;
+
+    /// The length of the longest chain created.
+    uint64_t longest;
+
+    /// Requests that came back from an application server and resumed
+    /// their chain.
+    uint64_t resumed;
+
+    /// Requests that carried an ODI token for a chain that no longer
+    /// exists.
+    uint64_t unknown;
+  };
+
+  AsChainTable();
+  ~AsChainTable();
+
+  /// Finds the chain the ODI token was given out for, returning a link to
+  /// the application server after the one it was given to.  Returns an
+  /// unset link if the token is not known.
+  AsChainLink lookup(const std::string& token);
+
+  /// Gets the current values of the counters.
+  Stats stats();
+
+  /// How often (in milliseconds) the counters are reported.
+  static const int REPORT_INTERVAL_MS = 1000;
+
+  friend class AsChain;
+
+private:
+  void register_chain(AsChain* as_chain);
+  void unregister_chain(AsChain* as_chain);
+  std::string new_token();
+  void maybe_report();
+
+  static const int TOKEN_LENGTH = 10;
+
+  static const char _b64[64];
+
+  pthread_mutex_t _lock;
+
+  /// Maps each ODI token to its chain and the index of the application
+  // server it was given to.
+  std::map<std::string, std::pair<AsChain*, size_t> > _odi_map;
+
+  Stats _stats;
+
+  Statistic _statistic;
+  uint64_t _next_report_ms;
+};
@@ -40,12 +40,15 @@
 #ifndef AUTHENTICATION_H__
 #define AUTHENTICATION_H__
 
+class DigestCache;
+
 extern pjsip_module mod_auth;
 
 pj_status_t init_authentication(const std::string& realm_name,
                                 bool tp_auth,
                                 const std::string& auth_config,
                                 HSSConnection* hss_connection,
+                                DigestCache* digest_cache,
                                 AnalyticsLogger* analytics_logger);
 
 void destroy_authentication();
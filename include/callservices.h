@@ -52,6 +52,7 @@ extern "C" {
 
 #include "xdmconnection.h"
 #include "simservs.h"
+#include "lookups.h"
 
 // forward declaration
 class UASTransaction;
@@ -63,6 +64,7 @@ public:
   ~CallServices();
 
   bool is_mmtel(std::string uri);
+  std::string get_simservs_xml(const std::string& public_id, SAS::TrailId trail);
 
   class CallServiceBase
   {
@@ -132,7 +134,10 @@ private:
   XDMConnection* _xdmc;
   std::string _mmtel_uri; //< URI of built-in MMTEL AS.
 
-  simservs *get_user_services(pjsip_msg *msg, std::string public_id, SAS::TrailId trail);
+  simservs *get_user_services(pjsip_msg *msg,
+                              std::string public_id,
+                              Lookup<std::string>& prefetched,
+                              SAS::TrailId trail);
 
   static int parse_privacy_headers(pjsip_generic_array_hdr *header_array);
   static void build_privacy_header(pjsip_tx_data *tx_data, int fields);
@@ -0,0 +1,151 @@
+/**
+ * @file circuitbreaker.h Declarations for the CircuitBreaker class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef CIRCUITBREAKER_H__
+#define CIRCUITBREAKER_H__
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+/// @class CircuitBreaker
+///
+/// Stops requests being sent to a server that is failing most of them, so
+/// that callers fail straight away rather than each waiting for requests
+/// to time out.
+///
+/// The breaker is closed (letting requests through) until, within a window,
+/// at least the minimum number of requests have completed and the given
+/// ratio of them have failed.  It then opens, rejecting all requests for a
+/// while, before going half-open: one trial request at a time is let
+/// through, and once enough have succeeded in a row the breaker closes
+/// again.  If a trial fails, the breaker opens again.
+class CircuitBreaker
+{
+public:
+  enum State
+  {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  /// Constructor.
+  CircuitBreaker(const std::string& name,
+                 ///< name of the server, for logging
+                 double failure_ratio = DEFAULT_FAILURE_RATIO);
+                 ///< ratio of failed requests at which to open, or 0 to
+                 ///< never open
+  ~CircuitBreaker();
+
+  /// Whether a request may be sent.  If so, trial is set to whether it is
+  /// a trial request, and the caller must report how it went by calling
+  /// complete().
+  bool allow(bool& trial);
+
+  /// Report that a request let through by allow() has completed, and
+  /// whether it succeeded.
+  void complete(bool ok, bool trial);
+
+  /// Counters.
+  struct Stats
+  {
+    State state;
+
+    /// Times the breaker has opened.
+    uint64_t opened;
+
+    /// Requests rejected because the breaker wasn't closed.
+    uint64_t rejected;
+  };
+
+  /// Get the current state and counters.
+  Stats stats();
+
+  /// Name of a state, for reporting: "closed", "open" or "half-open".
+  static std::string state_name(State state);
+
+  /// Default ratio of failed requests at which the breaker opens.
+  static const double DEFAULT_FAILURE_RATIO;
+
+  /// Length of the window over which requests are counted.
+  static const int WINDOW_MS = 10 * 1000;
+
+  /// Requests that must complete within the window before the breaker can
+  /// open.
+  static const int MIN_REQUESTS = 20;
+
+  /// How long the breaker stays open before letting trial requests
+  /// through.
+  static const int OPEN_MS = 5 * 1000;
+
+  /// Trial requests that must succeed in a row for the breaker to close.
+  static const int TRIAL_REQUESTS = 3;
+
+private:
+  void open(uint64_t now_ms);
+  static uint64_t now_ms();
+
+  const std::string _name;
+  const double _failure_ratio;
+
+  pthread_mutex_t _lock;
+
+  /// Everything else must be accessed under _lock.
+  State _state;
+
+  /// When the current window started, and the requests completed and
+  /// failed in it.
+  uint64_t _window_start_ms;
+  int _requests;
+  int _failures;
+
+  /// When an open breaker goes half-open.
+  uint64_t _open_until_ms;
+
+  /// Whether a trial request is in progress, and how many have succeeded
+  /// in a row.
+  bool _trial_in_progress;
+  int _trial_successes;
+
+  uint64_t _opened;
+  uint64_t _rejected;
+};
+
+#endif
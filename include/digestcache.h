@@ -0,0 +1,98 @@
+/**
+ * @file digestcache.h Declarations for the DigestCache class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// DigestCache is an in-process cache of subscribers' digest credentials,
+/// so that authenticating a request doesn't usually need a request to
+/// Homestead.
+///
+///
+
+#ifndef DIGESTCACHE_H__
+#define DIGESTCACHE_H__
+
+#include <string>
+#include <vector>
+
+#include "ttlcache.h"
+
+/// @class DigestCache
+///
+/// A cache of digest HA1 values keyed by private ID, public ID and realm.
+/// Unknown users are cached as "", so that a device repeatedly trying to
+/// authenticate as one doesn't cost a request to Homestead each time.
+///
+/// As well as expiring, a private ID's entries can be invalidated (e.g.,
+/// because authentication with one failed) so that password changes take
+/// effect straight away.
+class DigestCache : public TtlCache<std::string>
+{
+public:
+  /// Constructor.
+  DigestCache(size_t max_entries,
+              ///< maximum number of digests to cache
+              int ttl_ms,
+              ///< how long a digest may be used for
+              int negative_ttl_ms,
+              ///< how long to remember that a user is unknown
+              Statistic* statistic = NULL,
+              ///< if not NULL, counters are reported here; not owned
+              int num_shards = DEFAULT_SHARDS);
+              ///< number of independently locked shards
+
+  /// Get a digest, calling the loader if it isn't cached.  Returns "" if
+  /// the user is unknown, or the digest couldn't be loaded and there is no
+  /// expired one.
+  std::string get(const std::string& private_id,
+                  const std::string& public_id,
+                  const std::string& realm,
+                  const Loader& loader);
+
+  /// Drop the digests cached for a private ID, so that the next lookups
+  /// load them afresh.  Digests loaded in the last MIN_INVALIDATE_AGE_MS are
+  /// kept, so that a device repeatedly failing to authenticate doesn't cost
+  /// a request to Homestead each time.
+  void invalidate(const std::string& private_id);
+
+  /// How long (in milliseconds) a digest must have been cached for before
+  /// it can be invalidated.
+  static const int MIN_INVALIDATE_AGE_MS = 1000;
+
+protected:
+  void add_stat_values(const Stats& stats, std::vector<std::string>& values);
+};
+
+#endif
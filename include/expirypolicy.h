@@ -0,0 +1,132 @@
+/**
+ * @file expirypolicy.h Registration expiry policy.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// ExpiryPolicy decides how long the registrar grants registrations for.
+///
+///
+
+#ifndef EXPIRYPOLICY_H__
+#define EXPIRYPOLICY_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+class Statistic;
+
+/// @class ExpiryPolicy
+///
+/// Grants each binding the expiry it asked for, up to a maximum.  Two
+/// things are done to spread out the load of refreshing registrations.
+///
+/// - Granted expiries are shortened by a random amount, up to a configured
+///   percentage, so UEs that registered together (for example, after an
+///   outage) don't keep refreshing together.
+/// - When REGISTERs are queueing for longer than LOW_LATENCY_MS before
+///   being processed, the maximum is raised, up to overload_max_expires
+///   at HIGH_LATENCY_MS, so the node gets fewer refreshes while it is
+///   busy.
+///
+/// The queueing latency is smoothed over recent REGISTERs, and drops to
+/// zero once REGISTERs stop arriving.  If there is a statistic, a
+/// background thread reports the REGISTER rate to it every
+/// REPORT_INTERVAL_MS, whether or not any arrive.
+class ExpiryPolicy
+{
+public:
+  ExpiryPolicy(int max_expires = DEFAULT_MAX_EXPIRES,
+               ///< longest expiry normally granted, in seconds
+               int overload_max_expires = DEFAULT_MAX_EXPIRES,
+               ///< longest expiry granted when overloaded, in seconds;
+               ///< must not be more than the edge proxy's flow timeout
+               int jitter_percent = 0,
+               ///< most that granted expiries are shortened by
+               Statistic* statistic = NULL);
+               ///< if not NULL, the REGISTER rate is reported here; not owned
+  ~ExpiryPolicy();
+
+  /// Note that a REGISTER has been received, and how long (in
+  /// milliseconds) it was queued before being processed.
+  void record(int latency_ms);
+
+  /// Get the expiry (in seconds) to grant a binding that asked for the
+  /// specified expiry.  Removing a binding (asking for 0) is always
+  /// granted.
+  int grant(int requested);
+
+  /// Get the longest expiry (in seconds) currently being granted, before
+  /// jitter.
+  int max_expires();
+
+  static const int DEFAULT_MAX_EXPIRES = 300;
+
+  /// Smoothed queueing latencies (in milliseconds) at which the maximum
+  /// expiry starts to rise, and reaches overload_max_expires.
+  static const int LOW_LATENCY_MS = 50;
+  static const int HIGH_LATENCY_MS = 500;
+
+  /// How often (in milliseconds) the REGISTER rate is reported.
+  static const int REPORT_INTERVAL_MS = 1000;
+
+private:
+  int max_expires_locked();
+  void maybe_report(uint64_t now);
+  static void* reporter_thread(void* p);
+  void reporter_loop();
+
+  int _max_expires;
+  int _overload_max_expires;
+  int _jitter_percent;
+  Statistic* _statistic;
+
+  pthread_mutex_t _lock;
+  unsigned int _seed;
+
+  /// Smoothed latency, in microseconds.
+  uint64_t _latency_us;
+
+  /// REGISTERs received since the rate was last reported.
+  uint64_t _registers;
+  uint64_t _last_report_ms;
+
+  /// Thread that reports the rate, and the condition it waits on between
+  /// reports, signalled to terminate it.
+  pthread_t _reporter;
+  pthread_cond_t _reporter_cond;
+  bool _terminating;
+};
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * @file flowindex.h Index of registration bindings by the flow they use.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// FlowIndex maps each flow a UE registered over to the bindings that
+/// use it, so the bindings can be removed as soon as the flow fails.
+///
+///
+
+#ifndef FLOWINDEX_H__
+#define FLOWINDEX_H__
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <utility>
+#include <pthread.h>
+
+namespace RegData {
+
+  /// @class RegData::FlowIndex
+  ///
+  /// Thread-safe index from a flow (identified by an opaque string, such as
+  /// an edge proxy's flow token or the name of the transport a REGISTER
+  /// arrived on) to the (AoR, binding) pairs registered over it.  Each
+  /// binding is indexed under at most one flow, until it expires.  Not all
+  /// stores report bindings expiring, so expired bindings are swept from the
+  /// index as it is updated rather than waiting to be removed.
+  class FlowIndex
+  {
+  public:
+    /// An (AoR, binding ID) pair.
+    typedef std::pair<std::string, std::string> BindingKey;
+
+    FlowIndex();
+    ~FlowIndex();
+
+    /// Index a binding under a flow until it expires (in seconds since the
+    /// epoch), moving it from any flow it was previously indexed under.
+    void add(const std::string& flow,
+             const std::string& aor_id,
+             const std::string& binding_id,
+             int expires);
+
+    /// Remove a binding from the index.
+    void remove(const std::string& aor_id, const std::string& binding_id);
+
+    /// Remove all the bindings for an AoR from the index.
+    void remove_aor(const std::string& aor_id);
+
+    /// Get the flow a binding is indexed under, or "" if none.
+    std::string flow(const std::string& aor_id, const std::string& binding_id);
+
+    /// Remove a flow from the index, returning the unexpired bindings that
+    /// used it.
+    std::vector<BindingKey> take(const std::string& flow);
+
+    /// Number of bindings in the index.
+    size_t size();
+
+  private:
+    /// The flow a binding is indexed under, and when it expires.
+    struct Entry
+    {
+      std::string flow;
+      int expires;
+    };
+
+    void remove_locked(const std::string& aor_id,
+                       const std::string& binding_id);
+    void sweep_locked(int now);
+
+    pthread_mutex_t _lock;
+
+    /// Map from flow to the bindings using it.
+    std::map<std::string, std::set<BindingKey> > _flows;
+
+    /// Map from AoR to its indexed bindings and their flows.
+    std::map<std::string, std::map<std::string, Entry> > _aors;
+
+    /// The indexed bindings, ordered by expiry time.
+    std::set<std::pair<int, BindingKey> > _expiries;
+  };
+
+} // namespace RegData
+
+#endif
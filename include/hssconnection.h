@@ -54,18 +54,23 @@
 class HSSConnection
 {
 public:
-  HSSConnection(const std::string& server);
+  HSSConnection(const std::string& server,
+                HttpEngine* engine = NULL,
+                double failure_ratio = CircuitBreaker::DEFAULT_FAILURE_RATIO);
   ~HSSConnection();
 
-  Json::Value* get_digest_data(const std::string& private_user_id,
-                               const std::string& public_user_id,
-                               SAS::TrailId trail);
-  virtual bool get_user_ifc(const std::string& public_user_id,
-                            std::string& xml_data,
-                            SAS::TrailId trail);
+  HTTPCode get_digest_data(const std::string& private_user_id,
+                           const std::string& public_user_id,
+                           Json::Value*& object,
+                           SAS::TrailId trail);
+  virtual HTTPCode get_user_ifc(const std::string& public_user_id,
+                                std::string& xml_data,
+                                SAS::TrailId trail);
 
 private:
-  virtual Json::Value* get_object(const std::string& path, SAS::TrailId trail);
+  virtual HTTPCode get_object(const std::string& path,
+                              Json::Value*& object,
+                              SAS::TrailId trail);
 
   HttpConnection* _http;
 };
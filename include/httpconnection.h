@@ -40,36 +40,147 @@
 #pragma once
 
 #include <map>
+#include <vector>
+#include <functional>
+#include <stdint.h>
 
 #include <curl/curl.h>
 #include <sas.h>
 
 #include "statistic.h"
+#include "httpengine.h"
+#include "upstreambalancer.h"
+#include "latencytracker.h"
+#include "circuitbreaker.h"
 
-/// Provides managed access to data on a single HTTP server. Properly
-/// supports round-robin DNS load balancing.
+/// The result of an HTTP request: the status code of the response, or if
+/// there was no response, a status code describing why.
+typedef long HTTPCode;
+#define HTTP_OK 200
+#define HTTP_NOT_FOUND 404
+#define HTTP_SERVER_ERROR 500
+#define HTTP_SERVER_UNAVAILABLE 503
+#define HTTP_GATEWAY_TIMEOUT 504
+
+/// Provides managed access to data on a single HTTP server.  Requests are
+/// balanced over the addresses the server's name resolves to, avoiding
+/// any that are failing or slow.
+///
+/// Without an engine, each thread making requests has its own connection
+/// and makes its requests synchronously.  With an engine, requests are
+/// made asynchronously on the engine's I/O threads, sharing their pools of
+/// connections.
+///
+/// Identical GETs (same path and asserted user) made while one is already
+/// in progress don't go to the server: they wait for the one in progress
+/// and share its result.
+///
+/// How long to wait for a response adapts to how quickly the server has
+/// been responding.  With an engine, a request that's taking longer than
+/// usual is hedged: a second request is sent to another address, and
+/// the first response used.
+///
+/// If most requests to the server are failing, a circuit breaker stops
+/// any more being sent for a while, so that GETs fail straight away
+/// rather than waiting to time out.
 ///
 class HttpConnection
 {
 public:
-  HttpConnection(const std::string& server, bool assertUser, int sasEventBase, const std::string& statName);
+  HttpConnection(const std::string& server,
+                 bool assertUser,
+                 int sasEventBase,
+                 const std::string& statName,
+                 const std::string& getsStatName,
+                 const std::string& breakerStatName,
+                 HttpEngine* engine = NULL,
+                 double failureRatio = CircuitBreaker::DEFAULT_FAILURE_RATIO);
   ~HttpConnection();
 
-  virtual bool get(const std::string& path, std::string& doc, const std::string& username, SAS::TrailId trail);
+  /// Called when an asynchronous GET completes, with its result (HTTP_OK
+  /// if it succeeded) and the document retrieved.  With an engine, this is
+  /// on one of the engine's threads, so must not block.
+  typedef std::function<void(HTTPCode rc, const std::string& doc)> Callback;
+
+  virtual HTTPCode get(const std::string& path, std::string& doc, const std::string& username, SAS::TrailId trail);
+  virtual void get_async(const std::string& path, const std::string& username, SAS::TrailId trail, const Callback& callback);
+
+  /// Counters for the GETs of one class of path, i.e., with the same
+  /// first segment (e.g., "credentials").
+  struct GetStats
+  {
+    /// GETs sent to the server.
+    uint64_t requests;
+    /// GETs that shared the result of an identical one in progress.
+    uint64_t coalesced;
+    /// GETs that were hedged.
+    uint64_t hedged;
+  };
+
+  /// Whether requests are being sent to the server, i.e., the circuit
+  /// breaker is closed.  If not, GETs fail with HTTP_SERVER_UNAVAILABLE
+  /// unless they are trial requests.
+  bool available();
+
+  /// Gets the current values of the counters, keyed by class of path.
+  std::map<std::string, GetStats> get_stats();
+
+  /// How often (in milliseconds) the counters are reported.
+  static const int REPORT_INTERVAL_MS = 1000;
 
 private:
+  class Flight;
+  class Request;
+
+  static std::string path_class(const std::string& path);
+  static HTTPCode curl_code_to_http_code(CURL* curl, CURLcode code);
+
+  CURL* create_curl_handle();
   CURL* get_curl_handle();
+  void release_curl_handle(CURL* curl);
+  std::shared_ptr<Flight> start_get(const std::string& path, const std::string& username, SAS::TrailId trail, const Callback& callback);
+  bool hedge(const std::string& path, const std::string& username, SAS::TrailId trail, const std::shared_ptr<Flight>& flight);
+  long timeout_ms();
+  void send(Request* req);
+  void on_complete(Request* req, CURLcode rc);
+  void maybe_report();
 
   const std::string _server;
   const bool _assertUser;
   const int _sasEventBase;
   pthread_key_t _thread_local;
 
+  /// Engine to make requests on, or NULL to make them synchronously.
+  /// Not owned.
+  HttpEngine* _engine;
+
+  UpstreamBalancer _balancer;
+
+  /// Statistic reporting the state of each of the balancer's targets.
   Statistic _statistic;
 
   pthread_mutex_t _lock;
   std::map<std::string, int> _serverCount;  // must access under _lock
+  std::vector<CURL*> _free_handles;  // must access under _lock
+
+  /// The GETs in progress, keyed by the path and asserted user.  Must
+  /// access under _lock.
+  std::map<std::string, std::shared_ptr<Flight> > _in_flight;
+
+  std::map<std::string, GetStats> _get_stats;  // must access under _lock
+  Statistic _gets_statistic;
+  uint64_t _next_report_ms;  // must access under _lock
+
+  /// Recent latencies of the server's responses.
+  LatencyTracker _latencies;
+
+  /// Hedges that can be sent, within the budget.  Must access under _lock.
+  double _saved_hedges;
+
+  CircuitBreaker _breaker;
+
+  /// Statistic reporting the state of the circuit breaker.
+  Statistic _breaker_statistic;
 
   friend class PoolEntry; // so it can update stats
 };
-
@@ -0,0 +1,87 @@
+/**
+ * @file httpengine.h Asynchronous HTTP request engine
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef HTTPENGINE_H__
+#define HTTPENGINE_H__
+
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include <curl/curl.h>
+
+/// @class HttpEngine
+///
+/// Runs HTTP requests asynchronously, on a small number of I/O threads
+/// each driving a cURL multi handle.  The requests a thread runs share a
+/// pool of keep-alive connections, so many requests can be in progress at
+/// once without tying up a connection (or a worker thread) each.
+class HttpEngine
+{
+public:
+  /// Called on an I/O thread when a request completes, with its result.
+  /// Must not block, as that would hold up the thread's other requests.
+  typedef std::function<void(CURLcode rc)> Callback;
+
+  /// Constructor.
+  HttpEngine(int num_threads,
+             ///< number of I/O threads
+             long max_host_connections = DEFAULT_MAX_HOST_CONNECTIONS);
+             ///< maximum connections each thread opens to any one server
+  ~HttpEngine();
+
+  /// Run the request set up on the cURL easy handle, calling the callback
+  /// when it completes.  The handle must be left alone until then.  If
+  /// the engine is being destroyed, requests complete with
+  /// CURLE_ABORTED_BY_CALLBACK.
+  void perform(CURL* curl, const Callback& callback);
+
+  /// Default maximum connections each thread opens to any one server.
+  static const long DEFAULT_MAX_HOST_CONNECTIONS = 10;
+
+private:
+  class IoThread;
+
+  std::vector<IoThread*> _threads;
+
+  /// Thread to give the next request to.
+  std::atomic<unsigned int> _next;
+};
+
+#endif
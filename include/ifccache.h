@@ -0,0 +1,95 @@
+/**
+ * @file ifccache.h Declarations for the IfcCache class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// IfcCache is an in-process cache of subscribers' initial filter criteria,
+/// so that Homestead is only asked for them when they may have changed.
+///
+///
+
+#ifndef IFCCACHE_H__
+#define IFCCACHE_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "ttlcache.h"
+
+class TriggerPoint;
+
+/// An initial filter criterion, compiled from the subscriber's
+/// ServiceProfile so that requests can be matched against it without
+/// parsing any XML.
+struct Ifc
+{
+  Ifc() : priority(0) {}
+
+  /// Criteria with lower priorities are evaluated first.
+  int priority;
+
+  /// The condition for invoking the application server, or NULL if it is
+  /// always invoked.
+  std::shared_ptr<const TriggerPoint> trigger;
+
+  /// The application server to invoke if the criterion matches.
+  std::string server_name;
+};
+
+/// A subscriber's iFCs, in priority order.
+typedef std::vector<Ifc> Ifcs;
+
+/// @class IfcCache
+///
+/// A cache of compiled iFCs keyed by served user.  Subscribers with no
+/// iFCs (i.e., that Homestead doesn't know) are cached as NULL.
+class IfcCache : public TtlCache<std::shared_ptr<const Ifcs> >
+{
+public:
+  /// Constructor.
+  IfcCache(size_t max_entries,
+           ///< maximum number of subscribers to cache
+           int ttl_ms,
+           ///< how long a subscriber's iFCs may be used for
+           int negative_ttl_ms,
+           ///< how long to remember that a subscriber has no iFCs
+           Statistic* statistic = NULL,
+           ///< if not NULL, counters are reported here; not owned
+           int num_shards = DEFAULT_SHARDS);
+           ///< number of independently locked shards
+};
+
+#endif
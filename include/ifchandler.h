@@ -52,32 +52,46 @@ extern "C" {
 
 #include "hssconnection.h"
 #include "sessioncase.h"
+#include "ifccache.h"
+#include "triggerpoint.h"
+#include "lookups.h"
 
 /// iFC handler.
 class IfcHandler
 {
 public:
-  IfcHandler(HSSConnection* hss);
+  IfcHandler(HSSConnection* hss, IfcCache* cache = NULL);
   ~IfcHandler();
 
   void lookup_ifcs(const SessionCase& session_case,
                    pjsip_msg* msg,
                    SAS::TrailId trail,
                    std::string& served_user,
-                   std::vector<std::string>& application_servers);
+                   std::vector<std::string>& application_servers,
+                   Lookup<std::shared_ptr<const Ifcs> >* prefetched = NULL);
+  std::shared_ptr<const Ifcs> get_ifcs(const std::string& served_user,
+                                       SAS::TrailId trail);
+  static std::string served_user_from_msg(const SessionCase& session_case, pjsip_msg *msg);
 
 private:
   static bool filter_matches(const SessionCase& session_case,
                              pjsip_msg* msg,
-                             rapidxml::xml_node<>* ifc);
-  static void calculate_application_servers(const SessionCase& session_case,
-                                            pjsip_msg* msg,
-                                            std::string& ifc_xml,
-                                            std::vector<std::string>& as_list);
-  static std::string served_user_from_msg(const SessionCase& session_case, pjsip_msg *msg);
+                             const Ifc& ifc);
+  IfcCache::LoadResult load_ifcs(const std::string& served_user,
+                                 SAS::TrailId trail,
+                                 std::shared_ptr<const Ifcs>& ifcs);
+  static void compile_ifcs(std::string& ifc_xml, Ifcs& ifcs);
+  static void match_ifcs(const SessionCase& session_case,
+                         pjsip_msg* msg,
+                         const std::shared_ptr<const Ifcs>& ifcs,
+                         std::vector<std::string>& application_servers);
   static std::string user_from_uri(pjsip_uri *uri);
 
   HSSConnection* _hss;
+
+  /// Cache of compiled iFCs, or NULL to fetch them from Homestead for
+  /// every request.  Not owned.
+  IfcCache* _cache;
 };
 
 
@@ -0,0 +1,90 @@
+/**
+ * @file latencytracker.h Percentiles of recent request latencies
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef LATENCYTRACKER_H__
+#define LATENCYTRACKER_H__
+
+#include <vector>
+#include <stddef.h>
+#include <pthread.h>
+
+/// @class LatencyTracker
+///
+/// Tracks the latencies of the most recent requests to a server, and their
+/// percentiles.  The percentiles are recalculated periodically rather than
+/// on every request, so they are cheap to read.
+class LatencyTracker
+{
+public:
+  /// Constructor.
+  LatencyTracker(size_t window = DEFAULT_WINDOW);
+                 ///< number of recent latencies to track
+  ~LatencyTracker();
+
+  /// Add a request's latency.
+  void add(double latency_ms);
+
+  /// Gets a percentile (from 0 to 100) of the recent latencies, or -1 if
+  /// there aren't enough to tell yet.
+  double percentile(double p);
+
+  /// Default number of recent latencies to track.
+  static const size_t DEFAULT_WINDOW = 1000;
+
+  /// Number of latencies needed before percentiles are given.
+  static const size_t MIN_SAMPLES = 20;
+
+  /// Maximum number of latencies added between recalculations.
+  static const size_t RECALCULATE_INTERVAL = 100;
+
+private:
+  pthread_mutex_t _lock;
+
+  /// The recent latencies, as a ring buffer.
+  const size_t _window;
+  std::vector<double> _latencies;
+  size_t _next;
+
+  /// The latencies as they were when last sorted, and how many have been
+  /// added since.
+  std::vector<double> _sorted;
+  size_t _since_sort;
+};
+
+#endif
@@ -43,7 +43,15 @@
 #ifndef LOCALSTORE_H__
 #define LOCALSTORE_H__
 
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <pthread.h>
+
 #include "regdata.h"
+#include "timerwheel.h"
+#include "aorlog.h"
 
 namespace RegData {
 
@@ -83,10 +91,33 @@ namespace RegData {
     uint64_t _cas;
   };
 
+  /// @class RegData::LocalStore
+  ///
+  /// An in-memory store, safe to use from every worker thread.
+  ///
+  /// AoRs are spread across independently locked shards by a hash of the
+  /// AoR ID, so threads working on different subscribers rarely contend.
+  /// CAS values come from a per-shard counter, so a value is never reused
+  /// for an AoR even if it is removed and recreated.  An AoR that has never
+  /// been written (or has no bindings left) has a CAS of zero, and writing
+  /// it only succeeds if no-one else has created it in the meantime.
+  ///
+  /// Each shard keeps a timer wheel entry per AoR for its earliest binding
+  /// expiry.  A background thread pops these every second, removing expired
+  /// bindings (and AoRs left with none) and telling the expiry listener.
+  /// Reads only scan an AoR's bindings once its earliest expiry has passed.
+  ///
+  /// If given a file, the store keeps a copy of its AoRs there in an AoRLog,
+  /// so they survive a restart.  On startup the store indexes the file and
+  /// sets the expiry timers without decoding anything, and each AoR is
+  /// decoded from the file the first time it is used.
   class LocalStore : public Store
   {
   public:
-    LocalStore();
+    LocalStore(int num_shards = DEFAULT_SHARDS,
+               ///< number of independently locked shards
+               const std::string& log_file = "");
+               ///< file in which to keep the AoRs, if any
     virtual ~LocalStore();
 
     void flush_all();
@@ -94,8 +125,82 @@ namespace RegData {
     AoR* get_aor_data(const std::string& aor_id);
     bool set_aor_data(const std::string& aor_id, AoR* aor_data);
 
+    /// Gets the AoRs a shard at a time, taking each shard's lock once.
+    void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                            MultiGetCallback callback);
+
+    /// Remove everything that has expired by the given time.  Called every
+    /// second by the background thread.
+    void expire_all(int now);
+
+    /// Default number of shards.
+    static const int DEFAULT_SHARDS = 64;
+
   private:
-    std::map<std::string, LocalAoR> _db;
+    struct Entry
+    {
+      Entry() :
+        aor_data(),
+        loaded(true),
+        next_expiry(0),
+        timer(NULL)
+      {
+      }
+
+      LocalAoR aor_data;
+
+      /// False until the bindings have been read in from the log.
+      bool loaded;
+
+      /// The earliest binding expiry time, and the timer set for it.
+      int next_expiry;
+      TimerWheel::Timer* timer;
+    };
+
+    typedef std::unordered_map<std::string, Entry> Entries;
+
+    struct Shard
+    {
+      pthread_mutex_t lock;
+      Entries db;
+      TimerWheel* timers;
+
+      /// The last CAS value handed out in this shard.
+      uint64_t cas;
+    };
+
+    struct ExpiredBinding
+    {
+      std::string aor_id;
+      std::string binding_id;
+      AoR::Binding binding;
+    };
+
+    size_t shard_index(const std::string& aor_id);
+    Shard& shard_for(const std::string& aor_id);
+    LocalAoR* copy_aor(Shard& shard,
+                       const std::string& aor_id,
+                       int now,
+                       std::vector<ExpiredBinding>& expired);
+    bool expire(Shard& shard,
+                Entries::iterator i,
+                int now,
+                std::vector<ExpiredBinding>& expired);
+    bool update_timer(Shard& shard, Entries::iterator i);
+    void add_loaded(const std::string& aor_id, int next_expiry);
+    void clear();
+    void notify(const std::vector<ExpiredBinding>& expired);
+
+    static void* expiry_thread(void* p);
+    void expiry_loop();
+
+    std::vector<Shard*> _shards;
+    AoRLog* _log;
+
+    pthread_t _expiry_thread;
+    pthread_mutex_t _expiry_lock;
+    pthread_cond_t _expiry_cond;
+    bool _terminating;
   };
 
 } // namespace RegData
@@ -40,11 +40,15 @@
 #ifndef LOCALSTOREFACTORY_H__
 #define LOCALSTOREFACTORY_H__
 
+#include <string>
+
 #include "regdata.h"
 
 namespace RegData {
 
-  RegData::Store* create_local_store();
+  /// Create a local store, keeping the AoRs in the given file (if any) so
+  /// they survive a restart.
+  RegData::Store* create_local_store(const std::string& log_file = "");
   void destroy_local_store(RegData::Store* store);
 
 } // namespace RegData
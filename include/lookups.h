@@ -0,0 +1,195 @@
+/**
+ * @file lookups.h Declarations for the LookupPool and Lookup classes.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// Lookups are the requests sprout makes to other components while
+/// processing a SIP request: Homestead for iFCs, the XDMS for simservs,
+/// ENUM, and the registration store.  Rather than making them one at a
+/// time as processing reaches the point of needing each, they can be
+/// started together when the request arrives, so that processing only
+/// waits as long as the slowest.
+///
+
+#ifndef LOOKUPS_H__
+#define LOOKUPS_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <pthread.h>
+
+#include "eventq.h"
+#include "log.h"
+
+/// @class LookupPool
+///
+/// A pool of threads for running lookups.
+class LookupPool
+{
+public:
+  /// Constructor.
+  LookupPool(int num_threads,
+             ///< number of lookups that can run at once
+             int max_queue = DEFAULT_MAX_QUEUE);
+             ///< maximum number of lookups waiting for a thread
+  ~LookupPool();
+
+  /// Run the function on one of the pool's threads.  Returns false
+  /// without running it if too many lookups are waiting for a thread
+  /// already.  A pool with no threads runs the function straight away,
+  /// on the caller's thread.
+  bool run(const std::function<void()>& fn);
+
+  /// Default maximum number of lookups waiting for a thread.
+  static const int DEFAULT_MAX_QUEUE = 1000;
+
+private:
+  static void* thread_entry(void* p);
+  void process_lookups();
+
+  eventq<std::function<void()> > _q;
+  std::vector<pthread_t> _threads;
+};
+
+
+/// @class Lookup
+///
+/// A lookup that may be started before its result is needed.
+///
+/// A lookup is started for a key (such as the subscriber whose data it
+/// fetches).  When the result is needed, it is only used if it is for the
+/// same key; otherwise the lookup is done again for the right key, and
+/// the started lookup's result is discarded.  This means lookups can be
+/// started speculatively, before it is certain what will be needed.
+template<class T>
+class Lookup
+{
+public:
+  typedef std::function<T()> Fn;
+
+  Lookup() : _used(false) {}
+
+  ~Lookup()
+  {
+    if ((_result != NULL) && (!_used))
+    {
+      LOG_DEBUG("Discarding unused lookup for %s", _key.c_str());
+    }
+  }
+
+  /// Start the lookup for the key on the pool.  If there is no pool, or
+  /// it is busy, the lookup is left until its result is needed.  Note that
+  /// the function may run after the Lookup has been destroyed, so must not
+  /// refer to anything that might have gone by then.
+  void start(LookupPool* pool, const std::string& key, const Fn& fn)
+  {
+    std::shared_ptr<Result> result(new Result());
+    if ((pool != NULL) &&
+        (pool->run([result, fn]() { result->set(fn()); })))
+    {
+      _key = key;
+      _result = result;
+      _used = false;
+    }
+  }
+
+  /// Get the result of the lookup for the key, waiting for it if it was
+  /// started, and calling the function to do it now if not.
+  T get(const std::string& key, const Fn& fn)
+  {
+    if ((_result != NULL) && (key == _key))
+    {
+      _used = true;
+      return _result->wait();
+    }
+    return fn();
+  }
+
+  /// @returns true if a lookup has been started.
+  bool started() const { return _result != NULL; };
+
+private:
+  /// The result of a lookup, shared with the pool thread doing it.
+  class Result
+  {
+  public:
+    Result() : _done(false)
+    {
+      pthread_mutex_init(&_lock, NULL);
+      pthread_cond_init(&_cond, NULL);
+    }
+
+    ~Result()
+    {
+      pthread_cond_destroy(&_cond);
+      pthread_mutex_destroy(&_lock);
+    }
+
+    void set(const T& value)
+    {
+      pthread_mutex_lock(&_lock);
+      _value = value;
+      _done = true;
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_lock);
+    }
+
+    T wait()
+    {
+      pthread_mutex_lock(&_lock);
+      while (!_done)
+      {
+        pthread_cond_wait(&_cond, &_lock);
+      }
+      T value = _value;
+      pthread_mutex_unlock(&_lock);
+      return value;
+    }
+
+  private:
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    bool _done;
+    T _value;
+  };
+
+  std::string _key;
+  std::shared_ptr<Result> _result;
+  bool _used;
+};
+
+#endif
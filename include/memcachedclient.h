@@ -0,0 +1,373 @@
+/**
+ * @file @file memcachedclient.h Asynchronous, pipelined memcached client
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// MemcachedClient talks the memcached binary protocol to a set of servers
+/// over a few long-lived connections, which all callers share.
+///
+///
+
+#ifndef MEMCACHEDCLIENT_H__
+#define MEMCACHEDCLIENT_H__
+
+#include <string>
+#include <list>
+#include <vector>
+#include <map>
+#include <functional>
+#include <stdint.h>
+#include <pthread.h>
+
+/// @class MemcachedClient
+///
+/// An asynchronous memcached client.
+///
+/// Keys are spread across the servers by consistent hashing, as in ketama:
+/// each server is given POINTS_PER_SERVER points on a ring of hash values,
+/// and a key is stored on the servers owning the first distinct points at
+/// or after the key's hash.  So adding or removing a server only moves the
+/// keys next to its points.  With more than one replica, a write goes to
+/// the first of the key's servers that can be reached (using the CAS) and
+/// then to the others in parallel (unconditionally), and a read tries the
+/// servers in order until one has the key.
+///
+/// Requests for each server are spread across a fixed number of
+/// connections to it.  Requests are pipelined: a caller writes its request
+/// and returns, and each connection has a reader thread that matches
+/// responses back to requests by their opaque ID and calls the request's
+/// callback.  So a handful of connections can carry every worker's
+/// requests, and throughput is bounded by memcached rather than by how many
+/// threads are waiting.
+///
+/// Callbacks run on a reader thread (or on the caller's thread, if the
+/// request fails before being sent), so they must be quick and must not
+/// wait for another request.  Every request gets exactly one callback.  If
+/// a connection fails, or a response takes longer than the timeout, all the
+/// requests outstanding on it fail and it is reconnected when next used.
+class MemcachedClient
+{
+public:
+  /// The outcome of a request.
+  enum Status
+  {
+    /// Success.
+    OK,
+
+    /// The key doesn't exist.
+    NOT_FOUND,
+
+    /// The key already exists (for an add) or has changed (for a CAS).
+    EXISTS,
+
+    /// The server couldn't be reached or returned an error.
+    ERROR
+  };
+
+  /// Called with the result of a get.  The value is only valid for the
+  /// duration of the call, and only if the status is OK.
+  typedef std::function<void(Status status,
+                             const char* value,
+                             size_t length,
+                             uint64_t cas)> GetCallback;
+
+  /// Called with the result for one key of a multi-get.
+  typedef std::function<void(const std::string& key,
+                             Status status,
+                             const char* value,
+                             size_t length,
+                             uint64_t cas)> MultiGetCallback;
+
+  /// Called with the result of a store or flush, and for a store the new
+  /// CAS value.
+  typedef std::function<void(Status status, uint64_t cas)> StoreCallback;
+
+  /// Constructor.
+  MemcachedClient(const std::list<std::string>& servers,
+                  ///< servers, as host:port
+                  int connections,
+                  ///< number of connections to each server
+                  int timeout_ms = DEFAULT_TIMEOUT_MS,
+                  ///< how long to wait for a response
+                  int replicas = 1);
+                  ///< number of servers to store each key on
+  ~MemcachedClient();
+
+  /// Change the set of servers.  Keys that keep the same servers are
+  /// unaffected.  For the next migration_ms, a key that isn't on its new
+  /// servers is also looked for on its old ones, and if found there is
+  /// returned with a CAS of zero, so the next write adds it to the new
+  /// servers.  Changing the servers again during a migration ends it.
+  void set_servers(const std::list<std::string>& servers, int migration_ms);
+
+  /// Start a migration from where libmemcached's default (modulo)
+  /// distribution put keys on the current servers: for the next
+  /// migration_ms, keys are also looked for on the server their hash
+  /// modulo the number of servers picks, as for set_servers.  This lets a
+  /// running deployment upgrade from a libmemcached-based client without
+  /// losing its keys.
+  void migrate_from_modulo(int migration_ms);
+
+  /// Get a key's value and CAS.  The CAS is zero if the value had to be
+  /// found somewhere other than the first of the key's servers that could
+  /// be reached, so that the next write restores it there.
+  void get(const std::string& key, GetCallback callback);
+
+  /// Get several keys at once.  The keys for each server (the first of
+  /// each key's servers, with any that fail falling back as for get) go down one
+  /// connection as a single write of quiet gets followed by a no-op, so
+  /// misses cost no responses and the no-op's response shows that the batch
+  /// is finished; every server is sent its batch before any replies are
+  /// awaited.  The callback is called once per key, in any order, and may
+  /// be called on several reader threads at once.
+  void get_multi(const std::vector<std::string>& keys,
+                 MultiGetCallback callback);
+
+  /// Store a value.  If the CAS is zero the key must not exist already;
+  /// otherwise it must not have changed since the CAS was read.
+  void store(const std::string& key,
+             const std::string& value,
+             int expiry,
+             ///< absolute expiry time, in seconds since the epoch
+             uint64_t cas,
+             StoreCallback callback);
+
+  /// Delete every key on every server, waiting for the result.
+  Status flush_all();
+
+  /// Synchronous get, copying the value.
+  Status get(const std::string& key, std::string& value, uint64_t& cas);
+
+  /// Synchronous store, updating the CAS on success.
+  Status store(const std::string& key,
+               const std::string& value,
+               int expiry,
+               uint64_t& cas);
+
+  /// Default response timeout.
+  static const int DEFAULT_TIMEOUT_MS = 500;
+
+  /// How long to wait before retrying a server we couldn't connect to.
+  static const int RECONNECT_INTERVAL_MS = 1000;
+
+  /// The number of points each server has on the hash ring.
+  static const int POINTS_PER_SERVER = 160;
+
+  /// How long a server is kept after it stops being used, once a migration
+  /// away from it has ended, so that requests already routed to it can
+  /// finish.
+  static const int RETIRE_DELAY_MS = 60 * 1000;
+
+  /// Lets a thread wait for an asynchronous request to complete.
+  class Completion
+  {
+  public:
+    Completion();
+    ~Completion();
+
+    /// Wake the waiting thread.
+    void complete();
+
+    /// Wait until complete() is called.
+    void wait();
+
+  private:
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    bool _complete;
+  };
+
+private:
+  struct Request
+  {
+    Request() : sent_ms(0), quiet(false) {}
+
+    uint64_t sent_ms;
+
+    /// Whether the server only responds if the key is found.  A quiet get
+    /// has missed once a later request on the same connection is answered.
+    bool quiet;
+
+    GetCallback get_callback;
+    StoreCallback store_callback;
+  };
+
+  /// A connection to a server, with its own reader thread.
+  class Connection
+  {
+  public:
+    Connection(const std::string& host,
+               const std::string& port,
+               int timeout_ms);
+    ~Connection();
+
+    /// Send one or more requests, built by append_request, in a single
+    /// write.  Returns false if they couldn't be sent, in which case none of
+    /// their callbacks have been called.
+    bool send(std::string& msg, const std::vector<Request>& requests);
+
+  private:
+    bool connect();
+    void disconnect(std::vector<Request>& failed);
+    void reader();
+    bool process(const char* data, size_t length);
+    static void* reader_thread(void* p);
+    static void fail(const std::vector<Request>& failed);
+
+    std::string _host;
+    std::string _port;
+    int _timeout_ms;
+
+    /// Serialises writes to the socket, so that requests go out in the
+    /// order they are numbered.  Taken before _lock, and never held while
+    /// connecting.
+    pthread_mutex_t _send_lock;
+
+    /// Protects everything below.  Never held while blocked on the
+    /// network.
+    pthread_mutex_t _lock;
+    pthread_cond_t _connected_cond;
+    int _fd;
+    bool _connecting;
+    uint64_t _retry_ms;
+    uint64_t _next_seq;
+
+    /// Requests awaiting a response, by send sequence number.  Numbers are
+    /// handed out in order, so the first is the oldest.  The opaque ID on
+    /// the wire is the bottom 32 bits of the sequence number, which wraps
+    /// long before the sequence number does.
+    std::map<uint64_t, Request> _in_flight;
+
+    bool _terminating;
+    pthread_t _reader;
+  };
+
+  /// A server, and the connections to it.
+  struct Server
+  {
+    Server(const std::string& name, int connections, int timeout_ms);
+    ~Server();
+
+    /// Pick a connection, spreading requests across them.
+    Connection* connection();
+
+    std::string name;
+    std::vector<Connection*> connections;
+    volatile uint32_t next_connection;
+  };
+
+  /// Points on the hash ring, and which server owns each.  A modulo ring
+  /// has no points: a key's server is picked by its hash modulo the number
+  /// of servers, as libmemcached does by default.
+  struct Ring
+  {
+    Ring() : points(), servers(), modulo(false) {}
+    std::map<uint32_t, Server*> points;
+    std::vector<Server*> servers;
+    bool modulo;
+  };
+
+  /// The servers to try for a key: its replicas, nearest first, followed
+  /// during a migration by any of its old replicas that aren't new ones.
+  struct Route
+  {
+    std::vector<Server*> servers;
+    size_t replicas;
+  };
+
+  static void append_request(std::string& msg,
+                             uint8_t opcode,
+                             const std::string& key,
+                             const std::string& extras,
+                             const std::string& value,
+                             uint64_t cas);
+  void build_ring(const std::list<std::string>& servers, Ring& ring);
+  void find_replicas(const Ring& ring,
+                     uint32_t hash,
+                     std::vector<Server*>& replicas);
+  Route route(const std::string& key);
+  void tidy_servers(uint64_t now);
+  void retire_unused_servers(uint64_t now);
+  void get_from(const std::string& key,
+                const Route& route,
+                size_t index,
+                bool missed,
+                GetCallback callback);
+  void got(const std::string& key,
+           const Route& route,
+           size_t index,
+           bool missed,
+           GetCallback callback,
+           Status status,
+           const char* value,
+           size_t length,
+           uint64_t cas);
+  void store_to(const std::string& key,
+                const std::string& value,
+                const std::string& extras,
+                uint64_t cas,
+                const Route& route,
+                size_t index,
+                StoreCallback callback);
+  void replicate(const std::string& key,
+                 const std::string& value,
+                 const std::string& extras,
+                 const Route& route,
+                 size_t index,
+                 uint64_t cas,
+                 StoreCallback callback);
+
+  int _connections_per_server;
+  int _timeout_ms;
+  int _replicas;
+
+  /// Protects the rings.
+  pthread_rwlock_t _lock;
+
+  /// The servers on either ring, by name.  Requests use them without
+  /// holding the lock, so servers that are no longer used are retired, and
+  /// only destroyed RETIRE_DELAY_MS later.
+  std::map<std::string, Server*> _servers;
+
+  /// Retired servers, oldest first, with when to destroy each.
+  std::list<std::pair<uint64_t, Server*> > _retired;
+
+  /// The current ring, and during a migration the previous one.
+  Ring _ring;
+  Ring _old_ring;
+  uint64_t _migration_end_ms;
+};
+
+#endif
@@ -44,16 +44,16 @@
 #define MEMCACHEDSTORE_H__
 
 #include <sstream>
-
-extern "C" {
-#include <libmemcached/memcached.h>
-#include <libmemcached/util.h>
-}
+#include <list>
 
 #include "regdata.h"
+#include "memcachedclient.h"
+#include "expirypolicy.h"
 
 namespace RegData {
 
+  class AoRCache;
+
   /// @class RegData::MemcachedAoR
   ///
   /// A memcached-based implementation of the Address of Record class.
@@ -103,33 +103,61 @@ namespace RegData {
   class MemcachedStore : public Store
   {
   public:
-    MemcachedStore(const std::list<std::string>& servers, int pool_size);
-    ~MemcachedStore();
+    MemcachedStore(const std::list<std::string>& servers,
+                   int connections,
+                   AoRCache* cache = NULL,
+                   int replicas = 1,
+                   int max_expires = ExpiryPolicy::DEFAULT_MAX_EXPIRES);
+    virtual ~MemcachedStore();
 
     void flush_all();
 
+    void set_servers(const std::list<std::string>& servers);
+
     AoR* get_aor_data(const std::string& aor_id);
     bool set_aor_data(const std::string& aor_id, AoR* aor_data);
 
+    void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                            MultiGetCallback callback);
+
+    void get_aor_data_async(const std::string& aor_id, GetCallback callback);
+    void set_aor_data_async(const std::string& aor_id,
+                            AoR* aor_data,
+                            SetCallback callback);
+
   private:
-    /// Helper: to_string method using ostringstream.
-    template <class T>
-      std::string to_string(T t, ///< datum to convert
-                            std::ios_base & (*f)(std::ios_base&)
-                            ///< modifier to apply
-                           )
+    /// Read an AoR from, or write one to, the memcached cluster.
+    virtual MemcachedAoR* get_from_server(const std::string& aor_id);
+    virtual bool set_on_server(const std::string& aor_id, MemcachedAoR* aor_data);
+
+    MemcachedAoR* got_from_server(MemcachedClient::Status status,
+                                  const char* data,
+                                  size_t length,
+                                  uint64_t cas);
+    void cache(const std::string& aor_id, MemcachedAoR* aor_data);
+    int prepare_set(MemcachedAoR* aor_data, std::string& value);
+    void set_complete(const std::string& aor_id,
+                      MemcachedAoR* aor_data,
+                      bool success);
+
+    static std::string serialize_aor(MemcachedAoR* aor_data);
+    static MemcachedAoR* deserialize_aor(const char* data, size_t length);
+    static inline MemcachedAoR* deserialize_aor(const std::string& s)
     {
-      std::ostringstream oss;
-      oss << f << t;
-      return oss.str();
+      return deserialize_aor(s.data(), s.length());
     }
 
-    static std::string serialize_aor(MemcachedAoR* aor_data);
-    static MemcachedAoR* deserialize_aor(const std::string& s);
+    /// The client for the memcached cluster.  Owned by this object.
+    MemcachedClient* _client;
 
-    /// The memcached pool in use. Owned by this object.
-    memcached_pool_st* _pool;
+    /// The near-cache in front of the memcached cluster, or NULL if there
+    /// isn't one.  Owned by this object.
+    AoRCache* _cache;
 
+    /// How long to keep looking for AoRs on their old servers after the
+    /// servers change.  This is the longest a binding can last: the longest
+    /// expiry the registrar grants, even when overloaded.
+    int _migration_period_ms;
   };
 
 } // namespace RegData
@@ -40,15 +40,27 @@
 #ifndef MEMCACHEDSTOREFACTORY_H__
 #define MEMCACHEDSTOREFACTORY_H__
 
+#include <list>
+#include <string>
+
 #include "regdata.h"
+#include "expirypolicy.h"
 
 namespace RegData
 {
+  class AoRCache;
+
   RegData::Store* create_memcached_store(const std::list<std::string>& servers,
-                                         int connections);
+                                         int connections,
+                                         AoRCache* cache = NULL,
+                                         int replicas = 1,
+                                         int max_expires = ExpiryPolicy::DEFAULT_MAX_EXPIRES);
 
   void destroy_memcached_store(RegData::Store* store);
 
+  void set_memcached_store_servers(RegData::Store* store,
+                                   const std::list<std::string>& servers);
+
 } // namespace RegData
 
 #endif
@@ -0,0 +1,121 @@
+/**
+ * @file parsedbinding.h Registration bindings parsed ready for routing.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// ParsedBinding holds a binding's contact URI and Path headers parsed
+/// into PJSIP URIs, so they can be cloned into a request without being
+/// parsed again.
+///
+///
+
+#ifndef PARSEDBINDING_H__
+#define PARSEDBINDING_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+
+#include "regdata.h"
+
+/// @class ParsedBinding
+///
+/// The parsed form of a binding's contact URI and Path headers, held in its
+/// own pool.  This is immutable once created, so can be shared (through
+/// RegData::AoR::Binding::_parsed) between threads.
+class ParsedBinding
+{
+public:
+  ~ParsedBinding();
+
+  /// Parse a contact URI and Path headers.  Returns NULL if any of them is
+  /// badly formed.
+  static std::shared_ptr<const ParsedBinding>
+    parse(const std::string& uri,
+          const RegData::AoR::Binding::PathHeaders& path_headers);
+
+  /// Get a binding's contact URI in a pool.  This clones the parsed form
+  /// if the binding has one, and otherwise parses the URI straight into the
+  /// pool - bindings read from memcached are never parsed, and a parsed form
+  /// built for them would be thrown away with the AoR.  Returns NULL if the
+  /// URI is badly formed.
+  static pjsip_uri* binding_uri(const RegData::AoR::Binding* binding,
+                                pj_pool_t* pool);
+
+  /// Get a binding's Path URIs in a pool in the same way, adding them to
+  /// the list in order.  Returns false if any of them is badly formed.
+  static bool binding_paths(const RegData::AoR::Binding* binding,
+                            pj_pool_t* pool,
+                            std::list<pjsip_uri*>& paths);
+
+  /// Clone the contact URI into a pool.
+  pjsip_uri* uri(pj_pool_t* pool) const;
+
+  /// Clone the Path URIs into a pool, adding them to the list in order.
+  void paths(pj_pool_t* pool, std::list<pjsip_uri*>& paths) const;
+
+  /// Whether this is the parsed form of the specified contact URI and Path
+  /// headers.
+  bool matches(const std::string& uri,
+               const RegData::AoR::Binding::PathHeaders& path_headers) const;
+
+private:
+  /// The binding's parsed form, or NULL if it hasn't been parsed or has
+  /// changed since.
+  static const ParsedBinding* parsed(const RegData::AoR::Binding* binding);
+
+  ParsedBinding(pj_pool_t* pool,
+                const std::string& uri,
+                const RegData::AoR::Binding::PathHeaders& path_headers);
+
+  /// Sizes of the pool blocks the URIs are parsed into.  A contact URI
+  /// and a couple of Path URIs fit in the first block.
+  static const int POOL_INITIAL_SIZE = 1024;
+  static const int POOL_INCREMENT = 512;
+
+  pj_pool_t* _pool;
+  std::string _uri_str;
+  RegData::AoR::Binding::PathHeaders _path_strs;
+  pjsip_uri* _uri;
+  std::vector<pjsip_uri*> _paths;
+};
+
+#endif
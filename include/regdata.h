@@ -41,16 +41,27 @@
 #define REGDATA_H__
 
 #include <string>
-#include <list>
-#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 
+class ParsedBinding;
+
 namespace RegData
 {
   /// @class RegData::AoR
   ///
   /// Addresses that are registered for this address of record.
+  ///
+  /// The bindings are held in a flat vector sorted by binding ID, and the
+  /// Binding objects themselves are allocated in blocks owned by the AoR.
+  /// Bindings released by remove_binding() or clear() are kept for reuse
+  /// (along with the capacity of their strings and vectors), so refilling or
+  /// copying into an existing AoR allocates very little, and copying a
+  /// fresh AoR allocates one block for all its bindings.
   class AoR
   {
   public:
@@ -60,6 +71,19 @@ namespace RegData
     class Binding
     {
     public:
+      /// Path headers, in order.
+      typedef std::vector<std::string> PathHeaders;
+
+      /// Contact header parameters, as name -> value in order of appearance.
+      typedef std::vector<std::pair<std::string, std::string> > Params;
+
+      Binding() :
+        _cseq(0),
+        _expires(0),
+        _priority(0)
+      {
+      }
+
       /// The registered contact URI, e.g.,
       /// "sip:2125551212@192.168.0.1:55491;transport=TCP;rinstance=fad34fbcdea6a931"
       std::string _uri;
@@ -71,7 +95,7 @@ namespace RegData
 
       /// Contains any path headers (in order) that were present on the
       /// register.  Empty if there were none.
-      std::list<std::string> _path_headers;
+      PathHeaders _path_headers;
 
       /// The CSeq value of the REGISTER request.
       int _cseq;
@@ -87,19 +111,32 @@ namespace RegData
 
       /// Any other parameters found in the Contact: header, stored as key ->
       /// value in order of appearance.  E.g., "+sip.ice" -> "".
-      std::list<std::pair<std::string, std::string> > _params;
+      Params _params;
+
+      /// The contact URI and Path headers parsed ready for routing, or
+      /// NULL if they haven't been parsed.  This isn't stored, but it is
+      /// shared by copies of the binding in this process (so bindings in
+      /// the local store only need parsing when they are registered).  See
+      /// ParsedBinding.
+      std::shared_ptr<const ParsedBinding> _parsed;
+
+    private:
+      /// Empty the binding, keeping any memory it has allocated.
+      void reset();
+
+      friend class AoR;
     };
 
     /// Constructor: the store is initially empty.
     AoR() :
-      _bindings()
+      _bindings(),
+      _slots(),
+      _num_used(0),
+      _blocks()
     {
     }
 
-    virtual ~AoR()
-    {
-      clear();
-    }
+    virtual ~AoR();
 
     /// Make sure copy is deep!
     AoR(const AoR& other);
@@ -107,20 +144,31 @@ namespace RegData
     // Make sure assignment is deep!
     AoR& operator= (AoR const& other);
 
-    /// Clear all the bindings from this object.
+    /// Move construction and assignment just take over the other AoR's
+    /// storage.
+    AoR(AoR&& other);
+    AoR& operator= (AoR&& other);
+
+    /// Exchange the bindings (and binding storage) of two AoRs.
+    void swap(AoR& other);
+
+    /// Clear all the bindings from this object.  The storage is kept for
+    /// reuse.
     void clear();
 
     /// Retrieve a binding by Contact URI, creating an empty one if necessary.
     /// The created binding is completely empty, even the Contact URI field.
+    /// Pointers to bindings stay valid until the binding is removed.
     Binding* get_binding(const std::string& binding_id);
 
     /// Removes any binding that had the given ID.  If there is no such binding,
     /// does nothing.
     void remove_binding(const std::string& binding_id);
 
-    /// Binding ID -> Binding.  First is sometimes the contact URI, but not always.
-    /// Second is a pointer to an object owned by this object.
-    typedef std::map<std::string, Binding*> Bindings;
+    /// Binding ID -> Binding, sorted by binding ID.  First is sometimes the
+    /// contact URI, but not always.  Second is a pointer to an object owned by
+    /// this object.
+    typedef std::vector<std::pair<std::string, Binding*> > Bindings;
 
     /// Retrieve all the bindings.
     inline const Bindings& bindings()
@@ -129,9 +177,29 @@ namespace RegData
     }
 
   private:
-    /// Map holding the bindings for a particular AoR indexed by binding ID.
+    /// Take an unused binding slot, allocating a new block if there are none.
+    Binding* alloc_binding();
+
+    /// Return a binding's slot to the unused set.
+    void free_binding(Binding* b);
+
+    /// Make sure there are at least this many unused binding slots.
+    void reserve_bindings(size_t count);
+
+    /// Find the first entry in _bindings with an ID no less than binding_id.
+    Bindings::iterator lower_bound(const std::string& binding_id);
+
+    /// Vector holding the bindings for a particular AoR sorted by binding ID.
     Bindings _bindings;
 
+    /// Every binding slot this AoR owns.  The first _num_used are in use,
+    /// the rest are free.
+    std::vector<Binding*> _slots;
+    size_t _num_used;
+
+    /// Blocks of bindings, allocated with new[].  These own the slots.
+    std::vector<Binding*> _blocks;
+
     /// Store code is allowed to manipulate bindings directly.
     friend class Store;
   };
@@ -143,6 +211,25 @@ namespace RegData
   class Store
   {
   public:
+    /// Interface for hearing about bindings that a store has removed because
+    /// they expired.
+    class ExpiryListener
+    {
+    public:
+      virtual ~ExpiryListener()
+      {
+      }
+
+      virtual void binding_expired(const std::string& aor_id,
+                                   const std::string& binding_id,
+                                   const AoR::Binding& binding) = 0;
+    };
+
+    Store() :
+      _expiry_listener(NULL)
+    {
+    }
+
     /// Must define a destructor, even though it does nothing, to ensure there
     /// is an entry for it in the vtable.
     virtual ~Store()
@@ -163,7 +250,63 @@ namespace RegData
     /// succeeds, this returns true.
     virtual bool set_aor_data(const std::string& aor_id, AoR* data) = 0;
 
+    /// Called with the result of get_aor_data_async: the data, which the
+    /// callee owns, or NULL in case of error.
+    typedef std::function<void(AoR*)> GetCallback;
+
+    /// Called with the result of set_aor_data_async.
+    typedef std::function<void(bool)> SetCallback;
+
+    /// Asynchronous versions of get_aor_data and set_aor_data.  The callback
+    /// is called exactly once, either before these return or later on
+    /// another thread, so it must not block.  The data passed to
+    /// set_aor_data_async must stay valid until the callback is called.
+    ///
+    /// By default these just call the synchronous methods.
+    virtual void get_aor_data_async(const std::string& aor_id,
+                                    GetCallback callback)
+    {
+      callback(get_aor_data(aor_id));
+    }
+
+    virtual void set_aor_data_async(const std::string& aor_id,
+                                    AoR* data,
+                                    SetCallback callback)
+    {
+      callback(set_aor_data(aor_id, data));
+    }
+
+    /// Called with the result of get_aor_data_multi for each AoR: the
+    /// data, which the callee owns, or NULL in case of error.
+    typedef std::function<void(const std::string& aor_id, AoR*)> MultiGetCallback;
+
+    /// Get the data for several AoRs at once.  The callback is called once
+    /// for each AoR as its data arrives, never for two at once, and this
+    /// returns once all the calls have been made.
+    ///
+    /// By default this gets each AoR in turn.
+    virtual void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                    MultiGetCallback callback)
+    {
+      for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+      {
+        callback(aor_ids[ii], get_aor_data(aor_ids[ii]));
+      }
+    }
+
     virtual int expire_bindings(AoR* aor_data, int now);
+
+    /// Set the listener to tell about expired bindings, or NULL for none.
+    /// Only stores that expire bindings in the background (the LocalStore)
+    /// report them; the memcached store drops them lazily on each node
+    /// that reads the AoR, so can't report each one exactly once.
+    void set_expiry_listener(ExpiryListener* listener)
+    {
+      _expiry_listener = listener;
+    }
+
+  protected:
+    ExpiryListener* _expiry_listener;
   };
 
 }; // namespace RegData
@@ -44,14 +44,24 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <string>
+
 #include "regdata.h"
 #include "analyticslogger.h"
+#include "expirypolicy.h"
 
 extern pjsip_module mod_registrar;
 
 extern pj_status_t init_registrar(RegData::Store* registrar_store,
-                                  AnalyticsLogger* analytics_logger);
+                                  AnalyticsLogger* analytics_logger,
+                                  ExpiryPolicy* expiry_policy);
 
 extern void destroy_registrar();
 
+/// Called when a request to a binding fails because its flow has failed.
+/// Removes the binding, and any other bindings registered over the same
+/// flow.
+extern void registrar_flow_failed(const std::string& aor_id,
+                                  const std::string& binding_id);
+
 #endif
@@ -0,0 +1,207 @@
+/**
+ * @file shmstore.h Definitions for the ShmStore class
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// ShmStore implements the Store interface for storing registration data,
+/// using a POSIX shared memory segment shared by the sprout processes on a
+/// host.
+///
+
+#ifndef SHMSTORE_H__
+#define SHMSTORE_H__
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "regdata.h"
+
+namespace RegData {
+
+  /// @class RegData::ShmAoR
+  ///
+  /// An AoR read from the shared memory store.
+  class ShmAoR : public AoR
+  {
+  public:
+    ShmAoR() :
+      AoR(),
+      _cas(0)
+    {
+    }
+
+    inline void set_cas(uint64_t cas) { _cas = cas; };
+    inline uint64_t get_cas() { return _cas; };
+
+    // Override copy constructor and operator= to ensure cas gets copied
+    // across also.
+    ShmAoR(const ShmAoR& to_copy) :
+      AoR(to_copy)
+    {
+      if (&to_copy != this)
+      {
+        _cas = to_copy._cas;
+      }
+    }
+
+    void operator=(const ShmAoR& to_copy)
+    {
+      if (&to_copy != this)
+      {
+        AoR::operator=((AoR&)to_copy);
+        _cas = to_copy._cas;
+      }
+    }
+
+  private:
+    uint64_t _cas;
+  };
+
+  /// @class RegData::ShmStore
+  ///
+  /// A store held in a POSIX shared memory segment, so every process on the
+  /// host that opens the same segment sees the same registrations.  The
+  /// segment outlives the processes using it.
+  ///
+  /// The segment holds an open-addressing hash table of buckets, each
+  /// pointing to a block holding the AoR ID and the AoR encoded by
+  /// AoRCodec.  Blocks come from an allocator in the segment with a free
+  /// list for each power-of-two size.
+  ///
+  /// Reads take no locks.  Each bucket has a sequence number which is odd
+  /// while the bucket is being changed, and a reader copies the bucket and
+  /// its block and retries if the sequence number moved meanwhile.  Writes
+  /// are serialized by a robust process-shared mutex, so a process that dies
+  /// mid-write doesn't block the others; the bucket it was changing is
+  /// dropped.
+  ///
+  /// Each bucket carries a CAS value from a counter in the segment, and a
+  /// write only succeeds if the CAS it was read with is still current (or
+  /// is zero and the AoR doesn't exist).  Bindings are expired when read,
+  /// and a background thread in each process removes AoRs with no live
+  /// bindings every second.  Expired bindings aren't reported to the
+  /// expiry listener.
+  ///
+  /// The table doesn't grow, so writes of new AoRs fail once it or the data
+  /// area is full.
+  class ShmStore : public Store
+  {
+  public:
+    ShmStore(const std::string& name,
+             ///< name of the shared memory segment, e.g., "/sprout-regdata"
+             uint32_t num_buckets = DEFAULT_BUCKETS,
+             ///< size of the hash table, if the segment is created
+             size_t data_size = DEFAULT_DATA_SIZE);
+             ///< size of the data area, if the segment is created
+    virtual ~ShmStore();
+
+    /// Returns true if the segment was opened successfully.
+    bool ready() { return (_header != NULL); }
+
+    void flush_all();
+
+    AoR* get_aor_data(const std::string& aor_id);
+    bool set_aor_data(const std::string& aor_id, AoR* aor_data);
+
+    /// Remove the AoRs with no bindings that are live at the given time.
+    /// Called every second by the background thread.
+    void expire_all(int now);
+
+    static const uint32_t DEFAULT_BUCKETS = 256 * 1024;
+    static const size_t DEFAULT_DATA_SIZE = 256 * 1024 * 1024;
+
+  private:
+    enum BucketState
+    {
+      EMPTY = 0,
+      USED,
+      DELETED
+    };
+
+    struct Bucket
+    {
+      std::atomic<uint32_t> seq;
+      std::atomic<uint32_t> state;
+      std::atomic<uint64_t> hash;
+      std::atomic<uint64_t> cas;
+
+      /// Offset of the block from the start of the segment, and the lengths
+      /// of the key and value in it.
+      std::atomic<uint64_t> block;
+      std::atomic<uint32_t> key_length;
+      std::atomic<uint32_t> value_length;
+
+      /// The latest binding expiry time.
+      std::atomic<int32_t> expiry;
+    };
+
+    struct Header;
+
+    bool open_segment(const std::string& name,
+                      uint32_t num_buckets,
+                      size_t data_size);
+    void init_segment(uint32_t num_buckets, size_t data_size);
+    void lock();
+    void unlock();
+    Bucket* buckets();
+    bool read(const std::string& aor_id, uint64_t hash, std::string& value, uint64_t* cas);
+    Bucket* find(const std::string& aor_id, uint64_t hash, Bucket** free);
+    bool key_matches(Bucket* b, const std::string& aor_id);
+    void begin_write(Bucket* b);
+    void end_write(Bucket* b);
+    void remove(Bucket* b);
+    uint64_t alloc_block(size_t length);
+    void free_block(uint64_t block, size_t length);
+
+    static int size_class(size_t length);
+    static uint64_t hash_key(const std::string& aor_id);
+
+    static void* sweep_thread(void* p);
+    void sweep_loop();
+
+    Header* _header;
+    size_t _size;
+
+    pthread_t _sweep_thread;
+    pthread_mutex_t _sweep_lock;
+    pthread_cond_t _sweep_cond;
+    bool _terminating;
+  };
+
+} // namespace RegData
+
+#endif
@@ -59,6 +59,7 @@ class UACTransaction;
 #include "sessioncase.h"
 #include "ifchandler.h"
 #include "aschain.h"
+#include "lookups.h"
 
 /// Short-lived data structure holding details of how we are to serve
 // this request.
@@ -71,16 +72,19 @@ public:
   {
   }
 
-  ServingState(SessionCase* session_case,
-               bool original_dialog) :
+  ServingState(const SessionCase* session_case,
+               bool original_dialog,
+               const AsChainLink& original_dialog_link) :
     _session_case(session_case),
-    _original_dialog(original_dialog)
+    _original_dialog(original_dialog),
+    _original_dialog_link(original_dialog_link)
   {
   }
 
   ServingState(const ServingState& to_copy) :
     _session_case(to_copy._session_case),
-    _original_dialog(to_copy._original_dialog)
+    _original_dialog(to_copy._original_dialog),
+    _original_dialog_link(to_copy._original_dialog_link)
   {
   }
 
@@ -90,6 +94,7 @@ public:
     {
       _session_case = to_copy._session_case;
       _original_dialog = to_copy._original_dialog;
+      _original_dialog_link = to_copy._original_dialog_link;
     }
     return *this;
   }
@@ -109,19 +114,22 @@ public:
   bool is_set() const { return _session_case != NULL; };
   const SessionCase& session_case() const { return *_session_case; };
   bool original_dialog() const { return _original_dialog; };
+  const AsChainLink& original_dialog_link() const { return _original_dialog_link; };
 
 private:
 
   /// Points to the session case.  If this is NULL it means the serving
   // state has not been set up.
-  SessionCase* _session_case;
+  const SessionCase* _session_case;
 
   /// Is this related to an existing (original) dialog? If so, we
   // should continue handling the existing AS chain rather than
-  // creating a new one.  In the current implementation this is
-  // just a boolean, but once we support more than a single AS
-  // it will be a pointer to an existing AsChain object.
+  // creating a new one.
   bool _original_dialog;
+
+  /// The position in the existing AS chain, if it is still around.
+  // This holds its own reference to the chain.
+  AsChainLink _original_dialog_link;
 };
 
 // This is the data that is attached to the UAS transaction
@@ -148,6 +156,10 @@ public:
   pj_status_t handle_final_response();
 
   void register_proxy(CallServices::Terminating* proxy);
+  Lookup<std::string>& simservs_lookup(const SessionCase& session_case)
+  {
+    return session_case.is_originating() ? _orig_simservs_lookup : _term_simservs_lookup;
+  }
 
   pj_status_t send_response(int st_code, const pj_str_t* st_text=NULL);
   bool redirect(std::string, int);
@@ -173,6 +185,11 @@ private:
                  pjsip_rx_data* rdata,
                  pjsip_tx_data* tdata,
                  TrustBoundary* trust);
+  void start_lookups(pjsip_msg* msg, const ServingState& serving_state);
+  Lookup<std::shared_ptr<const Ifcs> >& ifcs_lookup(const SessionCase& session_case)
+  {
+    return session_case.is_originating() ? _orig_ifcs_lookup : _term_ifcs_lookup;
+  }
   void log_on_tsx_start(const pjsip_rx_data* rdata);
   void log_on_tsx_complete();
   pj_status_t init_uac_transactions(pjsip_tx_data* tdata, target_list& targets);
@@ -186,7 +203,7 @@ private:
   pjsip_tx_data*       _req;
   pjsip_tx_data*       _best_rsp;
   TrustBoundary*       _trust;  //< Trust-boundary processing for this B2BUA to apply.
-  AsChain*             _as_chain;  //< AS chain / original dialog this transaction belongs to, if any.
+  AsChainLink          _as_chain_link;  //< Position in the AS chain / original dialog this transaction belongs to, if any.
 #define MAX_FORKING 10
   UACTransaction*      _uac_data[MAX_FORKING];
   struct
@@ -198,6 +215,15 @@ private:
   CallServices::Terminating* _proxy;  //< A proxy inserted into the signalling path, which sees all responses.
   bool                 _pending_destroy;
   int                  _context_count;
+
+  // Lookups started when the request arrived, so that they run
+  // concurrently rather than one after another.  See start_lookups.
+  Lookup<std::shared_ptr<const Ifcs> > _orig_ifcs_lookup;
+  Lookup<std::shared_ptr<const Ifcs> > _term_ifcs_lookup;
+  Lookup<std::string>  _orig_simservs_lookup;
+  Lookup<std::string>  _term_simservs_lookup;
+  Lookup<std::string>  _enum_lookup;
+  Lookup<std::shared_ptr<RegData::AoR> > _aor_lookup;
 };
 
 // This is the data that is attached to the UAC transaction
@@ -253,7 +279,8 @@ pj_status_t init_stateful_proxy(RegData::Store* registrar_store,
                                 const std::string& trusted_hosts,
                                 AnalyticsLogger* analytics_logger,
                                 EnumService *enumService,
-                                BgcfService *bgcfService);
+                                BgcfService *bgcfService,
+                                LookupPool* lookupPool);
 
 void destroy_stateful_proxy();
 
@@ -264,7 +291,8 @@ pj_status_t proxy_process_edge_routing(pjsip_rx_data *rdata,
 void proxy_calculate_targets(pjsip_msg* msg,
                              pj_pool_t* pool,
                              target_list& targets,
-                             int max_targets);
+                             int max_targets,
+                             Lookup<std::shared_ptr<RegData::AoR> >* aor_lookup = NULL);
 #endif
 
 #endif
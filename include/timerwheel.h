@@ -0,0 +1,116 @@
+/**
+ * @file @file timerwheel.h Hierarchical timer wheel keyed on expiry time
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// TimerWheel keeps a set of string-keyed timers, each due at a time in
+/// seconds, so those that have expired can be found without scanning.
+///
+///
+
+#ifndef TIMERWHEEL_H__
+#define TIMERWHEEL_H__
+
+#include <string>
+#include <vector>
+
+/// @class TimerWheel
+///
+/// A hierarchical timer wheel with one-second ticks.
+///
+/// There are NUM_LEVELS wheels of SLOTS_PER_LEVEL slots.  A slot on the
+/// lowest wheel holds timers due in one particular second; a slot on each
+/// higher wheel covers SLOTS_PER_LEVEL times as long as one on the wheel
+/// below.  As time passes the slots of the higher wheels are cascaded down,
+/// so scheduling, cancelling and popping a timer are all O(1) and each timer
+/// is only moved once per level.  Timers further out than the top wheel
+/// covers (about 194 days) are parked in its last slot and re-filed when it
+/// comes round.
+///
+/// TimerWheel does no locking of its own.
+class TimerWheel
+{
+public:
+  /// A scheduled timer.  Owned by the wheel; don't use one after it has
+  /// been cancelled or popped.
+  struct Timer
+  {
+    Timer* prev;
+    Timer* next;
+    int expiry;
+    std::string id;
+  };
+
+  /// Constructor.
+  TimerWheel(int now);
+             ///< the current time, in seconds
+  ~TimerWheel();
+
+  /// Schedule a timer for the given time.  A time that has already passed
+  /// pops on the next call to pop_expired.
+  Timer* schedule(const std::string& id, int expiry);
+
+  /// Cancel a timer.
+  void cancel(Timer* timer);
+
+  /// Advance to the given time, appending the IDs of all timers that are
+  /// now due to expired and removing them from the wheel.
+  void pop_expired(int now, std::vector<std::string>& expired);
+
+  /// Cancel every timer.
+  void clear();
+
+  /// The number of timers scheduled.
+  size_t size() const { return _size; }
+
+  static const int SLOT_BITS = 6;
+  static const int SLOTS_PER_LEVEL = 1 << SLOT_BITS;
+  static const int NUM_LEVELS = 4;
+
+private:
+  void file(Timer* timer);
+  void cascade(int level);
+  static void unlink(Timer* timer);
+
+  /// Each slot is a circular list headed by a sentinel.
+  Timer _slots[NUM_LEVELS][SLOTS_PER_LEVEL];
+
+  /// Every timer due at or before this time has been popped.
+  int _now;
+
+  size_t _size;
+};
+
+#endif
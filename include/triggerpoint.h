@@ -0,0 +1,170 @@
+/**
+ * @file triggerpoint.h Compiled iFC trigger points.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// A TriggerPoint is the condition part of an initial filter criterion
+/// (3GPP TS 29.228, appendix B), compiled from XML into a form that can be
+/// evaluated against every initial request cheaply.
+///
+
+#ifndef TRIGGERPOINT_H__
+#define TRIGGERPOINT_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/regex.hpp>
+
+#include "rapidxml/rapidxml.hpp"
+
+#include "sessioncase.h"
+
+/// @class TriggerPoint
+///
+/// A set of Service Point Triggers (SPTs) combined in conjunctive or
+/// disjunctive normal form.
+///
+/// Compiling a trigger point parses its SPTs, compiles their regular
+/// expressions, and orders them so the cheap tests (method, session case)
+/// come before the expensive ones (regular expressions over the
+/// Request-URI, headers and SDP).  Each group of SPTs then stops being
+/// evaluated as soon as its outcome is known, as does the trigger point.
+///
+/// Evaluation only reads the message, formatting the Request-URI and
+/// header values into buffers on the stack where they need to be matched
+/// as text, so it does no allocation of its own.
+class TriggerPoint
+{
+public:
+  /// Compile a TriggerPoint element.  Returns NULL, having logged why, if
+  /// it isn't valid.
+  static TriggerPoint* compile(rapidxml::xml_node<>* node);
+
+  /// Check whether an initial request matches the trigger point.
+  bool matches(const SessionCase& session_case, pjsip_msg* msg) const;
+
+  /// Values of the SessionCase SPT.
+  enum
+  {
+    ORIGINATING_REGISTERED = 0,
+    TERMINATING_REGISTERED = 1,
+    TERMINATING_UNREGISTERED = 2,
+    ORIGINATING_UNREGISTERED = 3,
+    ORIGINATING_CDIV = 4
+  };
+
+  /// The longest Request-URI or header value that can be matched against
+  /// a regular expression.  Longer ones never match.
+  static const int MAX_MATCH_LENGTH = 2048;
+
+private:
+  /// The kinds of SPT, in the order they are evaluated in.
+  enum SptType
+  {
+    METHOD,
+    SESSION_CASE,
+    REQUEST_URI,
+    SESSION_DESCRIPTION,
+    SIP_HEADER
+  };
+
+  struct Spt
+  {
+    SptType type;
+    bool negated;
+
+    /// The method, for METHOD SPTs.
+    std::string method;
+
+    /// The session case, for SESSION_CASE SPTs.
+    int session_case;
+
+    /// The header name or SDP line type, for SIP_HEADER and
+    /// SESSION_DESCRIPTION SPTs.
+    boost::regex name;
+
+    /// The Request-URI, header value or SDP line content.  A SIP_HEADER or
+    /// SESSION_DESCRIPTION SPT without one just checks that the header or
+    /// line is present.
+    boost::regex content;
+    bool has_content;
+
+    /// The groups the SPT belongs to.
+    std::vector<int> groups;
+  };
+
+  /// A group of SPTs, as a range of _members.
+  struct Group
+  {
+    size_t begin;
+    size_t end;
+  };
+
+  TriggerPoint() : _cnf(false) {}
+
+  static bool compile_spt(rapidxml::xml_node<>* node, Spt& spt);
+  bool evaluate(size_t index,
+                const SessionCase& session_case,
+                pjsip_msg* msg,
+                uint64_t& evaluated,
+                uint64_t& results) const;
+  static bool evaluate(const Spt& spt,
+                       const SessionCase& session_case,
+                       pjsip_msg* msg);
+  static bool match_session_case(int spt_session_case,
+                                 const SessionCase& session_case);
+  static bool match_header(const Spt& spt, pjsip_msg* msg);
+  static bool match_sdp(const Spt& spt, pjsip_msg* msg);
+
+  /// Whether the groups are combined in conjunctive normal form (each
+  /// group is a disjunction, and they must all be true) or disjunctive
+  /// normal form (each group is a conjunction, and any may be true).
+  bool _cnf;
+
+  /// The SPTs, cheapest first.
+  std::vector<Spt> _spts;
+
+  /// The groups, and the indexes in _spts of their members, cheapest
+  /// first.
+  std::vector<Group> _groups;
+  std::vector<size_t> _members;
+};
+
+#endif
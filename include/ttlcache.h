@@ -0,0 +1,423 @@
+/**
+ * @file ttlcache.h Template definition for a cache of loaded values with a TTL
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+/// TtlCache is an in-process cache of values loaded from elsewhere (e.g.,
+/// from Homestead), each used for a fixed time before being loaded again.
+///
+///
+
+#ifndef TTLCACHE_H__
+#define TTLCACHE_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "statistic.h"
+#include "log.h"
+
+/// @class TtlCache
+///
+/// A size-bounded, sharded cache of values keyed by string.
+///
+/// Entries live for a TTL, so changes to the underlying data take effect
+/// after at most that long.  Keys with no value are remembered too, for a
+/// separate (usually shorter) TTL, so that repeated lookups of them don't
+/// each cost a load.
+///
+/// If several threads want the same value while it isn't cached, only the
+/// first loads it; the others wait for its result.
+///
+/// Expired entries are kept until they are replaced or evicted, so that if
+/// a value can't be loaded (e.g., because the server holding it is
+/// unavailable) the expired one can be used instead.
+///
+/// A key may start with a group name, terminated by a NUL.  A group's
+/// entries are all in the same shard, so can be invalidated together.
+template<class V>
+class TtlCache
+{
+public:
+  /// Counters, totalled across all shards.
+  struct Stats
+  {
+    /// Lookups answered from the cache, including those for keys with no
+    /// value.
+    uint64_t hits;
+
+    /// Lookups that had to load the value.
+    uint64_t misses;
+
+    /// Lookups that waited for another thread to load the value.
+    uint64_t coalesced;
+
+    /// Entries currently in the cache.
+    uint64_t entries;
+
+    /// Lookups answered with an expired value, because it couldn't be
+    /// loaded.
+    uint64_t stale;
+
+    /// Entries dropped by invalidate_group().
+    uint64_t invalidated;
+  };
+
+  /// The result of loading a value.
+  enum LoadResult
+  {
+    LOADED,
+    NOT_FOUND,
+    FAILED
+  };
+
+  /// Loads a value.
+  typedef std::function<LoadResult(V& value)> Loader;
+
+  /// Constructor.
+  TtlCache(size_t max_entries,
+           ///< maximum number of entries to cache
+           int ttl_ms,
+           ///< how long a value may be used for
+           int negative_ttl_ms,
+           ///< how long to remember that a key has no value
+           Statistic* statistic = NULL,
+           ///< if not NULL, counters are reported here; not owned
+           int num_shards = DEFAULT_SHARDS) :
+           ///< number of independently locked shards
+    _shards(num_shards),
+    _max_entries_per_shard((max_entries + num_shards - 1) / num_shards),
+    _ttl_ms(ttl_ms),
+    _negative_ttl_ms(negative_ttl_ms),
+    _statistic(statistic),
+    _next_report_ms(0)
+  {
+    for (int ii = 0; ii < num_shards; ++ii)
+    {
+      Shard* shard = new Shard;
+      pthread_mutex_init(&shard->lock, NULL);
+      pthread_cond_init(&shard->loaded, NULL);
+      shard->hits = 0;
+      shard->misses = 0;
+      shard->coalesced = 0;
+      shard->stale = 0;
+      shard->invalidated = 0;
+      _shards[ii] = shard;
+    }
+    pthread_mutex_init(&_report_lock, NULL);
+  }
+
+  virtual ~TtlCache()
+  {
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      pthread_cond_destroy(&_shards[ii]->loaded);
+      pthread_mutex_destroy(&_shards[ii]->lock);
+      delete _shards[ii];
+    }
+    pthread_mutex_destroy(&_report_lock);
+  }
+
+  /// Get a value, calling the loader if it isn't cached.  Returns V() if
+  /// the key has no value, or it couldn't be loaded and there is no expired
+  /// one.
+  V get(const std::string& key, const Loader& loader)
+  {
+    V value = V();
+    uint64_t now = now_ms();
+    Shard& shard = shard_for(key);
+
+    pthread_mutex_lock(&shard.lock);
+    typename std::map<std::string, Entry>::iterator i = shard.entries.find(key);
+    if ((i != shard.entries.end()) && (i->second.expiry_ms > now))
+    {
+      // Fresh entry, so use it and mark it most recently used.
+      value = i->second.value;
+      shard.lru.splice(shard.lru.begin(), shard.lru, i->second.lru);
+      ++shard.hits;
+      pthread_mutex_unlock(&shard.lock);
+    }
+    else
+    {
+      typename std::map<std::string, std::shared_ptr<Load> >::iterator j =
+                                                          shard.loads.find(key);
+      if (j != shard.loads.end())
+      {
+        // Another thread is already loading this value, so wait for it.
+        LOG_DEBUG("Waiting for %s to be loaded", key.c_str());
+        std::shared_ptr<Load> load = j->second;
+        ++shard.coalesced;
+        while (!load->done)
+        {
+          pthread_cond_wait(&shard.loaded, &shard.lock);
+        }
+        value = load->value;
+        pthread_mutex_unlock(&shard.lock);
+      }
+      else
+      {
+        // Load the value ourselves, without holding the lock.
+        std::shared_ptr<Load> load(new Load());
+        shard.loads[key] = load;
+        ++shard.misses;
+        pthread_mutex_unlock(&shard.lock);
+
+        V loaded = V();
+        LoadResult result = loader(loaded);
+        if (result == LOADED)
+        {
+          value = loaded;
+        }
+
+        pthread_mutex_lock(&shard.lock);
+        if (result != FAILED)
+        {
+          put(shard, key, value, result, now_ms());
+        }
+        else
+        {
+          // Make do with the expired value, if we still have it, but don't
+          // cache anything so that the next lookup tries again.
+          i = shard.entries.find(key);
+          if (i != shard.entries.end())
+          {
+            LOG_DEBUG("Using expired value for %s", key.c_str());
+            value = i->second.value;
+            ++shard.stale;
+          }
+        }
+        load->value = value;
+        load->done = true;
+        shard.loads.erase(key);
+        pthread_cond_broadcast(&shard.loaded);
+        pthread_mutex_unlock(&shard.lock);
+      }
+    }
+
+    maybe_report(now);
+    return value;
+  }
+
+  /// Drop the entries for a group, so that the next lookups load them
+  /// afresh.  Entries loaded in the last min_age_ms are kept.
+  void invalidate_group(const std::string& group, int min_age_ms)
+  {
+    std::string prefix = group + '\0';
+    uint64_t now = now_ms();
+    Shard& shard = shard_for(prefix);
+
+    pthread_mutex_lock(&shard.lock);
+    typename std::map<std::string, Entry>::iterator i = shard.entries.lower_bound(prefix);
+    while ((i != shard.entries.end()) &&
+           (i->first.compare(0, prefix.size(), prefix) == 0))
+    {
+      typename std::map<std::string, Entry>::iterator next = i;
+      ++next;
+      if (now >= i->second.loaded_ms + min_age_ms)
+      {
+        LOG_DEBUG("Invalidating cached value for %s", group.c_str());
+        erase(shard, i);
+        ++shard.invalidated;
+      }
+      i = next;
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Get the current values of the counters.
+  Stats stats()
+  {
+    Stats stats = {0, 0, 0, 0, 0, 0};
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      Shard& shard = *_shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.coalesced += shard.coalesced;
+      stats.entries += shard.entries.size();
+      stats.stale += shard.stale;
+      stats.invalidated += shard.invalidated;
+      pthread_mutex_unlock(&shard.lock);
+    }
+    return stats;
+  }
+
+  /// Default number of shards.
+  static const int DEFAULT_SHARDS = 16;
+
+  /// How often (in milliseconds) the counters are reported.
+  static const int REPORT_INTERVAL_MS = 1000;
+
+protected:
+  /// Add the values of any counters reported as well as hits, misses,
+  /// coalesced lookups, entries and stale lookups.
+  virtual void add_stat_values(const Stats& stats,
+                               std::vector<std::string>& values)
+  {
+  }
+
+private:
+  struct Entry
+  {
+    /// V() if the key has no value.
+    V value;
+    uint64_t loaded_ms;
+    uint64_t expiry_ms;
+    std::list<std::string>::iterator lru;
+  };
+
+  /// A load in progress, which other threads can wait for.
+  struct Load
+  {
+    Load() : done(false), value() {}
+    bool done;
+    V value;
+  };
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    /// Signalled when a load completes.
+    pthread_cond_t loaded;
+
+    std::map<std::string, Entry> entries;
+    std::map<std::string, std::shared_ptr<Load> > loads;
+
+    /// Keys, most recently used first.
+    std::list<std::string> lru;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t stale;
+    uint64_t invalidated;
+  };
+
+  /// The shard for a key, chosen by its group if it has one.
+  Shard& shard_for(const std::string& key)
+  {
+    std::string group = key.substr(0, key.find('\0'));
+    return *_shards[std::hash<std::string>()(group) % _shards.size()];
+  }
+
+  /// Cache a value, or the fact that a key has none, replacing any expired
+  /// entry.  The shard lock must be held.
+  void put(Shard& shard,
+           const std::string& key,
+           const V& value,
+           LoadResult result,
+           uint64_t now)
+  {
+    typename std::map<std::string, Entry>::iterator i = shard.entries.find(key);
+    if (i != shard.entries.end())
+    {
+      erase(shard, i);
+    }
+
+    // Make room for the new entry if necessary.
+    if (shard.entries.size() >= _max_entries_per_shard)
+    {
+      erase(shard, shard.entries.find(shard.lru.back()));
+    }
+    shard.lru.push_front(key);
+    Entry& entry = shard.entries[key];
+    entry.value = value;
+    entry.loaded_ms = now;
+    entry.expiry_ms = now + ((result == LOADED) ? _ttl_ms : _negative_ttl_ms);
+    entry.lru = shard.lru.begin();
+  }
+
+  /// Remove an entry.  The shard lock must be held.
+  void erase(Shard& shard, typename std::map<std::string, Entry>::iterator i)
+  {
+    shard.lru.erase(i->second.lru);
+    shard.entries.erase(i);
+  }
+
+  /// Report the counters if the reporting interval has passed.  Only one
+  /// thread reports; the others carry on without waiting.
+  void maybe_report(uint64_t now)
+  {
+    if ((_statistic != NULL) &&
+        (now >= _next_report_ms) &&
+        (pthread_mutex_trylock(&_report_lock) == 0))
+    {
+      if (now >= _next_report_ms)
+      {
+        _next_report_ms = now + REPORT_INTERVAL_MS;
+        Stats s = stats();
+        std::vector<std::string> values;
+        values.push_back(std::to_string((unsigned long long)s.hits));
+        values.push_back(std::to_string((unsigned long long)s.misses));
+        values.push_back(std::to_string((unsigned long long)s.coalesced));
+        values.push_back(std::to_string((unsigned long long)s.entries));
+        values.push_back(std::to_string((unsigned long long)s.stale));
+        add_stat_values(s, values);
+        _statistic->report_change(values);
+      }
+      pthread_mutex_unlock(&_report_lock);
+    }
+  }
+
+  static uint64_t now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  std::vector<Shard*> _shards;
+  size_t _max_entries_per_shard;
+  int _ttl_ms;
+  int _negative_ttl_ms;
+
+  Statistic* _statistic;
+  pthread_mutex_t _report_lock;
+  volatile uint64_t _next_report_ms;
+};
+
+template<class V> const int TtlCache<V>::DEFAULT_SHARDS;
+template<class V> const int TtlCache<V>::REPORT_INTERVAL_MS;
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file upstreambalancer.h Balancing of requests over a server's addresses
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef UPSTREAMBALANCER_H__
+#define UPSTREAMBALANCER_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdint.h>
+#include <pthread.h>
+
+/// @class UpstreamBalancer
+///
+/// Balances the requests to a server over the addresses its name resolves
+/// to (its targets), rather than leaving it to DNS.  Each target's latency
+/// and error rate are tracked, and requests go to whichever of two randomly
+/// chosen targets has the least outstanding work.  A target that fails too
+/// often, or is much slower than the others, is ejected for a while, then
+/// re-admitted once a single probe request to it succeeds.
+///
+/// The server's name is resolved when the balancer is created, then again
+/// periodically on a background thread, so choosing a target never waits
+/// for DNS.  If the name can't be resolved (and never has been), it is used
+/// as the only target, leaving cURL to resolve it.
+class UpstreamBalancer
+{
+public:
+  /// Constructor.
+  UpstreamBalancer(const std::string& server);
+                   ///< server name, with optional port, e.g., "hs.example.com:8888"
+  ~UpstreamBalancer();
+
+  /// A target requests can be sent to.  Must access under the balancer's
+  /// lock, apart from the address and IP.
+  struct Target
+  {
+    /// Address to send requests to, with the server's port if it has one.
+    std::string address;
+
+    /// IP address (or the server's host name, if it couldn't be resolved).
+    std::string ip;
+
+    /// Requests sent to the target and not yet completed.
+    int outstanding;
+
+    /// Moving average of the time requests to the target take.
+    double latency_ms;
+
+    /// Moving average of the proportion of requests that fail.
+    double error_rate;
+
+    /// Requests completed since the target was last admitted.
+    int samples;
+
+    /// The number of times in a row the target has been ejected.
+    int ejections;
+
+    /// CLOCK_MONOTONIC time the ejection ends, or 0 if not ejected.
+    uint64_t ejected_until_ms;
+
+    /// Whether a probe request is in progress.
+    bool probing;
+  };
+
+  /// Choose a target for a request, preferring not to use the avoided
+  /// one (e.g., because the request just failed on it).  The caller must
+  /// report how the request went by calling complete().
+  std::shared_ptr<Target> select(const Target* avoid = NULL);
+
+  /// Report that a request to the target has completed, whether it
+  /// succeeded, and how long it took.
+  void complete(const std::shared_ptr<Target>& target, bool ok, double latency_ms);
+
+  /// Gets copies of the targets, for reporting.
+  std::vector<Target> targets();
+
+  /// State of a target, for reporting: "active", "ejected" or "probing".
+  static std::string state(const Target& target);
+
+  /// How often (in milliseconds) the server's name is resolved again.
+  static const int RESOLVE_INTERVAL_MS = 30 * 1000;
+
+  /// Weight of each new sample in the moving averages.
+  static const double EWMA_WEIGHT;
+
+  /// Requests a target must complete before it can be ejected.
+  static const int MIN_SAMPLES = 5;
+
+  /// Error rate above which a target is ejected.
+  static const double MAX_ERROR_RATE;
+
+  /// How many times slower than the average of the other targets a target
+  /// must be to be ejected, and the minimum latency a target must have
+  /// before it's considered slow at all.
+  static const double LATENCY_OUTLIER_FACTOR;
+  static const int MIN_OUTLIER_LATENCY_MS = 50;
+
+  /// How long a target is ejected for the first time.  This doubles each
+  /// time it is ejected again without being successfully probed, up to
+  /// the maximum.
+  static const int BASE_EJECTION_MS = 10 * 1000;
+  static const int MAX_EJECTION_MS = 5 * 60 * 1000;
+
+private:
+  std::vector<std::string> resolve();
+  static void* resolver_thread(void* p);
+  void resolver_loop();
+  void update_targets(const std::vector<std::string>& ips);
+  static std::shared_ptr<Target> new_target(const std::string& address, const std::string& ip);
+  bool is_outlier(const Target& target);
+  void eject(Target& target, uint64_t now_ms);
+  static uint64_t now_ms();
+
+  /// The server, as configured, and its host name and port (if any).
+  const std::string _server;
+  std::string _host;
+  std::string _port;
+
+  pthread_mutex_t _lock;
+
+  /// Targets, keyed by address.  Must access under _lock.
+  std::map<std::string, std::shared_ptr<Target> > _targets;
+
+  /// Thread that resolves the server's name every RESOLVE_INTERVAL_MS,
+  /// and the condition it waits on between times, signalled to terminate
+  /// it.  _terminating must be accessed under _lock.
+  pthread_t _resolver;
+  pthread_cond_t _resolver_cond;
+  bool _terminating;
+
+  /// Random number generator for choosing targets.  Must access under
+  /// _lock.
+  std::default_random_engine _rand;
+};
+
+#endif
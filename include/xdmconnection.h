@@ -48,7 +48,9 @@
 class XDMConnection
 {
 public:
-  XDMConnection(const std::string& server);
+  XDMConnection(const std::string& server,
+                HttpEngine* engine = NULL,
+                double failure_ratio = CircuitBreaker::DEFAULT_FAILURE_RATIO);
   XDMConnection(HttpConnection* http);
   virtual ~XDMConnection();
 
@@ -217,9 +217,258 @@ class ConnectedIpsRenderer < AbstractRenderer
   end
 end
 
-# Register the two statistics we currently expose
+# Upstream statistics are reported as:
+#
+# <address1>
+#
+# <connections1>
+#
+# <outstanding1>
+#
+# <latency1>
+#
+# <error percentage1>
+#
+# <state1>
+#
+# <address2>
+#
+# ...
+#
+# We convert it into a hash of address => state.
+class UpstreamRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    hash = {}
+    while not msg.empty?
+      k = msg.shift
+      hash[k] = {
+        "connections" => msg.shift.to_i,
+        "outstanding" => msg.shift.to_i,
+        "latency_ms" => msg.shift.to_i,
+        "error_percent" => msg.shift.to_i,
+        "state" => msg.shift
+      }
+    end
+    hash
+  end
+end
+
+# Cache statistics are reported as:
+#
+# <hits>
+#
+# <misses>
+#
+# <stale>
+#
+# <entries>
+#
+# where the first three are counts since the process started.
+class CacheStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+hits:#{msg[0]}
+misses:#{msg[1]}
+stale:#{msg[2]}
+entries:#{msg[3]}
+    EOF
+  end
+end
+
+# AS chain statistics are reported as:
+#
+# <chains>
+#
+# <created>
+#
+# <application servers>
+#
+# <longest>
+#
+# <resumed>
+#
+# <unknown>
+#
+# where all but the first are counts since the process started.
+class AsChainStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+chains:#{msg[0]}
+created:#{msg[1]}
+application_servers:#{msg[2]}
+longest:#{msg[3]}
+resumed:#{msg[4]}
+unknown:#{msg[5]}
+    EOF
+  end
+end
+
+# iFC cache statistics are reported as:
+#
+# <hits>
+#
+# <misses>
+#
+# <coalesced>
+#
+# <entries>
+#
+# <stale>
+#
+# where all but entries are counts since the process started.
+class IfcCacheStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+hits:#{msg[0]}
+misses:#{msg[1]}
+coalesced:#{msg[2]}
+entries:#{msg[3]}
+stale:#{msg[4]}
+    EOF
+  end
+end
+
+# Digest cache statistics are reported as:
+#
+# <hits>
+#
+# <misses>
+#
+# <coalesced>
+#
+# <entries>
+#
+# <stale>
+#
+# <invalidated>
+#
+# where all but entries are counts since the process started.
+class DigestCacheStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+hits:#{msg[0]}
+misses:#{msg[1]}
+coalesced:#{msg[2]}
+entries:#{msg[3]}
+stale:#{msg[4]}
+invalidated:#{msg[5]}
+    EOF
+  end
+end
+
+# Registrar write statistics are reported as:
+#
+# <writes>
+#
+# <coalesced>
+#
+# <conflicts>
+#
+# <retries>
+#
+# <failures>
+#
+# all counts since the process started.
+class WriteStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+writes:#{msg[0]}
+coalesced:#{msg[1]}
+conflicts:#{msg[2]}
+retries:#{msg[3]}
+failures:#{msg[4]}
+    EOF
+  end
+end
+
+# GET statistics are reported as:
+#
+# <path class1>
+#
+# <requests1>
+#
+# <coalesced1>
+#
+# <hedged1>
+#
+# <path class2>
+#
+# ...
+#
+# where the counts are since the process started.  We convert it into a
+# hash of path class => counts.
+class GetStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    hash = {}
+    while not msg.empty?
+      k = msg.shift
+      requests = msg.shift
+      coalesced = msg.shift
+      hedged = msg.shift
+      hash[k] = { "requests" => requests.to_i, "coalesced" => coalesced.to_i, "hedged" => hedged.to_i }
+    end
+    hash
+  end
+end
+
+# Circuit breaker statistics are reported as:
+#
+# <state>
+#
+# <opened>
+#
+# <rejected>
+#
+# where the last two are counts since the process started.
+class BreakerStatsRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+state:#{msg[0]}
+opened:#{msg[1]}
+rejected:#{msg[2]}
+    EOF
+  end
+end
+
+# Registration rate statistics are reported as:
+#
+# <REGISTERs per second>
+#
+# <queueing latency in ms>
+#
+# <maximum expiry in seconds>
+class RegistrationRateRenderer < AbstractRenderer
+  # @see AbstractRenderer#render
+  def render(msg)
+    <<-EOF
+rate:#{msg[0]}
+latency:#{msg[1]}
+max_expires:#{msg[2]}
+    EOF
+  end
+end
+
+# Register the statistics we currently expose
 CWStatCollector.register_renderer("client_count", SimpleStatRenderer)
-CWStatCollector.register_renderer("connected_homesteads", ConnectedIpsRenderer)
-CWStatCollector.register_renderer("connected_homers", ConnectedIpsRenderer)
+CWStatCollector.register_renderer("connected_homesteads", UpstreamRenderer)
+CWStatCollector.register_renderer("connected_homers", UpstreamRenderer)
 CWStatCollector.register_renderer("connected_sprouts", ConnectedIpsRenderer)
 CWStatCollector.register_renderer("call_stats", CallStatsRenderer)
+CWStatCollector.register_renderer("as_chains", AsChainStatsRenderer)
+CWStatCollector.register_renderer("digest_cache", DigestCacheStatsRenderer)
+CWStatCollector.register_renderer("homer_breaker", BreakerStatsRenderer)
+CWStatCollector.register_renderer("homer_gets", GetStatsRenderer)
+CWStatCollector.register_renderer("homestead_breaker", BreakerStatsRenderer)
+CWStatCollector.register_renderer("homestead_gets", GetStatsRenderer)
+CWStatCollector.register_renderer("ifc_cache", IfcCacheStatsRenderer)
+CWStatCollector.register_renderer("memstore_cache", CacheStatsRenderer)
+CWStatCollector.register_renderer("registrar_writes", WriteStatsRenderer)
+CWStatCollector.register_renderer("registration_rate", RegistrationRateRenderer)
@@ -0,0 +1,236 @@
+/**
+ * @file aorcache.cpp In-process cache of registration data
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "aorcache.h"
+
+#include <time.h>
+#include <functional>
+
+#include "statistic.h"
+#include "log.h"
+
+namespace RegData {
+
+  const int AoRCache::DEFAULT_SHARDS;
+  const int AoRCache::REPORT_INTERVAL_MS;
+
+  AoRCache::AoRCache(size_t max_entries,
+                     int ttl_ms,
+                     Statistic* statistic,
+                     int num_shards) :
+    _shards(num_shards),
+    _max_entries_per_shard((max_entries + num_shards - 1) / num_shards),
+    _ttl_ms(ttl_ms),
+    _statistic(statistic),
+    _next_report_ms(0)
+  {
+    for (int ii = 0; ii < num_shards; ++ii)
+    {
+      Shard* shard = new Shard;
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->hits = 0;
+      shard->misses = 0;
+      shard->stale = 0;
+      _shards[ii] = shard;
+    }
+    pthread_mutex_init(&_report_lock, NULL);
+    LOG_STATUS("Caching up to %d AoRs for %dms", (int)max_entries, ttl_ms);
+  }
+
+  AoRCache::~AoRCache()
+  {
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii]->lock);
+      delete _shards[ii];
+    }
+    pthread_mutex_destroy(&_report_lock);
+  }
+
+  /// Look up an AoR, returning a copy (including its CAS) for the caller to
+  /// own, or NULL if there is no usable entry.
+  MemcachedAoR* AoRCache::get(const std::string& aor_id)
+  {
+    MemcachedAoR* aor_data = NULL;
+    uint64_t now = now_ms();
+    Shard& shard = shard_for(aor_id);
+
+    pthread_mutex_lock(&shard.lock);
+    std::map<std::string, Entry>::iterator i = shard.entries.find(aor_id);
+    if ((i != shard.entries.end()) && (i->second.expiry_ms > now))
+    {
+      // Fresh entry, so copy it out and mark it most recently used.
+      aor_data = new MemcachedAoR(i->second.aor_data);
+      shard.lru.splice(shard.lru.begin(), shard.lru, i->second.lru);
+      ++shard.hits;
+    }
+    else
+    {
+      if (i != shard.entries.end())
+      {
+        // Expired, so it's no use to anyone.
+        erase(shard, i);
+      }
+      ++shard.misses;
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    maybe_report(now);
+    return aor_data;
+  }
+
+  /// Cache a copy of an AoR, replacing any existing entry.
+  void AoRCache::put(const std::string& aor_id, const MemcachedAoR& aor_data)
+  {
+    uint64_t now = now_ms();
+    Shard& shard = shard_for(aor_id);
+
+    pthread_mutex_lock(&shard.lock);
+    std::map<std::string, Entry>::iterator i = shard.entries.find(aor_id);
+    if (i == shard.entries.end())
+    {
+      // New entry, so make room for it if necessary.
+      if (shard.entries.size() >= _max_entries_per_shard)
+      {
+        erase(shard, shard.entries.find(shard.lru.back()));
+      }
+      shard.lru.push_front(aor_id);
+      i = shard.entries.insert(std::make_pair(aor_id, Entry())).first;
+      i->second.lru = shard.lru.begin();
+    }
+    else
+    {
+      shard.lru.splice(shard.lru.begin(), shard.lru, i->second.lru);
+    }
+
+    // Assigning into the existing entry reuses its binding storage.
+    i->second.aor_data = aor_data;
+    i->second.expiry_ms = now + _ttl_ms;
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Drop any entry for an AoR because a write through it was rejected.
+  void AoRCache::invalidate(const std::string& aor_id)
+  {
+    Shard& shard = shard_for(aor_id);
+
+    pthread_mutex_lock(&shard.lock);
+    std::map<std::string, Entry>::iterator i = shard.entries.find(aor_id);
+    if (i != shard.entries.end())
+    {
+      LOG_DEBUG("Dropping stale cache entry for %s", aor_id.c_str());
+      erase(shard, i);
+      ++shard.stale;
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Drop every entry.
+  void AoRCache::clear()
+  {
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      Shard& shard = *_shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      shard.entries.clear();
+      shard.lru.clear();
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+
+  /// Get the current values of the counters.
+  AoRCache::Stats AoRCache::stats()
+  {
+    Stats stats = {0, 0, 0, 0};
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      Shard& shard = *_shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.stale += shard.stale;
+      stats.entries += shard.entries.size();
+      pthread_mutex_unlock(&shard.lock);
+    }
+    return stats;
+  }
+
+  AoRCache::Shard& AoRCache::shard_for(const std::string& aor_id)
+  {
+    return *_shards[std::hash<std::string>()(aor_id) % _shards.size()];
+  }
+
+  /// Remove an entry.  The shard lock must be held.
+  void AoRCache::erase(Shard& shard, std::map<std::string, Entry>::iterator i)
+  {
+    shard.lru.erase(i->second.lru);
+    shard.entries.erase(i);
+  }
+
+  /// Report the counters if the reporting interval has passed.  Only one
+  /// thread reports; the others carry on without waiting.
+  void AoRCache::maybe_report(uint64_t now)
+  {
+    if ((_statistic != NULL) &&
+        (now >= _next_report_ms) &&
+        (pthread_mutex_trylock(&_report_lock) == 0))
+    {
+      if (now >= _next_report_ms)
+      {
+        _next_report_ms = now + REPORT_INTERVAL_MS;
+        Stats s = stats();
+        std::vector<std::string> values;
+        values.push_back(std::to_string((unsigned long long)s.hits));
+        values.push_back(std::to_string((unsigned long long)s.misses));
+        values.push_back(std::to_string((unsigned long long)s.stale));
+        values.push_back(std::to_string((unsigned long long)s.entries));
+        _statistic->report_change(values);
+      }
+      pthread_mutex_unlock(&_report_lock);
+    }
+  }
+
+  uint64_t AoRCache::now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+} // namespace RegData
@@ -0,0 +1,524 @@
+/**
+ * @file aorcodec.cpp Binary encoding of registration data records.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "aorcodec.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "log.h"
+
+namespace RegData {
+
+  const char AoRCodec::MAGIC[3] = {'\xFF', 'R', 'D'};
+  const uint8_t AoRCodec::VERSION;
+  const uint8_t AoRCodec::FLAG_COMPRESSED;
+  const size_t AoRCodec::COMPRESS_THRESHOLD;
+  const size_t AoRCodec::MAX_BODY_LENGTH;
+  const size_t AoRCodec::HEADER_LENGTH;
+
+  namespace {
+
+    /// Appends varints and length-prefixed strings to a string buffer.
+    class Writer
+    {
+    public:
+      Writer(std::string& out) : _out(out) {}
+
+      inline void put_varint(uint32_t value)
+      {
+        while (value >= 0x80)
+        {
+          _out.push_back((char)((value & 0x7F) | 0x80));
+          value >>= 7;
+        }
+        _out.push_back((char)value);
+      }
+
+      inline void put_string(const std::string& s)
+      {
+        put_varint(s.length());
+        _out.append(s);
+      }
+
+    private:
+      std::string& _out;
+    };
+
+    /// Reads varints and length-prefixed strings from a buffer, checking
+    /// that nothing is read beyond the end of it.  Once a read fails all
+    /// subsequent reads also fail.
+    class Reader
+    {
+    public:
+      Reader(const char* data, size_t length) :
+        _p(data),
+        _end(data + length),
+        _ok(true)
+      {
+      }
+
+      inline bool ok() const { return _ok; }
+      inline bool at_end() const { return _p == _end; }
+      inline const char* position() const { return _p; }
+      inline void fail() { _ok = false; }
+      inline size_t remaining() const { return _end - _p; }
+
+      inline uint32_t get_varint()
+      {
+        uint32_t value = 0;
+        for (int shift = 0; (_ok) && (shift < 35); shift += 7)
+        {
+          if (_p == _end)
+          {
+            break;
+          }
+          uint8_t byte = (uint8_t)*_p++;
+          value |= (uint32_t)(byte & 0x7F) << shift;
+          if ((byte & 0x80) == 0)
+          {
+            return value;
+          }
+        }
+        _ok = false;
+        return 0;
+      }
+
+      inline void get_string(std::string& s)
+      {
+        uint32_t length = get_varint();
+        if ((_ok) && (length <= (size_t)(_end - _p)))
+        {
+          s.assign(_p, length);
+          _p += length;
+        }
+        else
+        {
+          _ok = false;
+        }
+      }
+
+      /// Read a native-endian int (legacy format only).
+      inline int get_int()
+      {
+        int value = 0;
+        if ((_ok) && (sizeof(int) <= (size_t)(_end - _p)))
+        {
+          memcpy(&value, _p, sizeof(int));
+          _p += sizeof(int);
+        }
+        else
+        {
+          _ok = false;
+        }
+        return value;
+      }
+
+      /// Read a NUL-terminated string (legacy format only).
+      inline void get_cstring(std::string& s)
+      {
+        const char* nul = (_ok) ? (const char*)memchr(_p, '\0', _end - _p) : NULL;
+        if (nul != NULL)
+        {
+          s.assign(_p, nul - _p);
+          _p = nul + 1;
+        }
+        else
+        {
+          _ok = false;
+        }
+      }
+
+      /// Check a count read from the record is plausible given the bytes
+      /// remaining, so a corrupt count can't make us allocate wildly.
+      inline bool check_count(uint32_t count, size_t min_bytes_each)
+      {
+        if ((size_t)(_end - _p) / min_bytes_each < count)
+        {
+          _ok = false;
+        }
+        return _ok;
+      }
+
+    private:
+      const char* _p;
+      const char* _end;
+      bool _ok;
+    };
+
+    /// Per-thread deflate and inflate streams.  Setting up a zlib stream
+    /// allocates and zeroes several tens of KB of state, which costs far
+    /// more than compressing a registration record, so each thread keeps a
+    /// pair of streams and resets them between records.
+    struct ZStreams
+    {
+      z_stream deflater;
+      z_stream inflater;
+      bool deflater_ok;
+      bool inflater_ok;
+    };
+
+    // Records are small and repetitive, so an 8KB window and a small hash
+    // table find almost all the matches the defaults would.
+    const int DEFLATE_WINDOW_BITS = 13;
+    const int DEFLATE_MEM_LEVEL = 5;
+
+    pthread_key_t zstreams_key;
+    pthread_once_t zstreams_once = PTHREAD_ONCE_INIT;
+
+    void cleanup_zstreams(void* ptr)
+    {
+      ZStreams* zs = (ZStreams*)ptr;
+      if (zs->deflater_ok)
+      {
+        deflateEnd(&zs->deflater);
+      }
+      if (zs->inflater_ok)
+      {
+        inflateEnd(&zs->inflater);
+      }
+      delete zs;
+    }
+
+    void create_zstreams_key()
+    {
+      pthread_key_create(&zstreams_key, cleanup_zstreams);
+    }
+
+    ZStreams* get_zstreams()
+    {
+      pthread_once(&zstreams_once, create_zstreams_key);
+      ZStreams* zs = (ZStreams*)pthread_getspecific(zstreams_key);
+      if (zs == NULL)
+      {
+        zs = new ZStreams;
+        memset(zs, 0, sizeof(*zs));
+        zs->deflater_ok = (deflateInit2(&zs->deflater,
+                                        Z_BEST_SPEED,
+                                        Z_DEFLATED,
+                                        DEFLATE_WINDOW_BITS,
+                                        DEFLATE_MEM_LEVEL,
+                                        Z_DEFAULT_STRATEGY) == Z_OK);
+        // Inflate with the largest window so any valid zlib stream is
+        // accepted, whatever settings wrote it.
+        zs->inflater_ok = (inflateInit(&zs->inflater) == Z_OK);
+        pthread_setspecific(zstreams_key, zs);
+      }
+      return zs;
+    }
+
+  } // namespace
+
+  /// Encode the bindings in the AoR, replacing the contents of out.
+  void AoRCodec::encode(AoR* aor_data, std::string& out)
+  {
+    out.assign(MAGIC, sizeof(MAGIC));
+    out.push_back((char)VERSION);
+    out.push_back((char)0);
+    encode_body(aor_data, out);
+
+    size_t body_length = out.length() - HEADER_LENGTH;
+    if (body_length > COMPRESS_THRESHOLD)
+    {
+      // Large record (typically lots of bindings with long Path sets), so
+      // see whether deflating the body is worthwhile.  Favour speed over
+      // ratio - the bulk of the saving comes from repeated Path and
+      // +sip.instance strings, which even the fastest level finds.
+      ZStreams* zs = get_zstreams();
+      if (!zs->deflater_ok)
+      {
+        // LCOV_EXCL_START - only fails if out of memory
+        return;
+        // LCOV_EXCL_STOP
+      }
+
+      z_stream* strm = &zs->deflater;
+      deflateReset(strm);
+      std::string compressed;
+      compressed.assign(MAGIC, sizeof(MAGIC));
+      compressed.push_back((char)VERSION);
+      compressed.push_back((char)FLAG_COMPRESSED);
+      Writer(compressed).put_varint(body_length);
+      size_t prefix_length = compressed.length();
+
+      // Only worth keeping if it saves something, so never let the output
+      // grow as large as the original.
+      compressed.resize(out.length());
+      strm->next_in = (Bytef*)out.data() + HEADER_LENGTH;
+      strm->avail_in = body_length;
+      strm->next_out = (Bytef*)&compressed[prefix_length];
+      strm->avail_out = compressed.length() - prefix_length;
+      if (deflate(strm, Z_FINISH) == Z_STREAM_END)
+      {
+        compressed.resize(prefix_length + strm->total_out);
+        out.swap(compressed);
+      }
+    }
+  }
+
+  /// Decode a record, adding the bindings it holds to aor_data.
+  bool AoRCodec::decode(const char* data, size_t length, AoR* aor_data)
+  {
+    if ((length < HEADER_LENGTH) ||
+        (memcmp(data, MAGIC, sizeof(MAGIC)) != 0))
+    {
+      // No header, so this is a record written before the format was
+      // versioned.
+      return decode_legacy(data, length, aor_data);
+    }
+
+    uint8_t version = (uint8_t)data[3];
+    uint8_t flags = (uint8_t)data[4];
+    if (version != VERSION)
+    {
+      LOG_ERROR("Unsupported registration record version %d", version);
+      return false;
+    }
+
+    data += HEADER_LENGTH;
+    length -= HEADER_LENGTH;
+
+    if (flags & FLAG_COMPRESSED)
+    {
+      Reader reader(data, length);
+      uint32_t body_length = reader.get_varint();
+      if ((!reader.ok()) || (body_length > MAX_BODY_LENGTH))
+      {
+        LOG_ERROR("Invalid compressed registration record");
+        return false;
+      }
+
+      ZStreams* zs = get_zstreams();
+      if (!zs->inflater_ok)
+      {
+        // LCOV_EXCL_START - only fails if out of memory
+        LOG_ERROR("Failed to initialize zlib");
+        return false;
+        // LCOV_EXCL_STOP
+      }
+
+      z_stream* strm = &zs->inflater;
+      inflateReset(strm);
+      std::string body(body_length, '\0');
+      strm->next_in = (Bytef*)reader.position();
+      strm->avail_in = reader.remaining();
+      strm->next_out = (Bytef*)&body[0];
+      strm->avail_out = body.length();
+      int rc = inflate(strm, Z_FINISH);
+      if ((rc != Z_STREAM_END) ||
+          (strm->avail_in != 0) ||
+          (strm->total_out != body.length()))
+      {
+        LOG_ERROR("Failed to inflate registration record, rc = %d", rc);
+        return false;
+      }
+      return decode_body(body.data(), body.length(), aor_data);
+    }
+
+    return decode_body(data, length, aor_data);
+  }
+
+  void AoRCodec::encode_body(AoR* aor_data, std::string& out)
+  {
+    Writer writer(out);
+
+    writer.put_varint(aor_data->bindings().size());
+    for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      AoR::Binding* b = i->second;
+      writer.put_string(i->first);
+      writer.put_string(b->_uri);
+      writer.put_string(b->_cid);
+      writer.put_varint((uint32_t)b->_cseq);
+      writer.put_varint((uint32_t)b->_expires);
+      writer.put_varint((uint32_t)b->_priority);
+
+      writer.put_varint(b->_params.size());
+      for (AoR::Binding::Params::const_iterator j = b->_params.begin();
+           j != b->_params.end();
+           ++j)
+      {
+        writer.put_string(j->first);
+        writer.put_string(j->second);
+      }
+
+      writer.put_varint(b->_path_headers.size());
+      for (AoR::Binding::PathHeaders::const_iterator j = b->_path_headers.begin();
+           j != b->_path_headers.end();
+           ++j)
+      {
+        writer.put_string(*j);
+      }
+    }
+  }
+
+  bool AoRCodec::decode_body(const char* data, size_t length, AoR* aor_data)
+  {
+    Reader reader(data, length);
+    std::string binding_id;
+
+    // Every binding takes at least nine bytes (six single-byte varints and
+    // three empty strings), every param two and every path one.
+    uint32_t num_bindings = reader.get_varint();
+    reader.check_count(num_bindings, 9);
+
+    for (uint32_t ii = 0; (reader.ok()) && (ii < num_bindings); ++ii)
+    {
+      reader.get_string(binding_id);
+      if (!reader.ok())
+      {
+        break;
+      }
+
+      AoR::Binding* b = aor_data->get_binding(binding_id);
+      reader.get_string(b->_uri);
+      reader.get_string(b->_cid);
+      b->_cseq = (int)reader.get_varint();
+      b->_expires = (int)reader.get_varint();
+      b->_priority = (int)reader.get_varint();
+
+      uint32_t num_params = reader.get_varint();
+      if (reader.check_count(num_params, 2))
+      {
+        b->_params.resize(num_params);
+        for (AoR::Binding::Params::iterator j = b->_params.begin();
+             j != b->_params.end();
+             ++j)
+        {
+          reader.get_string(j->first);
+          reader.get_string(j->second);
+        }
+      }
+
+      uint32_t num_paths = reader.get_varint();
+      if (reader.check_count(num_paths, 1))
+      {
+        b->_path_headers.resize(num_paths);
+        for (AoR::Binding::PathHeaders::iterator j = b->_path_headers.begin();
+             j != b->_path_headers.end();
+             ++j)
+        {
+          reader.get_string(*j);
+        }
+      }
+    }
+
+    if ((!reader.ok()) || (!reader.at_end()))
+    {
+      LOG_ERROR("Malformed registration record (%d bytes)", (int)length);
+      return false;
+    }
+
+    return true;
+  }
+
+  /// Decode a record in the original unversioned format.
+  bool AoRCodec::decode_legacy(const char* data, size_t length, AoR* aor_data)
+  {
+    Reader reader(data, length);
+    std::string binding_id;
+
+    // In this format a binding takes at least 23 bytes (five ints and
+    // three terminating NULs), a param two and a path one.
+    int num_bindings = reader.get_int();
+    LOG_DEBUG("Decoding legacy record with %d bindings", num_bindings);
+    if ((num_bindings < 0) || (!reader.check_count(num_bindings, 23)))
+    {
+      LOG_ERROR("Malformed legacy registration record (%d bytes)", (int)length);
+      return false;
+    }
+
+    for (int ii = 0; (reader.ok()) && (ii < num_bindings); ++ii)
+    {
+      reader.get_cstring(binding_id);
+      if (!reader.ok())
+      {
+        break;
+      }
+
+      AoR::Binding* b = aor_data->get_binding(binding_id);
+      reader.get_cstring(b->_uri);
+      reader.get_cstring(b->_cid);
+      b->_cseq = reader.get_int();
+      b->_expires = reader.get_int();
+      b->_priority = reader.get_int();
+
+      int num_params = reader.get_int();
+      if ((num_params < 0) || (!reader.check_count(num_params, 2)))
+      {
+        reader.fail();
+        break;
+      }
+      b->_params.resize(num_params);
+      for (AoR::Binding::Params::iterator j = b->_params.begin();
+           j != b->_params.end();
+           ++j)
+      {
+        reader.get_cstring(j->first);
+        reader.get_cstring(j->second);
+      }
+
+      int num_paths = reader.get_int();
+      if ((num_paths < 0) || (!reader.check_count(num_paths, 1)))
+      {
+        reader.fail();
+        break;
+      }
+      b->_path_headers.resize(num_paths);
+      for (AoR::Binding::PathHeaders::iterator j = b->_path_headers.begin();
+           j != b->_path_headers.end();
+           ++j)
+      {
+        reader.get_cstring(*j);
+      }
+    }
+
+    if (!reader.ok())
+    {
+      LOG_ERROR("Malformed legacy registration record (%d bytes)", (int)length);
+      return false;
+    }
+
+    return true;
+  }
+
+} // namespace RegData
@@ -0,0 +1,496 @@
+/**
+ * @file aorlog.cpp Memory-mapped log of registration data.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aorlog.h"
+#include "aorcodec.h"
+#include "log.h"
+
+namespace RegData {
+
+  const char AoRLog::FILE_MAGIC[8] = {'S', 'P', 'R', 'T', 'A', 'O', 'R', '1'};
+  const size_t AoRLog::INITIAL_SIZE;
+  const size_t AoRLog::COMPACT_FACTOR;
+
+
+  AoRLog::AoRLog(const std::string& path) :
+    _path(path),
+    _fd(-1),
+    _base(NULL),
+    _size(0),
+    _used(sizeof(FILE_MAGIC)),
+    _live(0),
+    _index()
+  {
+    pthread_mutex_init(&_lock, NULL);
+
+    _base = map_file(path, O_RDWR | O_CREAT, INITIAL_SIZE, &_fd, &_size);
+    if (_base == NULL)
+    {
+      LOG_ERROR("Unable to use %s for registration data, registrations will be lost on restart",
+                path.c_str());
+    }
+    else if (memcmp(_base, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+    {
+      // Either a new file, or not one of ours.  Start again from scratch.
+      LOG_STATUS("Initializing registration data file %s", path.c_str());
+      memset(_base, 0, _size);
+      memcpy(_base, FILE_MAGIC, sizeof(FILE_MAGIC));
+    }
+    else
+    {
+      scan();
+      LOG_STATUS("Found %zu registrations in %s", _index.size(), path.c_str());
+    }
+  }
+
+
+  AoRLog::~AoRLog()
+  {
+    if (_base != NULL)
+    {
+      munmap(_base, _size);
+      close(_fd);
+    }
+    pthread_mutex_destroy(&_lock);
+  }
+
+
+  void AoRLog::load(LoadCallback callback)
+  {
+    pthread_mutex_lock(&_lock);
+    for (Index::const_iterator i = _index.begin(); i != _index.end(); ++i)
+    {
+      callback(i->first, header(i->second.offset)->next_expiry);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  void AoRLog::write(const std::string& aor_id, AoR* aor_data)
+  {
+    // Encode the AoR before taking the lock.  An AoR with no bindings is
+    // written with an empty value.
+    RecordHeader hdr;
+    std::string value;
+    hdr.magic = RECORD_MAGIC;
+    hdr.key_length = aor_id.length();
+    hdr.next_expiry = 0;
+    hdr.last_expiry = 0;
+    if (!aor_data->bindings().empty())
+    {
+      AoRCodec::encode(aor_data, value);
+      hdr.next_expiry = aor_data->bindings()[0].second->_expires;
+      for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+           i != aor_data->bindings().end();
+           ++i)
+      {
+        hdr.next_expiry = std::min(hdr.next_expiry, (int32_t)i->second->_expires);
+        hdr.last_expiry = std::max(hdr.last_expiry, (int32_t)i->second->_expires);
+      }
+    }
+    hdr.value_length = value.length();
+    hdr.value_checksum = checksum(0, value.data(), value.length());
+    hdr.header_checksum = header_checksum(&hdr, aor_id.data());
+    size_t length = record_length(aor_id.length(), value.length());
+
+    pthread_mutex_lock(&_lock);
+    Index::iterator i = _index.find(aor_id);
+    if ((_base == NULL) ||
+        ((value.empty()) && (i == _index.end())))
+    {
+      // Either there's no log, or the AoR has no bindings and isn't in the
+      // log anyway.
+      pthread_mutex_unlock(&_lock);
+      return;
+    }
+
+    if (!reserve(length))
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Unable to grow %s, registration for %s will be lost on restart",
+                _path.c_str(), aor_id.c_str());
+      pthread_mutex_unlock(&_lock);
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    // Write the body before the header, so a partly written record is never
+    // mistaken for a whole one.
+    char* record = _base + _used;
+    memcpy(record + sizeof(RecordHeader), aor_id.data(), aor_id.length());
+    memcpy(record + sizeof(RecordHeader) + aor_id.length(), value.data(), value.length());
+    memcpy(record, &hdr, sizeof(RecordHeader));
+
+    if (i != _index.end())
+    {
+      _live -= i->second.length;
+      _index.erase(i);
+    }
+    if (!value.empty())
+    {
+      Location& loc = _index[aor_id];
+      loc.offset = _used;
+      loc.length = length;
+      _live += length;
+    }
+    _used += length;
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  bool AoRLog::read(const std::string& aor_id, AoR* aor_data)
+  {
+    bool rc = false;
+
+    pthread_mutex_lock(&_lock);
+    Index::const_iterator i = _index.find(aor_id);
+    if (i != _index.end())
+    {
+      const RecordHeader* hdr = header(i->second.offset);
+      const char* value = (const char*)hdr + sizeof(RecordHeader) + hdr->key_length;
+      if (checksum(0, value, hdr->value_length) != hdr->value_checksum)
+      {
+        LOG_ERROR("Corrupt registration data for %s in %s",
+                  aor_id.c_str(), _path.c_str());
+      }
+      else
+      {
+        rc = AoRCodec::decode(value, hdr->value_length, aor_data);
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return rc;
+  }
+
+
+  void AoRLog::maybe_compact(int now)
+  {
+    pthread_mutex_lock(&_lock);
+    if ((_base == NULL) ||
+        (_used <= INITIAL_SIZE) ||
+        (_used <= COMPACT_FACTOR * _live))
+    {
+      pthread_mutex_unlock(&_lock);
+      return;
+    }
+
+    // Copy the live records to a new file, leaving room for the log to grow
+    // again before it next needs compacting.
+    std::string tmp_path = _path + ".tmp";
+    int fd;
+    size_t size;
+    char* base = map_file(tmp_path,
+                          O_RDWR | O_CREAT | O_TRUNC,
+                          std::max(INITIAL_SIZE, COMPACT_FACTOR * _live),
+                          &fd,
+                          &size);
+    if (base == NULL)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Unable to compact %s", _path.c_str());
+      pthread_mutex_unlock(&_lock);
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    Index index;
+    size_t used = sizeof(FILE_MAGIC);
+    size_t live = 0;
+    memcpy(base, FILE_MAGIC, sizeof(FILE_MAGIC));
+    for (Index::const_iterator i = _index.begin(); i != _index.end(); ++i)
+    {
+      // Records that have expired are normally superseded by the time the
+      // log is compacted, but make sure they go.
+      if (header(i->second.offset)->last_expiry > now)
+      {
+        memcpy(base + used, _base + i->second.offset, i->second.length);
+        Location& loc = index[i->first];
+        loc.offset = used;
+        loc.length = i->second.length;
+        used += loc.length;
+        live += loc.length;
+      }
+    }
+
+    // Make sure the new file is on disk before it replaces the old one.
+    if ((msync(base, used, MS_SYNC) != 0) ||
+        (rename(tmp_path.c_str(), _path.c_str()) != 0))
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Unable to replace %s with compacted log: %s",
+                _path.c_str(), strerror(errno));
+      munmap(base, size);
+      close(fd);
+      unlink(tmp_path.c_str());
+      pthread_mutex_unlock(&_lock);
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    LOG_INFO("Compacted %s from %zu to %zu bytes", _path.c_str(), _used, used);
+    munmap(_base, _size);
+    close(_fd);
+    _fd = fd;
+    _base = base;
+    _size = size;
+    _used = used;
+    _live = live;
+    _index.swap(index);
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  void AoRLog::clear()
+  {
+    pthread_mutex_lock(&_lock);
+    if (_base != NULL)
+    {
+      memset(_base + sizeof(FILE_MAGIC), 0, _used - sizeof(FILE_MAGIC));
+      _used = sizeof(FILE_MAGIC);
+      _live = 0;
+      _index.clear();
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  /// Open a file, making sure it's at least the given size, and map all of
+  /// it.  Returns NULL on failure.
+  char* AoRLog::map_file(const std::string& path,
+                         int flags,
+                         size_t min_size,
+                         int* fd,
+                         size_t* size)
+  {
+    *fd = open(path.c_str(), flags, 0600);
+    if (*fd < 0)
+    {
+      LOG_ERROR("Failed to open %s: %s", path.c_str(), strerror(errno));
+      return NULL;
+    }
+
+    struct stat st;
+    if (fstat(*fd, &st) != 0)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to stat %s: %s", path.c_str(), strerror(errno));
+      close(*fd);
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    *size = st.st_size;
+    if (*size < min_size)
+    {
+      *size = min_size;
+      if (ftruncate(*fd, *size) != 0)
+      {
+        // LCOV_EXCL_START
+        LOG_ERROR("Failed to size %s: %s", path.c_str(), strerror(errno));
+        close(*fd);
+        return NULL;
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    void* base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (base == MAP_FAILED)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to map %s: %s", path.c_str(), strerror(errno));
+      close(*fd);
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    return (char*)base;
+  }
+
+
+  /// Build the index from the record headers, stopping at the first record
+  /// that isn't whole.
+  void AoRLog::scan()
+  {
+    size_t offset = sizeof(FILE_MAGIC);
+    size_t length;
+    while (check_header(offset, &length))
+    {
+      const RecordHeader* hdr = header(offset);
+      std::string aor_id((const char*)hdr + sizeof(RecordHeader), hdr->key_length);
+      Index::iterator i = _index.find(aor_id);
+      if (i != _index.end())
+      {
+        _live -= i->second.length;
+        _index.erase(i);
+      }
+      if (hdr->value_length > 0)
+      {
+        Location& loc = _index[aor_id];
+        loc.offset = offset;
+        loc.length = length;
+        _live += length;
+      }
+      offset += length;
+    }
+    _used = offset;
+
+    // Anything after the last whole record is left over from a write that
+    // didn't complete.  Clear it so it can't be mistaken for a record once
+    // it's partly overwritten.
+    size_t tail = std::min(sizeof(RecordHeader), _size - offset);
+    if ((tail > 0) &&
+        (memcmp(_base + offset, std::string(tail, '\0').data(), tail) != 0))
+    {
+      LOG_WARNING("Discarding incomplete record at offset %zu in %s",
+                  offset, _path.c_str());
+      memset(_base + offset, 0, _size - offset);
+    }
+  }
+
+
+  /// Check whether there is a whole record at the given offset, returning
+  /// its length if so.
+  bool AoRLog::check_header(size_t offset, size_t* length)
+  {
+    if (offset + sizeof(RecordHeader) > _size)
+    {
+      // The file is full.
+      return false; // LCOV_EXCL_LINE
+    }
+
+    const RecordHeader* hdr = header(offset);
+    if ((hdr->magic != RECORD_MAGIC) ||
+        (hdr->key_length > _size) ||
+        (hdr->value_length > _size))
+    {
+      return false;
+    }
+
+    *length = record_length(hdr->key_length, hdr->value_length);
+    return ((offset + *length <= _size) &&
+            (header_checksum(hdr, (const char*)hdr + sizeof(RecordHeader)) ==
+             hdr->header_checksum));
+  }
+
+
+  const AoRLog::RecordHeader* AoRLog::header(size_t offset)
+  {
+    return (const RecordHeader*)(_base + offset);
+  }
+
+
+  /// Make room for a record of the given length, growing the file if
+  /// necessary.  Must be called with the lock held.
+  bool AoRLog::reserve(size_t length)
+  {
+    if (_used + length <= _size)
+    {
+      return true;
+    }
+
+    size_t size = _size;
+    while (size < _used + length)
+    {
+      size *= 2;
+    }
+
+    if (ftruncate(_fd, size) != 0)
+    {
+      // LCOV_EXCL_START
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    void* base = mremap(_base, _size, size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED)
+    {
+      // LCOV_EXCL_START
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    _base = (char*)base;
+    _size = size;
+    return true;
+  }
+
+
+  /// Records are padded so headers stay aligned.
+  size_t AoRLog::record_length(size_t key_length, size_t value_length)
+  {
+    return (sizeof(RecordHeader) + key_length + value_length + 7) & ~(size_t)7;
+  }
+
+
+  uint32_t AoRLog::header_checksum(const RecordHeader* hdr, const char* key)
+  {
+    uint32_t hash = checksum(0, hdr, offsetof(RecordHeader, header_checksum));
+    return checksum(hash, key, hdr->key_length);
+  }
+
+
+  /// FNV-1a, continuing from the given hash (or starting afresh if it is
+  /// zero).
+  uint32_t AoRLog::checksum(uint32_t hash, const void* data, size_t length)
+  {
+    if (hash == 0)
+    {
+      hash = 2166136261u;
+    }
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t ii = 0; ii < length; ++ii)
+    {
+      hash = (hash ^ p[ii]) * 16777619u;
+    }
+    return hash;
+  }
+
+} // namespace RegData
@@ -0,0 +1,238 @@
+/**
+ * @file aorwriter.cpp Combines concurrent updates to the same AoR.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "aorwriter.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "statistic.h"
+#include "log.h"
+
+namespace RegData {
+
+  const int AoRWriter::DEFAULT_MAX_ATTEMPTS;
+  const int AoRWriter::BASE_BACKOFF_US;
+  const int AoRWriter::MAX_BACKOFF_US;
+  const int AoRWriter::REPORT_INTERVAL_MS;
+
+  AoRWriter::AoRWriter(Store* store,
+                       Statistic* statistic,
+                       int max_attempts) :
+    _store(store),
+    _statistic(statistic),
+    _max_attempts(max_attempts),
+    _queues(),
+    _next_report_ms(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    _stats.writes = 0;
+    _stats.coalesced = 0;
+    _stats.conflicts = 0;
+    _stats.retries = 0;
+    _stats.failures = 0;
+  }
+
+
+  AoRWriter::~AoRWriter()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+
+  AoR* AoRWriter::update(const std::string& aor_id, Update update)
+  {
+    Pending me;
+    me.update = update;
+    pthread_cond_init(&me.cond, NULL);
+    me.lead = false;
+    me.done = false;
+    me.aor_data = NULL;
+
+    pthread_mutex_lock(&_lock);
+    Queue& queue = _queues[aor_id];
+    queue.pending.push_back(&me);
+    if (queue.busy)
+    {
+      // Another thread is writing this AoR.  Wait for it to apply this
+      // update, or to hand over to this thread.
+      while ((!me.done) && (!me.lead))
+      {
+        pthread_cond_wait(&me.cond, &_lock);
+      }
+    }
+
+    if (!me.done)
+    {
+      // Write all the updates queued so far.  The queue can't be removed
+      // while this thread is on it, and stays busy until the last writer
+      // finishes.
+      std::vector<Pending*> batch;
+      batch.swap(queue.pending);
+      queue.busy = true;
+      pthread_mutex_unlock(&_lock);
+
+      Stats stats = {0, 0, 0, 0, 0};
+      AoR* aor_data = write(aor_id, batch, stats);
+      std::vector<AoR*> results(batch.size(), NULL);
+      for (size_t ii = 0; ii < batch.size(); ++ii)
+      {
+        if ((batch[ii] != &me) && (aor_data != NULL))
+        {
+          results[ii] = new AoR(*aor_data);
+        }
+      }
+      me.aor_data = aor_data;
+
+      pthread_mutex_lock(&_lock);
+      for (size_t ii = 0; ii < batch.size(); ++ii)
+      {
+        if (batch[ii] != &me)
+        {
+          batch[ii]->aor_data = results[ii];
+          batch[ii]->done = true;
+          pthread_cond_signal(&batch[ii]->cond);
+        }
+      }
+
+      if (queue.pending.empty())
+      {
+        _queues.erase(aor_id);
+      }
+      else
+      {
+        // More updates arrived during the write, so hand over to the first
+        // of their threads.
+        queue.pending.front()->lead = true;
+        pthread_cond_signal(&queue.pending.front()->cond);
+      }
+
+      _stats.writes += stats.writes;
+      _stats.coalesced += batch.size() - 1;
+      _stats.conflicts += stats.conflicts;
+      _stats.retries += stats.retries;
+      _stats.failures += (aor_data == NULL) ? batch.size() : 0;
+      maybe_report();
+    }
+    pthread_mutex_unlock(&_lock);
+
+    pthread_cond_destroy(&me.cond);
+    return me.aor_data;
+  }
+
+
+  AoRWriter::Stats AoRWriter::stats()
+  {
+    pthread_mutex_lock(&_lock);
+    Stats stats = _stats;
+    pthread_mutex_unlock(&_lock);
+    return stats;
+  }
+
+
+  /// Read the AoR, apply the updates and write it back, retrying if it
+  /// changes in the meantime.
+  AoR* AoRWriter::write(const std::string& aor_id,
+                        const std::vector<Pending*>& batch,
+                        Stats& stats)
+  {
+    unsigned int seed = time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+    for (int attempt = 1; ; ++attempt)
+    {
+      AoR* aor_data = _store->get_aor_data(aor_id);
+      if (aor_data == NULL)
+      {
+        // Failed to get data for the AoR because there is no connection to
+        // the store.
+        LOG_ERROR("Failed to get AoR binding for %s from store", aor_id.c_str());
+        return NULL;
+      }
+
+      for (size_t ii = 0; ii < batch.size(); ++ii)
+      {
+        batch[ii]->update(aor_data);
+      }
+
+      if (_store->set_aor_data(aor_id, aor_data))
+      {
+        ++stats.writes;
+        return aor_data;
+      }
+
+      delete aor_data;
+      ++stats.conflicts;
+      if (attempt >= _max_attempts)
+      {
+        LOG_ERROR("Failed to write AoR %s after %d attempts", aor_id.c_str(), attempt);
+        return NULL;
+      }
+
+      // Back off for a random time, so nodes writing the same AoR don't
+      // keep colliding.
+      ++stats.retries;
+      int backoff = std::min(BASE_BACKOFF_US << std::min(attempt - 1, 16), MAX_BACKOFF_US);
+      usleep(rand_r(&seed) % (backoff + 1));
+    }
+  }
+
+
+  /// Report the counters if the reporting interval has passed.  Must be
+  /// called with the lock held.
+  void AoRWriter::maybe_report()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if ((_statistic != NULL) && (now >= _next_report_ms))
+    {
+      _next_report_ms = now + REPORT_INTERVAL_MS;
+      std::vector<std::string> values;
+      values.push_back(std::to_string((unsigned long long)_stats.writes));
+      values.push_back(std::to_string((unsigned long long)_stats.coalesced));
+      values.push_back(std::to_string((unsigned long long)_stats.conflicts));
+      values.push_back(std::to_string((unsigned long long)_stats.retries));
+      values.push_back(std::to_string((unsigned long long)_stats.failures));
+      _statistic->report_change(values);
+    }
+  }
+
+} // namespace RegData
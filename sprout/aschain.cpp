@@ -35,6 +35,9 @@
  */
 
 
+#include <string.h>
+#include <time.h>
+
 #include "log.h"
 #include "pjutils.h"
 
@@ -42,13 +45,17 @@
 #include "stateful_proxy.h"
 #include "aschain.h"
 
-AsChain::AsChain(const SessionCase& session_case,
-                 std::string served_user,
-                 std::vector<std::string> application_servers) :
+AsChain::AsChain(AsChainTable* as_chain_table,
+                 const SessionCase& session_case,
+                 const std::string& served_user,
+                 const std::vector<std::string>& application_servers) :
+  _as_chain_table(as_chain_table),
+  _refs(1),
   _session_case(session_case),
   _served_user(served_user),
   _application_servers(application_servers)
 {
+  _as_chain_table->register_chain(this);
 }
 
 AsChain::~AsChain()
@@ -66,46 +73,120 @@ const SessionCase& AsChain::session_case() const
   return _session_case;
 }
 
-/// Apply first AS (if any) to initial request.
+/// @returns the served user. Only valid after lookup_ifcs called.
+std::string AsChain::served_user() const
+{
+  return _served_user;
+}
+
+void AsChain::inc_ref()
+{
+  // The count is only changed under the table lock, so that the chain
+  // can't be looked up while it is being deleted.
+  pthread_mutex_lock(&_as_chain_table->_lock);
+  ++_refs;
+  pthread_mutex_unlock(&_as_chain_table->_lock);
+}
+
+void AsChain::dec_ref()
+{
+  // Unregister the chain under the same lock, so it can't be looked up
+  // once the count has reached zero.
+  AsChainTable* as_chain_table = _as_chain_table;
+  pthread_mutex_lock(&as_chain_table->_lock);
+  bool last = ((--_refs) == 0);
+  if (last)
+  {
+    as_chain_table->unregister_chain(this);
+  }
+  pthread_mutex_unlock(&as_chain_table->_lock);
+
+  if (last)
+  {
+    delete this;
+    as_chain_table->maybe_report();
+  }
+}
+
+
+/// Create an AS chain and return a link to its first application server.
+AsChainLink AsChainLink::create_as_chain(AsChainTable* as_chain_table,
+                                         const SessionCase& session_case,
+                                         const std::string& served_user,
+                                         const std::vector<std::string>& application_servers)
+{
+  AsChain* as_chain = new AsChain(as_chain_table,
+                                  session_case,
+                                  served_user,
+                                  application_servers);
+  return AsChainLink(as_chain, 0);
+}
+
+void AsChainLink::release()
+{
+  if (_as_chain != NULL)
+  {
+    _as_chain->dec_ref();
+    _as_chain = NULL;
+    _index = 0;
+  }
+}
+
+std::string AsChainLink::to_string() const
+{
+  return (_as_chain != NULL) ?
+    _as_chain->to_string() + " AS " + std::to_string((unsigned long long)_index) :
+    "None";
+}
+
+/// Apply the remaining ASs (if any) to initial request, up to and
+/// including the first external one.
 //
 // @Returns whether processing should stop, continue, or skip to the end.
-AsChain::Disposition AsChain::on_initial_request(CallServices* call_services,
-                                                 UASTransaction* uas_data,
-                                                 pjsip_msg* msg,
-                                                 pjsip_tx_data* tdata,
-                                                 // OUT: target to
-                                                 // use, if
-                                                 // disposition is
-                                                 // Skip. Dynamically
-                                                 // allocated, to be
-                                                 // freed by caller.
-                                                 target** pre_target)
-{
-  if (call_services && is_mmtel(call_services))
+AsChain::Disposition AsChainLink::on_initial_request(CallServices* call_services,
+                                                     UASTransaction* uas_data,
+                                                     pjsip_msg* msg,
+                                                     pjsip_tx_data* tdata,
+                                                     // OUT: target to
+                                                     // use, if
+                                                     // disposition is
+                                                     // Skip. Dynamically
+                                                     // allocated, to be
+                                                     // freed by caller.
+                                                     target** pre_target)
+{
+  while (!complete())
   {
-    if (_session_case.is_originating())
-    {
-      LOG_DEBUG("Invoke originating MMTEL services");
-      CallServices::Originating originating(call_services, uas_data, msg, served_user());
-      bool proceed = originating.on_initial_invite(tdata);
-      return proceed ? AsChain::Disposition::Next : AsChain::Disposition::Stop;
-    }
-    else
+    const std::string& as_uri_str = _as_chain->_application_servers[_index];
+
+    if (call_services && call_services->is_mmtel(as_uri_str))
     {
-      // MMTEL terminating call services need to insert themselves into
-      // the signalling path.
-      LOG_DEBUG("Invoke terminating MMTEL services");
-      CallServices::Terminating* terminating =
-        new CallServices::Terminating(call_services, uas_data, msg, served_user());
-      uas_data->register_proxy(terminating);
-      bool proceed = terminating->on_initial_invite(tdata);
-      return proceed ? AsChain::Disposition::Next : AsChain::Disposition::Stop;
+      ++_index;
+      bool proceed;
+
+      if (_as_chain->_session_case.is_originating())
+      {
+        LOG_DEBUG("Invoke originating MMTEL services");
+        CallServices::Originating originating(call_services, uas_data, msg, served_user());
+        proceed = originating.on_initial_invite(tdata);
+      }
+      else
+      {
+        // MMTEL terminating call services need to insert themselves into
+        // the signalling path.
+        LOG_DEBUG("Invoke terminating MMTEL services");
+        CallServices::Terminating* terminating =
+          new CallServices::Terminating(call_services, uas_data, msg, served_user());
+        uas_data->register_proxy(terminating);
+        proceed = terminating->on_initial_invite(tdata);
+      }
+
+      if (!proceed)
+      {
+        return AsChain::Disposition::Stop;
+      }
+      continue;
     }
-  }
-  else if (!_application_servers.empty())
-  {
-    // Temporary code, supporting only one application server.
-    std::string as_uri_str = _application_servers[0];
 
     pjsip_uri* as_uri = PJUtils::uri_from_string(as_uri_str, tdata->pool);
 
@@ -114,98 +195,217 @@ AsChain::Disposition AsChain::on_initial_request(CallServices* call_services,
       // @@@ would be good to check earlier, e.g., when parsing the iFCs.
       LOG_WARNING("Badly formed URI %s in iFC", as_uri_str.c_str());
       // @@@ hmm, should really simulate a 408 here.
-      return AsChain::Disposition::Next;
+      ++_index;
+      continue;
     }
 
-    LOG_DEBUG("Invoking external AS %s", PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, as_uri).c_str());
+    // Stop processing the chain and send the request out to the AS.  It
+    // comes back to us with the AS's ODI token, and carries on from the
+    // AS after it.
+    *pre_target = as_target(as_uri, tdata);
+    ++_index;
+    return AsChain::Disposition::Skip;
+  }
 
-    // @@@ P-A-I basic support
+  LOG_DEBUG("No application servers left to invoke");
+  return AsChain::Disposition::Next;
+}
 
-    // @@@ P-Served-User support, including session case and registration state
+/// Build the target for sending the request to the current AS.
+target* AsChainLink::as_target(pjsip_uri* as_uri, pjsip_tx_data* tdata)
+{
+  LOG_DEBUG("Invoking external AS %s", PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, as_uri).c_str());
 
-    // Start defining the new target.
-    target* as_target = new target;
-    as_target->from_store = false;
-    as_target->transport = NULL;
+  // @@@ P-A-I basic support
 
-    // Request-URI should remain unchanged
-    as_target->uri = tdata->msg->line.req.uri;
+  // @@@ P-Served-User support, including session case and registration state
 
-    // Set the AS URI as the topmost route header.  Set loose-route,
-    // otherwise the headers get mucked up.
-    ((pjsip_sip_uri*)as_uri)->lr_param = 1;  // @@@ fixme cast
-    as_target->paths.push_back(as_uri);
+  // Start defining the new target.
+  target* as_target = new target;
+  as_target->from_store = false;
+  as_target->transport = NULL;
 
-    // Insert route header below it with an ODI in it.
-    pjsip_sip_uri* self_uri = pjsip_sip_uri_create(tdata->pool, false);  // sip: not sips:
-    std::string odi_token = PJUtils::pj_str_to_string(&STR_ODI_PREFIX) + "unity";
-    pj_strdup2(tdata->pool, &self_uri->user, odi_token.c_str());
-    self_uri->host = stack_data.local_host;
-    self_uri->port = stack_data.trusted_port;
-    self_uri->transport_param = ((pjsip_sip_uri*)as_uri)->transport_param;  // Use same transport as AS, in case it can only cope with one. @@@ not sure if that's a good idea @@@ hack re cast - not good
-    self_uri->lr_param = 1;
+  // Request-URI should remain unchanged
+  as_target->uri = tdata->msg->line.req.uri;
 
-    if (_session_case.is_originating())
-    {
-      // @@@ Until we have proper AS chain processing, we need to put
-      // the session case into the ODI URI.
-      pjsip_param *orig_param = PJ_POOL_ALLOC_T(tdata->pool, pjsip_param);
-      pj_strdup(tdata->pool, &orig_param->name, &STR_ORIG);
-      pj_strdup2(tdata->pool, &orig_param->value, "");
-      pj_list_insert_after(&self_uri->other_param, orig_param);
-    }
+  // Set the AS URI as the topmost route header.  Set loose-route,
+  // otherwise the headers get mucked up.
+  ((pjsip_sip_uri*)as_uri)->lr_param = 1;  // @@@ fixme cast
+  as_target->paths.push_back(as_uri);
 
-    as_target->paths.push_back((pjsip_uri*)self_uri);
+  // Insert route header below it with an ODI in it.
+  pjsip_sip_uri* self_uri = pjsip_sip_uri_create(tdata->pool, false);  // sip: not sips:
+  pj_strdup2(tdata->pool, &self_uri->user, _as_chain->_odi_tokens[_index].c_str());
+  self_uri->host = stack_data.local_host;
+  self_uri->port = stack_data.trusted_port;
+  self_uri->transport_param = ((pjsip_sip_uri*)as_uri)->transport_param;  // Use same transport as AS, in case it can only cope with one. @@@ not sure if that's a good idea @@@ hack re cast - not good
+  self_uri->lr_param = 1;
 
-    // @@@ to support demo AS's limitations (TCP not supported),
-    // record-route ourselves via UDP, before the AS.  This means that
-    // the AS only has to route to us (via the transport we specify),
-    // rather than to an arbitrary previous hop (e.g., bono over TCP
-    // for a simple 1-AS call).
-    PJUtils::add_record_route(tdata, "udp", stack_data.trusted_port, NULL);
+  if (_as_chain->_session_case.is_originating())
+  {
+    // The chain knows its session case, but keep it in the ODI URI too
+    // for a request that comes back after the chain has gone.
+    pjsip_param *orig_param = PJ_POOL_ALLOC_T(tdata->pool, pjsip_param);
+    pj_strdup(tdata->pool, &orig_param->name, &STR_ORIG);
+    pj_strdup2(tdata->pool, &orig_param->value, "");
+    pj_list_insert_after(&self_uri->other_param, orig_param);
+  }
 
-    // Stop processing the chain and send the request out to the AS.
-    *pre_target = as_target;
-    return AsChain::Disposition::Skip;
+  as_target->paths.push_back((pjsip_uri*)self_uri);
+
+  // @@@ to support demo AS's limitations (TCP not supported),
+  // record-route ourselves via UDP, before the AS.  This means that
+  // the AS only has to route to us (via the transport we specify),
+  // rather than to an arbitrary previous hop (e.g., bono over TCP
+  // for a simple 1-AS call).
+  PJUtils::add_record_route(tdata, "udp", stack_data.trusted_port, NULL);
+
+  return as_target;
+}
+
+
+const char AsChainTable::_b64[64] =
+{
+  'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+  'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+  'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+  'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+  'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+  'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+  'w', 'x', 'y', 'z', '0', '1', '2', '3',
+  '4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+AsChainTable::AsChainTable() :
+  _odi_map(),
+  _statistic("as_chains"),
+  _next_report_ms(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+AsChainTable::~AsChainTable()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+/// Give each of the chain's application servers an ODI token, and
+/// register the chain under them.
+void AsChainTable::register_chain(AsChain* as_chain)
+{
+  pthread_mutex_lock(&_lock);
+
+  for (size_t ii = 0; ii < as_chain->size(); ++ii)
+  {
+    std::string token = new_token();
+    as_chain->_odi_tokens.push_back(token);
+    _odi_map[token] = std::make_pair(as_chain, ii);
   }
-  else
+
+  ++_stats.chains;
+  ++_stats.created;
+  _stats.application_servers += as_chain->size();
+  if (as_chain->size() > _stats.longest)
   {
-    LOG_DEBUG("No application servers configured");
-    return AsChain::Disposition::Next;
+    _stats.longest = as_chain->size();
   }
+
+  pthread_mutex_unlock(&_lock);
+
+  maybe_report();
 }
 
+/// Remove the chain's ODI tokens.  Called with the lock held.
+void AsChainTable::unregister_chain(AsChain* as_chain)
+{
+  for (std::vector<std::string>::const_iterator ii = as_chain->_odi_tokens.begin();
+       ii != as_chain->_odi_tokens.end();
+       ++ii)
+  {
+    _odi_map.erase(*ii);
+  }
+  --_stats.chains;
+}
 
-/// See if we should be invoking our MMTEL AS.  Only valid after lookup_ifcs called.
-// @returns true if we should invoke MMTEL, false if not.
-bool AsChain::is_mmtel(CallServices* call_services)
+/// Create a random ODI token that isn't in use.  Called with the lock held.
+std::string AsChainTable::new_token()
 {
-  // Check if we're supposed to be supplying local MMTel services
-  bool local_mmtel = false;
-  for (std::vector<std::string>::const_iterator ii = _application_servers.begin();
-       ii < _application_servers.end();
-       ii++)
+  std::string token;
+  do
   {
-    if (call_services->is_mmtel(*ii))
+    token = PJUtils::pj_str_to_string(&STR_ODI_PREFIX);
+    for (int ii = 0; ii < TOKEN_LENGTH; ++ii)
     {
-      LOG_DEBUG("Got local MMTel services");
-      local_mmtel = true;
-      break;
+      token += _b64[rand() % 64];
     }
   }
+  while (_odi_map.find(token) != _odi_map.end());
 
-  return local_mmtel;
+  return token;
 }
 
-/// @returns the served user. Only valid after lookup_ifcs called.
-std::string AsChain::served_user() const
+AsChainLink AsChainTable::lookup(const std::string& token)
 {
-  return _served_user;
+  AsChain* as_chain = NULL;
+  size_t index = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, std::pair<AsChain*, size_t> >::const_iterator i = _odi_map.find(token);
+  if (i != _odi_map.end())
+  {
+    // The request resumes the chain after the AS the token was given to.
+    // We already hold the lock, so take the link's reference directly.
+    as_chain = i->second.first;
+    index = i->second.second + 1;
+    ++as_chain->_refs;
+    ++_stats.resumed;
+  }
+  else
+  {
+    ++_stats.unknown;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  maybe_report();
+  return (as_chain != NULL) ? AsChainLink(as_chain, index) : AsChainLink();
 }
 
+AsChainTable::Stats AsChainTable::stats()
+{
+  pthread_mutex_lock(&_lock);
+  Stats stats = _stats;
+  pthread_mutex_unlock(&_lock);
+  return stats;
+}
 
-/// @returns true if this AS chain has been completed (no ASs left), false otherwise.
-bool AsChain::complete() const
+/// Report the counters, if it's time to.
+void AsChainTable::maybe_report()
 {
-  return _application_servers.empty();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  pthread_mutex_lock(&_lock);
+  bool report = (now >= _next_report_ms);
+  Stats s = _stats;
+  if (report)
+  {
+    _next_report_ms = now + REPORT_INTERVAL_MS;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (report)
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string((unsigned long long)s.chains));
+    values.push_back(std::to_string((unsigned long long)s.created));
+    values.push_back(std::to_string((unsigned long long)s.application_servers));
+    values.push_back(std::to_string((unsigned long long)s.longest));
+    values.push_back(std::to_string((unsigned long long)s.resumed));
+    values.push_back(std::to_string((unsigned long long)s.unknown));
+    _statistic.report_change(values);
+  }
 }
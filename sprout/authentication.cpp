@@ -57,6 +57,7 @@ extern "C" {
 #include "constants.h"
 #include "analyticslogger.h"
 #include "hssconnection.h"
+#include "digestcache.h"
 #include "authentication.h"
 
 
@@ -88,6 +89,10 @@ pjsip_module mod_auth =
 static HSSConnection* hss;
 
 
+// Cache of subscriber credentials, or NULL if they aren't cached.
+static DigestCache* digests;
+
+
 // Analytics logger.
 static AnalyticsLogger* analytics;
 
@@ -115,6 +120,28 @@ pjsip_auth_srv auth_srv;
 bool ims_auth;
 
 
+/// Fetches a user's digest from the HSS.
+//
+// @returns NOT_FOUND if the HSS doesn't know the user, or FAILED for any
+// other error, so the cache can use any expired digest instead.
+static DigestCache::LoadResult load_digest(const std::string& private_id,
+                                           const std::string& public_id,
+                                           SAS::TrailId trail,
+                                           std::string& digest)
+{
+  Json::Value* data;
+  HTTPCode http_rc = hss->get_digest_data(private_id, public_id, data, trail);
+  if (http_rc != HTTP_OK)
+  {
+    return (http_rc == HTTP_NOT_FOUND) ? DigestCache::NOT_FOUND : DigestCache::FAILED;
+  }
+
+  digest = data->get("digest", "" ).asString();
+  delete data;
+  return (digest != "") ? DigestCache::LOADED : DigestCache::NOT_FOUND;
+}
+
+
 pj_status_t user_lookup(pj_pool_t *pool,
                         const pjsip_auth_lookup_cred_param *param,
                         pjsip_cred_info *cred_info)
@@ -126,7 +153,7 @@ pj_status_t user_lookup(pj_pool_t *pool,
   SAS::TrailId trail = get_trail(rdata);
 
   pj_status_t status = PJSIP_EAUTHACCNOTFOUND;
-  Json::Value* data;
+  std::string digest;
 
   std::string private_id;
   std::string public_id;
@@ -159,25 +186,33 @@ pj_status_t user_lookup(pj_pool_t *pool,
               realm->slen, realm->ptr);
   }
 
-  data = hss->get_digest_data(private_id, public_id, trail);
-
-  if (data != NULL)
+  if (digests != NULL)
   {
-    std::string digest = data->get("digest", "" ).asString();
-    if (digest != "")
+    digest = digests->get(private_id,
+                          public_id,
+                          PJUtils::pj_str_to_string(realm),
+                          [&](std::string& loaded) -> DigestCache::LoadResult
     {
-      LOG_DEBUG("Digest for user %.*s in realm %.*s = %s",
-                acc_name->slen, acc_name->ptr,
-                realm->slen, realm->ptr,
-                digest.c_str());
-      pj_strdup(pool, &cred_info->realm, realm);
-      pj_cstr(&cred_info->scheme, "digest");
-      pj_strdup(pool, &cred_info->username, acc_name);
-      cred_info->data_type = PJSIP_CRED_DATA_DIGEST;
-      pj_strdup2(pool, &cred_info->data, digest.c_str());
-      status = PJ_SUCCESS;
-    }
-    delete data;
+      return load_digest(private_id, public_id, trail, loaded);
+    });
+  }
+  else
+  {
+    load_digest(private_id, public_id, trail, digest);
+  }
+
+  if (digest != "")
+  {
+    LOG_DEBUG("Digest for user %.*s in realm %.*s = %s",
+              acc_name->slen, acc_name->ptr,
+              realm->slen, realm->ptr,
+              digest.c_str());
+    pj_strdup(pool, &cred_info->realm, realm);
+    pj_cstr(&cred_info->scheme, "digest");
+    pj_strdup(pool, &cred_info->username, acc_name);
+    cred_info->data_type = PJSIP_CRED_DATA_DIGEST;
+    pj_strdup2(pool, &cred_info->data, digest.c_str());
+    status = PJ_SUCCESS;
   }
 
   return status;
@@ -355,6 +390,13 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
         analytics->auth_failure(PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, rdata->msg_info.msg->line.req.uri));
       }
 
+      if ((status == PJSIP_EAUTHINVALIDDIGEST) && (digests != NULL))
+      {
+        // The password may have changed since the digest was cached, so
+        // get it afresh next time.
+        digests->invalidate(PJUtils::pj_str_to_string(&auth_hdr->credential.digest.username));
+      }
+
       // @TODO - need more diagnostics here so we can identify and flag
       // attacks.
 
@@ -380,12 +422,14 @@ pj_status_t init_authentication(const std::string& realm_name,
                                 bool tp_auth,
                                 const std::string& auth_config,
                                 HSSConnection* hss_connection,
+                                DigestCache* digest_cache,
                                 AnalyticsLogger* analytics_logger)
 {
   pj_status_t status;
 
   tp_auth_supported = tp_auth;
   hss = hss_connection;
+  digests = digest_cache;
   analytics = analytics_logger;
 
   if (auth_config == "sip-digest")
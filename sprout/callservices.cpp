@@ -81,20 +81,21 @@ bool CallServices::is_mmtel(std::string uri)
 
 
 // Get the user services (simservs) configuration if relevant and present.
+// If it has already been prefetched, that is used if it is for the right
+// user.
 //
 // @returns The simservs object if it is relevant and present.  If there is
 // no simservs configuration for the user, returns a default simservs object
 // with all services disabled.
-simservs *CallServices::get_user_services(pjsip_msg *msg, std::string public_id, SAS::TrailId trail)
+simservs *CallServices::get_user_services(pjsip_msg *msg,
+                                          std::string public_id,
+                                          Lookup<std::string>& prefetched,
+                                          SAS::TrailId trail)
 {
-  // Fetch the user's simservs configuration from the XDMS
-  LOG_DEBUG("Fetching simservs configuration for %s", public_id.c_str());
-  std::string simservs_xml;
-  if (!_xdmc->get_simservs(public_id, simservs_xml, "", trail))
+  std::string simservs_xml = prefetched.get(public_id, [&]()
   {
-    LOG_DEBUG("Failed to fetch simservs configuration for %s, no MMTel services enabled", public_id.c_str());
-    return new simservs("");
-  }
+    return get_simservs_xml(public_id, trail);
+  });
 
   // Parse the retrieved XDMS information
   simservs *user_services = new simservs(simservs_xml);
@@ -102,6 +103,22 @@ simservs *CallServices::get_user_services(pjsip_msg *msg, std::string public_id,
   return user_services;
 }
 
+// Fetch the user's simservs configuration from the XDMS.
+//
+// @returns The simservs XML, or an empty string (meaning all services
+// disabled) if there is none.
+std::string CallServices::get_simservs_xml(const std::string& public_id, SAS::TrailId trail)
+{
+  LOG_DEBUG("Fetching simservs configuration for %s", public_id.c_str());
+  std::string simservs_xml;
+  if (!_xdmc->get_simservs(public_id, simservs_xml, "", trail))
+  {
+    LOG_DEBUG("Failed to fetch simservs configuration for %s, no MMTel services enabled", public_id.c_str());
+    simservs_xml = "";
+  }
+  return simservs_xml;
+}
+
 // Parse a privacy header into a bitfield.
 //
 // @returns Bitfield of privacy fields that were in the header.
@@ -400,7 +417,10 @@ CallServices::Originating::Originating(CallServices* callServices,
                                        std::string served_user) :  //< Public ID of served user
   CallServices::CallServiceBase("1", uas_data)
 {
-  _user_services = callServices->get_user_services(msg, served_user, uas_data->trail());
+  _user_services = callServices->get_user_services(msg,
+                                                   served_user,
+                                                   uas_data->simservs_lookup(SessionCase::Originating),
+                                                   uas_data->trail());
 }
 
 CallServices::Originating::~Originating()
@@ -503,7 +523,10 @@ CallServices::Terminating::Terminating(CallServices* callServices,
   CallServices::CallServiceBase("1", uas_data),
   _ringing(false)
 {
-  _user_services = callServices->get_user_services(msg, served_user, uas_data->trail());
+  _user_services = callServices->get_user_services(msg,
+                                                   served_user,
+                                                   uas_data->simservs_lookup(SessionCase::Terminating),
+                                                   uas_data->trail());
 
   // Determine the media type conditions, in case they're needed later.
   if (msg->line.req.method.id == PJSIP_INVITE_METHOD)
@@ -0,0 +1,188 @@
+/**
+ * @file circuitbreaker.cpp Implementation of the CircuitBreaker class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <time.h>
+
+#include "log.h"
+#include "circuitbreaker.h"
+
+const double CircuitBreaker::DEFAULT_FAILURE_RATIO = 0.5;
+const int CircuitBreaker::WINDOW_MS;
+const int CircuitBreaker::MIN_REQUESTS;
+const int CircuitBreaker::OPEN_MS;
+const int CircuitBreaker::TRIAL_REQUESTS;
+
+CircuitBreaker::CircuitBreaker(const std::string& name,
+                               double failure_ratio) :
+  _name(name),
+  _failure_ratio(failure_ratio),
+  _state(CLOSED),
+  _window_start_ms(now_ms()),
+  _requests(0),
+  _failures(0),
+  _open_until_ms(0),
+  _trial_in_progress(false),
+  _trial_successes(0),
+  _opened(0),
+  _rejected(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+CircuitBreaker::~CircuitBreaker()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+/// Whether a request may be sent: always if the breaker is closed, and
+/// only as the single trial request if it's half-open.
+bool CircuitBreaker::allow(bool& trial)
+{
+  uint64_t now = now_ms();
+  bool allowed = true;
+  trial = false;
+
+  pthread_mutex_lock(&_lock);
+  if ((_state == OPEN) && (now >= _open_until_ms))
+  {
+    LOG_INFO("Sending trial requests to %s", _name.c_str());
+    _state = HALF_OPEN;
+    _trial_successes = 0;
+  }
+
+  if (_state == HALF_OPEN)
+  {
+    allowed = !_trial_in_progress;
+    _trial_in_progress = true;
+    trial = allowed;
+  }
+  else if (_state == OPEN)
+  {
+    allowed = false;
+  }
+
+  if (!allowed)
+  {
+    ++_rejected;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return allowed;
+}
+
+/// Count a completed request, opening or closing the breaker if need be.
+/// The results of requests that were let through before the breaker
+/// opened are ignored once it has.
+void CircuitBreaker::complete(bool ok, bool trial)
+{
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  if (trial)
+  {
+    _trial_in_progress = false;
+    if (!ok)
+    {
+      open(now);
+    }
+    else if (++_trial_successes >= TRIAL_REQUESTS)
+    {
+      LOG_STATUS("%s is available again", _name.c_str());
+      _state = CLOSED;
+      _window_start_ms = now;
+      _requests = 0;
+      _failures = 0;
+    }
+  }
+  else if (_state == CLOSED)
+  {
+    if (now >= _window_start_ms + WINDOW_MS)
+    {
+      _window_start_ms = now;
+      _requests = 0;
+      _failures = 0;
+    }
+
+    ++_requests;
+    if (!ok)
+    {
+      ++_failures;
+    }
+
+    if ((_failure_ratio > 0) &&
+        (_requests >= MIN_REQUESTS) &&
+        (_failures >= _failure_ratio * _requests))
+    {
+      LOG_ERROR("%d of the last %d requests to %s failed",
+                _failures, _requests, _name.c_str());
+      open(now);
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+/// Get the current state and counters.
+CircuitBreaker::Stats CircuitBreaker::stats()
+{
+  pthread_mutex_lock(&_lock);
+  Stats stats = {_state, _opened, _rejected};
+  pthread_mutex_unlock(&_lock);
+  return stats;
+}
+
+std::string CircuitBreaker::state_name(State state)
+{
+  return (state == CLOSED) ? "closed" : (state == OPEN) ? "open" : "half-open";
+}
+
+/// Open the breaker.  The lock must be held.
+void CircuitBreaker::open(uint64_t now)
+{
+  LOG_WARNING("Not sending requests to %s for %dms", _name.c_str(), OPEN_MS);
+  _state = OPEN;
+  _open_until_ms = now + OPEN_MS;
+  ++_opened;
+}
+
+uint64_t CircuitBreaker::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file digestcache.cpp Implementation of the DigestCache class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "digestcache.h"
+
+#include "log.h"
+
+const int DigestCache::MIN_INVALIDATE_AGE_MS;
+
+DigestCache::DigestCache(size_t max_entries,
+                         int ttl_ms,
+                         int negative_ttl_ms,
+                         Statistic* statistic,
+                         int num_shards) :
+  TtlCache<std::string>(max_entries,
+                        ttl_ms,
+                        negative_ttl_ms,
+                        statistic,
+                        num_shards)
+{
+  LOG_STATUS("Caching up to %d digests for %dms (%dms for unknown users)",
+             (int)max_entries, ttl_ms, negative_ttl_ms);
+}
+
+/// Get a digest, calling the loader if it isn't cached.  Entries are keyed
+/// by private ID, public ID and realm, grouped by private ID so that they
+/// can be invalidated together.
+std::string DigestCache::get(const std::string& private_id,
+                             const std::string& public_id,
+                             const std::string& realm,
+                             const Loader& loader)
+{
+  return TtlCache<std::string>::get(private_id + '\0' + public_id + '\0' + realm,
+                                    loader);
+}
+
+/// Drop the digests cached for a private ID, apart from any loaded very
+/// recently.
+void DigestCache::invalidate(const std::string& private_id)
+{
+  invalidate_group(private_id, MIN_INVALIDATE_AGE_MS);
+}
+
+/// Report the number of digests invalidated too.
+void DigestCache::add_stat_values(const Stats& stats,
+                                  std::vector<std::string>& values)
+{
+  values.push_back(std::to_string((unsigned long long)stats.invalidated));
+}
@@ -0,0 +1,235 @@
+/**
+ * @file expirypolicy.cpp Registration expiry policy.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "expirypolicy.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "statistic.h"
+#include "log.h"
+
+const int ExpiryPolicy::DEFAULT_MAX_EXPIRES;
+const int ExpiryPolicy::LOW_LATENCY_MS;
+const int ExpiryPolicy::HIGH_LATENCY_MS;
+const int ExpiryPolicy::REPORT_INTERVAL_MS;
+
+/// Get the monotonic time in milliseconds.
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+ExpiryPolicy::ExpiryPolicy(int max_expires,
+                           int overload_max_expires,
+                           int jitter_percent,
+                           Statistic* statistic) :
+  _max_expires(max_expires),
+  _overload_max_expires((overload_max_expires > max_expires) ?
+                          overload_max_expires : max_expires),
+  _jitter_percent(jitter_percent),
+  _statistic(statistic),
+  _seed(time(NULL)),
+  _latency_us(0),
+  _registers(0),
+  _last_report_ms(now_ms()),
+  _terminating(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_reporter_cond, NULL);
+
+  if (_statistic != NULL)
+  {
+    int rc = pthread_create(&_reporter, NULL, &reporter_thread, (void*)this);
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating REGISTER rate reporting thread");
+      _statistic = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+}
+
+
+ExpiryPolicy::~ExpiryPolicy()
+{
+  if (_statistic != NULL)
+  {
+    pthread_mutex_lock(&_lock);
+    _terminating = true;
+    pthread_cond_signal(&_reporter_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_reporter, NULL);
+  }
+  pthread_cond_destroy(&_reporter_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void ExpiryPolicy::record(int latency_ms)
+{
+  uint64_t latency_us = (latency_ms > 0) ? (uint64_t)latency_ms * 1000 : 0;
+
+  pthread_mutex_lock(&_lock);
+
+  // Smooth the latency with a weight of 1/8 for each new sample, as TCP
+  // does for round trip times.
+  _latency_us = _latency_us - (_latency_us >> 3) + (latency_us >> 3);
+  ++_registers;
+  maybe_report(now_ms());
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int ExpiryPolicy::grant(int requested)
+{
+  pthread_mutex_lock(&_lock);
+
+  int expiry = max_expires_locked();
+  if (requested < expiry)
+  {
+    expiry = requested;
+  }
+
+  if ((expiry > 0) && (_jitter_percent > 0))
+  {
+    int jitter = expiry * _jitter_percent / 100;
+    expiry -= rand_r(&_seed) % (jitter + 1);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return expiry;
+}
+
+
+int ExpiryPolicy::max_expires()
+{
+  pthread_mutex_lock(&_lock);
+  int expiry = max_expires_locked();
+  pthread_mutex_unlock(&_lock);
+  return expiry;
+}
+
+
+/// Scale the maximum expiry between the normal and overload maximums
+/// according to the latency.  Must be called with the lock held.
+int ExpiryPolicy::max_expires_locked()
+{
+  uint64_t low_us = LOW_LATENCY_MS * 1000;
+  uint64_t high_us = HIGH_LATENCY_MS * 1000;
+  if (_latency_us <= low_us)
+  {
+    return _max_expires;
+  }
+  else if (_latency_us >= high_us)
+  {
+    return _overload_max_expires;
+  }
+  else
+  {
+    return _max_expires +
+           (int)((_overload_max_expires - _max_expires) *
+                 (_latency_us - low_us) / (high_us - low_us));
+  }
+}
+
+
+/// Report the REGISTER rate, latency and maximum expiry if the reporting
+/// interval has passed.  Must be called with the lock held.
+void ExpiryPolicy::maybe_report(uint64_t now)
+{
+  uint64_t elapsed = now - _last_report_ms;
+  if ((_statistic != NULL) && (elapsed >= (uint64_t)REPORT_INTERVAL_MS))
+  {
+    if (_registers == 0)
+    {
+      // No REGISTERs have arrived for a whole interval, so none are
+      // queueing.
+      _latency_us = 0;
+    }
+
+    std::vector<std::string> values;
+    values.push_back(std::to_string((unsigned long long)(_registers * 1000 / elapsed)));
+    values.push_back(std::to_string((unsigned long long)(_latency_us / 1000)));
+    values.push_back(std::to_string((long long)max_expires_locked()));
+    _statistic->report_change(values);
+
+    LOG_DEBUG("%llu REGISTERs in %llums, latency %llums, max expiry %ds",
+              (unsigned long long)_registers, (unsigned long long)elapsed,
+              (unsigned long long)(_latency_us / 1000), max_expires_locked());
+    _registers = 0;
+    _last_report_ms = now;
+  }
+}
+
+
+void* ExpiryPolicy::reporter_thread(void* p)
+{
+  ((ExpiryPolicy*)p)->reporter_loop();
+  return NULL;
+}
+
+
+/// Report every REPORT_INTERVAL_MS until terminated, so the statistic
+/// drops to zero when REGISTERs stop.
+void ExpiryPolicy::reporter_loop()
+{
+  pthread_mutex_lock(&_lock);
+  while (!_terminating)
+  {
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_sec += REPORT_INTERVAL_MS / 1000;
+    pthread_cond_timedwait(&_reporter_cond, &_lock, &next);
+
+    if (!_terminating)
+    {
+      maybe_report(now_ms());
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
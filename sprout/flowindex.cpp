@@ -0,0 +1,212 @@
+/**
+ * @file flowindex.cpp Index of registration bindings by the flow they use.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <time.h>
+
+#include "flowindex.h"
+
+namespace RegData {
+
+  FlowIndex::FlowIndex() :
+    _flows(),
+    _aors(),
+    _expiries()
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+
+  FlowIndex::~FlowIndex()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+
+  void FlowIndex::add(const std::string& flow,
+                      const std::string& aor_id,
+                      const std::string& binding_id,
+                      int expires)
+  {
+    pthread_mutex_lock(&_lock);
+    sweep_locked(time(NULL));
+    remove_locked(aor_id, binding_id);
+    _flows[flow].insert(BindingKey(aor_id, binding_id));
+    Entry& entry = _aors[aor_id][binding_id];
+    entry.flow = flow;
+    entry.expires = expires;
+    _expiries.insert(std::make_pair(expires, BindingKey(aor_id, binding_id)));
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  void FlowIndex::remove(const std::string& aor_id,
+                         const std::string& binding_id)
+  {
+    pthread_mutex_lock(&_lock);
+    remove_locked(aor_id, binding_id);
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  void FlowIndex::remove_aor(const std::string& aor_id)
+  {
+    pthread_mutex_lock(&_lock);
+    std::map<std::string, std::map<std::string, Entry> >::iterator i =
+                                                            _aors.find(aor_id);
+    if (i != _aors.end())
+    {
+      // Take a copy of the binding IDs, as removing the last one removes
+      // the AoR's entry.
+      std::vector<std::string> binding_ids;
+      for (std::map<std::string, Entry>::const_iterator j = i->second.begin();
+           j != i->second.end();
+           ++j)
+      {
+        binding_ids.push_back(j->first);
+      }
+      for (size_t ii = 0; ii < binding_ids.size(); ++ii)
+      {
+        remove_locked(aor_id, binding_ids[ii]);
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+
+  std::string FlowIndex::flow(const std::string& aor_id,
+                              const std::string& binding_id)
+  {
+    std::string flow;
+    pthread_mutex_lock(&_lock);
+    std::map<std::string, std::map<std::string, Entry> >::const_iterator i =
+                                                            _aors.find(aor_id);
+    if (i != _aors.end())
+    {
+      std::map<std::string, Entry>::const_iterator j = i->second.find(binding_id);
+      if (j != i->second.end())
+      {
+        flow = j->second.flow;
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+    return flow;
+  }
+
+
+  std::vector<FlowIndex::BindingKey> FlowIndex::take(const std::string& flow)
+  {
+    std::vector<BindingKey> bindings;
+    pthread_mutex_lock(&_lock);
+    sweep_locked(time(NULL));
+    std::map<std::string, std::set<BindingKey> >::iterator i = _flows.find(flow);
+    if (i != _flows.end())
+    {
+      bindings.assign(i->second.begin(), i->second.end());
+      for (size_t ii = 0; ii < bindings.size(); ++ii)
+      {
+        remove_locked(bindings[ii].first, bindings[ii].second);
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+    return bindings;
+  }
+
+
+  size_t FlowIndex::size()
+  {
+    size_t size = 0;
+    pthread_mutex_lock(&_lock);
+    for (std::map<std::string, std::set<BindingKey> >::const_iterator i = _flows.begin();
+         i != _flows.end();
+         ++i)
+    {
+      size += i->second.size();
+    }
+    pthread_mutex_unlock(&_lock);
+    return size;
+  }
+
+
+  /// Remove a binding from both maps, dropping any entries left empty.
+  /// Must be called with the lock held.
+  void FlowIndex::remove_locked(const std::string& aor_id,
+                                const std::string& binding_id)
+  {
+    std::map<std::string, std::map<std::string, Entry> >::iterator i =
+                                                            _aors.find(aor_id);
+    if (i == _aors.end())
+    {
+      return;
+    }
+    std::map<std::string, Entry>::iterator j = i->second.find(binding_id);
+    if (j == i->second.end())
+    {
+      return;
+    }
+
+    std::map<std::string, std::set<BindingKey> >::iterator k = _flows.find(j->second.flow);
+    k->second.erase(BindingKey(aor_id, binding_id));
+    if (k->second.empty())
+    {
+      _flows.erase(k);
+    }
+    _expiries.erase(std::make_pair(j->second.expires, BindingKey(aor_id, binding_id)));
+
+    i->second.erase(j);
+    if (i->second.empty())
+    {
+      _aors.erase(i);
+    }
+  }
+
+
+  /// Remove all the bindings that have expired by the given time.  Must be
+  /// called with the lock held.
+  void FlowIndex::sweep_locked(int now)
+  {
+    while ((!_expiries.empty()) &&
+           (_expiries.begin()->first <= now))
+    {
+      // Copy the key, as removing the binding erases it from the set.
+      BindingKey key = _expiries.begin()->second;
+      remove_locked(key.first, key.second);
+    }
+  }
+
+} // namespace RegData
@@ -47,11 +47,17 @@
 #include "hssconnection.h"
 
 
-HSSConnection::HSSConnection(const std::string& server) :
+HSSConnection::HSSConnection(const std::string& server,
+                             HttpEngine* engine,
+                             double failure_ratio) :
   _http(new HttpConnection(server,
                            false,
                            SASEvent::TX_HSS_BASE,
-                           "connected_homesteads"))
+                           "connected_homesteads",
+                           "homestead_gets",
+                           "homestead_breaker",
+                           engine,
+                           failure_ratio))
 {
 }
 
@@ -64,22 +70,23 @@ HSSConnection::~HSSConnection()
 
 
 /// Retrieve user's digest data as JSON object. Caller is responsible for deleting.
-Json::Value* HSSConnection::get_digest_data(const std::string& private_user_identity,
-                                            const std::string& public_user_identity,
-                                            SAS::TrailId trail)
+HTTPCode HSSConnection::get_digest_data(const std::string& private_user_identity,
+                                        const std::string& public_user_identity,
+                                        Json::Value*& object,
+                                        SAS::TrailId trail)
 {
   std::string path = "/credentials/" +
                      Utils::url_escape(private_user_identity) + "/" +
                      Utils::url_escape(public_user_identity) +
                      "/digest";
-  return get_object(path, trail);
+  return get_object(path, object, trail);
 }
 
 
 /// Retrieve user's initial filter criteria as JSON object. Caller is responsible for deleting.
-bool HSSConnection::get_user_ifc(const std::string& public_user_identity,
-                                 std::string& xml_data,
-                                 SAS::TrailId trail)
+HTTPCode HSSConnection::get_user_ifc(const std::string& public_user_identity,
+                                     std::string& xml_data,
+                                     SAS::TrailId trail)
 {
   std::string path = "/filtercriteria/" +
                      Utils::url_escape(public_user_identity);
@@ -87,12 +94,15 @@ bool HSSConnection::get_user_ifc(const std::string& public_user_identity,
 }
 
 /// Retrieve a JSON object from a path on the server. Caller is responsible for deleting.
-Json::Value* HSSConnection::get_object(const std::string& path, SAS::TrailId trail)
+HTTPCode HSSConnection::get_object(const std::string& path,
+                                   Json::Value*& root,
+                                   SAS::TrailId trail)
 {
   std::string json_data;
-  Json::Value* root = NULL;
+  root = NULL;
 
-  if (_http->get(path, json_data, "", trail))
+  HTTPCode http_rc = _http->get(path, json_data, "", trail);
+  if (http_rc == HTTP_OK)
   {
     root = new Json::Value;
     Json::Reader reader;
@@ -103,8 +113,9 @@ Json::Value* HSSConnection::get_object(const std::string& path, SAS::TrailId tra
       LOG_ERROR("Failed to parse Homestead response:\n %s\n %s\n %s\n", path.c_str(), json_data.c_str(), reader.getFormatedErrorMessages().c_str());
       delete root;
       root = NULL;
+      http_rc = HTTP_SERVER_ERROR;
     }
   }
 
-  return root;
+  return http_rc;
 }
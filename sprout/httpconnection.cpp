@@ -38,8 +38,9 @@
 
 #include <curl/curl.h>
 #include <cassert>
+#include <errno.h>
 #include <iostream>
-#include <boost/lexical_cast.hpp>
+#include <algorithm>
 
 #include "utils.h"
 #include "log.h"
@@ -53,7 +54,23 @@
 /// be set to what we consider acceptable.  Covers lookup, possibly
 /// multiple connection attempts, request, and response.  In
 /// milliseconds.
+///
+/// Once we've seen how quickly the server usually responds, we wait
+/// less: a multiple of the 99th percentile of its recent latencies, but
+/// no less than the minimum.
 static const long TOTAL_TIMEOUT_MS = 500;
+static const long MIN_TIMEOUT_MS = 100;
+static const double TIMEOUT_PERCENTILE = 99.0;
+static const double TIMEOUT_FACTOR = 3.0;
+
+/// With an engine, if a request has taken longer than the 95th percentile
+/// of the server's recent latencies, a hedged request is sent to another
+/// of its addresses, and whichever responds first is used.  Each request
+/// earns a fraction of a hedge, so that hedges only ever add that fraction
+/// to the load on the server, and a few hedges can be saved up for bursts.
+static const double HEDGE_PERCENTILE = 95.0;
+static const double HEDGE_BUDGET = 0.1;
+static const double MAX_SAVED_HEDGES = 10.0;
 
 /// Approximate length of time to wait before giving up on a
 /// connection attempt to a single address (in milliseconds).  cURL
@@ -146,7 +163,7 @@ private:
 };
 
 
-/// Set the remote IP, and update statistics.
+/// Set the remote IP, and update the connection counts.
 void PoolEntry::setRemoteIp(std::string value)  //< Remote IP, or "" if no connection.
 {
   if (value == _remoteIp)
@@ -177,21 +194,7 @@ void PoolEntry::setRemoteIp(std::string value)  //< Remote IP, or "" if no conne
 
   _remoteIp = value;
 
-  // Now build the statistics to report.
-  std::vector<std::string> new_value;
-
-  for (std::map<std::string, int>::iterator iter = _parent->_serverCount.begin();
-       iter != _parent->_serverCount.end();
-       ++iter)
-  {
-    new_value.push_back(iter->first);
-    new_value.push_back(boost::lexical_cast<std::string>(iter->second));
-  }
-
   pthread_mutex_unlock(&_parent->_lock);
-
-  // Actually report outside the mutex to avoid any risk of deadlock.
-  _parent->_statistic.report_change(new_value);
 }
 
 /// cURL helper - write data into string.
@@ -219,14 +222,93 @@ static void cleanup_curl(void* curlptr)
 }
 
 
+/// A GET in progress, which identical GETs can wait for.
+class HttpConnection::Flight
+{
+public:
+  Flight(const std::string& key) :
+    _key(key),
+    _attempts(1),
+    _done(false),
+    _trial(false)
+  {
+  }
+
+  const std::string _key;
+
+  /// Called with the result.
+  std::vector<Callback> _callbacks;
+
+  /// The number of requests for the GET in progress: 2 if it has been
+  /// hedged, else 1.
+  int _attempts;
+
+  /// Whether the result is in.
+  bool _done;
+
+  /// Whether the GET is a trial request for the circuit breaker.
+  bool _trial;
+
+  /// The target the first request was (last) sent to.
+  std::shared_ptr<UpstreamBalancer::Target> _target;
+};
+
+/// A request in progress.
+class HttpConnection::Request
+{
+public:
+  Request(const std::string& path, const std::string& username, const std::shared_ptr<Flight>& flight, SAS::TrailId trail) :
+    _path(path),
+    _username(username),
+    _flight(flight),
+    _trail(trail),
+    _extra_headers(NULL),
+    _curl(NULL),
+    _entry(NULL),
+    _now_ms(0L),
+    _sent_us(0L),
+    _recycle_conn(false),
+    _hedge(false)
+  {
+  }
+
+  const std::string _path;
+  const std::string _username;
+  const std::shared_ptr<Flight> _flight;
+  const SAS::TrailId _trail;
+  std::string _url;
+  std::shared_ptr<UpstreamBalancer::Target> _target;
+  std::string _doc;
+  struct curl_slist* _extra_headers;
+  CURL* _curl;
+  PoolEntry* _entry;
+  unsigned long _now_ms;
+  unsigned long _sent_us;
+  bool _recycle_conn;
+  bool _hedge;
+};
+
+
 HttpConnection::HttpConnection(const std::string& server,  //< Server to send HTTP requests to.
                                bool assertUser,            //< Assert user in header?
                                int sasEventBase,           //< SAS events: sasEventBase - will have  SASEvent::HTTP_REQ / RSP / ERR added to it.
-                               const std::string& statName) :  //< Name of statistic to report connection info to.
+                               const std::string& statName,  //< Name of statistic to report connection info to.
+                               const std::string& getsStatName,  //< Name of statistic to report GET counters to.
+                               const std::string& breakerStatName,  //< Name of statistic to report the circuit breaker's state to.
+                               HttpEngine* engine,         //< Engine to make requests on, or NULL to make them synchronously.
+                               double failureRatio) :      //< Ratio of failed GETs at which to stop sending them for a while, or 0 to never stop.
   _server(server),
   _assertUser(assertUser),
   _sasEventBase(sasEventBase),
-  _statistic(statName)
+  _engine(engine),
+  _balancer(server),
+  _statistic(statName),
+  _gets_statistic(getsStatName),
+  _next_report_ms(0),
+  _latencies(),
+  _saved_hedges(MAX_SAVED_HEDGES),
+  _breaker(server, failureRatio),
+  _breaker_statistic(breakerStatName)
 {
   pthread_key_create(&_thread_local, cleanup_curl);
   pthread_mutex_init(&_lock, NULL);
@@ -246,175 +328,578 @@ HttpConnection::~HttpConnection()
     pthread_setspecific(_thread_local, NULL);
     cleanup_curl(curl);
   }
+
+  // Clean up the handles used with the engine.  Any requests still in
+  // progress must have completed by now.
+  for (size_t ii = 0; ii < _free_handles.size(); ++ii)
+  {
+    cleanup_curl(_free_handles[ii]);
+  }
 }
 
-/// Get the thread-local curl handle if it exists, and create it if not.
-CURL* HttpConnection::get_curl_handle()
+/// Create and set up a curl handle.
+CURL* HttpConnection::create_curl_handle()
 {
-  CURL* curl = pthread_getspecific(_thread_local);
-  if (curl == NULL)
-  {
-    curl = curl_easy_init();
-    LOG_DEBUG("Allocated CURL handle %p", curl);
-    pthread_setspecific(_thread_local, curl);
+  CURL* curl = curl_easy_init();
+  LOG_DEBUG("Allocated CURL handle %p", curl);
 
-    // Create our private data
-    PoolEntry* entry = new PoolEntry(this);
-    curl_easy_setopt(curl, CURLOPT_PRIVATE, entry);
+  // Create our private data
+  PoolEntry* entry = new PoolEntry(this);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, entry);
 
-    // Retrieved data will always be written to a string.
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &string_store);
+  // Retrieved data will always be written to a string.
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &string_store);
 
-    // Tell cURL to fail on 400+ response codes.
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  // Tell cURL to fail on 400+ response codes.
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 
+  if (_engine == NULL)
+  {
     // We always talk to the same server, unless we intentionally want
     // to rotate our requests. So a connection pool makes no sense.
+    // (With an engine, connections are pooled by the engine instead.)
     curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, 1L);
+  }
 
-    // Maximum time to wait for a response.
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, TOTAL_TIMEOUT_MS);
+  // Maximum time to wait for a response.
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, TOTAL_TIMEOUT_MS);
 
-    // Time to wait until we establish a TCP connection to one of the
-    // available addresses.  We will try the first address for half of
-    // this time.
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2 * SINGLE_CONNECT_TIMEOUT_MS);
+  // Time to wait until we establish a TCP connection to one of the
+  // available addresses.  We will try the first address for half of
+  // this time.
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2 * SINGLE_CONNECT_TIMEOUT_MS);
 
-    // We mustn't reuse DNS responses, because cURL does no shuffling
-    // of DNS entries and we rely on this for load balancing.
-    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
+  // We resolve the server's name ourselves, but if that failed cURL
+  // resolves it.  We mustn't reuse DNS responses then, because cURL does
+  // no shuffling of DNS entries and we rely on this for load balancing.
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
 
-    // Nagle is not required. Probably won't bite us, but can't hurt
-    // to turn it off.
-    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+  // Nagle is not required. Probably won't bite us, but can't hurt
+  // to turn it off.
+  curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+
+  // We are a multithreaded app using C-Ares. This is the
+  // recommended setting.
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+  return curl;
+}
+
+/// Get a curl handle for a request.  Without an engine, this is the
+/// thread-local curl handle, created if it doesn't exist yet.  With one,
+/// it is a free handle from the pool, or a new one if there are none.
+CURL* HttpConnection::get_curl_handle()
+{
+  CURL* curl = NULL;
+  if (_engine == NULL)
+  {
+    curl = pthread_getspecific(_thread_local);
+    if (curl == NULL)
+    {
+      curl = create_curl_handle();
+      pthread_setspecific(_thread_local, curl);
+    }
+  }
+  else
+  {
+    pthread_mutex_lock(&_lock);
+    if (!_free_handles.empty())
+    {
+      curl = _free_handles.back();
+      _free_handles.pop_back();
+    }
+    pthread_mutex_unlock(&_lock);
 
-    // We are a multithreaded app using C-Ares. This is the
-    // recommended setting.
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (curl == NULL)
+    {
+      curl = create_curl_handle();
+    }
   }
   return curl;
 }
 
-/// Get data; return true iff OK
-bool HttpConnection::get(const std::string& path,       //< Absolute path to request from server - must start with "/"
-                         std::string& doc,             //< OUT: Retrieved document
-                         const std::string& username,  //< Username to assert (if assertUser was true, else ignored).
-                         SAS::TrailId trail)          //< SAS trail to use
+/// Finish with a curl handle got from get_curl_handle.
+void HttpConnection::release_curl_handle(CURL* curl)
 {
-  std::string url = "http://" + _server + path;
-  struct curl_slist *extra_headers = NULL;
-  CURL *curl = get_curl_handle();
+  if (_engine != NULL)
+  {
+    pthread_mutex_lock(&_lock);
+    _free_handles.push_back(curl);
+    pthread_mutex_unlock(&_lock);
+  }
+}
 
-  PoolEntry* entry;
-  CURLcode rc = curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&entry);
-  assert(rc == CURLE_OK);
+/// Get data; return the HTTP status code, HTTP_OK iff OK
+HTTPCode HttpConnection::get(const std::string& path,       //< Absolute path to request from server - must start with "/"
+                             std::string& doc,             //< OUT: Retrieved document
+                             const std::string& username,  //< Username to assert (if assertUser was true, else ignored).
+                             SAS::TrailId trail)          //< SAS trail to use
+{
+  // The result may come from another thread: the engine's, or one making
+  // an identical request.  Wait for it.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  bool done = false;
+  HTTPCode http_rc = HTTP_SERVER_ERROR;
+
+  Callback callback = [&](HTTPCode rsp_rc, const std::string& rsp_doc)
+  {
+    pthread_mutex_lock(&lock);
+    http_rc = rsp_rc;
+    doc = rsp_doc;
+    done = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  };
+  std::shared_ptr<Flight> flight = start_get(path, username, trail, callback);
+
+  // If we sent the request, and it's taking longer than usual, hedge it.
+  double hedge_ms = ((flight != NULL) && (_engine != NULL)) ? _latencies.percentile(HEDGE_PERCENTILE) : -1.0;
+  struct timespec hedge_at;
+  if (hedge_ms >= 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &hedge_at);
+    long hedge_ns = hedge_at.tv_nsec + (long)(hedge_ms * 1000000);
+    hedge_at.tv_sec += hedge_ns / 1000000000;
+    hedge_at.tv_nsec = hedge_ns % 1000000000;
+  }
 
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &doc);
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  pthread_mutex_lock(&lock);
+  while (!done)
+  {
+    if (hedge_ms >= 0)
+    {
+      if (pthread_cond_timedwait(&cond, &lock, &hedge_at) == ETIMEDOUT)
+      {
+        hedge_ms = -1.0;
+        pthread_mutex_unlock(&lock);
+        hedge(path, username, trail, flight);
+        pthread_mutex_lock(&lock);
+      }
+    }
+    else
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+  }
+  pthread_mutex_unlock(&lock);
 
-  if (_assertUser)
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+  return http_rc;
+}
+
+/// Get data, calling the callback when done.  If an identical GET is
+/// already in progress, just wait for it and share its result.
+void HttpConnection::get_async(const std::string& path,       //< Absolute path to request from server - must start with "/"
+                               const std::string& username,  //< Username to assert (if assertUser was true, else ignored).
+                               SAS::TrailId trail,           //< SAS trail to use
+                               const Callback& callback)     //< Called with the result
+{
+  start_get(path, username, trail, callback);
+}
+
+/// Whether the circuit breaker is closed.
+bool HttpConnection::available()
+{
+  return (_breaker.stats().state == CircuitBreaker::CLOSED);
+}
+
+/// Start a GET, or wait for an identical one in progress.  Returns the
+/// GET if this started it, else NULL.  If the circuit breaker rejects
+/// the GET, the callback is called straight away.
+std::shared_ptr<HttpConnection::Flight> HttpConnection::start_get(const std::string& path,
+                                                                  const std::string& username,
+                                                                  SAS::TrailId trail,
+                                                                  const Callback& callback)
+{
+  // The asserted user is part of the request, so GETs for different
+  // users can't share a response.
+  std::string key = _assertUser ? (path + " " + username) : path;
+
+  pthread_mutex_lock(&_lock);
+  std::shared_ptr<Flight> flight;
+  std::map<std::string, std::shared_ptr<Flight> >::iterator existing = _in_flight.find(key);
+  bool coalesced = (existing != _in_flight.end());
+  bool trial = false;
+  bool rejected = (!coalesced) && (!_breaker.allow(trial));
+  GetStats& stats = _get_stats[path_class(path)];
+  if (coalesced)
+  {
+    existing->second->_callbacks.push_back(callback);
+    ++stats.coalesced;
+  }
+  else if (!rejected)
   {
-    extra_headers = curl_slist_append(extra_headers, ("X-XCAP-Asserted-Identity: " + username).c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, extra_headers);
+    flight = std::make_shared<Flight>(key);
+    flight->_trial = trial;
+    flight->_callbacks.push_back(callback);
+    _in_flight[key] = flight;
+    ++stats.requests;
+    _saved_hedges = std::min(_saved_hedges + HEDGE_BUDGET, MAX_SAVED_HEDGES);
   }
+  pthread_mutex_unlock(&_lock);
+
+  maybe_report();
+
+  if (coalesced)
+  {
+    LOG_DEBUG("Waiting for HTTP request in progress : %s", path.c_str());
+    return flight;
+  }
+
+  if (rejected)
+  {
+    LOG_DEBUG("Not sending HTTP request while %s is unavailable : %s", _server.c_str(), path.c_str());
+    callback(HTTP_SERVER_UNAVAILABLE, "");
+    return flight;
+  }
+
+  Request* req = new Request(path, username, flight, trail);
+  req->_curl = get_curl_handle();
 
+  CURLcode rc = curl_easy_getinfo(req->_curl, CURLINFO_PRIVATE, (char**)&req->_entry);
+  assert(rc == CURLE_OK);
+
+  curl_easy_setopt(req->_curl, CURLOPT_WRITEDATA, &req->_doc);
 
   // Determine whether to recycle the connection, based on
   // previously-calculated deadline.
   struct timespec tp;
   int rv = clock_gettime(CLOCK_MONOTONIC, &tp);
   assert(rv == 0);
-  unsigned long now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
-  bool recycle_conn = entry->isConnectionExpired(now_ms);
+  req->_now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
+  req->_recycle_conn = req->_entry->isConnectionExpired(req->_now_ms);
+
+  send(req);
+  return flight;
+}
 
-  // Try to get a decent connection. We may need to retry, but only
-  // once - cURL itself does most of the retrying for us.
-  for (int i = 0; i < 2; i++)
+/// Send a second request for a GET that's taking a while, if it's still
+/// in progress and there's enough budget.  Returns whether it was sent.
+bool HttpConnection::hedge(const std::string& path,
+                           const std::string& username,
+                           SAS::TrailId trail,
+                           const std::shared_ptr<Flight>& flight)
+{
+  pthread_mutex_lock(&_lock);
+  bool send_hedge = (!flight->_done) && (_saved_hedges >= 1.0);
+  if (send_hedge)
   {
-    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, recycle_conn ? 1L : 0L);
+    _saved_hedges -= 1.0;
+    ++flight->_attempts;
+    ++_get_stats[path_class(path)].hedged;
+  }
+  std::shared_ptr<UpstreamBalancer::Target> target = flight->_target;
+  pthread_mutex_unlock(&_lock);
 
-    // Report the request to SAS.
-    SAS::Event http_req_event(trail, _sasEventBase + SASEvent::HTTP_REQ, 1u);
-    http_req_event.add_var_param(url);
-    SAS::report_event(http_req_event);
+  if (send_hedge)
+  {
+    LOG_DEBUG("Hedging HTTP request : %s", path.c_str());
+    Request* req = new Request(path, username, flight, trail);
+    req->_curl = get_curl_handle();
+    CURLcode rc = curl_easy_getinfo(req->_curl, CURLINFO_PRIVATE, (char**)&req->_entry);
+    assert(rc == CURLE_OK);
+    curl_easy_setopt(req->_curl, CURLOPT_WRITEDATA, &req->_doc);
+
+    // Send it somewhere other than the first request.  It isn't retried,
+    // as it's only sent to save time, not to recover from failure.
+    req->_target = target;
+    req->_hedge = true;
+    send(req);
+  }
 
-    // Send the request.
-    doc.clear();
-    LOG_DEBUG("Sending HTTP request : %s (try %d)", url.c_str(), i);
-    rc = curl_easy_perform(curl);
+  return send_hedge;
+}
 
-    if (rc == CURLE_OK)
-    {
-      // Report the response to SAS.
-      LOG_DEBUG("Received HTTP response : %s", doc.c_str());
-      SAS::Event http_rsp_event(trail, _sasEventBase + SASEvent::HTTP_RSP, 1u);
-      http_rsp_event.add_var_param(url);
-      http_rsp_event.add_var_param(doc);
-      SAS::report_event(http_rsp_event);
-
-      if (recycle_conn)
-      {
-        entry->updateDeadline(now_ms);
-      }
+/// How long to wait for a response.
+long HttpConnection::timeout_ms()
+{
+  double latency_ms = _latencies.percentile(TIMEOUT_PERCENTILE);
+  if (latency_ms < 0)
+  {
+    return TOTAL_TIMEOUT_MS;
+  }
+  return std::max(MIN_TIMEOUT_MS, std::min(TOTAL_TIMEOUT_MS, (long)(latency_ms * TIMEOUT_FACTOR)));
+}
 
-      // Success!
-      break;
+/// Send the request (or resend it on a fresh connection).
+void HttpConnection::send(Request* req)
+{
+  // Choose where to send the request.  If it's being resent, avoid the
+  // target it just failed on.
+  req->_target = _balancer.select(req->_target.get());
+  req->_url = "http://" + req->_target->address + req->_path;
+  curl_easy_setopt(req->_curl, CURLOPT_URL, req->_url.c_str());
+  curl_easy_setopt(req->_curl, CURLOPT_TIMEOUT_MS, timeout_ms());
+
+  if (!req->_hedge)
+  {
+    pthread_mutex_lock(&_lock);
+    req->_flight->_target = req->_target;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  if (req->_extra_headers != NULL)
+  {
+    curl_slist_free_all(req->_extra_headers);
+    req->_extra_headers = NULL;
+  }
+
+  if (_assertUser)
+  {
+    req->_extra_headers = curl_slist_append(req->_extra_headers, ("X-XCAP-Asserted-Identity: " + req->_username).c_str());
+  }
+
+  if (req->_target->address != _server)
+  {
+    // We're sending the request to one of the server's addresses, so tell
+    // it the name we're using for it.
+    req->_extra_headers = curl_slist_append(req->_extra_headers, ("Host: " + _server).c_str());
+  }
+
+  curl_easy_setopt(req->_curl, CURLOPT_HTTPHEADER, req->_extra_headers);
+  curl_easy_setopt(req->_curl, CURLOPT_FRESH_CONNECT, req->_recycle_conn ? 1L : 0L);
+
+  // Report the request to SAS.
+  SAS::Event http_req_event(req->_trail, _sasEventBase + SASEvent::HTTP_REQ, 1u);
+  http_req_event.add_var_param(req->_url);
+  SAS::report_event(http_req_event);
+
+  // Send the request.
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  req->_sent_us = tp.tv_sec * 1000000 + (tp.tv_nsec / 1000);
+  req->_doc.clear();
+  LOG_DEBUG("Sending HTTP request : %s%s", req->_url.c_str(), req->_recycle_conn ? " (fresh connection)" : "");
+  if (_engine != NULL)
+  {
+    _engine->perform(req->_curl, [this, req](CURLcode rc) { on_complete(req, rc); });
+  }
+  else
+  {
+    on_complete(req, curl_easy_perform(req->_curl));
+  }
+}
+
+/// Handle the completion of a request, retrying it if necessary.
+void HttpConnection::on_complete(Request* req, CURLcode rc)
+{
+  // Tell the balancer how the target did.  An HTTP error response still
+  // shows that the server is working.
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  unsigned long now_us = tp.tv_sec * 1000000 + (tp.tv_nsec / 1000);
+  double latency_ms = (now_us - req->_sent_us) / 1000.0;
+  _balancer.complete(req->_target,
+                     (rc == CURLE_OK) || (rc == CURLE_HTTP_RETURNED_ERROR),
+                     latency_ms);
+
+  // Track how long the server takes to respond.  Count timeouts too, so
+  // that if it slows down we wait longer.
+  if ((rc == CURLE_OK) ||
+      (rc == CURLE_HTTP_RETURNED_ERROR) ||
+      (rc == CURLE_OPERATION_TIMEDOUT))
+  {
+    _latencies.add(latency_ms);
+  }
+  if (rc == CURLE_OK)
+  {
+    // Report the response to SAS.
+    LOG_DEBUG("Received HTTP response : %s", req->_doc.c_str());
+    SAS::Event http_rsp_event(req->_trail, _sasEventBase + SASEvent::HTTP_RSP, 1u);
+    http_rsp_event.add_var_param(req->_url);
+    http_rsp_event.add_var_param(req->_doc);
+    SAS::report_event(http_rsp_event);
+
+    if (req->_recycle_conn)
+    {
+      req->_entry->updateDeadline(req->_now_ms);
     }
-    else
+  }
+  else
+  {
+    // Report the error to SAS
+    LOG_ERROR("HTTP error response : %s : %s", req->_url.c_str(), curl_easy_strerror(rc));
+    SAS::Event http_err_event(req->_trail, _sasEventBase + SASEvent::HTTP_ERR, 1u);
+    http_err_event.add_static_param(rc);
+    http_err_event.add_var_param(req->_url);
+    http_err_event.add_var_param(curl_easy_strerror(rc));
+    SAS::report_event(http_err_event);
+
+    // Is this an error we should retry? If cURL itself has already
+    // retried (e.g., CURLE_COULDNT_CONNECT) then there is no point
+    // in us retrying. But if the remote application has hung
+    // (CURLE_OPERATION_TIMEDOUT) or a previously-up connection has
+    // failed (CURLE_SEND|RECV_ERROR) then we must retry once
+    // ourselves.
+    bool non_fatal = ((rc == CURLE_OPERATION_TIMEDOUT) ||
+                      (rc == CURLE_SEND_ERROR) ||
+                      (rc == CURLE_RECV_ERROR));
+
+    if (!req->_recycle_conn && !req->_hedge && non_fatal)
     {
-      // Report the error to SAS
-      LOG_ERROR("HTTP error response : %s : %s", url.c_str(), curl_easy_strerror(rc));
-      SAS::Event http_err_event(trail, _sasEventBase + SASEvent::HTTP_ERR, 1u);
-      http_err_event.add_static_param(rc);
-      http_err_event.add_var_param(url);
-      http_err_event.add_var_param(curl_easy_strerror(rc));
-      SAS::report_event(http_err_event);
-
-      // Is this an error we should retry? If cURL itself has already
-      // retried (e.g., CURLE_COULDNT_CONNECT) then there is no point
-      // in us retrying. But if the remote application has hung
-      // (CURLE_OPERATION_TIMEDOUT) or a previously-up connection has
-      // failed (CURLE_SEND|RECV_ERROR) then we must retry once
-      // ourselves.
-      bool non_fatal = ((rc == CURLE_OPERATION_TIMEDOUT) ||
-                        (rc == CURLE_SEND_ERROR) ||
-                        (rc == CURLE_RECV_ERROR));
-
-      if (!recycle_conn && non_fatal)
-      {
-        // Loop around and try again.  Always request a fresh
-        // connection.
-        recycle_conn = true;
-      }
-      else
-      {
-        // Fatal error - we're done!
-        break;
-      }
+      // Try again.  Always request a fresh connection.
+      req->_recycle_conn = true;
+      send(req);
+      return;
     }
   }
 
-  curl_slist_free_all(extra_headers);
+  if (req->_extra_headers != NULL)
+  {
+    // The handle may be used for other requests, so mustn't keep a
+    // pointer to the headers.
+    curl_slist_free_all(req->_extra_headers);
+    curl_easy_setopt(req->_curl, CURLOPT_HTTPHEADER, (struct curl_slist*)NULL);
+  }
 
   if ((rc == CURLE_OK) || (rc == CURLE_HTTP_RETURNED_ERROR))
   {
     char* remote_ip;
-    CURLcode rc = curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &remote_ip);
+    CURLcode rc = curl_easy_getinfo(req->_curl, CURLINFO_PRIMARY_IP, &remote_ip);
 
     if (rc == CURLE_OK)
     {
-      entry->setRemoteIp(remote_ip);
+      req->_entry->setRemoteIp(remote_ip);
     }
     else
     {
-      entry->setRemoteIp("UNKNOWN");  // LCOV_EXCL_LINE Can't happen.
+      req->_entry->setRemoteIp("UNKNOWN");  // LCOV_EXCL_LINE Can't happen.
     }
   }
   else
   {
-    entry->setRemoteIp("");
+    req->_entry->setRemoteIp("");
+  }
+
+  HTTPCode http_rc = curl_code_to_http_code(req->_curl, rc);
+  release_curl_handle(req->_curl);
+
+  // The first response is used.  A failure is only used if there's no
+  // other request for the GET still in progress, which might succeed.
+  // Finish with the GET before calling any of the callbacks waiting for it,
+  // so that any new GETs they make are sent afresh.
+  std::shared_ptr<Flight> flight = req->_flight;
+  std::vector<Callback> callbacks;
+  pthread_mutex_lock(&_lock);
+  --flight->_attempts;
+  if ((!flight->_done) &&
+      ((rc == CURLE_OK) || (flight->_attempts == 0)))
+  {
+    flight->_done = true;
+    callbacks.swap(flight->_callbacks);
+    _in_flight.erase(flight->_key);
+
+    // Tell the circuit breaker how the GET went.  As for the balancer, an
+    // HTTP error response shows that the server is working.
+    _breaker.complete((rc == CURLE_OK) || (rc == CURLE_HTTP_RETURNED_ERROR), flight->_trial);
   }
+  pthread_mutex_unlock(&_lock);
 
-  return (rc == CURLE_OK);
+  for (std::vector<Callback>::const_iterator ii = callbacks.begin();
+       ii != callbacks.end();
+       ++ii)
+  {
+    (*ii)(http_rc, req->_doc);
+  }
+  delete req;
+}
+
+/// The class of a path, for counting GETs: its first segment.
+std::string HttpConnection::path_class(const std::string& path)
+{
+  size_t end = path.find_first_of("/?", 1);
+  return path.substr(1, (end == std::string::npos) ? std::string::npos : end - 1);
 }
 
+/// The HTTP status code for the result of a request.  Must be called
+/// before the handle is used for another request.
+HTTPCode HttpConnection::curl_code_to_http_code(CURL* curl, CURLcode code)
+{
+  switch (code)
+  {
+  case CURLE_OK:
+    return HTTP_OK;
+  case CURLE_HTTP_RETURNED_ERROR:
+  {
+    long http_rc = HTTP_SERVER_ERROR;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    return http_rc;
+  }
+  case CURLE_REMOTE_FILE_NOT_FOUND:
+    return HTTP_NOT_FOUND;
+  case CURLE_OPERATION_TIMEDOUT:
+    return HTTP_GATEWAY_TIMEOUT;
+  default:
+    // No response from the server.
+    return HTTP_SERVER_UNAVAILABLE;
+  }
+}
+
+std::map<std::string, HttpConnection::GetStats> HttpConnection::get_stats()
+{
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, GetStats> stats = _get_stats;
+  pthread_mutex_unlock(&_lock);
+  return stats;
+}
+
+/// Report the counters, if it's time to.
+void HttpConnection::maybe_report()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  pthread_mutex_lock(&_lock);
+  bool report = (now >= _next_report_ms);
+  std::map<std::string, GetStats> stats;
+  std::map<std::string, int> connections;
+  if (report)
+  {
+    _next_report_ms = now + REPORT_INTERVAL_MS;
+    stats = _get_stats;
+    connections = _serverCount;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (report)
+  {
+    std::vector<UpstreamBalancer::Target> targets = _balancer.targets();
+    std::vector<std::string> connected;
+    for (std::vector<UpstreamBalancer::Target>::const_iterator ii = targets.begin();
+         ii != targets.end();
+         ++ii)
+    {
+      connected.push_back(ii->address);
+      connected.push_back(std::to_string((long long)connections[ii->ip]));
+      connected.push_back(std::to_string((long long)ii->outstanding));
+      connected.push_back(std::to_string((long long)(ii->latency_ms + 0.5)));
+      connected.push_back(std::to_string((long long)(ii->error_rate * 100 + 0.5)));
+      connected.push_back(UpstreamBalancer::state(*ii));
+    }
+    _statistic.report_change(connected);
+
+    std::vector<std::string> values;
+    for (std::map<std::string, GetStats>::const_iterator ii = stats.begin();
+         ii != stats.end();
+         ++ii)
+    {
+      values.push_back(ii->first);
+      values.push_back(std::to_string((unsigned long long)ii->second.requests));
+      values.push_back(std::to_string((unsigned long long)ii->second.coalesced));
+      values.push_back(std::to_string((unsigned long long)ii->second.hedged));
+    }
+    _gets_statistic.report_change(values);
+
+    CircuitBreaker::Stats breaker = _breaker.stats();
+    std::vector<std::string> state;
+    state.push_back(CircuitBreaker::state_name(breaker.state));
+    state.push_back(std::to_string((unsigned long long)breaker.opened));
+    state.push_back(std::to_string((unsigned long long)breaker.rejected));
+    _breaker_statistic.report_change(state);
+  }
+}
@@ -0,0 +1,283 @@
+/**
+ * @file httpengine.cpp Asynchronous HTTP request engine
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "log.h"
+#include "httpengine.h"
+
+/// Longest time an I/O thread waits for something to happen before
+/// checking its requests again, in milliseconds.  cURL usually asks for
+/// less than this.
+static const long MAX_WAIT_MS = 100;
+
+const long HttpEngine::DEFAULT_MAX_HOST_CONNECTIONS;
+
+/// An I/O thread, running requests on its own cURL multi handle.
+class HttpEngine::IoThread
+{
+public:
+  IoThread(long max_host_connections);
+  ~IoThread();
+
+  void perform(CURL* curl, const Callback& callback);
+
+private:
+  static void* thread_entry(void* p);
+  void run();
+  void wait();
+  void wake();
+
+  CURLM* _multi;
+  pthread_t _thread;
+
+  /// Written to wake the thread when there are new requests.
+  int _wake_pipe[2];
+
+  pthread_mutex_t _lock;
+  std::deque<std::pair<CURL*, Callback> > _pending;  // must access under _lock
+  bool _terminated;  // must access under _lock
+
+  /// Requests the multi handle is running.  Only accessed on the thread.
+  std::map<CURL*, Callback> _running;
+};
+
+HttpEngine::IoThread::IoThread(long max_host_connections) :
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  _multi = curl_multi_init();
+  curl_multi_setopt(_multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+
+  int rc = pipe(_wake_pipe);
+  if (rc == 0)
+  {
+    fcntl(_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating HTTP I/O thread wake pipe");
+    _wake_pipe[0] = -1;
+    _wake_pipe[1] = -1;
+    // LCOV_EXCL_STOP
+  }
+
+  rc = pthread_create(&_thread, NULL, &IoThread::thread_entry, (void*)this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating HTTP I/O thread");
+    _terminated = true;
+    // LCOV_EXCL_STOP
+  }
+}
+
+HttpEngine::IoThread::~IoThread()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = !_terminated;
+  _terminated = true;
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    wake();
+    pthread_join(_thread, NULL);
+  }
+
+  close(_wake_pipe[0]);
+  close(_wake_pipe[1]);
+  curl_multi_cleanup(_multi);
+  pthread_mutex_destroy(&_lock);
+}
+
+void HttpEngine::IoThread::perform(CURL* curl, const Callback& callback)
+{
+  pthread_mutex_lock(&_lock);
+  bool terminated = _terminated;
+  if (!terminated)
+  {
+    _pending.push_back(std::make_pair(curl, callback));
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (terminated)
+  {
+    callback(CURLE_ABORTED_BY_CALLBACK);
+  }
+  else
+  {
+    wake();
+  }
+}
+
+void* HttpEngine::IoThread::thread_entry(void* p)
+{
+  ((IoThread*)p)->run();
+  return NULL;
+}
+
+void HttpEngine::IoThread::run()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    // Start any new requests.
+    while (!_pending.empty())
+    {
+      curl_multi_add_handle(_multi, _pending.front().first);
+      _running.insert(_pending.front());
+      _pending.pop_front();
+    }
+    pthread_mutex_unlock(&_lock);
+
+    // Let cURL do what it can without blocking, then report on the
+    // requests that have completed.  The callbacks may start new
+    // requests, so are called without the lock.
+    int still_running;
+    curl_multi_perform(_multi, &still_running);
+
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(_multi, &msgs_left)) != NULL)
+    {
+      if (msg->msg == CURLMSG_DONE)
+      {
+        CURL* curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        curl_multi_remove_handle(_multi, curl);
+
+        std::map<CURL*, Callback>::iterator i = _running.find(curl);
+        Callback callback = i->second;
+        _running.erase(i);
+        callback(rc);
+      }
+    }
+
+    wait();
+    pthread_mutex_lock(&_lock);
+  }
+
+  // We're terminating, so fail the requests that haven't completed.
+  std::deque<std::pair<CURL*, Callback> > aborted;
+  aborted.swap(_pending);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::map<CURL*, Callback>::iterator i = _running.begin();
+       i != _running.end();
+       ++i)
+  {
+    curl_multi_remove_handle(_multi, i->first);
+    aborted.push_back(*i);
+  }
+  _running.clear();
+
+  for (std::deque<std::pair<CURL*, Callback> >::iterator i = aborted.begin();
+       i != aborted.end();
+       ++i)
+  {
+    i->second(CURLE_ABORTED_BY_CALLBACK);
+  }
+}
+
+/// Wait until cURL has something to do, or there are new requests.
+void HttpEngine::IoThread::wait()
+{
+  // cURL polls its own sockets, so there's no limit on their descriptor
+  // numbers, and we add the wake pipe to the set.  It also caps the wait
+  // at its own timeout.
+  struct curl_waitfd wake_fd;
+  wake_fd.fd = _wake_pipe[0];
+  wake_fd.events = CURL_WAIT_POLLIN;
+  wake_fd.revents = 0;
+
+  int num_fds = 0;
+  curl_multi_wait(_multi, &wake_fd, 1, MAX_WAIT_MS, &num_fds);
+  if (wake_fd.revents & CURL_WAIT_POLLIN)
+  {
+    // Empty the pipe, so it's ready to wake us again.
+    char buf[64];
+    while (read(_wake_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+  }
+}
+
+/// Wake the thread from waiting.
+void HttpEngine::IoThread::wake()
+{
+  // If the pipe is full the thread is being woken anyway, so failing to
+  // write doesn't matter.
+  char c = 0;
+  ssize_t rc = write(_wake_pipe[1], &c, 1);
+  (void)rc;
+}
+
+
+HttpEngine::HttpEngine(int num_threads, long max_host_connections) :
+  _next(0)
+{
+  for (int ii = 0; ii < std::max(num_threads, 1); ++ii)
+  {
+    _threads.push_back(new IoThread(max_host_connections));
+  }
+}
+
+HttpEngine::~HttpEngine()
+{
+  for (size_t ii = 0; ii < _threads.size(); ++ii)
+  {
+    delete _threads[ii];
+  }
+}
+
+void HttpEngine::perform(CURL* curl, const Callback& callback)
+{
+  // Share the requests out between the threads.
+  _threads[_next++ % _threads.size()]->perform(curl, callback);
+}
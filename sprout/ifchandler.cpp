@@ -34,6 +34,8 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <algorithm>
+#include <stdlib.h>
 
 #include "log.h"
 #include "hssconnection.h"
@@ -45,8 +47,9 @@
 using namespace rapidxml;
 
 
-IfcHandler::IfcHandler(HSSConnection* hss) :
-  _hss(hss)
+IfcHandler::IfcHandler(HSSConnection* hss, IfcCache* cache) :
+  _hss(hss),
+  _cache(cache)
 {
 }
 
@@ -60,19 +63,17 @@ IfcHandler::~IfcHandler()
 /// Check whether the message matches the specified filter.
 //
 // @returns true if the message matches, false if not.
-bool IfcHandler::filter_matches(const SessionCase& session_case, pjsip_msg *msg, xml_node<>* ifc)
+bool IfcHandler::filter_matches(const SessionCase& session_case, pjsip_msg *msg, const Ifc& ifc)
 {
-  // TODO: Calculate the message matching properly.
-  return (msg->line.req.method.id == PJSIP_INVITE_METHOD);
+  return ((ifc.trigger == NULL) ||
+          (ifc.trigger->matches(session_case, msg)));
 }
 
 
-/// Determines the list of application servers to apply this message to, given
-// the supplied incoming filter criteria.
-void IfcHandler::calculate_application_servers(const SessionCase& session_case,
-                                               pjsip_msg *msg,
-                                               std::string& ifc_xml,
-                                               std::vector<std::string>& as_list)
+/// Compiles the supplied ServiceProfile into a list of filter criteria in
+// priority order, so that requests can be matched against them without
+// parsing the XML again.  If the document is invalid the list is left empty.
+void IfcHandler::compile_ifcs(std::string& ifc_xml, Ifcs& ifcs)
 {
   xml_document<> ifc_doc;
   try
@@ -92,37 +93,80 @@ void IfcHandler::calculate_application_servers(const SessionCase& session_case,
     return;
   }
 
-  // Spin through the list of filter criteria, checking whether each matches
-  // and adding the application server to the list if so.
+  // Spin through the list of filter criteria, compiling each one that names
+  // an application server.
   for (xml_node<>* ifc = sp->first_node("InitialFilterCriteria");
        ifc;
        ifc = ifc->next_sibling("InitialFilterCriteria"))
   {
-    if (filter_matches(session_case, msg, ifc))
+    xml_node<>* as = ifc->first_node("ApplicationServer");
+    xml_node<>* server_name = (as != NULL) ? as->first_node("ServerName") : NULL;
+    if (server_name)
     {
-      xml_node<>* as = ifc->first_node("ApplicationServer");
-      if (as)
+      Ifc compiled;
+      compiled.server_name = server_name->value();
+
+      xml_node<>* priority = ifc->first_node("Priority");
+      if (priority)
       {
-        xml_node<>* server_name = as->first_node("ServerName");
-        if (server_name)
+        compiled.priority = atoi(priority->value());
+      }
+
+      xml_node<>* tp = ifc->first_node("TriggerPoint");
+      if (tp)
+      {
+        compiled.trigger.reset(TriggerPoint::compile(tp));
+        if (compiled.trigger == NULL)
         {
-          LOG_DEBUG("Found (triggered) server %s", server_name->value());
-          as_list.push_back(server_name->value());
+          // Better to leave out an application server than to invoke it
+          // when it shouldn't be.
+          LOG_WARNING("Ignoring invalid iFC for %s", compiled.server_name.c_str());
+          continue;
         }
       }
+
+      ifcs.push_back(compiled);
     }
   }
+
+  std::stable_sort(ifcs.begin(),
+                   ifcs.end(),
+                   [](const Ifc& a, const Ifc& b) { return a.priority < b.priority; });
+}
+
+
+/// Fetches the served user's iFCs from Homestead and compiles them.
+//
+// @returns NOT_FOUND if Homestead doesn't know the user, or FAILED for any
+// other error, so the cache can use any expired iFCs instead.
+IfcCache::LoadResult IfcHandler::load_ifcs(const std::string& served_user,
+                                           SAS::TrailId trail,
+                                           std::shared_ptr<const Ifcs>& ifcs)
+{
+  LOG_DEBUG("Fetching IFC information for %s", served_user.c_str());
+  std::string ifc_xml;
+  HTTPCode http_rc = _hss->get_user_ifc(served_user, ifc_xml, trail);
+  if (http_rc != HTTP_OK)
+  {
+    return (http_rc == HTTP_NOT_FOUND) ? IfcCache::NOT_FOUND : IfcCache::FAILED;
+  }
+  Ifcs* compiled = new Ifcs();
+  compile_ifcs(ifc_xml, *compiled);
+  ifcs.reset(compiled);
+  return IfcCache::LOADED;
 }
 
 
 /// Get the list of application servers that should apply to this message,
 // by inspecting the relevant subscriber's iFCs. If there are no iFCs,
-// the list will be empty.
+// the list will be empty.  If the iFCs have already been prefetched,
+// they are used if they are for the right subscriber.
 void IfcHandler::lookup_ifcs(const SessionCase& session_case,
                              pjsip_msg *msg,
                              SAS::TrailId trail,
                              std::string& served_user, //< OUT
-                             std::vector<std::string>& application_servers)  //< OUT
+                             std::vector<std::string>& application_servers,  //< OUT
+                             Lookup<std::shared_ptr<const Ifcs> >* prefetched)
 {
   served_user = served_user_from_msg(session_case, msg);
 
@@ -132,15 +176,70 @@ void IfcHandler::lookup_ifcs(const SessionCase& session_case,
   }
   else
   {
-    LOG_DEBUG("Fetching IFC information for %s", served_user.c_str());
-    std::string ifc_xml;
-    if (!_hss->get_user_ifc(served_user, ifc_xml, trail))
+    std::shared_ptr<const Ifcs> ifcs;
+    if (prefetched != NULL)
     {
-      LOG_INFO("No iFC found - no processing will be applied");
+      ifcs = prefetched->get(served_user, [&]()
+      {
+        return get_ifcs(served_user, trail);
+      });
     }
     else
     {
-      calculate_application_servers(session_case, msg, ifc_xml, application_servers);
+      ifcs = get_ifcs(served_user, trail);
+    }
+    match_ifcs(session_case, msg, ifcs, application_servers);
+  }
+}
+
+
+/// Get a subscriber's iFCs, from the cache if possible.  They may be
+// shared with other requests, so must not be changed.
+//
+// @returns the iFCs, or NULL if the subscriber has none.
+std::shared_ptr<const Ifcs> IfcHandler::get_ifcs(const std::string& served_user,
+                                                 SAS::TrailId trail)
+{
+  std::shared_ptr<const Ifcs> ifcs;
+  if (_cache != NULL)
+  {
+    ifcs = _cache->get(served_user, [&](std::shared_ptr<const Ifcs>& loaded) -> IfcCache::LoadResult
+    {
+      return load_ifcs(served_user, trail, loaded);
+    });
+  }
+  else
+  {
+    load_ifcs(served_user, trail, ifcs);
+  }
+  return ifcs;
+}
+
+
+/// Add the application servers whose filter criteria match this message
+// to the list.
+void IfcHandler::match_ifcs(const SessionCase& session_case,
+                            pjsip_msg *msg,
+                            const std::shared_ptr<const Ifcs>& ifcs,
+                            std::vector<std::string>& application_servers)  //< OUT
+{
+  if (ifcs == NULL)
+  {
+    LOG_INFO("No iFC found - no processing will be applied");
+  }
+  else
+  {
+    // Spin through the filter criteria, checking whether each matches
+    // and adding the application server to the list if so.
+    for (Ifcs::const_iterator ifc = ifcs->begin();
+         ifc != ifcs->end();
+         ++ifc)
+    {
+      if (filter_matches(session_case, msg, *ifc))
+      {
+        LOG_DEBUG("Found (triggered) server %s", ifc->server_name.c_str());
+        application_servers.push_back(ifc->server_name);
+      }
     }
   }
 }
@@ -0,0 +1,105 @@
+/**
+ * @file latencytracker.cpp Percentiles of recent request latencies
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <algorithm>
+#include <math.h>
+
+#include "latencytracker.h"
+
+const size_t LatencyTracker::DEFAULT_WINDOW;
+const size_t LatencyTracker::MIN_SAMPLES;
+const size_t LatencyTracker::RECALCULATE_INTERVAL;
+
+LatencyTracker::LatencyTracker(size_t window) :
+  _window(window),
+  _latencies(),
+  _next(0),
+  _sorted(),
+  _since_sort(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+LatencyTracker::~LatencyTracker()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void LatencyTracker::add(double latency_ms)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_latencies.size() < _window)
+  {
+    _latencies.push_back(latency_ms);
+  }
+  else
+  {
+    _latencies[_next] = latency_ms;
+    _next = (_next + 1) % _window;
+  }
+
+  // Recalculate after every latency until there are plenty, so that the
+  // first percentiles are available promptly.
+  if ((++_since_sort >= RECALCULATE_INTERVAL) ||
+      (_latencies.size() <= RECALCULATE_INTERVAL))
+  {
+    _sorted = _latencies;
+    std::sort(_sorted.begin(), _sorted.end());
+    _since_sort = 0;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+double LatencyTracker::percentile(double p)
+{
+  double latency_ms = -1.0;
+
+  pthread_mutex_lock(&_lock);
+  if (_sorted.size() >= MIN_SAMPLES)
+  {
+    // Use the nearest-rank method.
+    size_t rank = (size_t)ceil(p / 100.0 * _sorted.size());
+    latency_ms = _sorted[std::min(std::max(rank, (size_t)1), _sorted.size()) - 1];
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return latency_ms;
+}
@@ -53,16 +53,19 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <functional>
+#include <climits>
 
 #include "localstorefactory.h"
 #include "localstore.h"
+#include "log.h"
 
 namespace RegData {
 
 
-  RegData::Store* create_local_store()
+  RegData::Store* create_local_store(const std::string& log_file)
   {
-    return new LocalStore();
+    return new LocalStore(LocalStore::DEFAULT_SHARDS, log_file);
   }
 
 
@@ -72,42 +75,162 @@ namespace RegData {
   }
 
 
-  LocalStore::LocalStore() :
-    _db()
+  const int LocalStore::DEFAULT_SHARDS;
+
+
+  LocalStore::LocalStore(int num_shards, const std::string& log_file) :
+    _shards(num_shards),
+    _log(NULL),
+    _terminating(false)
   {
+    int now = time(NULL);
+    for (int ii = 0; ii < num_shards; ++ii)
+    {
+      Shard* shard = new Shard;
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->timers = new TimerWheel(now);
+      shard->cas = 0;
+      _shards[ii] = shard;
+    }
+
+    if (log_file != "")
+    {
+      // Pick up the AoRs left by the last run.  They aren't decoded until
+      // they are used, but their timers are set now so they expire on time.
+      _log = new AoRLog(log_file);
+      _log->load(std::bind(&LocalStore::add_loaded,
+                           this,
+                           std::placeholders::_1,
+                           std::placeholders::_2));
+    }
+
+    pthread_mutex_init(&_expiry_lock, NULL);
+    pthread_cond_init(&_expiry_cond, NULL);
+    int rc = pthread_create(&_expiry_thread, NULL, &expiry_thread, (void*)this);
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating binding expiry thread, bindings will only expire when read");
+      // LCOV_EXCL_STOP
+    }
   }
 
 
   LocalStore::~LocalStore()
   {
-    flush_all();
+    pthread_mutex_lock(&_expiry_lock);
+    _terminating = true;
+    pthread_cond_signal(&_expiry_cond);
+    pthread_mutex_unlock(&_expiry_lock);
+    pthread_join(_expiry_thread, NULL);
+    pthread_cond_destroy(&_expiry_cond);
+    pthread_mutex_destroy(&_expiry_lock);
+
+    // The log is kept for the next run, so just empty the shards.
+    delete _log;
+    clear();
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii]->lock);
+      delete _shards[ii]->timers;
+      delete _shards[ii];
+    }
   }
 
 
   void LocalStore::flush_all()
   {
-    _db.clear();
+    clear();
+    if (_log != NULL)
+    {
+      _log->clear();
+    }
+  }
+
+
+  void LocalStore::clear()
+  {
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      Shard* shard = _shards[ii];
+      pthread_mutex_lock(&shard->lock);
+      shard->db.clear();
+      shard->timers->clear();
+      pthread_mutex_unlock(&shard->lock);
+    }
   }
 
 
   AoR* LocalStore::get_aor_data(const std::string& aor_id)
   {
-    LocalAoR* aor_data = new LocalAoR;
-    std::map<std::string, LocalAoR>::iterator i = _db.find(aor_id);
-    if (i != _db.end())
+    std::vector<ExpiredBinding> expired;
+    Shard& shard = shard_for(aor_id);
+
+    pthread_mutex_lock(&shard.lock);
+    LocalAoR* aor_data = copy_aor(shard, aor_id, time(NULL), expired);
+    pthread_mutex_unlock(&shard.lock);
+
+    notify(expired);
+
+    return (AoR*)aor_data;
+  }
+
+
+  void LocalStore::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                      MultiGetCallback callback)
+  {
+    // Group the AoRs by shard.
+    std::vector<std::vector<size_t> > shard_aors(_shards.size());
+    for (size_t ii = 0; ii < aor_ids.size(); ++ii)
     {
-      // AoR is already in database, so expire the bindings then copy
-      // the data.
-      expire_bindings(&i->second, time(NULL));
-      *aor_data = i->second;
+      shard_aors[shard_index(aor_ids[ii])].push_back(ii);
     }
-    else
+
+    int now = time(NULL);
+    std::vector<LocalAoR*> aors;
+    for (size_t ii = 0; ii < shard_aors.size(); ++ii)
     {
-      // AoR is not already in the database, so insert it.
-      _db.insert(std::make_pair(aor_id, *aor_data));
+      if (shard_aors[ii].empty())
+      {
+        continue;
+      }
+
+      std::vector<ExpiredBinding> expired;
+      Shard& shard = *_shards[ii];
+      aors.clear();
+      pthread_mutex_lock(&shard.lock);
+      for (size_t jj = 0; jj < shard_aors[ii].size(); ++jj)
+      {
+        aors.push_back(copy_aor(shard, aor_ids[shard_aors[ii][jj]], now, expired));
+      }
+      pthread_mutex_unlock(&shard.lock);
+
+      notify(expired);
+
+      for (size_t jj = 0; jj < aors.size(); ++jj)
+      {
+        callback(aor_ids[shard_aors[ii][jj]], (AoR*)aors[jj]);
+      }
     }
+  }
 
-    return (AoR*)aor_data;
+
+  /// Copy an AoR out of its shard, giving an empty AoR with no CAS if it
+  /// doesn't exist or has no live bindings.  Must be called with the shard
+  /// lock held.
+  LocalAoR* LocalStore::copy_aor(Shard& shard,
+                                 const std::string& aor_id,
+                                 int now,
+                                 std::vector<ExpiredBinding>& expired)
+  {
+    LocalAoR* aor_data = new LocalAoR;
+    Entries::iterator i = shard.db.find(aor_id);
+    if ((i != shard.db.end()) &&
+        (!expire(shard, i, now, expired)))
+    {
+      *aor_data = i->second.aor_data;
+    }
+    return aor_data;
   }
 
 
@@ -117,22 +240,227 @@ namespace RegData {
     LocalAoR* aor_data = (LocalAoR*)(data);
     if (aor_data != NULL)
     {
-      std::map<std::string, LocalAoR>::iterator i = _db.find(aor_id);
+      int now = time(NULL);
+      Shard& shard = shard_for(aor_id);
 
-      if (i != _db.end())
+      pthread_mutex_lock(&shard.lock);
+      Entries::iterator i = shard.db.find(aor_id);
+
+      // The write succeeds if the AoR is unchanged since it was read,
+      // including if it didn't exist then and still doesn't.
+      if ((i != shard.db.end()) ?
+          (aor_data->get_cas() == i->second.aor_data.get_cas()) :
+          (aor_data->get_cas() == 0))
       {
-        if (aor_data->get_cas() == i->second.get_cas())
+        aor_data->set_cas(++shard.cas);
+        if (i == shard.db.end())
         {
-          // CAS is unchanged, so increment the CAS and update the data.
-          aor_data->set_cas(aor_data->get_cas() + 1);
-          i->second = *aor_data;
-          rc = true;
+          i = shard.db.insert(std::make_pair(aor_id, Entry())).first;
         }
+        i->second.aor_data = *aor_data;
+        i->second.loaded = true;
+
+        // Bindings that have already expired are being removed by the
+        // caller, so drop them without telling the expiry listener.
+        expire_bindings(&i->second.aor_data, now);
+        update_timer(shard, i);
+        rc = true;
       }
+      pthread_mutex_unlock(&shard.lock);
     }
 
     return rc;
   }
 
+
+  /// Add an AoR found in the log on startup.
+  void LocalStore::add_loaded(const std::string& aor_id, int next_expiry)
+  {
+    Shard& shard = shard_for(aor_id);
+    Entry& entry = shard.db[aor_id];
+    entry.aor_data.set_cas(++shard.cas);
+    entry.loaded = false;
+    entry.next_expiry = next_expiry;
+    entry.timer = shard.timers->schedule(aor_id, next_expiry);
+  }
+
+
+  void LocalStore::expire_all(int now)
+  {
+    std::vector<ExpiredBinding> expired;
+    std::vector<std::string> aor_ids;
+
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      Shard& shard = *_shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      shard.timers->pop_expired(now, aor_ids);
+      for (size_t jj = 0; jj < aor_ids.size(); ++jj)
+      {
+        // The popped timer has gone, so forget it before expiring the AoR.
+        // Every entry has a timer, so the AoR must still be there.
+        Entries::iterator i = shard.db.find(aor_ids[jj]);
+        i->second.timer = NULL;
+        expire(shard, i, now, expired);
+      }
+      pthread_mutex_unlock(&shard.lock);
+      aor_ids.clear();
+    }
+
+    notify(expired);
+  }
+
+
+  size_t LocalStore::shard_index(const std::string& aor_id)
+  {
+    return std::hash<std::string>()(aor_id) % _shards.size();
+  }
+
+
+  LocalStore::Shard& LocalStore::shard_for(const std::string& aor_id)
+  {
+    return *_shards[shard_index(aor_id)];
+  }
+
+
+  /// Remove an AoR's expired bindings, noting them in expired.  Removes the
+  /// AoR altogether, returning true, if it has no bindings left.  Must be
+  /// called with the shard lock held.
+  bool LocalStore::expire(Shard& shard,
+                          Entries::iterator i,
+                          int now,
+                          std::vector<ExpiredBinding>& expired)
+  {
+    Entry& entry = i->second;
+    if (!entry.loaded)
+    {
+      // First use since startup, so read the bindings from the log.  If the
+      // record is missing or corrupt the AoR is left with no bindings, so
+      // gets removed.
+      entry.loaded = true;
+      if (!_log->read(i->first, &entry.aor_data))
+      {
+        LOG_ERROR("Failed to load registration data for %s", i->first.c_str());
+        entry.aor_data.clear();
+        return update_timer(shard, i);
+      }
+    }
+
+    if (now < entry.next_expiry)
+    {
+      // Nothing can have expired yet.
+      return false;
+    }
+
+    for (AoR::Bindings::const_iterator j = entry.aor_data.bindings().begin();
+         j != entry.aor_data.bindings().end();
+         ++j)
+    {
+      if (j->second->_expires <= now)
+      {
+        ExpiredBinding eb;
+        eb.aor_id = i->first;
+        eb.binding_id = j->first;
+        eb.binding = *j->second;
+        expired.push_back(eb);
+      }
+    }
+    expire_bindings(&entry.aor_data, now);
+
+    return update_timer(shard, i);
+  }
+
+
+  /// Make sure an AoR's timer is set for its earliest binding expiry,
+  /// removing the AoR altogether, and returning true, if it has no bindings.
+  /// Called whenever an AoR changes, so also writes it to the log.  Must be
+  /// called with the shard lock held.
+  bool LocalStore::update_timer(Shard& shard, Entries::iterator i)
+  {
+    Entry& entry = i->second;
+    if (_log != NULL)
+    {
+      _log->write(i->first, &entry.aor_data);
+    }
+
+    const AoR::Bindings& bindings = entry.aor_data.bindings();
+    int next_expiry = INT_MAX;
+    for (AoR::Bindings::const_iterator j = bindings.begin();
+         j != bindings.end();
+         ++j)
+    {
+      next_expiry = std::min(next_expiry, j->second->_expires);
+    }
+
+    if ((entry.timer != NULL) &&
+        (bindings.empty() || (entry.timer->expiry != next_expiry)))
+    {
+      shard.timers->cancel(entry.timer);
+      entry.timer = NULL;
+    }
+
+    if (bindings.empty())
+    {
+      shard.db.erase(i);
+      return true;
+    }
+
+    entry.next_expiry = next_expiry;
+    if (entry.timer == NULL)
+    {
+      entry.timer = shard.timers->schedule(i->first, next_expiry);
+    }
+    return false;
+  }
+
+
+  /// Tell the expiry listener about expired bindings.  Called without any
+  /// shard lock held.
+  void LocalStore::notify(const std::vector<ExpiredBinding>& expired)
+  {
+    if (_expiry_listener != NULL)
+    {
+      for (size_t ii = 0; ii < expired.size(); ++ii)
+      {
+        _expiry_listener->binding_expired(expired[ii].aor_id,
+                                          expired[ii].binding_id,
+                                          expired[ii].binding);
+      }
+    }
+  }
+
+
+  void* LocalStore::expiry_thread(void* p)
+  {
+    ((LocalStore*)p)->expiry_loop();
+    return NULL;
+  }
+
+
+  void LocalStore::expiry_loop()
+  {
+    pthread_mutex_lock(&_expiry_lock);
+    while (!_terminating)
+    {
+      struct timespec next;
+      clock_gettime(CLOCK_REALTIME, &next);
+      next.tv_sec += 1;
+      pthread_cond_timedwait(&_expiry_cond, &_expiry_lock, &next);
+
+      if (!_terminating)
+      {
+        pthread_mutex_unlock(&_expiry_lock);
+        int now = time(NULL);
+        expire_all(now);
+        if (_log != NULL)
+        {
+          _log->maybe_compact(now);
+        }
+        pthread_mutex_lock(&_expiry_lock);
+      }
+    }
+    pthread_mutex_unlock(&_expiry_lock);
+  }
+
 } // namespace RegData
 
@@ -0,0 +1,101 @@
+/**
+ * @file lookups.cpp Implementation of the LookupPool class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "lookups.h"
+
+const int LookupPool::DEFAULT_MAX_QUEUE;
+
+LookupPool::LookupPool(int num_threads, int max_queue) :
+  _q(max_queue),
+  _threads()
+{
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &LookupPool::thread_entry, (void*)this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating lookup thread");
+      // LCOV_EXCL_STOP
+    }
+  }
+}
+
+LookupPool::~LookupPool()
+{
+  // Stop the threads once they've finished the lookups in progress.
+  // Lookups still waiting for a thread are dropped.
+  _q.terminate();
+  for (size_t ii = 0; ii < _threads.size(); ++ii)
+  {
+    pthread_join(_threads[ii], NULL);
+  }
+}
+
+bool LookupPool::run(const std::function<void()>& fn)
+{
+  if (_threads.empty())
+  {
+    // No threads to run it on, so run it now.
+    fn();
+    return true;
+  }
+  return _q.push_noblock(fn);
+}
+
+void* LookupPool::thread_entry(void* p)
+{
+  ((LookupPool*)p)->process_lookups();
+  return NULL;
+}
+
+void LookupPool::process_lookups()
+{
+  std::function<void()> fn;
+  while (_q.pop(fn))
+  {
+    fn();
+    fn = NULL;
+  }
+}
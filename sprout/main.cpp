@@ -55,6 +55,8 @@ extern "C" {
 #include <list>
 #include <queue>
 #include <string>
+#include <fstream>
+#include <algorithm>
 
 
 #include "logger.h"
@@ -72,6 +74,13 @@ extern "C" {
 #include "options.h"
 #include "memcachedstorefactory.h"
 #include "localstorefactory.h"
+#include "shmstorefactory.h"
+#include "aorcache.h"
+#include "ifccache.h"
+#include "digestcache.h"
+#include "lookups.h"
+#include "httpengine.h"
+#include "statistic.h"
 #include "enumservice.h"
 #include "bgcfservice.h"
 #include "pjutils.h"
@@ -97,8 +106,26 @@ struct options
   std::string            auth_config;
   std::string            sas_server;
   std::string            hss_server;
+  int                    ifc_cache_size;
+  int                    ifc_cache_ttl;
+  int                    ifc_cache_negative_ttl;
+  int                    digest_cache_size;
+  int                    digest_cache_ttl;
+  int                    digest_cache_negative_ttl;
+  int                    lookup_threads;
+  int                    http_threads;
+  int                    http_failure_percent;
   std::string            xdm_server;
   std::string            store_servers;
+  std::string            store_servers_file;
+  int                    store_replicas;
+  int                    store_cache_size;
+  int                    store_cache_ttl;
+  std::string            local_store_file;
+  std::string            shm_store;
+  int                    reg_max_expires;
+  int                    reg_overload_max_expires;
+  int                    reg_expiry_jitter;
   std::string            enum_server;
   std::string            enum_suffix;
   std::string            enum_file;
@@ -115,6 +142,7 @@ struct options
 
 
 static pj_bool_t quit_flag = PJ_FALSE;
+static volatile sig_atomic_t reload_flag = 0;
 
 
 static void usage(void)
@@ -139,12 +167,65 @@ static void usage(void)
        "                            Use authentication\n"
        " -R, --realm <realm>        Use specified realm for authentication\n"
        "                            (if not specified, local host name is used)\n"
+       "     --digest-cache <entries>[:<ttl ms>[:<unknown user ttl ms>]]\n"
+       "                            Cache up to this many digest credentials\n"
+       "                            (default: 10000, or 0 to disable), each for the\n"
+       "                            specified time (default: 60000ms), or if the\n"
+       "                            user is unknown for the second time (default:\n"
+       "                            5000ms).  Password changes may not take effect\n"
+       "                            for this long.\n"
        " -M, --memstore <servers>   Use memcached store on comma-separated list of\n"
        "                            servers for registration state\n"
        "                            (otherwise uses local store)\n"
+       "     --memstore-file <file> Read the memcached servers from a file, separated\n"
+       "                            by commas or newlines, instead.  Sending SIGHUP\n"
+       "                            rereads the file, so servers can be added or\n"
+       "                            removed without a restart\n"
+       "     --memstore-replicas <n>\n"
+       "                            Store each registration on this many memcached\n"
+       "                            servers (default: 1)\n"
+       "     --memstore-cache <entries>[:<ttl ms>]\n"
+       "                            Cache up to this many AoRs read from or written\n"
+       "                            to the memcached store, each for the specified\n"
+       "                            time (default: 1000ms).  Other nodes' changes\n"
+       "                            may not be seen for this long.\n"
+       "     --local-store-file <file>\n"
+       "                            Keep the local store's registrations in this\n"
+       "                            file so they survive a restart\n"
+       "     --shm-store <name>     Use a store in the named POSIX shared memory\n"
+       "                            segment (e.g., /sprout-regdata), shared by all\n"
+       "                            the sprout processes on this host\n"
+       "     --reg-expires <max>[:<overload max>[:<jitter %>]]\n"
+       "                            Grant registrations for at most this many\n"
+       "                            seconds (default: 300), rising to the overload\n"
+       "                            maximum (default: 600, or the maximum if that\n"
+       "                            is higher) when REGISTERs are queueing.  Granted\n"
+       "                            expiries are shortened by up to the jitter\n"
+       "                            percentage (default: 10) to spread out refreshes\n"
        " -S, --sas <ipv4>           Use specified host as software assurance\n"
        "                            server.  Otherwise uses localhost\n"
        " -H, --hss <server>         Name/IP address of HSS server\n"
+       "     --ifc-cache <entries>[:<ttl ms>[:<no iFC ttl ms>]]\n"
+       "                            Cache the iFCs of up to this many subscribers\n"
+       "                            (default: 10000, or 0 to disable), each for the\n"
+       "                            specified time (default: 10000ms), or if they\n"
+       "                            have none for the second time (default: 1000ms).\n"
+       "                            Service profile changes may not take effect for\n"
+       "                            this long.\n"
+       "     --lookup-threads N     Number of threads for running the HSS, XDMS,\n"
+       "                            ENUM and registration store lookups for a\n"
+       "                            request concurrently (default: 4, or 0 to run\n"
+       "                            them one after another).  Each thread blocks\n"
+       "                            on one lookup at a time, so a busy node may\n"
+       "                            need more\n"
+       "     --http-threads N       Number of threads making requests to the HSS and\n"
+       "                            XDMS, sharing connections (default: 1, or 0 for\n"
+       "                            each worker thread to have its own connections)\n"
+       "     --http-failure-ratio <percent>\n"
+       "                            Stop sending requests to the HSS or XDMS for a\n"
+       "                            while once this percentage of them are failing,\n"
+       "                            failing lookups straight away instead (default:\n"
+       "                            50, or 0 to always send them)\n"
        " -X, --xdms <server>        Name/IP address of XDM server\n"
        " -E, --enum <server>        Name/IP address of ENUM server (default: 127.0.0.1)\n"
        " -x, --enum-suffix <suffix> Suffix appended to ENUM domains (default: .e164.arpa)\n"
@@ -163,6 +244,22 @@ static void usage(void)
 }
 
 
+/// Values for options that have no short form.
+enum
+{
+  OPT_MEMSTORE_CACHE = 256,
+  OPT_MEMSTORE_FILE,
+  OPT_MEMSTORE_REPLICAS,
+  OPT_LOCAL_STORE_FILE,
+  OPT_SHM_STORE,
+  OPT_REG_EXPIRES,
+  OPT_IFC_CACHE,
+  OPT_LOOKUP_THREADS,
+  OPT_HTTP_THREADS,
+  OPT_HTTP_FAILURE_RATIO,
+  OPT_DIGEST_CACHE
+};
+
 static pj_status_t init_options(int argc, char *argv[], struct options *options)
 {
   struct pj_getopt_option long_opt[] = {
@@ -178,8 +275,19 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
     { "auth",              required_argument, 0, 'A'},
     { "realm",             required_argument, 0, 'R'},
     { "memstore",          required_argument, 0, 'M'},
+    { "memstore-cache",    required_argument, 0, OPT_MEMSTORE_CACHE},
+    { "memstore-file",     required_argument, 0, OPT_MEMSTORE_FILE},
+    { "memstore-replicas", required_argument, 0, OPT_MEMSTORE_REPLICAS},
+    { "local-store-file",  required_argument, 0, OPT_LOCAL_STORE_FILE},
+    { "shm-store",         required_argument, 0, OPT_SHM_STORE},
+    { "reg-expires",       required_argument, 0, OPT_REG_EXPIRES},
     { "sas",               required_argument, 0, 'S'},
     { "hss",               required_argument, 0, 'H'},
+    { "ifc-cache",         required_argument, 0, OPT_IFC_CACHE},
+    { "digest-cache",      required_argument, 0, OPT_DIGEST_CACHE},
+    { "lookup-threads",    required_argument, 0, OPT_LOOKUP_THREADS},
+    { "http-threads",      required_argument, 0, OPT_HTTP_THREADS},
+    { "http-failure-ratio", required_argument, 0, OPT_HTTP_FAILURE_RATIO},
     { "xdms",              required_argument, 0, 'X'},
     { "enum",              required_argument, 0, 'E'},
     { "enum-suffix",       required_argument, 0, 'x'},
@@ -274,6 +382,61 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       fprintf(stdout, "Using memcached store on servers %s\n", pj_optarg);
       break;
 
+    case OPT_MEMSTORE_FILE:
+      options->store_servers_file = std::string(pj_optarg);
+      fprintf(stdout, "Reading memcached servers from %s\n", pj_optarg);
+      break;
+
+    case OPT_MEMSTORE_REPLICAS:
+      options->store_replicas = atoi(pj_optarg);
+      fprintf(stdout, "Storing registrations on %d memcached servers\n",
+              options->store_replicas);
+      break;
+
+    case OPT_MEMSTORE_CACHE:
+      {
+        std::vector<std::string> cache_options;
+        Utils::split_string(std::string(pj_optarg), ':', cache_options, 0, false);
+        options->store_cache_size = atoi(cache_options[0].c_str());
+        if (cache_options.size() > 1)
+        {
+          options->store_cache_ttl = atoi(cache_options[1].c_str());
+        }
+        fprintf(stdout, "Caching up to %d AoRs from memcached store for %dms\n",
+                options->store_cache_size, options->store_cache_ttl);
+      }
+      break;
+
+    case OPT_LOCAL_STORE_FILE:
+      options->local_store_file = std::string(pj_optarg);
+      fprintf(stdout, "Keeping local store registrations in %s\n", pj_optarg);
+      break;
+
+    case OPT_SHM_STORE:
+      options->shm_store = std::string(pj_optarg);
+      fprintf(stdout, "Using shared memory store %s\n", pj_optarg);
+      break;
+
+    case OPT_REG_EXPIRES:
+      {
+        std::vector<std::string> expires_options;
+        Utils::split_string(std::string(pj_optarg), ':', expires_options, 0, false);
+        options->reg_max_expires = atoi(expires_options[0].c_str());
+        if (expires_options.size() > 1)
+        {
+          options->reg_overload_max_expires = atoi(expires_options[1].c_str());
+        }
+        if (expires_options.size() > 2)
+        {
+          options->reg_expiry_jitter = atoi(expires_options[2].c_str());
+        }
+        fprintf(stdout, "Granting registrations for up to %ds (%ds when overloaded), less up to %d%%\n",
+                options->reg_max_expires,
+                std::max(options->reg_max_expires, options->reg_overload_max_expires),
+                options->reg_expiry_jitter);
+      }
+      break;
+
     case 'S':
       options->sas_server = std::string(pj_optarg);
       fprintf(stdout, "SAS set to %s\n", pj_optarg);
@@ -284,6 +447,60 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       fprintf(stdout, "HSS server set to %s\n", pj_optarg);
       break;
 
+    case OPT_IFC_CACHE:
+      {
+        std::vector<std::string> cache_options;
+        Utils::split_string(std::string(pj_optarg), ':', cache_options, 0, false);
+        options->ifc_cache_size = atoi(cache_options[0].c_str());
+        if (cache_options.size() > 1)
+        {
+          options->ifc_cache_ttl = atoi(cache_options[1].c_str());
+        }
+        if (cache_options.size() > 2)
+        {
+          options->ifc_cache_negative_ttl = atoi(cache_options[2].c_str());
+        }
+        fprintf(stdout, "Caching iFCs for up to %d subscribers for %dms (%dms if they have none)\n",
+                options->ifc_cache_size, options->ifc_cache_ttl,
+                options->ifc_cache_negative_ttl);
+      }
+      break;
+
+    case OPT_DIGEST_CACHE:
+      {
+        std::vector<std::string> cache_options;
+        Utils::split_string(std::string(pj_optarg), ':', cache_options, 0, false);
+        options->digest_cache_size = atoi(cache_options[0].c_str());
+        if (cache_options.size() > 1)
+        {
+          options->digest_cache_ttl = atoi(cache_options[1].c_str());
+        }
+        if (cache_options.size() > 2)
+        {
+          options->digest_cache_negative_ttl = atoi(cache_options[2].c_str());
+        }
+        fprintf(stdout, "Caching up to %d digests for %dms (%dms for unknown users)\n",
+                options->digest_cache_size, options->digest_cache_ttl,
+                options->digest_cache_negative_ttl);
+      }
+      break;
+
+    case OPT_LOOKUP_THREADS:
+      options->lookup_threads = atoi(pj_optarg);
+      fprintf(stdout, "Use %d lookup threads\n", options->lookup_threads);
+      break;
+
+    case OPT_HTTP_THREADS:
+      options->http_threads = atoi(pj_optarg);
+      fprintf(stdout, "Use %d HTTP threads\n", options->http_threads);
+      break;
+
+    case OPT_HTTP_FAILURE_RATIO:
+      options->http_failure_percent = atoi(pj_optarg);
+      fprintf(stdout, "Stop sending HTTP requests when %d%% fail\n",
+              options->http_failure_percent);
+      break;
+
     case 'X':
       options->xdm_server = std::string(pj_optarg);
       fprintf(stdout, "XDM server set to %s\n", pj_optarg);
@@ -393,6 +610,52 @@ int daemonize()
 }
 
 
+// Read a list of memcached servers, separated by commas or newlines, from a
+// file.  Returns an empty string if the file can't be read.
+static std::string read_store_servers(const std::string& file)
+{
+  std::string servers;
+  std::ifstream fs(file.c_str());
+  std::string line;
+  while (std::getline(fs, line))
+  {
+    Utils::trim(line);
+    if (line != "")
+    {
+      servers += (servers != "") ? "," + line : line;
+    }
+  }
+  return servers;
+}
+
+
+// SIGHUP handler, which asks the main loop to reread the memcached servers.
+void reload_handler(int sig)
+{
+  reload_flag = 1;
+}
+
+
+// Reread the memcached servers, and update the store if they've changed.
+static void reload_store_servers(struct options* opt, RegData::Store* store)
+{
+  std::string servers = read_store_servers(opt->store_servers_file);
+  if (servers == "")
+  {
+    LOG_ERROR("Failed to read memcached servers from %s, keeping %s",
+              opt->store_servers_file.c_str(), opt->store_servers.c_str());
+  }
+  else if (servers != opt->store_servers)
+  {
+    LOG_STATUS("Changing memcached servers to %s", servers.c_str());
+    opt->store_servers = servers;
+    std::list<std::string> server_list;
+    Utils::split_string(servers, ',', server_list, 0, true);
+    RegData::set_memcached_store_servers(store, server_list);
+  }
+}
+
+
 // Exception handler that simply dumps the stack and then crashes out.
 void exception_handler(int sig)
 {
@@ -419,9 +682,15 @@ int main(int argc, char *argv[])
   XDMConnection* xdm_connection = NULL;
   CallServices* call_services = NULL;
   IfcHandler* ifc_handler = NULL;
+  IfcCache* ifc_cache = NULL;
+  Statistic* ifc_cache_stat = NULL;
+  DigestCache* digest_cache = NULL;
+  Statistic* digest_cache_stat = NULL;
   AnalyticsLogger* analytics_logger = NULL;
   EnumService* enum_service = NULL;
   BgcfService* bgcf_service = NULL;
+  LookupPool* lookup_pool = NULL;
+  HttpEngine* http_engine = NULL;
 
   // Set up our exception signal handler for asserts and segfaults.
   signal(SIGABRT, exception_handler);
@@ -441,8 +710,26 @@ int main(int argc, char *argv[])
   // opt.auth_realm = "";
   // opt.auth_config = "";
   // opt.store_servers = "";
+  // opt.store_servers_file = "";
+  opt.store_replicas = 1;
+  opt.store_cache_size = 0;
+  opt.store_cache_ttl = 1000;
+  // opt.local_store_file = "";
+  // opt.shm_store = "";
+  opt.reg_max_expires = ExpiryPolicy::DEFAULT_MAX_EXPIRES;
+  opt.reg_overload_max_expires = 2 * ExpiryPolicy::DEFAULT_MAX_EXPIRES;
+  opt.reg_expiry_jitter = 10;
   opt.sas_server = "127.0.0.1";
   // opt.hss_server = "";
+  opt.ifc_cache_size = 10000;
+  opt.ifc_cache_ttl = 10000;
+  opt.ifc_cache_negative_ttl = 1000;
+  opt.digest_cache_size = 10000;
+  opt.digest_cache_ttl = 60000;
+  opt.digest_cache_negative_ttl = 5000;
+  opt.lookup_threads = 4;
+  opt.http_threads = 1;
+  opt.http_failure_percent = 50;
   // opt.xdm_server = "";
   opt.enum_server = "127.0.0.1";
   opt.enum_suffix = ".e164.arpa";
@@ -493,6 +780,16 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (opt.store_servers_file != "")
+  {
+    opt.store_servers = read_store_servers(opt.store_servers_file);
+    if (opt.store_servers == "")
+    {
+      LOG_ERROR("Failed to read memcached servers from %s", opt.store_servers_file.c_str());
+      return 1;
+    }
+  }
+
   if ((opt.store_servers != "") &&
       (opt.auth_enabled) &&
       (opt.worker_threads == 1))
@@ -540,19 +837,44 @@ int main(int argc, char *argv[])
   }
 
   RegData::Store* registrar_store = NULL;
+  Statistic* store_cache_stat = NULL;
   if (opt.store_servers != "")
   {
     // Use memcached store.
     LOG_STATUS("Using memcached store");
     std::list<std::string> servers;
     Utils::split_string(opt.store_servers, ',', servers, 0, true);
-    registrar_store = RegData::create_memcached_store(servers, 100);
+    RegData::AoRCache* store_cache = NULL;
+    if (opt.store_cache_size > 0)
+    {
+      store_cache_stat = new Statistic("memstore_cache");
+      store_cache = new RegData::AoRCache(opt.store_cache_size,
+                                          opt.store_cache_ttl,
+                                          store_cache_stat);
+    }
+    registrar_store = RegData::create_memcached_store(servers,
+                                                      4,
+                                                      store_cache,
+                                                      opt.store_replicas,
+                                                      std::max(opt.reg_max_expires,
+                                                               opt.reg_overload_max_expires));
+
+    if (opt.store_servers_file != "")
+    {
+      signal(SIGHUP, reload_handler);
+    }
+  }
+  else if (opt.shm_store != "")
+  {
+    // Use a store shared with the other processes on this host.
+    LOG_STATUS("Using shared memory store %s", opt.shm_store.c_str());
+    registrar_store = RegData::create_shm_store(opt.shm_store);
   }
   else
   {
     // Use local store.
     LOG_STATUS("Using local store");
-    registrar_store = RegData::create_local_store();
+    registrar_store = RegData::create_local_store(opt.local_store_file);
   }
 
   if (registrar_store == NULL)
@@ -561,18 +883,31 @@ int main(int argc, char *argv[])
     exit(0);
   }
 
+  if ((opt.http_threads > 0) &&
+      ((opt.hss_server != "") || (opt.xdm_server != "")))
+  {
+    // Create an engine to make HTTP requests asynchronously, so they can
+    // share a small number of connections.
+    LOG_STATUS("Creating %d HTTP threads", opt.http_threads);
+    http_engine = new HttpEngine(opt.http_threads);
+  }
+
   if (opt.hss_server != "")
   {
     // Create a connection to the HSS.
     LOG_STATUS("Creating connection to HSS %s", opt.hss_server.c_str());
-    hss_connection = new HSSConnection(opt.hss_server);
+    hss_connection = new HSSConnection(opt.hss_server,
+                                       http_engine,
+                                       opt.http_failure_percent / 100.0);
   }
 
   if (opt.xdm_server != "")
   {
     // Create a connection to the XDMS.
     LOG_STATUS("Creating connection to XDMS %s", opt.xdm_server.c_str());
-    xdm_connection = new XDMConnection(opt.xdm_server);
+    xdm_connection = new XDMConnection(opt.xdm_server,
+                                       http_engine,
+                                       opt.http_failure_percent / 100.0);
   }
 
   if (xdm_connection != NULL)
@@ -584,7 +919,15 @@ int main(int argc, char *argv[])
   if (hss_connection != NULL)
   {
     LOG_STATUS("Initializing iFC handler");
-    ifc_handler = new IfcHandler(hss_connection);
+    if (opt.ifc_cache_size > 0)
+    {
+      ifc_cache_stat = new Statistic("ifc_cache");
+      ifc_cache = new IfcCache(opt.ifc_cache_size,
+                               opt.ifc_cache_ttl,
+                               opt.ifc_cache_negative_ttl,
+                               ifc_cache_stat);
+    }
+    ifc_handler = new IfcHandler(hss_connection, ifc_cache);
   }
 
   // Initialise the OPTIONS handling module.
@@ -597,7 +940,15 @@ int main(int argc, char *argv[])
       opt.auth_realm = opt.local_host;
     }
     LOG_STATUS("Enabling %s authentication", opt.auth_config.c_str());
-    status = init_authentication(opt.auth_realm, false, opt.auth_config, hss_connection, analytics_logger);
+    if (opt.digest_cache_size > 0)
+    {
+      digest_cache_stat = new Statistic("digest_cache");
+      digest_cache = new DigestCache(opt.digest_cache_size,
+                                     opt.digest_cache_ttl,
+                                     opt.digest_cache_negative_ttl,
+                                     digest_cache_stat);
+    }
+    status = init_authentication(opt.auth_realm, false, opt.auth_config, hss_connection, digest_cache, analytics_logger);
   }
 
   if (!opt.edge_proxy)
@@ -612,6 +963,14 @@ int main(int argc, char *argv[])
       enum_service = new DNSEnumService(opt.enum_server, opt.enum_suffix);
     }
     bgcf_service = new BgcfService();
+
+    if (opt.lookup_threads > 0)
+    {
+      // Create a pool of threads to run the lookups for each request
+      // concurrently.
+      LOG_STATUS("Creating %d lookup threads", opt.lookup_threads);
+      lookup_pool = new LookupPool(opt.lookup_threads);
+    }
   }
 
   status = init_stateful_proxy(registrar_store,
@@ -625,7 +984,8 @@ int main(int argc, char *argv[])
                                opt.trusted_hosts,
                                analytics_logger,
                                enum_service,
-                               bgcf_service);
+                               bgcf_service,
+                               lookup_pool);
   if (status != PJ_SUCCESS)
   {
     LOG_ERROR("Error initializing stateful proxy, %s",
@@ -635,9 +995,16 @@ int main(int argc, char *argv[])
 
   // An edge proxy doesn't handle registrations, it passes them through.
   pj_bool_t registrar_enabled = !opt.edge_proxy;
+  Statistic* registration_stat = NULL;
+  ExpiryPolicy* expiry_policy = NULL;
   if (registrar_enabled)
   {
-    status = init_registrar(registrar_store, analytics_logger);
+    registration_stat = new Statistic("registration_rate");
+    expiry_policy = new ExpiryPolicy(opt.reg_max_expires,
+                                     opt.reg_overload_max_expires,
+                                     opt.reg_expiry_jitter,
+                                     registration_stat);
+    status = init_registrar(registrar_store, analytics_logger, expiry_policy);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error initializing registrar, %s",
@@ -670,6 +1037,12 @@ int main(int argc, char *argv[])
 
   while (!quit_flag)
   {
+    if (reload_flag)
+    {
+      reload_flag = 0;
+      reload_store_servers(&opt, registrar_store);
+    }
+
     if (opt.daemon || !opt.interactive)
     {
       sleep(10);
@@ -713,6 +1086,8 @@ int main(int argc, char *argv[])
   if (registrar_enabled)
   {
     destroy_registrar();
+    delete expiry_policy;
+    delete registration_stat;
   }
   if (websockets_enabled)
   {
@@ -722,11 +1097,19 @@ int main(int argc, char *argv[])
   if (opt.auth_enabled)
   {
     destroy_authentication();
+    delete digest_cache;
+    delete digest_cache_stat;
   }
   destroy_options();
   destroy_stack();
 
+  // Lookups use the services below, so stop them first.  Then stop the
+  // HTTP engine, which completes any requests still in progress.
+  delete lookup_pool;
+  delete http_engine;
   delete ifc_handler;
+  delete ifc_cache;
+  delete ifc_cache_stat;
   delete call_services;
   delete hss_connection;
   delete xdm_connection;
@@ -737,10 +1120,15 @@ int main(int argc, char *argv[])
   {
     RegData::destroy_memcached_store(registrar_store);
   }
+  else if (opt.shm_store != "")
+  {
+    RegData::destroy_shm_store(registrar_store);
+  }
   else
   {
     RegData::destroy_local_store(registrar_store);
   }
+  delete store_cache_stat;
 
   return 0;
 }
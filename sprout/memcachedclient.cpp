@@ -0,0 +1,1141 @@
+/**
+ * @file @file memcachedclient.cpp Asynchronous, pipelined memcached client
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "memcachedclient.h"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <endian.h>
+
+#include "log.h"
+
+// Memcached binary protocol constants.
+static const uint8_t REQUEST_MAGIC = 0x80;
+static const uint8_t RESPONSE_MAGIC = 0x81;
+static const size_t HEADER_LENGTH = 24;
+
+static const uint8_t OP_GET = 0x00;
+static const uint8_t OP_SET = 0x01;
+static const uint8_t OP_ADD = 0x02;
+static const uint8_t OP_FLUSH = 0x08;
+static const uint8_t OP_NOOP = 0x0a;
+static const uint8_t OP_GETKQ = 0x0d;
+
+static const uint16_t STATUS_OK = 0x0000;
+static const uint16_t STATUS_KEY_NOT_FOUND = 0x0001;
+static const uint16_t STATUS_KEY_EXISTS = 0x0002;
+
+/// How often the reader threads check for timed out requests.
+static const int POLL_INTERVAL_MS = 50;
+
+const int MemcachedClient::DEFAULT_TIMEOUT_MS;
+const int MemcachedClient::RECONNECT_INTERVAL_MS;
+const int MemcachedClient::POINTS_PER_SERVER;
+const int MemcachedClient::RETIRE_DELAY_MS;
+
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// Jenkins' one-at-a-time hash, used both for keys and for placing servers'
+/// points on the ring.
+static uint32_t one_at_a_time(const std::string& key)
+{
+  uint32_t value = 0;
+  for (const char* ptr = key.data(); ptr < key.data() + key.length(); ++ptr)
+  {
+    value += (uint32_t)*ptr;
+    value += (value << 10);
+    value ^= (value >> 6);
+  }
+  value += (value << 3);
+  value ^= (value >> 11);
+  value += (value << 15);
+  return value;
+}
+
+static MemcachedClient::Status to_status(uint16_t status)
+{
+  switch (status)
+  {
+    case STATUS_OK:            return MemcachedClient::OK;
+    case STATUS_KEY_NOT_FOUND: return MemcachedClient::NOT_FOUND;
+    case STATUS_KEY_EXISTS:    return MemcachedClient::EXISTS;
+    default:                   return MemcachedClient::ERROR;
+  }
+}
+
+MemcachedClient::MemcachedClient(const std::list<std::string>& servers,
+                                 int connections,
+                                 int timeout_ms,
+                                 int replicas) :
+  _connections_per_server(connections),
+  _timeout_ms(timeout_ms),
+  _replicas(replicas),
+  _servers(),
+  _retired(),
+  _ring(),
+  _old_ring(),
+  _migration_end_ms(0)
+{
+  pthread_rwlock_init(&_lock, NULL);
+  build_ring(servers, _ring);
+}
+
+MemcachedClient::~MemcachedClient()
+{
+  for (std::map<std::string, Server*>::iterator i = _servers.begin();
+       i != _servers.end();
+       ++i)
+  {
+    delete i->second;
+  }
+  for (std::list<std::pair<uint64_t, Server*> >::iterator i = _retired.begin();
+       i != _retired.end();
+       ++i)
+  {
+    delete i->second;
+  }
+  pthread_rwlock_destroy(&_lock);
+}
+
+void MemcachedClient::set_servers(const std::list<std::string>& servers,
+                                  int migration_ms)
+{
+  Ring ring;
+  pthread_rwlock_wrlock(&_lock);
+  build_ring(servers, ring);
+  _old_ring = _ring;
+  _ring = ring;
+  _migration_end_ms = now_ms() + migration_ms;
+  retire_unused_servers(now_ms());
+  pthread_rwlock_unlock(&_lock);
+  LOG_STATUS("Changed memcached servers, migrating keys for %dms", migration_ms);
+}
+
+void MemcachedClient::migrate_from_modulo(int migration_ms)
+{
+  pthread_rwlock_wrlock(&_lock);
+  _old_ring = Ring();
+  _old_ring.servers = _ring.servers;
+  _old_ring.modulo = true;
+  _migration_end_ms = now_ms() + migration_ms;
+  pthread_rwlock_unlock(&_lock);
+  LOG_STATUS("Migrating keys from modulo distribution for %dms", migration_ms);
+}
+
+void MemcachedClient::get(const std::string& key, GetCallback callback)
+{
+  get_from(key, route(key), 0, false, callback);
+}
+
+void MemcachedClient::get_multi(const std::vector<std::string>& keys,
+                                MultiGetCallback callback)
+{
+  // Group the keys by the first of their servers.
+  std::vector<Route> routes(keys.size());
+  std::map<Server*, std::vector<size_t> > server_keys;
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    routes[ii] = route(keys[ii]);
+    if (routes[ii].servers.empty())
+    {
+      callback(keys[ii], ERROR, NULL, 0, 0);
+    }
+    else
+    {
+      server_keys[routes[ii].servers[0]].push_back(ii);
+    }
+  }
+
+  for (std::map<Server*, std::vector<size_t> >::iterator i = server_keys.begin();
+       i != server_keys.end();
+       ++i)
+  {
+    std::string msg;
+    std::vector<Request> requests(i->second.size() + 1);
+    for (size_t jj = 0; jj < i->second.size(); ++jj)
+    {
+      const std::string& key = keys[i->second[jj]];
+      const Route& route = routes[i->second[jj]];
+      GetCallback key_callback = [key, callback](Status status,
+                                                 const char* value,
+                                                 size_t length,
+                                                 uint64_t cas)
+      {
+        callback(key, status, value, length, cas);
+      };
+      append_request(msg, OP_GETKQ, key, "", "", 0);
+      requests[jj].quiet = true;
+      requests[jj].get_callback = [this, key, route, key_callback](Status status,
+                                                                   const char* value,
+                                                                   size_t length,
+                                                                   uint64_t cas)
+      {
+        got(key, route, 0, false, key_callback, status, value, length, cas);
+      };
+    }
+
+    // The no-op's response needs no handling: its arrival is enough to
+    // show that any quiet gets still outstanding have missed.
+    append_request(msg, OP_NOOP, "", "", "", 0);
+
+    if (!i->first->connection()->send(msg, requests))
+    {
+      for (size_t jj = 0; jj < i->second.size(); ++jj)
+      {
+        requests[jj].get_callback(ERROR, NULL, 0, 0);
+      }
+    }
+  }
+}
+
+void MemcachedClient::store(const std::string& key,
+                            const std::string& value,
+                            int expiry,
+                            uint64_t cas,
+                            StoreCallback callback)
+{
+  // The extras are the flags (unused) and the expiry time.
+  uint32_t extras[2] = {0, htonl((uint32_t)expiry)};
+  store_to(key,
+           value,
+           std::string((const char*)extras, sizeof(extras)),
+           cas,
+           route(key),
+           0,
+           callback);
+}
+
+MemcachedClient::Status MemcachedClient::flush_all()
+{
+  std::vector<Server*> servers;
+  pthread_rwlock_rdlock(&_lock);
+  servers = _ring.servers;
+  if (now_ms() < _migration_end_ms)
+  {
+    servers.insert(servers.end(), _old_ring.servers.begin(), _old_ring.servers.end());
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  Status rc = OK;
+  for (size_t ii = 0; ii < servers.size(); ++ii)
+  {
+    Completion completion;
+    Status status = ERROR;
+    std::string msg;
+    append_request(msg, OP_FLUSH, "", "", "", 0);
+    std::vector<Request> requests(1);
+    requests[0].store_callback = [&](Status s, uint64_t) { status = s; completion.complete(); };
+    if (servers[ii]->connections[0]->send(msg, requests))
+    {
+      completion.wait();
+    }
+    if (status != OK)
+    {
+      rc = status;
+    }
+  }
+  return rc;
+}
+
+MemcachedClient::Status MemcachedClient::get(const std::string& key,
+                                             std::string& value,
+                                             uint64_t& cas)
+{
+  Completion completion;
+  Status rc;
+  get(key, [&](Status status, const char* data, size_t length, uint64_t data_cas)
+  {
+    rc = status;
+    if (status == OK)
+    {
+      value.assign(data, length);
+      cas = data_cas;
+    }
+    completion.complete();
+  });
+  completion.wait();
+  return rc;
+}
+
+MemcachedClient::Status MemcachedClient::store(const std::string& key,
+                                               const std::string& value,
+                                               int expiry,
+                                               uint64_t& cas)
+{
+  Completion completion;
+  Status rc;
+  store(key, value, expiry, cas, [&](Status status, uint64_t new_cas)
+  {
+    rc = status;
+    if (status == OK)
+    {
+      cas = new_cas;
+    }
+    completion.complete();
+  });
+  completion.wait();
+  return rc;
+}
+
+/// Append a request to a message.  The opaque ID is filled in when the
+/// message is sent.
+void MemcachedClient::append_request(std::string& msg,
+                                     uint8_t opcode,
+                                     const std::string& key,
+                                     const std::string& extras,
+                                     const std::string& value,
+                                     uint64_t cas)
+{
+  size_t start = msg.length();
+  msg.reserve(start + HEADER_LENGTH + extras.length() + key.length() + value.length());
+  msg.append(HEADER_LENGTH, '\0');
+  msg.append(extras).append(key).append(value);
+  char* header = &msg[start];
+  uint16_t key_length = htons(key.length());
+  uint32_t body_length = htonl(msg.length() - start - HEADER_LENGTH);
+  uint64_t net_cas = htobe64(cas);
+  header[0] = REQUEST_MAGIC;
+  header[1] = opcode;
+  memcpy(header + 2, &key_length, 2);
+  header[4] = extras.length();
+  memcpy(header + 8, &body_length, 4);
+  memcpy(header + 16, &net_cas, 8);
+}
+
+/// Build a hash ring from a list of servers, creating any servers we
+/// haven't seen before.  Must be called with the write lock held (or from
+/// the constructor).
+void MemcachedClient::build_ring(const std::list<std::string>& servers,
+                                 Ring& ring)
+{
+  for (std::list<std::string>::const_iterator i = servers.begin();
+       i != servers.end();
+       ++i)
+  {
+    Server*& server = _servers[*i];
+    if (server == NULL)
+    {
+      server = new Server(*i, _connections_per_server, _timeout_ms);
+    }
+
+    if (std::find(ring.servers.begin(), ring.servers.end(), server) == ring.servers.end())
+    {
+      ring.servers.push_back(server);
+      for (int ii = 0; ii < POINTS_PER_SERVER; ++ii)
+      {
+        ring.points[one_at_a_time(*i + "-" + std::to_string(ii))] = server;
+      }
+    }
+  }
+}
+
+/// Find the replicas for a hash: the owners of the first distinct points
+/// on the ring at or after it.
+void MemcachedClient::find_replicas(const Ring& ring,
+                                    uint32_t hash,
+                                    std::vector<Server*>& replicas)
+{
+  size_t count = std::min((size_t)_replicas, ring.servers.size());
+  if (ring.modulo)
+  {
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      replicas.push_back(ring.servers[(hash + ii) % ring.servers.size()]);
+    }
+    return;
+  }
+
+  std::map<uint32_t, Server*>::const_iterator i = ring.points.lower_bound(hash);
+  while (replicas.size() < count)
+  {
+    if (i == ring.points.end())
+    {
+      i = ring.points.begin();
+    }
+    if (std::find(replicas.begin(), replicas.end(), i->second) == replicas.end())
+    {
+      replicas.push_back(i->second);
+    }
+    ++i;
+  }
+}
+
+MemcachedClient::Route MemcachedClient::route(const std::string& key)
+{
+  Route route;
+  uint32_t hash = one_at_a_time(key);
+  uint64_t now = now_ms();
+
+  pthread_rwlock_rdlock(&_lock);
+  find_replicas(_ring, hash, route.servers);
+  route.replicas = route.servers.size();
+  bool migrating = (now < _migration_end_ms);
+  bool tidy = (((!migrating) && (!_old_ring.servers.empty())) ||
+               ((!_retired.empty()) && (now >= _retired.front().first)));
+  if (migrating)
+  {
+    std::vector<Server*> old_replicas;
+    find_replicas(_old_ring, hash, old_replicas);
+    for (size_t ii = 0; ii < old_replicas.size(); ++ii)
+    {
+      if (std::find(route.servers.begin(),
+                    route.servers.begin() + route.replicas,
+                    old_replicas[ii]) == route.servers.begin() + route.replicas)
+      {
+        route.servers.push_back(old_replicas[ii]);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  if (tidy)
+  {
+    tidy_servers(now);
+  }
+
+  return route;
+}
+
+/// Once a migration has ended, retire the servers only the old ring used,
+/// and destroy any retired servers that are due.
+void MemcachedClient::tidy_servers(uint64_t now)
+{
+  std::vector<Server*> dead;
+  pthread_rwlock_wrlock(&_lock);
+  if ((now >= _migration_end_ms) && (!_old_ring.servers.empty()))
+  {
+    _old_ring = Ring();
+    retire_unused_servers(now);
+  }
+  while ((!_retired.empty()) && (now >= _retired.front().first))
+  {
+    dead.push_back(_retired.front().second);
+    _retired.pop_front();
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  // Destroying a server waits for its reader threads, so don't hold the
+  // lock meanwhile.
+  for (size_t ii = 0; ii < dead.size(); ++ii)
+  {
+    LOG_STATUS("Disconnecting from memcached server %s", dead[ii]->name.c_str());
+    delete dead[ii];
+  }
+}
+
+/// Retire the servers that are on neither ring.  Must be called with the
+/// write lock held.
+void MemcachedClient::retire_unused_servers(uint64_t now)
+{
+  std::map<std::string, Server*>::iterator i = _servers.begin();
+  while (i != _servers.end())
+  {
+    Server* server = i->second;
+    if ((std::find(_ring.servers.begin(), _ring.servers.end(), server) == _ring.servers.end()) &&
+        (std::find(_old_ring.servers.begin(), _old_ring.servers.end(), server) == _old_ring.servers.end()))
+    {
+      _retired.push_back(std::make_pair(now + RETIRE_DELAY_MS, server));
+      _servers.erase(i++);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
+
+/// Get a key from the index'th of its servers.  missed says whether an
+/// earlier server didn't have it.
+void MemcachedClient::get_from(const std::string& key,
+                               const Route& route,
+                               size_t index,
+                               bool missed,
+                               GetCallback callback)
+{
+  if (index >= route.servers.size())
+  {
+    callback(missed ? NOT_FOUND : ERROR, NULL, 0, 0);
+    return;
+  }
+
+  std::string msg;
+  append_request(msg, OP_GET, key, "", "", 0);
+  std::vector<Request> requests(1);
+  requests[0].get_callback = [this, key, route, index, missed, callback](Status status,
+                                                                        const char* value,
+                                                                        size_t length,
+                                                                        uint64_t cas)
+  {
+    got(key, route, index, missed, callback, status, value, length, cas);
+  };
+  if (!route.servers[index]->connection()->send(msg, requests))
+  {
+    got(key, route, index, missed, callback, ERROR, NULL, 0, 0);
+  }
+}
+
+/// Handle the result of getting a key from one of its servers, moving on
+/// to the next if this one failed or didn't have it.
+void MemcachedClient::got(const std::string& key,
+                          const Route& route,
+                          size_t index,
+                          bool missed,
+                          GetCallback callback,
+                          Status status,
+                          const char* value,
+                          size_t length,
+                          uint64_t cas)
+{
+  if (status == OK)
+  {
+    if ((missed) || (index >= route.replicas))
+    {
+      // The next write won't go where this came from, so make it an add.
+      cas = 0;
+    }
+    callback(OK, value, length, cas);
+  }
+  else
+  {
+    get_from(key, route, index + 1, missed || (status == NOT_FOUND), callback);
+  }
+}
+
+/// Store a key on the index'th of its servers, moving on to the next if
+/// this one can't be reached, and copying the value to the rest once one
+/// accepts it.
+void MemcachedClient::store_to(const std::string& key,
+                               const std::string& value,
+                               const std::string& extras,
+                               uint64_t cas,
+                               const Route& route,
+                               size_t index,
+                               StoreCallback callback)
+{
+  if (index >= route.replicas)
+  {
+    callback(ERROR, 0);
+    return;
+  }
+
+  std::string msg;
+  append_request(msg, (cas == 0) ? OP_ADD : OP_SET, key, extras, value, cas);
+  std::vector<Request> requests(1);
+  requests[0].store_callback = [this, key, value, extras, cas, route, index, callback](Status status,
+                                                                                       uint64_t new_cas)
+  {
+    if (status == ERROR)
+    {
+      store_to(key, value, extras, cas, route, index + 1, callback);
+    }
+    else if (status == OK)
+    {
+      replicate(key, value, extras, route, index, new_cas, callback);
+    }
+    else
+    {
+      callback(status, new_cas);
+    }
+  };
+  if (!route.servers[index]->connection()->send(msg, requests))
+  {
+    requests[0].store_callback(ERROR, 0);
+  }
+}
+
+/// Copy a value just stored on the index'th of a key's replicas to the
+/// others, in parallel, completing the store once they have all answered.
+/// Failures are ignored: reads fall back past replicas without the value.
+void MemcachedClient::replicate(const std::string& key,
+                                const std::string& value,
+                                const std::string& extras,
+                                const Route& route,
+                                size_t index,
+                                uint64_t cas,
+                                StoreCallback callback)
+{
+  if (route.replicas == 1)
+  {
+    callback(OK, cas);
+    return;
+  }
+
+  std::shared_ptr<int> outstanding(new int(route.replicas - 1));
+  StoreCallback done = [outstanding, cas, callback](Status, uint64_t)
+  {
+    if (__sync_sub_and_fetch(outstanding.get(), 1) == 0)
+    {
+      callback(OK, cas);
+    }
+  };
+
+  std::string msg;
+  append_request(msg, OP_SET, key, extras, value, 0);
+  for (size_t ii = 0; ii < route.replicas; ++ii)
+  {
+    if (ii != index)
+    {
+      std::string replica_msg = msg;
+      std::vector<Request> requests(1);
+      requests[0].store_callback = done;
+      if (!route.servers[ii]->connection()->send(replica_msg, requests))
+      {
+        done(ERROR, 0);
+      }
+    }
+  }
+}
+
+MemcachedClient::Server::Server(const std::string& name,
+                                int num_connections,
+                                int timeout_ms) :
+  name(name),
+  connections(),
+  next_connection(0)
+{
+  // Split host:port, allowing for IPv6 addresses in square brackets.
+  std::string host = name;
+  std::string port = "11211";
+  size_t colon = name.rfind(':');
+  if ((colon != std::string::npos) &&
+      (name.find(']', colon) == std::string::npos))
+  {
+    host = name.substr(0, colon);
+    port = name.substr(colon + 1);
+  }
+  if ((host.length() > 1) && (host[0] == '['))
+  {
+    host = host.substr(1, host.length() - 2);
+  }
+
+  for (int ii = 0; ii < num_connections; ++ii)
+  {
+    connections.push_back(new Connection(host, port, timeout_ms));
+  }
+}
+
+MemcachedClient::Server::~Server()
+{
+  for (size_t ii = 0; ii < connections.size(); ++ii)
+  {
+    delete connections[ii];
+  }
+}
+
+MemcachedClient::Connection* MemcachedClient::Server::connection()
+{
+  return connections[__sync_fetch_and_add(&next_connection, 1) % connections.size()];
+}
+
+MemcachedClient::Completion::Completion() :
+  _complete(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+MemcachedClient::Completion::~Completion()
+{
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void MemcachedClient::Completion::complete()
+{
+  pthread_mutex_lock(&_lock);
+  _complete = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void MemcachedClient::Completion::wait()
+{
+  pthread_mutex_lock(&_lock);
+  while (!_complete)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+MemcachedClient::Connection::Connection(const std::string& host,
+                                        const std::string& port,
+                                        int timeout_ms) :
+  _host(host),
+  _port(port),
+  _timeout_ms(timeout_ms),
+  _fd(-1),
+  _connecting(false),
+  _retry_ms(0),
+  _next_seq(1),
+  _in_flight(),
+  _terminating(false)
+{
+  pthread_mutex_init(&_send_lock, NULL);
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_connected_cond, NULL);
+  int rc = pthread_create(&_reader, NULL, &reader_thread, (void*)this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating memcached reader thread for %s:%s",
+              _host.c_str(), _port.c_str());
+    // LCOV_EXCL_STOP
+  }
+}
+
+MemcachedClient::Connection::~Connection()
+{
+  std::vector<Request> failed;
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_signal(&_connected_cond);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_reader, NULL);
+
+  pthread_mutex_lock(&_lock);
+  disconnect(failed);
+  pthread_mutex_unlock(&_lock);
+  fail(failed);
+
+  pthread_cond_destroy(&_connected_cond);
+  pthread_mutex_destroy(&_lock);
+  pthread_mutex_destroy(&_send_lock);
+}
+
+bool MemcachedClient::Connection::send(std::string& msg,
+                                       const std::vector<Request>& requests)
+{
+  // Connect if we need to, without holding up other threads meanwhile.
+  // While another thread is connecting, or we failed to recently, fail
+  // straight away, so requests move on to another server.
+  pthread_mutex_lock(&_lock);
+  bool connected = (_fd >= 0);
+  bool connect_now = (!connected) && (!_connecting) && (now_ms() >= _retry_ms);
+  _connecting = _connecting || connect_now;
+  pthread_mutex_unlock(&_lock);
+
+  if (connect_now)
+  {
+    connected = connect();
+  }
+  if (!connected)
+  {
+    return false;
+  }
+
+  // Number the requests and write them under the send lock, so that a
+  // batch gets consecutive IDs and responses arrive in ID order.  The
+  // requests are in flight before they are written, so the reader thread
+  // can match the responses however quickly they come.  The reader only
+  // closes the socket under the send lock, so it stays open while we use
+  // it.
+  pthread_mutex_lock(&_send_lock);
+  pthread_mutex_lock(&_lock);
+  int fd = _fd;
+  uint64_t first_seq = _next_seq;
+  if (fd >= 0)
+  {
+    uint64_t now = now_ms();
+    size_t offset = 0;
+    for (size_t ii = 0; ii < requests.size(); ++ii)
+    {
+      uint32_t opaque = (uint32_t)_next_seq;
+      uint32_t body_length;
+      memcpy(&msg[offset + 12], &opaque, 4);
+      memcpy(&body_length, msg.data() + offset + 8, 4);
+      offset += HEADER_LENGTH + ntohl(body_length);
+
+      Request& r = _in_flight[_next_seq++];
+      r = requests[ii];
+      r.sent_ms = now;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (fd < 0)
+  {
+    // LCOV_EXCL_START - only if the connection drops between the checks
+    pthread_mutex_unlock(&_send_lock);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  size_t sent = 0;
+  while (sent < msg.length())
+  {
+    ssize_t n = ::send(fd, msg.data() + sent, msg.length() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      break; // LCOV_EXCL_LINE
+    }
+    sent += n;
+  }
+
+  std::vector<Request> failed;
+  if (sent < msg.length())
+  {
+    // LCOV_EXCL_START - the reader thread normally notices first
+    // The connection has failed.  Wake the reader thread to clean up, and
+    // fail whichever of the requests it hasn't already.
+    LOG_WARNING("Failed to send to memcached server %s:%s, %s",
+                _host.c_str(), _port.c_str(), strerror(errno));
+    shutdown(fd, SHUT_RDWR);
+    pthread_mutex_lock(&_lock);
+    for (size_t ii = 0; ii < requests.size(); ++ii)
+    {
+      std::map<uint64_t, Request>::iterator i = _in_flight.find(first_seq + ii);
+      if (i != _in_flight.end())
+      {
+        failed.push_back(i->second);
+        _in_flight.erase(i);
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+    // LCOV_EXCL_STOP
+  }
+  pthread_mutex_unlock(&_send_lock);
+
+  fail(failed);
+  return true;
+}
+
+/// Connect to the server.  Must be called without the lock held, by the
+/// one thread that set _connecting.
+bool MemcachedClient::Connection::connect()
+{
+  uint64_t now = now_ms();
+  int fd = -1;
+
+  struct addrinfo hints;
+  struct addrinfo* addrs = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(_host.c_str(), _port.c_str(), &hints, &addrs);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to resolve memcached server %s:%s, %s",
+              _host.c_str(), _port.c_str(), gai_strerror(rc));
+    addrs = NULL;
+  }
+
+  for (struct addrinfo* a = addrs; (a != NULL) && (fd < 0); a = a->ai_next)
+  {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0)
+    {
+      continue; // LCOV_EXCL_LINE
+    }
+
+    // Connect without blocking for longer than the timeout.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    rc = ::connect(fd, a->ai_addr, a->ai_addrlen);
+    if ((rc < 0) && (errno == EINPROGRESS))
+    {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      int err = ETIMEDOUT;
+      socklen_t len = sizeof(err);
+      if (poll(&pfd, 1, _timeout_ms) == 1)
+      {
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      }
+      rc = (err == 0) ? 0 : -1;
+      errno = err;
+    }
+
+    if (rc == 0)
+    {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      struct timeval tv = {_timeout_ms / 1000, (_timeout_ms % 1000) * 1000};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    else
+    {
+      LOG_ERROR("Failed to connect to memcached server %s:%s, %s",
+                _host.c_str(), _port.c_str(), strerror(errno));
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (addrs != NULL)
+  {
+    freeaddrinfo(addrs);
+  }
+
+  pthread_mutex_lock(&_lock);
+  _connecting = false;
+  if (fd >= 0)
+  {
+    LOG_DEBUG("Connected to memcached server %s:%s", _host.c_str(), _port.c_str());
+    _fd = fd;
+    pthread_cond_signal(&_connected_cond);
+  }
+  else
+  {
+    _retry_ms = now + RECONNECT_INTERVAL_MS;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return (fd >= 0);
+}
+
+/// Close the connection, failing all outstanding requests.  Must be called
+/// with the lock held, and (unless there can be no senders) the send lock.
+void MemcachedClient::Connection::disconnect(std::vector<Request>& failed)
+{
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+  for (std::map<uint64_t, Request>::iterator i = _in_flight.begin();
+       i != _in_flight.end();
+       ++i)
+  {
+    failed.push_back(i->second);
+  }
+  _in_flight.clear();
+}
+
+void* MemcachedClient::Connection::reader_thread(void* p)
+{
+  ((Connection*)p)->reader();
+  return NULL;
+}
+
+void MemcachedClient::Connection::reader()
+{
+  std::string buffer;
+  char chunk[16384];
+
+  pthread_mutex_lock(&_lock);
+  while (!_terminating)
+  {
+    if (_fd < 0)
+    {
+      pthread_cond_wait(&_connected_cond, &_lock);
+      continue;
+    }
+
+    // Only this thread closes the socket, so it's safe to use unlocked.
+    int fd = _fd;
+    pthread_mutex_unlock(&_lock);
+
+    bool ok = true;
+    std::vector<Request> failed;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, POLL_INTERVAL_MS) > 0)
+    {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n > 0)
+      {
+        buffer.append(chunk, n);
+
+        // Handle every complete response in the buffer.
+        size_t offset = 0;
+        while ((ok) && (buffer.length() - offset >= HEADER_LENGTH))
+        {
+          uint32_t body_length;
+          memcpy(&body_length, buffer.data() + offset + 8, 4);
+          body_length = ntohl(body_length);
+          if (buffer.length() - offset < HEADER_LENGTH + body_length)
+          {
+            break;
+          }
+          ok = process(buffer.data() + offset, HEADER_LENGTH + body_length);
+          offset += HEADER_LENGTH + body_length;
+        }
+        buffer.erase(0, offset);
+      }
+      else
+      {
+        LOG_WARNING("Lost connection to memcached server %s:%s",
+                    _host.c_str(), _port.c_str());
+        ok = false;
+      }
+    }
+
+    pthread_mutex_lock(&_lock);
+    if ((ok) &&
+        (!_in_flight.empty()) &&
+        (now_ms() - _in_flight.begin()->second.sent_ms > (uint64_t)_timeout_ms))
+    {
+      LOG_WARNING("Timed out waiting for memcached server %s:%s",
+                  _host.c_str(), _port.c_str());
+      ok = false;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (!ok)
+    {
+      // Shut the socket down first, so that any thread blocked sending on
+      // it gives up the send lock.
+      shutdown(fd, SHUT_RDWR);
+      pthread_mutex_lock(&_send_lock);
+      pthread_mutex_lock(&_lock);
+      disconnect(failed);
+      pthread_mutex_unlock(&_lock);
+      pthread_mutex_unlock(&_send_lock);
+      buffer.clear();
+    }
+
+    fail(failed);
+
+    pthread_mutex_lock(&_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+/// Handle a single response, returning false if it is malformed.
+bool MemcachedClient::Connection::process(const char* data, size_t length)
+{
+  if ((uint8_t)data[0] != RESPONSE_MAGIC)
+  {
+    LOG_ERROR("Bad response from memcached server %s:%s",
+              _host.c_str(), _port.c_str());
+    return false;
+  }
+
+  uint16_t key_length;
+  uint16_t status;
+  uint32_t opaque;
+  uint64_t cas;
+  memcpy(&key_length, data + 2, 2);
+  memcpy(&status, data + 6, 2);
+  memcpy(&opaque, data + 12, 4);
+  memcpy(&cas, data + 16, 8);
+  size_t value_offset = HEADER_LENGTH + (uint8_t)data[4] + ntohs(key_length);
+
+  Request request;
+  bool found = false;
+  std::vector<Request> missed;
+  pthread_mutex_lock(&_lock);
+
+  // Recover the full sequence number from the opaque ID.  Everything in
+  // flight was sent within 2^32 requests of the oldest, so counting on from
+  // that copes with the opaque ID wrapping.
+  std::map<uint64_t, Request>::iterator i = _in_flight.begin();
+  uint64_t seq = 0;
+  if (i != _in_flight.end())
+  {
+    seq = i->first + (uint32_t)(opaque - (uint32_t)i->first);
+  }
+
+  // The server answers requests in order, so any quiet gets sent before
+  // this one that are still outstanding have missed.
+  while ((i != _in_flight.end()) && (i->first < seq))
+  {
+    if (i->second.quiet)
+    {
+      missed.push_back(i->second);
+      _in_flight.erase(i++);
+    }
+    else
+    {
+      ++i; // LCOV_EXCL_LINE - servers don't skip non-quiet requests
+    }
+  }
+
+  if ((i != _in_flight.end()) && (i->first == seq))
+  {
+    request = i->second;
+    _in_flight.erase(i);
+    found = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t ii = 0; ii < missed.size(); ++ii)
+  {
+    missed[ii].get_callback(NOT_FOUND, NULL, 0, 0);
+  }
+
+  if (found)
+  {
+    Status rc = to_status(ntohs(status));
+    if (request.get_callback)
+    {
+      request.get_callback(rc,
+                           data + value_offset,
+                           length - value_offset,
+                           be64toh(cas));
+    }
+    else if (request.store_callback)
+    {
+      request.store_callback(rc, be64toh(cas));
+    }
+  }
+
+  return true;
+}
+
+/// Fail requests that were outstanding on a connection.  Must be called
+/// without the lock held.
+void MemcachedClient::Connection::fail(const std::vector<Request>& failed)
+{
+  for (size_t ii = 0; ii < failed.size(); ++ii)
+  {
+    if (failed[ii].get_callback)
+    {
+      failed[ii].get_callback(ERROR, NULL, 0, 0);
+    }
+    else if (failed[ii].store_callback)
+    {
+      failed[ii].store_callback(ERROR, 0);
+    }
+  }
+}
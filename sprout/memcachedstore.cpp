@@ -55,22 +55,31 @@
 #include <time.h>
 
 #include "memcachedstorefactory.h"
+#include "aorcodec.h"
+#include "aorcache.h"
 #include "log.h"
 
 namespace RegData {
 
   /// Create a new store object, using the memcached implementation.
   ///
-  /// For syntax of servers see
-  /// http://docs.libmemcached.org/libmemcached_configuration.html#description,
-  /// e.g., "localhost:11211".
+  /// Servers are given as host:port, e.g., "localhost:11211".
   RegData::Store* create_memcached_store(const std::list<std::string>& servers,
                                          ///< list of servers to be used
-                                         int connections)
-                                         ///< size of pool (used as init and
-                                         /// max)
+                                         int connections,
+                                         ///< number of connections to each
+                                         /// server
+                                         AoRCache* cache,
+                                         ///< near-cache to use, or NULL for
+                                         /// none; the store takes ownership
+                                         int replicas,
+                                         ///< number of servers to store each
+                                         /// AoR on
+                                         int max_expires)
+                                         ///< longest expiry (in seconds)
+                                         /// granted to a binding
   {
-    return new MemcachedStore(servers, connections);
+    return new MemcachedStore(servers, connections, cache, replicas, max_expires);
   }
 
   /// Destroy a store object which used the memcached implementation.
@@ -79,97 +88,97 @@ namespace RegData {
     delete (RegData::MemcachedStore*)store;
   }
 
-  /// Constructor: get a handle to the memcached connection pool of interest.
-  ///
-  /// For syntax of servers see
-  /// http://docs.libmemcached.org/libmemcached_configuration.html#description,
-  /// e.g., "localhost:11211".
+  /// Change the servers used by a store object which used the memcached
+  /// implementation.
+  void set_memcached_store_servers(RegData::Store* store,
+                                   const std::list<std::string>& servers)
+  {
+    ((RegData::MemcachedStore*)store)->set_servers(servers);
+  }
+
+  /// Constructor: set up the connections to the memcached servers.
   MemcachedStore::MemcachedStore(const std::list<std::string>& servers,
                                  ///< list of servers to be used
-                                 int pool_size)
-                                 ///< size of pool (used as init and max)
+                                 int connections,
+                                 ///< number of connections to each server
+                                 AoRCache* cache,
+                                 ///< near-cache to use, or NULL for none
+                                 int replicas,
+                                 ///< number of servers to store each AoR on
+                                 int max_expires) :
+                                 ///< longest expiry (in seconds) granted to
+                                 /// a binding
+    _client(new MemcachedClient(servers,
+                                connections,
+                                MemcachedClient::DEFAULT_TIMEOUT_MS,
+                                replicas)),
+    _cache(cache),
+    _migration_period_ms(max_expires * 1000)
   {
-    // Create the options string to connect to the servers.
-    std::string options;
-    for (std::list<std::string>::const_iterator i = servers.begin();
-         i != servers.end();
-         ++i)
-    {
-      options += "--SERVER=" + (*i) + " ";
-    }
-    options += "--BINARY-PROTOCOL";
-    options += " --POOL-MIN=" + to_string<int>(pool_size, std::dec) + " --POOL-MAX=" + to_string<int>(pool_size, std::dec);
-
-    _pool = memcached_pool(options.c_str(), options.length());
+    // Earlier releases used libmemcached's default modulo distribution,
+    // so look for AoRs where that put them until they have all been
+    // rewritten or expired.  Otherwise upgrading a running deployment
+    // would lose every registration.
+    _client->migrate_from_modulo(_migration_period_ms);
   }
 
   MemcachedStore::~MemcachedStore()
   {
-    memcached_pool_destroy(_pool);
+    delete _client;
+    delete _cache;
   }
 
-  /// Wipe the contents of all the memcached servers immediately, if we can
-  /// get a connection.  If not, does nothing.
+  /// Wipe the contents of all the memcached servers immediately.
   void MemcachedStore::flush_all()
   {
-    memcached_return_t rc;
+    if (_cache != NULL)
+    {
+      _cache->clear();
+    }
 
-    // Try to get a connection
-    struct timespec wait_time;
-    wait_time.tv_sec = 0;
-    wait_time.tv_nsec = 100 * 1000 * 1000;
-    memcached_st* st = memcached_pool_fetch(_pool, &wait_time, &rc);
+    _client->flush_all();
+  }
 
-    if (st != NULL)
+  /// Change the set of memcached servers.  AoRs whose servers change are
+  /// still found on their old servers for the longest a binding can last,
+  /// by which time they have either been rewritten to their new servers or
+  /// expired.
+  void MemcachedStore::set_servers(const std::list<std::string>& servers)
+  {
+    // Cached entries may have CAS values from the old servers.
+    if (_cache != NULL)
     {
-      // Got one: use it to wipe out the contents of the servers immediately.
-      rc = memcached_flush(st, 0);
-      memcached_pool_release(_pool, st);
+      _cache->clear();
     }
-  }
 
-  // LCOV_EXCL_START - need real memcached to test
+    _client->set_servers(servers, _migration_period_ms);
+  }
 
   /// Retrieve the AoR data for a given SIP URI, creating it if there isn't
-  /// any already, and returning NULL if we can't get a connection.
+  /// any already, and returning NULL if we can't reach the server.
+  ///
+  /// If there is a near-cache, a fresh cached copy is returned without
+  /// going to the server.
   AoR* MemcachedStore::get_aor_data(const std::string& aor_id)
                                     ///< the SIP URI
   {
-    memcached_return_t rc;
     MemcachedAoR* aor_data = NULL;
 
-    // Try to get a connection
-    struct timespec wait_time;
-    wait_time.tv_sec = 0;
-    wait_time.tv_nsec = 100 * 1000 * 1000;
-    memcached_st* st = memcached_pool_fetch(_pool, &wait_time, &rc);
+    if (_cache != NULL)
+    {
+      aor_data = _cache->get(aor_id);
+    }
 
-    if (st != NULL)
+    if (aor_data == NULL)
     {
-      // Got one: use it.
-      const char* key_ptr = aor_id.data();
-      const size_t key_len = aor_id.length();
-      rc = memcached_mget(st, &key_ptr, &key_len, 1);
-      if (memcached_success(rc))
-      {
-        memcached_result_st result;
-        memcached_result_create(st, &result);
-        memcached_fetch_result(st, &result, &rc);
+      aor_data = get_from_server(aor_id);
+      cache(aor_id, aor_data);
+    }
 
-        if (memcached_success(rc))
-        {
-          aor_data = deserialize_aor(std::string(memcached_result_value(&result), memcached_result_length(&result)));
-          aor_data->set_cas(memcached_result_cas(&result));
-          int now = time(NULL);
-          expire_bindings(aor_data, now);
-        }
-        else
-        {
-          // AoR does not exist, so create it.
-          aor_data = new MemcachedAoR();
-        }
-      }
-      memcached_pool_release(_pool, st);
+    if (aor_data != NULL)
+    {
+      int now = time(NULL);
+      expire_bindings(aor_data, now);
     }
 
     return (AoR*)aor_data;
@@ -179,148 +188,260 @@ namespace RegData {
   /// atomically.  If the underlying data has changed since it was last
   /// read, the update is rejected and this returns false; if the update
   /// succeeds, this returns true.
-  ///
-  /// If a connection cannot be obtained, returns a random boolean based on
-  /// data found on the call stack at the point of entry.
   bool MemcachedStore::set_aor_data(const std::string& aor_id,
                                     ///< the SIP URI
                                     AoR* data)
                                     ///< the data to store
   {
-    memcached_return_t rc;
     MemcachedAoR* aor_data = (MemcachedAoR*)data;
+    bool success = set_on_server(aor_id, aor_data);
+    set_complete(aor_id, aor_data, success);
+    return success;
+  }
 
-    // Try to get a connection.
-    struct timespec wait_time;
-    wait_time.tv_sec = 0;
-    wait_time.tv_nsec = 100 * 1000 * 1000;
-    memcached_st* st = memcached_pool_fetch(_pool, &wait_time, &rc);
-
-    if (st != NULL)
+  /// Retrieve several AoRs at once.  Fresh copies in the near-cache are
+  /// returned straight away, and the rest are fetched from all the servers
+  /// in parallel, with a single batch of requests to each.
+  void MemcachedStore::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                          MultiGetCallback callback)
+  {
+    int now = time(NULL);
+    std::vector<std::string> missing;
+    for (size_t ii = 0; ii < aor_ids.size(); ++ii)
     {
-      // Got one: use it.
-      //
-      // Expire any old bindings before writing to the server.  In theory,
-      // if there are no bindings left we could delete the entry, but this
-      // may cause concurrency problems because memcached does not support
-      // cas on delete operations.  In this case we do a memcached_cas with
-      // an effectively immediate expiry time.
-      int now = time(NULL);
-      int max_expires = expire_bindings(aor_data, now);
-      std::string value = serialize_aor(aor_data);
-      if (aor_data->get_cas() == 0)
+      MemcachedAoR* aor_data = (_cache != NULL) ? _cache->get(aor_ids[ii]) : NULL;
+      if (aor_data != NULL)
       {
-        // New record, so attempt to add.  This will fail if someone else
-        // gets there first.
-        rc = memcached_add(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, 0);
+        expire_bindings(aor_data, now);
+        callback(aor_ids[ii], aor_data);
       }
       else
       {
-        // This is an update to an existing record, so use memcached_cas
-        // to make sure it is atomic.
-        rc = memcached_cas(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, 0, aor_data->get_cas());
+        missing.push_back(aor_ids[ii]);
       }
-
-      memcached_pool_release(_pool, st);
     }
 
-    return memcached_success(rc);
+    if (!missing.empty())
+    {
+      // Results from different servers arrive on different reader threads,
+      // so take a lock to call the callback one at a time, and count the
+      // results in.
+      pthread_mutex_t lock;
+      pthread_mutex_init(&lock, NULL);
+      size_t outstanding = missing.size();
+      MemcachedClient::Completion completion;
+      _client->get_multi(missing,
+                         [&](const std::string& aor_id,
+                             MemcachedClient::Status status,
+                             const char* data,
+                             size_t length,
+                             uint64_t cas)
+      {
+        MemcachedAoR* aor_data = got_from_server(status, data, length, cas);
+        cache(aor_id, aor_data);
+        if (aor_data != NULL)
+        {
+          expire_bindings(aor_data, now);
+        }
+        pthread_mutex_lock(&lock);
+        callback(aor_id, aor_data);
+        bool done = (--outstanding == 0);
+        pthread_mutex_unlock(&lock);
+        if (done)
+        {
+          completion.complete();
+        }
+      });
+      completion.wait();
+      pthread_mutex_destroy(&lock);
+    }
   }
 
-  // LCOV_EXCL_STOP
-
-  /// Serialize the contents of an AoR.
-  std::string MemcachedStore::serialize_aor(MemcachedAoR* aor_data)
+  /// Asynchronous get_aor_data.  The request is pipelined with those from
+  /// other threads, and the callback is called on the connection's reader
+  /// thread when the response arrives.
+  void MemcachedStore::get_aor_data_async(const std::string& aor_id,
+                                          GetCallback callback)
   {
-    std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
+    MemcachedAoR* aor_data = NULL;
 
-    int num_bindings = aor_data->bindings().size();
-    oss.write((const char *)&num_bindings, sizeof(int));
+    if (_cache != NULL)
+    {
+      aor_data = _cache->get(aor_id);
+    }
 
-    for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
-         i != aor_data->bindings().end();
-         ++i)
+    if (aor_data != NULL)
+    {
+      expire_bindings(aor_data, time(NULL));
+      callback(aor_data);
+    }
+    else
     {
-      oss << i->first << '\0';
-
-      AoR::Binding* b = i->second;
-      oss << b->_uri << '\0';
-      oss << b->_cid << '\0';
-      oss.write((const char *)&b->_cseq, sizeof(int));
-      oss.write((const char *)&b->_expires, sizeof(int));
-      oss.write((const char *)&b->_priority, sizeof(int));
-      int num_params = b->_params.size();
-      oss.write((const char *)&num_params, sizeof(int));
-      for (std::list<std::pair<std::string, std::string> >::const_iterator i = b->_params.begin();
-           i != b->_params.end();
-           ++i)
+      _client->get(aor_id,
+                   [this, aor_id, callback](MemcachedClient::Status status,
+                                            const char* data,
+                                            size_t length,
+                                            uint64_t cas)
       {
-        oss << i->first << '\0' << i->second << '\0';
-      }
-      int num_path_hdrs = b->_path_headers.size();
-      oss.write((const char *)&num_path_hdrs, sizeof(int));
-      for (std::list<std::string>::const_iterator i = b->_path_headers.begin();
-           i != b->_path_headers.end();
-           ++i)
+        MemcachedAoR* aor_data = got_from_server(status, data, length, cas);
+        cache(aor_id, aor_data);
+        if (aor_data != NULL)
+        {
+          expire_bindings(aor_data, time(NULL));
+        }
+        callback(aor_data);
+      });
+    }
+  }
+
+  /// Asynchronous set_aor_data.
+  void MemcachedStore::set_aor_data_async(const std::string& aor_id,
+                                          AoR* data,
+                                          SetCallback callback)
+  {
+    MemcachedAoR* aor_data = (MemcachedAoR*)data;
+    std::string value;
+    int expiry = prepare_set(aor_data, value);
+    _client->store(aor_id,
+                   value,
+                   expiry,
+                   aor_data->get_cas(),
+                   [this, aor_id, aor_data, callback](MemcachedClient::Status status,
+                                                      uint64_t cas)
+    {
+      bool success = (status == MemcachedClient::OK);
+      if (success)
       {
-        oss << *i << '\0';
+        aor_data->set_cas(cas);
       }
+      set_complete(aor_id, aor_data, success);
+      callback(success);
+    });
+  }
+
+  /// Read the AoR data for a given SIP URI from the server, creating it if
+  /// there isn't any already, and returning NULL if we can't reach the
+  /// server.
+  MemcachedAoR* MemcachedStore::get_from_server(const std::string& aor_id)
+  {
+    MemcachedAoR* aor_data = NULL;
+    MemcachedClient::Completion completion;
+    _client->get(aor_id,
+                 [&](MemcachedClient::Status status,
+                     const char* data,
+                     size_t length,
+                     uint64_t cas)
+    {
+      // Decode straight out of the receive buffer rather than copying the
+      // value first.
+      aor_data = got_from_server(status, data, length, cas);
+      completion.complete();
+    });
+    completion.wait();
+    return aor_data;
+  }
+
+  /// Write the data for a particular address of record to the server,
+  /// updating its CAS if successful.
+  bool MemcachedStore::set_on_server(const std::string& aor_id,
+                                     MemcachedAoR* aor_data)
+  {
+    std::string value;
+    int expiry = prepare_set(aor_data, value);
+    uint64_t cas = aor_data->get_cas();
+    bool success = (_client->store(aor_id, value, expiry, cas) == MemcachedClient::OK);
+    aor_data->set_cas(cas);
+    return success;
+  }
+
+  /// Build an AoR from the result of a get.
+  MemcachedAoR* MemcachedStore::got_from_server(MemcachedClient::Status status,
+                                                const char* data,
+                                                size_t length,
+                                                uint64_t cas)
+  {
+    MemcachedAoR* aor_data = NULL;
+
+    if (status == MemcachedClient::OK)
+    {
+      aor_data = deserialize_aor(data, length);
+      aor_data->set_cas(cas);
+    }
+    else if (status == MemcachedClient::NOT_FOUND)
+    {
+      // AoR does not exist, so create it.
+      aor_data = new MemcachedAoR();
     }
 
-    return oss.str();
+    return aor_data;
   }
 
-  /// Deserialize the contents of an AoR
-  MemcachedAoR* MemcachedStore::deserialize_aor(const std::string& s)
+  /// Put a copy of an AoR just read from the server in the near-cache, if
+  /// there is one.
+  void MemcachedStore::cache(const std::string& aor_id, MemcachedAoR* aor_data)
   {
-    std::istringstream iss(s, std::istringstream::in|std::istringstream::binary);
+    if ((aor_data != NULL) && (_cache != NULL))
+    {
+      _cache->put(aor_id, *aor_data);
+    }
+  }
 
-    MemcachedAoR* aor_data = new MemcachedAoR();
-    int num_bindings;
-    iss.read((char *)&num_bindings, sizeof(int));
-    LOG_DEBUG("There are %d bindings", num_bindings);
+  /// Expire any old bindings and serialize what's left, returning the
+  /// expiry time to give the record.
+  ///
+  /// In theory, if there are no bindings left we could delete the entry,
+  /// but this may cause concurrency problems because memcached does not
+  /// support cas on delete operations.  In this case we do a cas with an
+  /// effectively immediate expiry time.
+  int MemcachedStore::prepare_set(MemcachedAoR* aor_data, std::string& value)
+  {
+    int now = time(NULL);
+    int max_expires = expire_bindings(aor_data, now);
+    value = serialize_aor(aor_data);
+    return max_expires;
+  }
 
-    for (int ii = 0; ii < num_bindings; ++ii)
+  /// Update the near-cache after a write.
+  void MemcachedStore::set_complete(const std::string& aor_id,
+                                    MemcachedAoR* aor_data,
+                                    bool success)
+  {
+    if (_cache != NULL)
     {
-      // Extract the binding identifier into a string.
-      std::string binding_id;
-      getline(iss, binding_id, '\0');
-
-      AoR::Binding* b = aor_data->get_binding(binding_id);
-
-      // Now extract the various fixed binding parameters.
-      getline(iss, b->_uri, '\0');
-      getline(iss, b->_cid, '\0');
-      iss.read((char *)&b->_cseq, sizeof(int));
-      iss.read((char *)&b->_expires, sizeof(int));
-      iss.read((char *)&b->_priority, sizeof(int));
-
-      int num_params;
-      iss.read((char *)&num_params, sizeof(int));
-      LOG_DEBUG("Binding has %d params", num_params);
-      b->_params.resize(num_params);
-      for (std::list<std::pair<std::string, std::string> >::iterator i = b->_params.begin();
-           i != b->_params.end();
-           ++i)
+      if (success)
       {
-        getline(iss, i->first, '\0');
-        getline(iss, i->second, '\0');
-        LOG_DEBUG("Read param %s = %s", i->first.c_str(), i->second.c_str());
+        // Cache what we wrote, with its new CAS.
+        _cache->put(aor_id, *aor_data);
       }
-
-      int num_paths = 0;
-      iss.read((char *)&num_paths, sizeof(int));
-      b->_path_headers.resize(num_paths);
-      LOG_DEBUG("Binding has %d paths", num_paths);
-      for (std::list<std::string>::iterator i = b->_path_headers.begin();
-           i != b->_path_headers.end();
-           ++i)
+      else
       {
-        getline(iss, *i, '\0');
-        LOG_DEBUG("Read path %s", i->c_str());
+        // The data was out of date (or we couldn't reach the server), so
+        // make sure the caller's retry reads from the server.
+        _cache->invalidate(aor_id);
       }
     }
+  }
 
+  /// Serialize the contents of an AoR.
+  std::string MemcachedStore::serialize_aor(MemcachedAoR* aor_data)
+  {
+    std::string value;
+    AoRCodec::encode(aor_data, value);
+    return value;
+  }
+
+  /// Deserialize the contents of an AoR, reading directly from the supplied
+  /// buffer.  If the record is corrupt the bindings are discarded, so the
+  /// next successful write replaces the record.
+  MemcachedAoR* MemcachedStore::deserialize_aor(const char* data, size_t length)
+  {
+    MemcachedAoR* aor_data = new MemcachedAoR();
+    if (!AoRCodec::decode(data, length, aor_data))
+    {
+      LOG_ERROR("Discarding corrupt registration record");
+      aor_data->clear();
+    }
+    LOG_DEBUG("There are %d bindings", (int)aor_data->bindings().size());
     return aor_data;
   }
 } // namespace RegData
@@ -0,0 +1,174 @@
+/**
+ * @file parsedbinding.cpp Registration bindings parsed ready for routing.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "parsedbinding.h"
+
+#include "pjutils.h"
+#include "stack.h"
+#include "log.h"
+
+const int ParsedBinding::POOL_INITIAL_SIZE;
+const int ParsedBinding::POOL_INCREMENT;
+
+ParsedBinding::ParsedBinding(pj_pool_t* pool,
+                             const std::string& uri,
+                             const RegData::AoR::Binding::PathHeaders& path_headers) :
+  _pool(pool),
+  _uri_str(uri),
+  _path_strs(path_headers),
+  _uri(NULL),
+  _paths()
+{
+}
+
+
+ParsedBinding::~ParsedBinding()
+{
+  pj_pool_release(_pool);
+}
+
+
+std::shared_ptr<const ParsedBinding>
+  ParsedBinding::parse(const std::string& uri,
+                       const RegData::AoR::Binding::PathHeaders& path_headers)
+{
+  pj_pool_t* pool = pj_pool_create(&stack_data.cp.factory,
+                                   "binding",
+                                   POOL_INITIAL_SIZE,
+                                   POOL_INCREMENT,
+                                   NULL);
+  std::shared_ptr<ParsedBinding> parsed(new ParsedBinding(pool, uri, path_headers));
+
+  parsed->_uri = PJUtils::uri_from_string(uri, pool);
+  if (parsed->_uri == NULL)
+  {
+    LOG_WARNING("Badly formed contact URI %s", uri.c_str());
+    return std::shared_ptr<const ParsedBinding>();
+  }
+
+  parsed->_paths.reserve(path_headers.size());
+  for (RegData::AoR::Binding::PathHeaders::const_iterator i = path_headers.begin();
+       i != path_headers.end();
+       ++i)
+  {
+    pjsip_uri* path = PJUtils::uri_from_string(*i, pool);
+    if (path == NULL)
+    {
+      LOG_WARNING("Badly formed path header %s for contact URI %s",
+                  i->c_str(), uri.c_str());
+      return std::shared_ptr<const ParsedBinding>();
+    }
+    parsed->_paths.push_back(path);
+  }
+
+  return parsed;
+}
+
+
+const ParsedBinding* ParsedBinding::parsed(const RegData::AoR::Binding* binding)
+{
+  if ((binding->_parsed != NULL) &&
+      (binding->_parsed->matches(binding->_uri, binding->_path_headers)))
+  {
+    return binding->_parsed.get();
+  }
+  return NULL;
+}
+
+
+pjsip_uri* ParsedBinding::binding_uri(const RegData::AoR::Binding* binding,
+                                      pj_pool_t* pool)
+{
+  const ParsedBinding* p = parsed(binding);
+  if (p != NULL)
+  {
+    return p->uri(pool);
+  }
+  return PJUtils::uri_from_string(binding->_uri, pool);
+}
+
+
+bool ParsedBinding::binding_paths(const RegData::AoR::Binding* binding,
+                                  pj_pool_t* pool,
+                                  std::list<pjsip_uri*>& paths)
+{
+  const ParsedBinding* p = parsed(binding);
+  if (p != NULL)
+  {
+    p->paths(pool, paths);
+    return true;
+  }
+
+  for (RegData::AoR::Binding::PathHeaders::const_iterator i = binding->_path_headers.begin();
+       i != binding->_path_headers.end();
+       ++i)
+  {
+    pjsip_uri* path = PJUtils::uri_from_string(*i, pool);
+    if (path == NULL)
+    {
+      return false;
+    }
+    paths.push_back(path);
+  }
+  return true;
+}
+
+
+pjsip_uri* ParsedBinding::uri(pj_pool_t* pool) const
+{
+  return (pjsip_uri*)pjsip_uri_clone(pool, _uri);
+}
+
+
+void ParsedBinding::paths(pj_pool_t* pool, std::list<pjsip_uri*>& paths) const
+{
+  for (std::vector<pjsip_uri*>::const_iterator i = _paths.begin();
+       i != _paths.end();
+       ++i)
+  {
+    paths.push_back((pjsip_uri*)pjsip_uri_clone(pool, *i));
+  }
+}
+
+
+bool ParsedBinding::matches(const std::string& uri,
+                            const RegData::AoR::Binding::PathHeaders& path_headers) const
+{
+  return ((_uri_str == uri) && (_path_strs == path_headers));
+}
@@ -43,18 +43,26 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
 #include <list>
 #include <queue>
+#include <functional>
 #include <string>
 
 #include "utils.h"
+#include "eventq.h"
 #include "sasevent.h"
 #include "pjutils.h"
 #include "stack.h"
 #include "memcachedstore.h"
+#include "aorwriter.h"
+#include "flowindex.h"
+#include "expirypolicy.h"
+#include "parsedbinding.h"
+#include "statistic.h"
 #include "registrar.h"
 #include "constants.h"
 #include "log.h"
@@ -62,10 +70,50 @@ extern "C" {
 
 static RegData::Store* store;
 
+static RegData::AoRWriter* writer;
+
+static Statistic* writer_stat;
+
+static RegData::FlowIndex* flow_index;
+
+static ExpiryPolicy* expiry_policy;
+
+/// Reliable transports UEs have registered over directly, which are
+/// watched so their bindings can be removed when they disconnect.
+static pthread_mutex_t watched_transports_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<pjsip_transport*, pjsip_tp_state_listener_key*> watched_transports;
+
+/// Flows that have failed, with the bindings registered over them, queued
+/// for flow_thread to remove.  Transport state callbacks run on PJSIP's
+/// transport thread, so mustn't wait for the store themselves.
+typedef std::pair<std::string, std::vector<RegData::FlowIndex::BindingKey> > FailedFlow;
+static eventq<FailedFlow>* failed_flows;
+static pthread_t flow_thread;
+
 
 static AnalyticsLogger* analytics;
 
 
+/// Tidies up after bindings the store expires by itself, generating
+/// analytics logs as if they had been deregistered.
+class ExpiryAnalytics : public RegData::Store::ExpiryListener
+{
+public:
+  void binding_expired(const std::string& aor_id,
+                       const std::string& binding_id,
+                       const RegData::AoR::Binding& binding)
+  {
+    flow_index->remove(aor_id, binding_id);
+    if (analytics != NULL)
+    {
+      analytics->registration(aor_id, binding_id, binding._uri, 0);
+    }
+  }
+};
+
+static ExpiryAnalytics expiry_analytics;
+
+
 //
 // mod_registrar is the module to receive SIP REGISTER requests.  This
 // must get invoked before the proxy UA module.
@@ -143,6 +191,203 @@ std::string get_binding_id(pjsip_contact_hdr *contact)
 }
 
 
+/// Find a binding in an AoR, returning NULL if there isn't one with this ID.
+static RegData::AoR::Binding* find_binding(RegData::AoR* aor_data,
+                                           const std::string& binding_id)
+{
+  for (RegData::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    if (i->first == binding_id)
+    {
+      return i->second;
+    }
+  }
+  return NULL;
+}
+
+
+/// Prefix for the flow identifiers of transports UEs connect over
+/// directly, distinguishing them from Path URIs.
+static const std::string TRANSPORT_FLOW_PREFIX = "transport:";
+
+
+/// Remove a binding because its flow has failed, if it still passes the
+/// check, and generate an analytics log as if it had been deregistered.
+static void remove_failed_binding(const std::string& aor_id,
+                                  const std::string& binding_id,
+                                  const std::function<bool(const RegData::AoR::Binding*)>& check)
+{
+  std::string contact_uri;
+  RegData::AoR* aor_data = writer->update(aor_id, [&](RegData::AoR* aor_data)
+  {
+    contact_uri.clear();
+    RegData::AoR::Binding* binding = find_binding(aor_data, binding_id);
+    if ((binding != NULL) && (check(binding)))
+    {
+      contact_uri = binding->_uri;
+      aor_data->remove_binding(binding_id);
+    }
+  });
+
+  if ((aor_data != NULL) &&
+      (!contact_uri.empty()) &&
+      (analytics != NULL))
+  {
+    analytics->registration(aor_id, binding_id, contact_uri, 0);
+  }
+  delete aor_data;
+}
+
+
+/// Remove the bindings that were registered over a flow that has failed.
+/// A binding that has since been re-registered over a different flow (as
+/// shown by its Path) is left alone.
+static void remove_flow_bindings(const std::string& flow,
+                                 const std::vector<RegData::FlowIndex::BindingKey>& bindings)
+{
+  bool is_transport = (flow.compare(0, TRANSPORT_FLOW_PREFIX.size(), TRANSPORT_FLOW_PREFIX) == 0);
+  for (size_t ii = 0; ii < bindings.size(); ++ii)
+  {
+    const std::string& aor = bindings[ii].first;
+    const std::string& binding_id = bindings[ii].second;
+    LOG_INFO("Remove binding %s for %s as flow %s has failed",
+             binding_id.c_str(), aor.c_str(), flow.c_str());
+    remove_failed_binding(aor, binding_id, [&](const RegData::AoR::Binding* binding)
+    {
+      return ((is_transport) ?
+                (binding->_path_headers.empty()) :
+                ((!binding->_path_headers.empty()) &&
+                 (binding->_path_headers.front() == flow)));
+    });
+  }
+}
+
+
+/// Called when a request to a binding gets 430 Flow Failed.
+void registrar_flow_failed(const std::string& aor_id, const std::string& binding_id)
+{
+  // Remove every binding registered over the same flow as this one.
+  std::string flow = flow_index->flow(aor_id, binding_id);
+  std::vector<RegData::FlowIndex::BindingKey> bindings;
+  if (flow != "")
+  {
+    bindings = flow_index->take(flow);
+    bindings.erase(std::remove(bindings.begin(),
+                               bindings.end(),
+                               RegData::FlowIndex::BindingKey(aor_id, binding_id)),
+                   bindings.end());
+  }
+
+  // Always remove the binding itself, even if it wasn't registered through
+  // this node.
+  LOG_INFO("Remove binding %s for %s as its flow has failed",
+           binding_id.c_str(), aor_id.c_str());
+  remove_failed_binding(aor_id, binding_id, [](const RegData::AoR::Binding*)
+  {
+    return true;
+  });
+
+  remove_flow_bindings(flow, bindings);
+}
+
+
+/// Removes the bindings of failed transports queued by
+/// on_transport_state_changed.
+static void* flow_thread_entry(void* p)
+{
+  FailedFlow failed_flow;
+  while (failed_flows->pop(failed_flow))
+  {
+    remove_flow_bindings(failed_flow.first, failed_flow.second);
+  }
+  return NULL;
+}
+
+
+/// Called by PJSIP when a transport a UE registered over changes state.
+static void on_transport_state_changed(pjsip_transport* tp,
+                                       pjsip_transport_state state,
+                                       const pjsip_transport_state_info* info)
+{
+  if (state == PJSIP_TP_STATE_DISCONNECTED)
+  {
+    pthread_mutex_lock(&watched_transports_lock);
+    bool watched = (watched_transports.erase(tp) > 0);
+    pthread_mutex_unlock(&watched_transports_lock);
+
+    if (watched)
+    {
+      std::string flow = TRANSPORT_FLOW_PREFIX + tp->obj_name;
+      LOG_DEBUG("Transport %s disconnected", flow.c_str());
+      std::vector<RegData::FlowIndex::BindingKey> bindings = flow_index->take(flow);
+      if (!bindings.empty())
+      {
+        failed_flows->push(FailedFlow(flow, bindings));
+      }
+      pjsip_transport_dec_ref(tp);
+    }
+  }
+}
+
+
+/// Get the identifier of the flow a REGISTER arrived over, so its bindings
+/// can be indexed by it.  If an edge proxy added a Path header with a flow
+/// token in it, this is the top Path URI.  If the UE connected directly over
+/// a reliable transport, this is the transport, which is watched so its
+/// bindings can be removed if it disconnects.  A transport from a proxy
+/// without Path support (so the REGISTER has more than one Via) may carry
+/// many UEs and be reconnected routinely, so isn't a flow.  Otherwise there
+/// is no flow to track, so this is "".
+static std::string get_flow(pjsip_rx_data* rdata)
+{
+  std::string flow;
+  pjsip_generic_string_hdr* path_hdr = (pjsip_generic_string_hdr*)
+              pjsip_msg_find_hdr_by_name(rdata->msg_info.msg, &STR_PATH, NULL);
+  if (path_hdr != NULL)
+  {
+    std::list<std::string> paths;
+    Utils::split_string(PJUtils::pj_str_to_string(&path_hdr->hvalue), ',', paths, 0, true);
+    if (!paths.empty())
+    {
+      // Only a Path URI with a user part (the flow token) identifies a
+      // flow, rather than just the edge proxy.
+      pjsip_uri* uri = PJUtils::uri_from_string(paths.front(), rdata->tp_info.pool);
+      if ((uri != NULL) &&
+          (PJSIP_URI_SCHEME_IS_SIP(uri)) &&
+          (((pjsip_sip_uri*)pjsip_uri_get_uri(uri))->user.slen > 0))
+      {
+        flow = paths.front();
+      }
+    }
+  }
+  else if ((PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport)) &&
+           (PJUtils::is_first_hop(rdata->msg_info.msg)))
+  {
+    pjsip_transport* tp = rdata->tp_info.transport;
+    flow = TRANSPORT_FLOW_PREFIX + tp->obj_name;
+
+    pthread_mutex_lock(&watched_transports_lock);
+    if (watched_transports.find(tp) == watched_transports.end())
+    {
+      // Hold a reference to the transport until it disconnects, so it can't
+      // be reused for another connection while its bindings are indexed.
+      pjsip_tp_state_listener_key* listener_key;
+      pjsip_transport_add_ref(tp);
+      pjsip_transport_add_state_listener(tp,
+                                         &on_transport_state_changed,
+                                         NULL,
+                                         &listener_key);
+      watched_transports[tp] = listener_key;
+      LOG_DEBUG("Watching transport %s", flow.c_str());
+    }
+    pthread_mutex_unlock(&watched_transports_lock);
+  }
+  return flow;
+}
+
+
 void process_register_request(pjsip_rx_data* rdata)
 {
   pj_status_t status;
@@ -180,26 +425,80 @@ void process_register_request(pjsip_rx_data* rdata)
   // Get the system time in seconds for calculating absolute expiry times.
   int now = time(NULL);
 
-  // The registration service uses optimistic locking to avoid concurrent
-  // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
-  RegData::AoR* aor_data;
-  do
+  // Note how long the REGISTER was queued for, as a measure of load.
+  pj_time_val queued;
+  pj_gettimeofday(&queued);
+  PJ_TIME_VAL_SUB(queued, rdata->pkt_info.timestamp);
+  expiry_policy->record(PJ_TIME_VAL_MSEC(queued));
+
+  // Get the Path headers, if present.  RFC 3327 allows us the option of
+  // rejecting a request with a Path header if there is no corresponding
+  // "path" entry in the Supported header but we don't do so on the assumption
+  // that the edge proxy knows what it's doing.
+  RegData::AoR::Binding::PathHeaders path_headers;
+  pjsip_generic_string_hdr* path_hdr =
+    (pjsip_generic_string_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_PATH, NULL);
+  while (path_hdr)
   {
-    // Find the current bindings for the AoR.
-    aor_data = store->get_aor_data(aor);
-    LOG_DEBUG("Retrieved AoR data %p", aor_data);
+    std::string path = PJUtils::pj_str_to_string(&path_hdr->hvalue);
+    LOG_DEBUG("Path header %s", path.c_str());
+
+    // Extract all the paths from this header.
+    Utils::split_string(path, ',', path_headers, 0, true);
+
+    // Look for the next header.
+    path_hdr = (pjsip_generic_string_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_PATH, path_hdr->next);
+  }
 
-    if (aor_data == NULL)
+  // Parse each SIP contact with the Path headers now, so that requests to
+  // the bindings don't have to, and reject the REGISTER if any of them is
+  // badly formed rather than storing bindings that can't be routed to.
+  std::vector<std::shared_ptr<const ParsedBinding> > parsed_contacts;
+  for (pjsip_contact_hdr* c = contact;
+       c != NULL;
+       c = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, c->next))
+  {
+    pjsip_uri* uri = ((!c->star) && (c->uri != NULL)) ?
+                         (pjsip_uri*)pjsip_uri_get_uri(c->uri) :
+                         NULL;
+    if ((uri != NULL) &&
+        (PJSIP_URI_SCHEME_IS_SIP(uri)))
     {
-      // Failed to get data for the AoR because there is no connection
-      // to the store.  Reject the register with a 500 response.
-      // LCOV_EXCL_START - local store (used in testing) never fails
-      LOG_ERROR("Failed to get AoR binding for %s from store", aor.c_str());
-      st_code = PJSIP_SC_INTERNAL_SERVER_ERROR;
-      break;
-      // LCOV_EXCL_STOP
+      std::string contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
+      std::shared_ptr<const ParsedBinding> parsed =
+                                 ParsedBinding::parse(contact_uri, path_headers);
+      if (parsed == NULL)
+      {
+        LOG_WARNING("Rejecting REGISTER for %s with badly formed contact %s",
+                    aor.c_str(), contact_uri.c_str());
+        PJUtils::respond_stateless(stack_data.endpt,
+                                   rdata,
+                                   PJSIP_SC_BAD_REQUEST,
+                                   NULL,
+                                   NULL,
+                                   NULL);
+        return;
+      }
+      parsed_contacts.push_back(parsed);
     }
+  }
+
+  // Find the flow the bindings are registered over.
+  std::string flow = get_flow(rdata);
+  std::vector<std::string> binding_ids;
+  bool cleared = false;
+
+  // Concurrent REGISTERs for the AoR on this node are combined into a
+  // single read-modify-write, which is retried if another node changes the
+  // AoR at the same time.  The update may be applied on another thread, or
+  // more than once, so it works through the contacts afresh each time.
+  pjsip_contact_hdr* first_contact = contact;
+  RegData::AoR* aor_data = writer->update(aor, [&](RegData::AoR* aor_data)
+  {
+    pjsip_contact_hdr* contact = first_contact;
+    size_t parsed_index = 0;
+    binding_ids.clear();
+    cleared = false;
 
     // Now loop through all the contacts.  If there are multiple contacts in
     // the contact header in the SIP message, pjsip parses them to separate
@@ -211,6 +510,7 @@ void process_register_request(pjsip_rx_data* rdata)
         // Wildcard contact, which can only be used to clear all bindings for
         // the AoR.
         aor_data->clear();
+        cleared = true;
         break;
       }
 
@@ -230,6 +530,8 @@ void process_register_request(pjsip_rx_data* rdata)
           binding_id = contact_uri;
         }
         LOG_DEBUG(". Binding identifier for contact = %s", binding_id.c_str());
+        binding_ids.push_back(binding_id);
+        const std::shared_ptr<const ParsedBinding>& parsed = parsed_contacts[parsed_index++];
 
         // Find the appropriate binding in the bindings list for this AoR.
         RegData::AoR::Binding* binding = aor_data->get_binding(binding_id);
@@ -244,24 +546,8 @@ void process_register_request(pjsip_rx_data* rdata)
           // TODO Examine Via header to see if we're the first hop
           // TODO Only if we're not the first hop, check that the top path header has "ob" parameter
 
-          // Get the Path headers, if present.  RFC 3327 allows us the option of
-          // rejecting a request with a Path header if there is no corresponding
-          // "path" entry in the Supported header but we don't do so on the assumption
-          // that the edge proxy knows what it's doing.
-          binding->_path_headers.clear();
-          pjsip_generic_string_hdr* path_hdr =
-            (pjsip_generic_string_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_PATH, NULL);
-          while (path_hdr)
-          {
-            std::string path = PJUtils::pj_str_to_string(&path_hdr->hvalue);
-            LOG_DEBUG("Path header %s", path.c_str());
-
-            // Extract all the paths from this header.
-            Utils::split_string(path, ',', binding->_path_headers, 0, true);
-
-            // Look for the next header.
-            path_hdr = (pjsip_generic_string_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_PATH, path_hdr->next);
-          }
+          binding->_path_headers = path_headers;
+          binding->_parsed = parsed;
 
           binding->_cid = cid;
           binding->_cseq = cseq;
@@ -276,14 +562,12 @@ void process_register_request(pjsip_rx_data* rdata)
             p = p->next;
           }
 
-          // Calculate the expiry period for the updated binding.
+          // Calculate the expiry period for the updated binding.  If the
+          // UE didn't ask for one, grant the longest we can.
           int expiry = (contact->expires != -1) ? contact->expires :
-                       (expires != NULL) ? expires->ivalue : 300;
-          if (expiry > 300)
-          {
-            // Expiry is too long, set it to the maximum of 300 seconds (5 minutes).
-            expiry = 300;
-          }
+                       (expires != NULL) ? expires->ivalue :
+                       expiry_policy->max_expires();
+          expiry = expiry_policy->grant(expiry);
           binding->_expires = now + expiry;
 
           if (analytics != NULL)
@@ -295,13 +579,41 @@ void process_register_request(pjsip_rx_data* rdata)
       }
       contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, contact->next);
     }
+  });
+
+  if (aor_data == NULL)
+  {
+    // Failed to read or write the AoR.  Reject the register with a 500
+    // response.
+    // LCOV_EXCL_START - local store (used in testing) never fails
+    st_code = PJSIP_SC_INTERNAL_SERVER_ERROR;
+    // LCOV_EXCL_STOP
   }
-  while (!store->set_aor_data(aor, aor_data));
 
   if (aor_data != NULL)
   {
     // Log the bindings.
     log_bindings(aor, aor_data);
+
+    // Update the flow index for the bindings in the REGISTER.
+    if (cleared)
+    {
+      flow_index->remove_aor(aor);
+    }
+    for (size_t ii = 0; ii < binding_ids.size(); ++ii)
+    {
+      RegData::AoR::Binding* binding = find_binding(aor_data, binding_ids[ii]);
+      if ((flow != "") &&
+          (binding != NULL) &&
+          (binding->_expires > now))
+      {
+        flow_index->add(flow, aor, binding_ids[ii], binding->_expires);
+      }
+      else
+      {
+        flow_index->remove(aor, binding_ids[ii]);
+      }
+    }
   }
 
   // Build and send the reply.
@@ -358,7 +670,7 @@ void process_register_request(pjsip_rx_data* rdata)
     if (binding->_expires > now)
     {
       // The binding hasn't expired.
-      pjsip_uri* uri = PJUtils::uri_from_string(binding->_uri, tdata->pool);
+      pjsip_uri* uri = ParsedBinding::binding_uri(binding, tdata->pool);
       if (uri != NULL)
       {
         // Contact URI is well formed, so include this in the response.
@@ -368,7 +680,7 @@ void process_register_request(pjsip_rx_data* rdata)
         contact->q1000 = binding->_priority;
         contact->expires = binding->_expires - now;
         pj_list_init(&contact->other_param);
-        for (std::list<std::pair<std::string, std::string> >::iterator j = binding->_params.begin();
+        for (RegData::AoR::Binding::Params::iterator j = binding->_params.begin();
              j != binding->_params.end();
              ++j)
         {
@@ -392,7 +704,7 @@ void process_register_request(pjsip_rx_data* rdata)
   }
 
   // Deal with path header related fields in the response.
-  pjsip_generic_string_hdr* path_hdr =
+  path_hdr =
     (pjsip_generic_string_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_PATH, NULL);
   if ((path_hdr != NULL) &&
       (!aor_data->bindings().empty()))
@@ -438,12 +750,30 @@ pj_bool_t registrar_on_rx_request(pjsip_rx_data *rdata)
 }
 
 
-pj_status_t init_registrar(RegData::Store* registrar_store, AnalyticsLogger* analytics_logger)
+pj_status_t init_registrar(RegData::Store* registrar_store,
+                           AnalyticsLogger* analytics_logger,
+                           ExpiryPolicy* registrar_expiry_policy)
 {
   pj_status_t status;
 
   store = registrar_store;
   analytics = analytics_logger;
+  expiry_policy = registrar_expiry_policy;
+  writer_stat = new Statistic("registrar_writes");
+  writer = new RegData::AoRWriter(store, writer_stat);
+  flow_index = new RegData::FlowIndex();
+  failed_flows = new eventq<FailedFlow>();
+
+  int rc = pthread_create(&flow_thread, NULL, &flow_thread_entry, NULL);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating flow thread");
+    return 1;
+    // LCOV_EXCL_STOP
+  }
+
+  store->set_expiry_listener(&expiry_analytics);
 
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_registrar);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -454,7 +784,34 @@ pj_status_t init_registrar(RegData::Store* registrar_store, AnalyticsLogger* ana
 
 void destroy_registrar()
 {
+  store->set_expiry_listener(NULL);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_registrar);
+
+  // Stop watching transports.
+  pthread_mutex_lock(&watched_transports_lock);
+  for (std::map<pjsip_transport*, pjsip_tp_state_listener_key*>::iterator i = watched_transports.begin();
+       i != watched_transports.end();
+       ++i)
+  {
+    pjsip_transport_remove_state_listener(i->first, i->second, NULL);
+    pjsip_transport_dec_ref(i->first);
+  }
+  watched_transports.clear();
+  pthread_mutex_unlock(&watched_transports_lock);
+
+  // Stop the flow thread.  Bindings of transports still queued are left to
+  // expire.
+  failed_flows->terminate();
+  pthread_join(flow_thread, NULL);
+  delete failed_flows;
+  failed_flows = NULL;
+
+  delete flow_index;
+  flow_index = NULL;
+  delete writer;
+  writer = NULL;
+  delete writer_stat;
+  writer_stat = NULL;
 }
 
 
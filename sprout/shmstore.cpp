@@ -0,0 +1,746 @@
+/**
+ * @file shmstore.cpp Shared memory implementation of the registration data store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmstorefactory.h"
+#include "shmstore.h"
+#include "aorcodec.h"
+#include "log.h"
+
+namespace RegData {
+
+
+  RegData::Store* create_shm_store(const std::string& name)
+  {
+    ShmStore* store = new ShmStore(name);
+    if (!store->ready())
+    {
+      delete store;
+      store = NULL;
+    }
+    return store;
+  }
+
+
+  void destroy_shm_store(RegData::Store* store)
+  {
+    delete (RegData::ShmStore*)store;
+  }
+
+
+  /// Written last when a segment is created, so processes opening it know
+  /// it is ready.
+  static const uint64_t SEGMENT_MAGIC = 0x5350525453484d31ULL;
+
+  /// Changed whenever the segment layout changes.
+  static const uint32_t SEGMENT_VERSION = 1;
+
+  /// The smallest block, and the number of block sizes (doubling each
+  /// time).
+  static const size_t MIN_BLOCK = 64;
+  static const int NUM_CLASSES = 16;
+
+  /// How long to wait for another process to finish creating a segment.
+  static const int INIT_TIMEOUT_MS = 5000;
+
+
+  struct ShmStore::Header
+  {
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t num_buckets;
+    uint64_t size;
+    uint64_t buckets_offset;
+    uint64_t data_offset;
+
+    /// Taken for every change to the segment.  The fields below are only
+    /// used with it held.
+    pthread_mutex_t write_lock;
+
+    /// The last CAS value handed out.
+    uint64_t cas;
+
+    /// The bucket being changed, or -1 if none.
+    int64_t dirty;
+
+    /// The next unallocated block, and the free blocks of each size.
+    uint64_t next_block;
+    uint64_t free_blocks[NUM_CLASSES];
+  };
+
+
+  const uint32_t ShmStore::DEFAULT_BUCKETS;
+  const size_t ShmStore::DEFAULT_DATA_SIZE;
+
+
+  ShmStore::ShmStore(const std::string& name,
+                     uint32_t num_buckets,
+                     size_t data_size) :
+    _header(NULL),
+    _size(0),
+    _terminating(false)
+  {
+    pthread_mutex_init(&_sweep_lock, NULL);
+    pthread_cond_init(&_sweep_cond, NULL);
+
+    if (open_segment(name, num_buckets, data_size))
+    {
+      int rc = pthread_create(&_sweep_thread, NULL, &sweep_thread, (void*)this);
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        LOG_ERROR("Error creating sweep thread, AoRs with no bindings will only be removed when written");
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+
+
+  ShmStore::~ShmStore()
+  {
+    if (_header != NULL)
+    {
+      pthread_mutex_lock(&_sweep_lock);
+      _terminating = true;
+      pthread_cond_signal(&_sweep_cond);
+      pthread_mutex_unlock(&_sweep_lock);
+      pthread_join(_sweep_thread, NULL);
+
+      munmap(_header, _size);
+    }
+    pthread_cond_destroy(&_sweep_cond);
+    pthread_mutex_destroy(&_sweep_lock);
+  }
+
+
+  /// Open the segment, creating it if no other process has.
+  bool ShmStore::open_segment(const std::string& name,
+                              uint32_t num_buckets,
+                              size_t data_size)
+  {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool created = (fd >= 0);
+    if (created)
+    {
+      _size = ((sizeof(Header) + 63) & ~63) +
+              ((num_buckets * sizeof(Bucket) + 63) & ~63) +
+              data_size;
+      if (ftruncate(fd, _size) != 0)
+      {
+        // LCOV_EXCL_START
+        LOG_ERROR("Failed to size shared memory segment %s: %s",
+                  name.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+        // LCOV_EXCL_STOP
+      }
+    }
+    else
+    {
+      fd = (errno == EEXIST) ? shm_open(name.c_str(), O_RDWR, 0600) : -1;
+      if (fd < 0)
+      {
+        LOG_ERROR("Failed to open shared memory segment %s: %s",
+                  name.c_str(), strerror(errno));
+        return false;
+      }
+
+      // The process creating the segment may not have sized it yet.
+      struct stat st;
+      for (int ii = 0;
+           (fstat(fd, &st) == 0) && (st.st_size == 0) && (ii < INIT_TIMEOUT_MS);
+           ++ii)
+      {
+        usleep(1000); // LCOV_EXCL_LINE
+      }
+      _size = st.st_size;
+    }
+
+    void* base = (_size >= sizeof(Header)) ?
+                 mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+                 MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+      LOG_ERROR("Failed to map shared memory segment %s", name.c_str());
+      return false;
+    }
+
+    Header* header = (Header*)base;
+    if (created)
+    {
+      _header = header;
+      init_segment(num_buckets, data_size);
+      LOG_STATUS("Created shared memory segment %s for registration data",
+                 name.c_str());
+    }
+    else
+    {
+      // Wait for the creator to finish setting the segment up.
+      uint64_t magic = header->magic.load(std::memory_order_acquire);
+      for (int ii = 0; (magic == 0) && (ii < INIT_TIMEOUT_MS); ++ii)
+      {
+        // LCOV_EXCL_START
+        usleep(1000);
+        magic = header->magic.load(std::memory_order_acquire);
+        // LCOV_EXCL_STOP
+      }
+
+      if ((magic != SEGMENT_MAGIC) ||
+          (header->version != SEGMENT_VERSION) ||
+          (header->size != _size))
+      {
+        LOG_ERROR("Shared memory segment %s is not a usable registration store",
+                  name.c_str());
+        munmap(base, _size);
+        return false;
+      }
+      _header = header;
+      LOG_STATUS("Opened shared memory segment %s for registration data",
+                 name.c_str());
+    }
+
+    return true;
+  }
+
+
+  /// Lay out a new segment.
+  void ShmStore::init_segment(uint32_t num_buckets, size_t data_size)
+  {
+    _header->version = SEGMENT_VERSION;
+    _header->num_buckets = num_buckets;
+    _header->size = _size;
+    _header->buckets_offset = (sizeof(Header) + 63) & ~63;
+    _header->data_offset = _size - data_size;
+    _header->cas = 0;
+    _header->dirty = -1;
+    _header->next_block = _header->data_offset;
+    memset(_header->free_blocks, 0, sizeof(_header->free_blocks));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&_header->write_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // The buckets are already zeroed, which leaves them empty.
+    _header->magic.store(SEGMENT_MAGIC, std::memory_order_release);
+  }
+
+
+  void ShmStore::flush_all()
+  {
+    if (_header == NULL)
+    {
+      return;
+    }
+
+    lock();
+    Bucket* table = buckets();
+    for (uint32_t ii = 0; ii < _header->num_buckets; ++ii)
+    {
+      if (table[ii].state.load(std::memory_order_relaxed) != EMPTY)
+      {
+        begin_write(&table[ii]);
+        table[ii].state.store(EMPTY, std::memory_order_relaxed);
+        end_write(&table[ii]);
+      }
+    }
+    _header->next_block = _header->data_offset;
+    memset(_header->free_blocks, 0, sizeof(_header->free_blocks));
+    unlock();
+  }
+
+
+  /// Retrieve the AoR data for a given SIP URI, creating it if there isn't
+  /// any already, and returning NULL if there is no segment.
+  AoR* ShmStore::get_aor_data(const std::string& aor_id)
+                              ///< the SIP URI
+  {
+    if (_header == NULL)
+    {
+      return NULL;
+    }
+
+    ShmAoR* aor_data = new ShmAoR;
+    std::string value;
+    uint64_t cas;
+    if (read(aor_id, hash_key(aor_id), value, &cas))
+    {
+      if (!AoRCodec::decode(value.data(), value.length(), aor_data))
+      {
+        // Let the AoR be overwritten.
+        LOG_ERROR("Failed to decode registration data for %s", aor_id.c_str());
+        aor_data->clear();
+      }
+      aor_data->set_cas(cas);
+      expire_bindings(aor_data, time(NULL));
+    }
+
+    return (AoR*)aor_data;
+  }
+
+
+  /// Update the data for a particular address of record.  If the AoR has
+  /// changed since it was read, the update is rejected and this returns
+  /// false.
+  bool ShmStore::set_aor_data(const std::string& aor_id,
+                              ///< the SIP URI
+                              AoR* data)
+                              ///< the data to store
+  {
+    ShmAoR* aor_data = (ShmAoR*)data;
+    if ((_header == NULL) || (aor_data == NULL))
+    {
+      return false;
+    }
+
+    // Encode the AoR before taking the lock.  The block holds the key
+    // followed by the value.
+    int expiry = expire_bindings(aor_data, time(NULL));
+    std::string record = aor_id;
+    if (!aor_data->bindings().empty())
+    {
+      std::string value;
+      AoRCodec::encode(aor_data, value);
+      record.append(value);
+    }
+    uint64_t hash = hash_key(aor_id);
+
+    lock();
+    Bucket* free_bucket;
+    Bucket* b = find(aor_id, hash, &free_bucket);
+    bool rc = (b != NULL) ?
+              (aor_data->get_cas() == b->cas.load(std::memory_order_relaxed)) :
+              (aor_data->get_cas() == 0);
+    if ((rc) && (record.length() == aor_id.length()))
+    {
+      // No bindings left, so remove the AoR.
+      if (b != NULL)
+      {
+        remove(b);
+      }
+    }
+    else if (rc)
+    {
+      uint64_t block = alloc_block(record.length());
+      if ((block == 0) || ((b == NULL) && (free_bucket == NULL)))
+      {
+        LOG_ERROR("Shared memory registration store is full, failed to write %s",
+                  aor_id.c_str());
+        if (block != 0)
+        {
+          free_block(block, record.length());
+        }
+        rc = false;
+      }
+      else
+      {
+        // Fill in the new block, then point the bucket at it.
+        memcpy((char*)_header + block, record.data(), record.length());
+        uint64_t old_block = 0;
+        size_t old_length = 0;
+        if (b == NULL)
+        {
+          b = free_bucket;
+        }
+        else
+        {
+          old_block = b->block.load(std::memory_order_relaxed);
+          old_length = b->key_length.load(std::memory_order_relaxed) +
+                       b->value_length.load(std::memory_order_relaxed);
+        }
+
+        begin_write(b);
+        b->state.store(USED, std::memory_order_relaxed);
+        b->hash.store(hash, std::memory_order_relaxed);
+        b->cas.store(_header->cas + 1, std::memory_order_relaxed);
+        b->block.store(block, std::memory_order_relaxed);
+        b->key_length.store(aor_id.length(), std::memory_order_relaxed);
+        b->value_length.store(record.length() - aor_id.length(), std::memory_order_relaxed);
+        b->expiry.store(expiry, std::memory_order_relaxed);
+        end_write(b);
+
+        if (old_block != 0)
+        {
+          free_block(old_block, old_length);
+        }
+      }
+    }
+
+    if (rc)
+    {
+      aor_data->set_cas(++_header->cas);
+    }
+    unlock();
+
+    return rc;
+  }
+
+
+  void ShmStore::expire_all(int now)
+  {
+    if (_header == NULL)
+    {
+      return;
+    }
+
+    // Look for candidates without the lock, then check them again with it.
+    std::vector<uint32_t> expired;
+    Bucket* table = buckets();
+    for (uint32_t ii = 0; ii < _header->num_buckets; ++ii)
+    {
+      if ((table[ii].state.load(std::memory_order_relaxed) == USED) &&
+          (table[ii].expiry.load(std::memory_order_relaxed) <= now))
+      {
+        expired.push_back(ii);
+      }
+    }
+
+    if (!expired.empty())
+    {
+      lock();
+      for (size_t ii = 0; ii < expired.size(); ++ii)
+      {
+        Bucket* b = &table[expired[ii]];
+        if ((b->state.load(std::memory_order_relaxed) == USED) &&
+            (b->expiry.load(std::memory_order_relaxed) <= now))
+        {
+          remove(b);
+        }
+      }
+      unlock();
+    }
+  }
+
+
+  /// Take the write lock.  If a process died holding it, drop the bucket it
+  /// was changing, if any.
+  void ShmStore::lock()
+  {
+    if (pthread_mutex_lock(&_header->write_lock) == EOWNERDEAD)
+    {
+      LOG_WARNING("Recovering shared memory registration store after a process died writing to it");
+      if (_header->dirty >= 0)
+      {
+        Bucket* b = &buckets()[_header->dirty];
+        b->state.store(DELETED, std::memory_order_relaxed);
+        uint32_t seq = b->seq.load(std::memory_order_relaxed);
+        b->seq.store((seq | 1) + 1, std::memory_order_release);
+        _header->dirty = -1;
+      }
+      pthread_mutex_consistent(&_header->write_lock);
+    }
+  }
+
+
+  void ShmStore::unlock()
+  {
+    pthread_mutex_unlock(&_header->write_lock);
+  }
+
+
+  ShmStore::Bucket* ShmStore::buckets()
+  {
+    return (Bucket*)((char*)_header + _header->buckets_offset);
+  }
+
+
+  /// Look up an AoR without any locks, copying out its value and CAS.
+  /// Returns false if it isn't there.
+  bool ShmStore::read(const std::string& aor_id,
+                      uint64_t hash,
+                      std::string& value,
+                      uint64_t* cas)
+  {
+    Bucket* table = buckets();
+    uint32_t num_buckets = _header->num_buckets;
+    for (uint32_t probe = 0; probe < num_buckets; ++probe)
+    {
+      Bucket* b = &table[(hash + probe) % num_buckets];
+      uint32_t seq;
+      uint32_t state;
+      bool match;
+      int spins = 0;
+      do
+      {
+        seq = b->seq.load(std::memory_order_acquire);
+        if ((seq & 1) && (++spins % 1000 == 0))
+        {
+          // The bucket has been being written for a while, so the writer
+          // may have died.  Taking the lock recovers the bucket if so.
+          lock(); // LCOV_EXCL_LINE
+          unlock(); // LCOV_EXCL_LINE
+        }
+
+        state = b->state.load(std::memory_order_relaxed);
+        match = false;
+        if ((state == USED) &&
+            (b->hash.load(std::memory_order_relaxed) == hash))
+        {
+          // Copy the block out before checking anything in it, as it may
+          // change under us.  Don't trust the lengths until the sequence
+          // number is checked either, beyond keeping them in bounds.
+          uint64_t block = b->block.load(std::memory_order_relaxed);
+          size_t key_length = b->key_length.load(std::memory_order_relaxed);
+          size_t value_length = b->value_length.load(std::memory_order_relaxed);
+          *cas = b->cas.load(std::memory_order_relaxed);
+          if ((block < _size) &&
+              (key_length + value_length <= _size - block))
+          {
+            value.assign((char*)_header + block, key_length + value_length);
+            match = ((key_length == aor_id.length()) &&
+                     (value.compare(0, key_length, aor_id) == 0));
+          }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+      }
+      while ((seq & 1) || (b->seq.load(std::memory_order_relaxed) != seq));
+
+      if (match)
+      {
+        value.erase(0, aor_id.length());
+        return true;
+      }
+      else if (state == EMPTY)
+      {
+        return false;
+      }
+    }
+
+    return false;
+  }
+
+
+  /// Find an AoR's bucket.  If it isn't there, returns NULL and sets free
+  /// to the first bucket it could go in, or NULL if the table is full.
+  /// Must be called with the lock held.
+  ShmStore::Bucket* ShmStore::find(const std::string& aor_id,
+                                   uint64_t hash,
+                                   Bucket** free)
+  {
+    *free = NULL;
+    Bucket* table = buckets();
+    uint32_t num_buckets = _header->num_buckets;
+    for (uint32_t probe = 0; probe < num_buckets; ++probe)
+    {
+      Bucket* b = &table[(hash + probe) % num_buckets];
+      uint32_t state = b->state.load(std::memory_order_relaxed);
+      if ((state == USED) &&
+          (b->hash.load(std::memory_order_relaxed) == hash) &&
+          (key_matches(b, aor_id)))
+      {
+        return b;
+      }
+      else if (state != USED)
+      {
+        if (*free == NULL)
+        {
+          *free = b;
+        }
+        if (state == EMPTY)
+        {
+          break;
+        }
+      }
+    }
+    return NULL;
+  }
+
+
+  bool ShmStore::key_matches(Bucket* b, const std::string& aor_id)
+  {
+    return ((b->key_length.load(std::memory_order_relaxed) == aor_id.length()) &&
+            (memcmp((char*)_header + b->block.load(std::memory_order_relaxed),
+                    aor_id.data(),
+                    aor_id.length()) == 0));
+  }
+
+
+  /// Mark a bucket as being changed.  Must be called with the lock held.
+  void ShmStore::begin_write(Bucket* b)
+  {
+    _header->dirty = b - buckets();
+    b->seq.store(b->seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+
+  void ShmStore::end_write(Bucket* b)
+  {
+    b->seq.store(b->seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+    _header->dirty = -1;
+  }
+
+
+  /// Remove an AoR from its bucket, freeing its block.  If the next bucket
+  /// is empty, this bucket and any removed ones before it can be emptied
+  /// too, so lookups don't have to step over them.  Must be called with the
+  /// lock held.
+  void ShmStore::remove(Bucket* b)
+  {
+    begin_write(b);
+    b->state.store(DELETED, std::memory_order_relaxed);
+    end_write(b);
+    free_block(b->block.load(std::memory_order_relaxed),
+         b->key_length.load(std::memory_order_relaxed) +
+         b->value_length.load(std::memory_order_relaxed));
+
+    Bucket* table = buckets();
+    uint32_t num_buckets = _header->num_buckets;
+    uint32_t ii = b - table;
+    if (table[(ii + 1) % num_buckets].state.load(std::memory_order_relaxed) == EMPTY)
+    {
+      while (table[ii].state.load(std::memory_order_relaxed) == DELETED)
+      {
+        begin_write(&table[ii]);
+        table[ii].state.store(EMPTY, std::memory_order_relaxed);
+        end_write(&table[ii]);
+        ii = (ii + num_buckets - 1) % num_buckets;
+      }
+    }
+  }
+
+
+  /// Allocate a block big enough for the given length, returning its offset
+  /// from the start of the segment, or zero if there's no room.  Must be
+  /// called with the lock held.
+  uint64_t ShmStore::alloc_block(size_t length)
+  {
+    int size_cls = size_class(length);
+    if (size_cls < 0)
+    {
+      return 0;
+    }
+
+    uint64_t block = _header->free_blocks[size_cls];
+    if (block != 0)
+    {
+      // Free blocks hold the offset of the next one.
+      memcpy(&_header->free_blocks[size_cls], (char*)_header + block, sizeof(uint64_t));
+    }
+    else if (_header->next_block + (MIN_BLOCK << size_cls) <= _size)
+    {
+      block = _header->next_block;
+      _header->next_block += (MIN_BLOCK << size_cls);
+    }
+    return block;
+  }
+
+
+  /// Return a block to the free list for its size.  Must be called with the
+  /// lock held.
+  void ShmStore::free_block(uint64_t block, size_t length)
+  {
+    int size_cls = size_class(length);
+    memcpy((char*)_header + block, &_header->free_blocks[size_cls], sizeof(uint64_t));
+    _header->free_blocks[size_cls] = block;
+  }
+
+
+  /// The smallest block size that holds the given length, or -1 if it's
+  /// too big for any.
+  int ShmStore::size_class(size_t length)
+  {
+    for (int size_cls = 0; size_cls < NUM_CLASSES; ++size_cls)
+    {
+      if (length <= (MIN_BLOCK << size_cls))
+      {
+        return size_cls;
+      }
+    }
+    return -1;
+  }
+
+
+  /// FNV-1a, which (unlike std::hash) is the same in every build, so
+  /// processes running different builds agree on where AoRs are.
+  uint64_t ShmStore::hash_key(const std::string& aor_id)
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t ii = 0; ii < aor_id.length(); ++ii)
+    {
+      hash = (hash ^ (unsigned char)aor_id[ii]) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+
+  void* ShmStore::sweep_thread(void* p)
+  {
+    ((ShmStore*)p)->sweep_loop();
+    return NULL;
+  }
+
+
+  void ShmStore::sweep_loop()
+  {
+    pthread_mutex_lock(&_sweep_lock);
+    while (!_terminating)
+    {
+      struct timespec next;
+      clock_gettime(CLOCK_REALTIME, &next);
+      next.tv_sec += 1;
+      pthread_cond_timedwait(&_sweep_cond, &_sweep_lock, &next);
+
+      if (!_terminating)
+      {
+        pthread_mutex_unlock(&_sweep_lock);
+        expire_all(time(NULL));
+        pthread_mutex_lock(&_sweep_lock);
+      }
+    }
+    pthread_mutex_unlock(&_sweep_lock);
+  }
+
+} // namespace RegData
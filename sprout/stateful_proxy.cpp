@@ -69,6 +69,7 @@
 ///
 /// UASTransaction::handle_incoming_non_cancel does:
 /// * 100 if necessary
+/// * start the lookups the request is likely to need (UASTransaction::start_lookups)
 /// * originating call services hook if appropriate.
 ///
 /// UASTransaction::handle_outgoing_non_cancel does:
@@ -124,6 +125,9 @@ extern "C" {
 #include "sessioncase.h"
 #include "ifchandler.h"
 #include "aschain.h"
+#include "registrar.h"
+#include "parsedbinding.h"
+#include "lookups.h"
 
 static RegData::Store* store;
 
@@ -139,6 +143,8 @@ static bool edge_proxy;
 static pjsip_uri* upstream_proxy;
 static ConnectionPool* upstream_conn_pool;
 static FlowTable* flow_table;
+static AsChainTable* as_chain_table;
+static LookupPool* lookup_pool;
 
 static bool ibcf = false;
 
@@ -210,13 +216,15 @@ static pj_status_t proxy_process_routing(pjsip_tx_data *tdata);
 static int compare_sip_sc(int sc1, int sc2);
 static pj_bool_t is_uri_routeable(const pjsip_uri* uri);
 static pj_bool_t is_user_numeric(const std::string& user);
+static bool enum_user_from_uri(const pjsip_uri* uri, std::string& user);
 static pj_status_t add_path(pjsip_tx_data* tdata,
                             const Flow* flow_data,
                             const pjsip_rx_data* rdata);
-static AsChain* create_as_chain(IfcHandler* ifc_handler,
-                                const SessionCase& session_case,
-                                pjsip_msg* msg,
-                                SAS::TrailId trail);
+static AsChainLink create_as_chain(IfcHandler* ifc_handler,
+                                   const SessionCase& session_case,
+                                   pjsip_msg* msg,
+                                   SAS::TrailId trail,
+                                   Lookup<std::shared_ptr<const Ifcs> >& ifcs_lookup);
 
 
 ///@{
@@ -368,6 +376,7 @@ void process_tsx_request(pjsip_rx_data* rdata)
   pjsip_tx_data* tdata;
   UASTransaction* uas_data;
   ServingState serving_state;
+  AsChainLink original_dialog;
   target* target = NULL;
   TrustBoundary* trust = &TrustBoundary::TRUSTED;
 
@@ -417,22 +426,31 @@ void process_tsx_request(pjsip_rx_data* rdata)
       // proxy_calculate_targets as an edge proxy.
       pjsip_sip_uri* uri = (pjsip_sip_uri*)hroute->name_addr.uri;
       pjsip_param* orig_param = pjsip_param_find(&uri->other_param, &STR_ORIG);
-      SessionCase* session_case = (orig_param != NULL) ? &SessionCase::Originating : &SessionCase::Terminating;
+      const SessionCase* session_case = (orig_param != NULL) ? &SessionCase::Originating : &SessionCase::Terminating;
 
       std::string user = PJUtils::pj_str_to_string(&uri->user);
-      bool original_dialog = false;
+      bool is_original_dialog = false;
       if (pj_strncmp(&uri->user, &STR_ODI_PREFIX, STR_ODI_PREFIX.slen) == 0)
       {
         // This is one of our original dialog identifier (ODI) tokens.
-        // See 3GPP TS 24.229 s5.4.3.4.
-        // @@@ For now we just flag it; later we will look up the existing object.
-        original_dialog = true;
+        // See 3GPP TS 24.229 s5.4.3.4.  Find the AS chain it came from,
+        // so we can carry on with the next AS.
+        is_original_dialog = true;
+        original_dialog = as_chain_table->lookup(user);
+        if (original_dialog.is_set())
+        {
+          session_case = &original_dialog.session_case();
+        }
+        else
+        {
+          LOG_WARNING("AS chain for %s no longer exists", user.c_str());
+        }
       }
 
       LOG_DEBUG("Got our Route header, session case %s, OD=%s",
                 session_case->to_string().c_str(),
-                original_dialog ? "y" : "n");
-      serving_state = ServingState(session_case, original_dialog);
+                original_dialog.to_string().c_str());
+      serving_state = ServingState(session_case, is_original_dialog, original_dialog);
     }
 
     // Do standard processing of Route headers.
@@ -1107,7 +1125,8 @@ static
 void proxy_calculate_targets(pjsip_msg* msg,
                              pj_pool_t* pool,
                              target_list& targets,
-                             int max_targets)
+                             int max_targets,
+                             Lookup<std::shared_ptr<RegData::AoR> >* aor_lookup)
 {
   // RFC 3261 Section 16.5 Determining Request Targets
 
@@ -1217,7 +1236,18 @@ void proxy_calculate_targets(pjsip_msg* msg,
     // Look up the target in the registration data store.
     std::string aor = PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, (pjsip_uri*)req_uri);
     LOG_INFO("Look up targets in registration store: %s", aor.c_str());
-    RegData::AoR* aor_data = store->get_aor_data(aor);
+    std::shared_ptr<RegData::AoR> aor_data;
+    if (aor_lookup != NULL)
+    {
+      aor_data = aor_lookup->get(aor, [&]()
+      {
+        return std::shared_ptr<RegData::AoR>(store->get_aor_data(aor));
+      });
+    }
+    else
+    {
+      aor_data.reset(store->get_aor_data(aor));
+    }
 
     // Pick up to max_targets bindings to attempt to contact.  Since
     // some of these may be stale, and we don't want stale bindings to
@@ -1269,33 +1299,23 @@ void proxy_calculate_targets(pjsip_msg* msg,
       target.from_store = PJ_TRUE;
       target.aor = aor;
       target.binding_id = i->first;
-      target.uri = PJUtils::uri_from_string(binding->_uri, pool);
       target.transport = NULL;
+
+      // Bindings from the local store or the AoR cache are parsed already,
+      // so just need cloning into the request's pool.  Others are parsed
+      // straight into it.
+      target.uri = ParsedBinding::binding_uri(binding, pool);
       if (target.uri == NULL)
       {
         LOG_WARNING("Ignoring badly formed contact URI %s for target %s",
                     binding->_uri.c_str(), aor.c_str());
         useable_contact = false;
       }
-      else
+      else if (!ParsedBinding::binding_paths(binding, pool, target.paths))
       {
-        for (std::list<std::string>::const_iterator j = binding->_path_headers.begin();
-             j != binding->_path_headers.end();
-             ++j)
-        {
-          pjsip_uri* path = PJUtils::uri_from_string(*j, pool);
-          if (path != NULL)
-          {
-            target.paths.push_back(PJUtils::uri_from_string(*j, pool));
-          }
-          else
-          {
-            LOG_WARNING("Ignoring contact %s for target %s because of badly formed path header %s",
-                        binding->_uri.c_str(), aor.c_str(), (*j).c_str());
-            useable_contact = false;
-            break;
-          }
-        }
+        LOG_WARNING("Ignoring contact %s for target %s because of a badly formed path header",
+                    binding->_uri.c_str(), aor.c_str());
+        useable_contact = false;
       }
 
       if (useable_contact)
@@ -1303,30 +1323,26 @@ void proxy_calculate_targets(pjsip_msg* msg,
         targets.push_back(target);
       }
     }
-
-    delete aor_data;
   }
 }
 
 
-/// Attempt ENUM lookup if appropriate.
-static pj_status_t translate_request_uri(pjsip_tx_data* tdata, SAS::TrailId trail)
+/// Attempt ENUM lookup if appropriate.  If it has already been
+// prefetched, that is used if it is for the right user.
+static pj_status_t translate_request_uri(pjsip_tx_data* tdata,
+                                         Lookup<std::string>& enum_lookup,
+                                         SAS::TrailId trail)
 {
   pj_status_t status = PJ_SUCCESS;
   std::string uri;
+  std::string user;
 
-  if (PJSIP_URI_SCHEME_IS_SIP(tdata->msg->line.req.uri))
+  if (enum_user_from_uri(tdata->msg->line.req.uri, user))
   {
-    std::string user = PJUtils::pj_str_to_string(&((pjsip_sip_uri*)tdata->msg->line.req.uri)->user);
-    if (is_user_numeric(user))
+    uri = enum_lookup.get(user, [&]()
     {
-      uri = enum_service->lookup_uri_from_user(user, trail);
-    }
-  }
-  else
-  {
-    std::string user = PJUtils::pj_str_to_string(&((pjsip_other_uri*)tdata->msg->line.req.uri)->content);
-    uri = enum_service->lookup_uri_from_user(user, trail);
+      return enum_service->lookup_uri_from_user(user, trail);
+    });
   }
 
   if (!uri.empty())
@@ -1415,7 +1431,7 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
                                                          _req(tdata),
                                                          _best_rsp(NULL),
                                                          _trust(trust),
-                                                         _as_chain(NULL),
+                                                         _as_chain_link(),
                                                          _proxy(NULL),
                                                          _pending_destroy(false),
                                                          _context_count(0)
@@ -1495,13 +1511,6 @@ UASTransaction::~UASTransaction()
     _proxy = NULL;
   }
 
-  if (_as_chain != NULL)
-  {
-    LOG_DEBUG("Free AS chain");
-    delete _as_chain;
-    _as_chain = NULL;
-  }
-
   LOG_DEBUG("UASTransaction destructor completed");
 }
 
@@ -1544,6 +1553,115 @@ UASTransaction* UASTransaction::get_from_tsx(pjsip_transaction* tsx)
 }
 
 
+// Start the lookups this request is likely to need, so that they run
+// concurrently rather than one after another as processing reaches each,
+// and the request only waits as long as the slowest.  The lookups are
+// speculative: if processing turns out to need a different one (for
+// example, because an AS has changed the request URI), it does that
+// itself and the result of this one is discarded.
+void UASTransaction::start_lookups(pjsip_msg* msg, const ServingState& serving_state)
+{
+  SAS::TrailId trail = this->trail();
+
+  // A request coming back from an AS goes on to the next AS in its chain
+  // if there is one, so nothing needed after the chain is looked up yet.
+  const AsChainLink& link = serving_state.original_dialog_link();
+  bool as_pending = ((serving_state.is_set()) &&
+                     (serving_state.original_dialog()) &&
+                     (link.is_set()) &&
+                     (!link.complete()));
+
+  if ((serving_state.is_set()) && (ifc_handler != NULL))
+  {
+    // A new originating request needs the originating user's services,
+    // and then (like a new terminating request) the terminating user's.
+    // A request coming back from an AS only needs the terminating user's,
+    // and only once it has been through the whole originating chain.
+    bool orig = ((!serving_state.original_dialog()) &&
+                 (serving_state.session_case().is_originating()));
+    bool term = ((!serving_state.original_dialog()) ||
+                 ((link.is_set()) &&
+                  (link.session_case().is_originating()) &&
+                  (!as_pending)));
+
+    if (orig)
+    {
+      std::string served_user = IfcHandler::served_user_from_msg(serving_state.session_case(), msg);
+      if (!served_user.empty())
+      {
+        ifcs_lookup(serving_state.session_case()).start(lookup_pool, served_user, [served_user, trail]()
+        {
+          return ifc_handler->get_ifcs(served_user, trail);
+        });
+
+        if ((call_services_handler != NULL) &&
+            (method() == PJSIP_INVITE_METHOD))
+        {
+          _orig_simservs_lookup.start(lookup_pool, served_user, [served_user, trail]()
+          {
+            return call_services_handler->get_simservs_xml(served_user, trail);
+          });
+        }
+      }
+    }
+
+    if (term)
+    {
+      std::string served_user = IfcHandler::served_user_from_msg(SessionCase::Terminating, msg);
+      if (!served_user.empty())
+      {
+        _term_ifcs_lookup.start(lookup_pool, served_user, [served_user, trail]()
+        {
+          return ifc_handler->get_ifcs(served_user, trail);
+        });
+
+        if ((call_services_handler != NULL) &&
+            (method() == PJSIP_INVITE_METHOD))
+        {
+          _term_simservs_lookup.start(lookup_pool, served_user, [served_user, trail]()
+          {
+            return call_services_handler->get_simservs_xml(served_user, trail);
+          });
+        }
+      }
+    }
+  }
+
+  if (as_pending)
+  {
+    return;
+  }
+
+  // The request URI is either translated by ENUM, or looked up in the
+  // registration store.  Where ENUM translates it, the registration store
+  // lookup needs the translated URI, so can't be started yet.
+  pjsip_uri* req_uri = msg->line.req.uri;
+  std::string user;
+  if ((enum_service != NULL) &&
+      (PJUtils::is_home_domain(req_uri)) &&
+      (!is_uri_routeable(req_uri)) &&
+      (enum_user_from_uri(req_uri, user)))
+  {
+    _enum_lookup.start(lookup_pool, user, [user, trail]()
+    {
+      return enum_service->lookup_uri_from_user(user, trail);
+    });
+  }
+  else if ((store != NULL) &&
+           (PJSIP_URI_SCHEME_IS_SIP(req_uri)) &&
+           (((pjsip_sip_uri*)req_uri)->maddr_param.slen == 0) &&
+           ((PJUtils::is_home_domain(req_uri)) ||
+            (PJUtils::is_uri_local(req_uri))))
+  {
+    std::string aor = PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, req_uri);
+    _aor_lookup.start(lookup_pool, aor, [aor]()
+    {
+      return std::shared_ptr<RegData::AoR>(store->get_aor_data(aor));
+    });
+  }
+}
+
+
 // Handle the incoming half of a non-CANCEL message.
 void UASTransaction::handle_incoming_non_cancel(pjsip_rx_data* rdata,
                                                 pjsip_tx_data* tdata,
@@ -1564,11 +1682,19 @@ void UASTransaction::handle_incoming_non_cancel(pjsip_rx_data* rdata,
   // Strip any untrusted headers as required, so we don't pass them on.
   _trust->process_request(tdata);
 
+  if (!edge_proxy)
+  {
+    start_lookups(tdata->msg, serving_state);
+  }
+
   if (serving_state.is_set())
   {
     if (serving_state.original_dialog())
     {
-      LOG_DEBUG("Already complete");
+      // The request has come back from an AS, so carry on down the
+      // chain it came from (if it's still around).
+      LOG_DEBUG("Original dialog, %s", serving_state.original_dialog_link().to_string().c_str());
+      _as_chain_link = serving_state.original_dialog_link();
 
       // @@@ to support demo AS's limitations (TCP not supported),
       // record-route ourselves via UDP, after the AS.  This means
@@ -1583,31 +1709,31 @@ void UASTransaction::handle_incoming_non_cancel(pjsip_rx_data* rdata,
     }
     else
     {
-      _as_chain = create_as_chain(ifc_handler,
-                                  serving_state.session_case(),
-                                  rdata->msg_info.msg,
-                                  trail());
+      _as_chain_link = create_as_chain(ifc_handler,
+                                       serving_state.session_case(),
+                                       rdata->msg_info.msg,
+                                       trail(),
+                                       ifcs_lookup(serving_state.session_case()));
     }
 
     if (serving_state.session_case().is_originating() &&
-        ((_as_chain == NULL) ||
-         (_as_chain->complete())))
+        _as_chain_link.complete())
     {
       // We've completed the originating half: switch to terminating
       // and look up again.
       LOG_DEBUG("Originating AS chain complete, move to terminating chain (1)");
-      delete _as_chain;
-
       if (ifc_handler == NULL)
       {
         LOG_INFO("No IFC handler");
+        _as_chain_link = AsChainLink();
       }
       else
       {
-        _as_chain = create_as_chain(ifc_handler,
-                                    SessionCase::Terminating,
-                                    rdata->msg_info.msg,
-                                    trail());
+        _as_chain_link = create_as_chain(ifc_handler,
+                                         SessionCase::Terminating,
+                                         rdata->msg_info.msg,
+                                         trail(),
+                                         _term_ifcs_lookup);
       }
     }
   }
@@ -1621,7 +1747,7 @@ AsChain::Disposition UASTransaction::handle_originating(pjsip_rx_data* rdata,
                                                         // OUT: target, if disposition is Skip
                                                         target** target)
 {
-  if (!(_as_chain && _as_chain->session_case().is_originating()))
+  if (!(_as_chain_link.is_set() && _as_chain_link.session_case().is_originating()))
   {
     // No chain or not an originating (or orig-cdiv) session case.  Skip.
     return AsChain::Disposition::Next;
@@ -1630,18 +1756,18 @@ AsChain::Disposition UASTransaction::handle_originating(pjsip_rx_data* rdata,
   // Apply originating call services to the message
   LOG_DEBUG("Applying originating services");
   AsChain::Disposition disposition;
-  disposition = _as_chain->on_initial_request(call_services_handler, this, rdata->msg_info.msg, tdata, target);
+  disposition = _as_chain_link.on_initial_request(call_services_handler, this, rdata->msg_info.msg, tdata, target);
 
   if (disposition == AsChain::Disposition::Next)
   {
     // We've completed the originating half: switch to terminating
     // and look up iFCs again.
     LOG_DEBUG("Originating AS chain complete, move to terminating chain (2)");
-    delete _as_chain;
-    _as_chain = create_as_chain(ifc_handler,
-                                SessionCase::Terminating,
-                                rdata->msg_info.msg,
-                                trail());
+    _as_chain_link = create_as_chain(ifc_handler,
+                                     SessionCase::Terminating,
+                                     rdata->msg_info.msg,
+                                     trail(),
+                                     _term_ifcs_lookup);
   }
 
   LOG_INFO("Originating services disposition %d", (int)disposition);
@@ -1664,7 +1790,7 @@ AsChain::Disposition UASTransaction::handle_terminating(pjsip_tx_data* tdata,
     // Request is targeted at this domain but URI is not currently
     // routeable, so translate it to a routeable URI.
     LOG_DEBUG("Translating URI");
-    status = translate_request_uri(_req, trail());
+    status = translate_request_uri(_req, _enum_lookup, trail());
 
     if (status != PJ_SUCCESS)
     {
@@ -1691,11 +1817,11 @@ AsChain::Disposition UASTransaction::handle_terminating(pjsip_tx_data* tdata,
 
   AsChain::Disposition disposition = AsChain::Disposition::Next;
 
-  if (_as_chain && _as_chain->session_case().is_terminating())
+  if (_as_chain_link.is_set() && _as_chain_link.session_case().is_terminating())
   {
     // Apply terminating call services to the message
     LOG_DEBUG("Apply terminating services");
-    disposition = _as_chain->on_initial_request(call_services_handler, this, tdata->msg, tdata, target);
+    disposition = _as_chain_link.on_initial_request(call_services_handler, this, tdata->msg, tdata, target);
     // On return from on_initial_request, our _proxy pointer
     // may be NULL.  Don't use it without checking first.
   }
@@ -1717,7 +1843,7 @@ void UASTransaction::handle_outgoing_non_cancel(pjsip_tx_data* tdata, target* ta
   else
   {
     // Find targets.
-    proxy_calculate_targets(tdata->msg, tdata->pool, targets, MAX_FORKING);
+    proxy_calculate_targets(tdata->msg, tdata->pool, targets, MAX_FORKING, &_aor_lookup);
   }
 
   if (targets.size() == 0)
@@ -2693,19 +2819,10 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
     if (rdata->msg_info.msg->line.status.code == SIP_STATUS_FLOW_FAILED &&
         _from_store)
     {
-      // We're the auth proxy and the flow we used failed, delete the
-      // record of the flow.  We need the retry loop to handle the store's
-      // compare-and-swap.
-      std::string aor = PJUtils::pj_str_to_string(&_aor);
-      std::string binding_id = PJUtils::pj_str_to_string(&_binding_id);
-      RegData::AoR* aor_data;
-      do
-      {
-        aor_data = store->get_aor_data(aor);
-        aor_data->remove_binding(binding_id);
-      } while (!store->set_aor_data(aor, aor_data));
-
-      delete aor_data;
+      // We're the auth proxy and the flow we used failed, so delete the
+      // record of the flow, along with any other bindings that used it.
+      registrar_flow_failed(PJUtils::pj_str_to_string(&_aor),
+                            PJUtils::pj_str_to_string(&_binding_id));
     }
   }
 
@@ -2784,7 +2901,8 @@ pj_status_t init_stateful_proxy(RegData::Store* registrar_store,
                                 const std::string& ibcf_trusted_hosts,
                                 AnalyticsLogger* analytics,
                                 EnumService *enumService,
-                                BgcfService *bgcfService)
+                                BgcfService *bgcfService,
+                                LookupPool* lookupPool)
 {
   pj_status_t status;
 
@@ -2844,9 +2962,16 @@ pj_status_t init_stateful_proxy(RegData::Store* registrar_store,
       }
     }
   }
+  else
+  {
+    // Create an AS chain table to keep track of the AS chains that
+    // requests are working their way along.
+    as_chain_table = new AsChainTable;
+  }
 
   enum_service = enumService;
   bgcf_service = bgcfService;
+  lookup_pool = lookupPool;
 
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_stateful_proxy);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -2869,6 +2994,11 @@ void destroy_stateful_proxy()
     // Destroy the flow table.
     delete flow_table;
   }
+  else
+  {
+    // Destroy the AS chain table.
+    delete as_chain_table;
+  }
 
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_stateful_proxy);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_tu);
@@ -2952,6 +3082,22 @@ static pj_bool_t is_user_numeric(const std::string& user)
   return PJ_TRUE;
 }
 
+/// Gets the user to look up in ENUM for a request URI.
+// @returns true if there is one, false if ENUM doesn't apply to the URI.
+static bool enum_user_from_uri(const pjsip_uri* uri, std::string& user)
+{
+  if (PJSIP_URI_SCHEME_IS_SIP(uri))
+  {
+    user = PJUtils::pj_str_to_string(&((pjsip_sip_uri*)uri)->user);
+    return is_user_numeric(user);
+  }
+  else
+  {
+    user = PJUtils::pj_str_to_string(&((pjsip_other_uri*)uri)->content);
+    return true;
+  }
+}
+
 /// Adds a Path header when functioning as an edge proxy.
 ///
 /// The path header consists of a SIP URI with our host and a user portion that
@@ -2995,11 +3141,13 @@ static pj_status_t add_path(pjsip_tx_data* tdata,
   return PJ_SUCCESS;
 }
 
-/// Factory method: create AsChain by looking up iFCs.
-AsChain* create_as_chain(IfcHandler* ifc_handler,
-                         const SessionCase& session_case,
-                         pjsip_msg* msg,
-                         SAS::TrailId trail)
+/// Factory method: create AsChain by looking up iFCs, returning a link
+/// to its start.
+AsChainLink create_as_chain(IfcHandler* ifc_handler,
+                            const SessionCase& session_case,
+                            pjsip_msg* msg,
+                            SAS::TrailId trail,
+                            Lookup<std::shared_ptr<const Ifcs> >& ifcs_lookup)
 {
   std::string served_user;
   std::vector<std::string> application_servers;
@@ -3007,10 +3155,12 @@ AsChain* create_as_chain(IfcHandler* ifc_handler,
                            msg,
                            trail,
                            served_user,
-                           application_servers);
-  return new AsChain(session_case,
-                     served_user,
-                     application_servers);
+                           application_servers,
+                           &ifcs_lookup);
+  return AsChainLink::create_as_chain(as_chain_table,
+                                     session_case,
+                                     served_user,
+                                     application_servers);
 }
 
 ///@}
@@ -119,10 +119,20 @@ void Statistic::reporter()
 
 
 static std::string known_statnames[] = {
+  "as_chains",
   "client_count",
   "connected_homers",
   "connected_homesteads",
-  "connected_sprouts"
+  "connected_sprouts",
+  "digest_cache",
+  "homer_breaker",
+  "homer_gets",
+  "homestead_breaker",
+  "homestead_gets",
+  "ifc_cache",
+  "memstore_cache",
+  "registrar_writes",
+  "registration_rate"
 };
 
 
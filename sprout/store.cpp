@@ -58,17 +58,51 @@
 
 namespace RegData {
 
-  AoR::AoR(const AoR& other)
+  /// Size of the first block of bindings allocated by an AoR.  Most AoRs
+  /// have only a handful of bindings, so they fit in one block.
+  static const size_t MIN_BINDING_BLOCK = 4;
+
+  /// Orders binding ID -> Binding entries by binding ID.
+  struct BindingIdLess
+  {
+    inline bool operator()(const AoR::Bindings::value_type& entry,
+                           const std::string& binding_id) const
+    {
+      return entry.first < binding_id;
+    }
+  };
+
+  void AoR::Binding::reset()
+  {
+    _uri.clear();
+    _cid.clear();
+    _path_headers.clear();
+    _cseq = 0;
+    _expires = 0;
+    _priority = 0;
+    _params.clear();
+    _parsed.reset();
+  }
+
+  AoR::~AoR()
   {
-    for (Bindings::const_iterator i = other._bindings.begin();
-         i != other._bindings.end();
+    for (std::vector<Binding*>::iterator i = _blocks.begin();
+         i != _blocks.end();
          ++i)
     {
-      Binding* bb = new Binding(*i->second);
-      _bindings.insert(std::make_pair(i->first, bb));
+      delete[] *i;
     }
   }
 
+  AoR::AoR(const AoR& other) :
+    _bindings(),
+    _slots(),
+    _num_used(0),
+    _blocks()
+  {
+    *this = other;
+  }
+
   // Make sure assignment is deep!
   AoR& AoR::operator= (AoR const& other)
   {
@@ -76,28 +110,56 @@ namespace RegData {
     {
       clear();
 
+      // The other AoR's bindings are already in order, so just copy them
+      // into our own slots.
+      reserve_bindings(other._bindings.size());
+      _bindings.reserve(other._bindings.size());
       for (Bindings::const_iterator i = other._bindings.begin();
            i != other._bindings.end();
            ++i)
       {
-        Binding* bb = new Binding(*i->second);
-        _bindings.insert(std::make_pair(i->first, bb));
+        Binding* bb = alloc_binding();
+        *bb = *i->second;
+        _bindings.push_back(std::make_pair(i->first, bb));
       }
     }
 
     return *this;
   }
 
-  /// Clear all the bindings from this object.
-  void AoR::clear()
+  AoR::AoR(AoR&& other) :
+    _bindings(),
+    _slots(),
+    _num_used(0),
+    _blocks()
   {
-    for (Bindings::iterator i = _bindings.begin();
-         i != _bindings.end();
-         ++i)
+    swap(other);
+  }
+
+  AoR& AoR::operator= (AoR&& other)
+  {
+    if (this != &other)
     {
-      delete i->second;
+      clear();
+      swap(other);
     }
+
+    return *this;
+  }
+
+  void AoR::swap(AoR& other)
+  {
+    _bindings.swap(other._bindings);
+    _slots.swap(other._slots);
+    std::swap(_num_used, other._num_used);
+    _blocks.swap(other._blocks);
+  }
+
+  /// Clear all the bindings from this object.
+  void AoR::clear()
+  {
     _bindings.clear();
+    _num_used = 0;
   }
 
   /// Retrieve a binding by Contact URI, creating an empty one if necessary.
@@ -105,16 +167,16 @@ namespace RegData {
   AoR::Binding* AoR::get_binding(const std::string& binding_id)
   {
     AoR::Binding* b;
-    AoR::Bindings::const_iterator i = _bindings.find(binding_id);
-    if (i != _bindings.end())
+    AoR::Bindings::iterator i = lower_bound(binding_id);
+    if ((i != _bindings.end()) && (i->first == binding_id))
     {
       b = i->second;
     }
     else
     {
       // No existing binding with this id, so create a new one.
-      b = new Binding;
-      _bindings.insert(std::make_pair(binding_id, b));
+      b = alloc_binding();
+      _bindings.insert(i, std::make_pair(binding_id, b));
     }
     return b;
   }
@@ -123,14 +185,64 @@ namespace RegData {
   /// does nothing.
   void AoR::remove_binding(const std::string& binding_id)
   {
-    AoR::Bindings::iterator i = _bindings.find(binding_id);
-    if (i != _bindings.end())
+    AoR::Bindings::iterator i = lower_bound(binding_id);
+    if ((i != _bindings.end()) && (i->first == binding_id))
     {
-      delete i->second;
+      free_binding(i->second);
       _bindings.erase(i);
     }
   }
 
+  AoR::Bindings::iterator AoR::lower_bound(const std::string& binding_id)
+  {
+    return std::lower_bound(_bindings.begin(),
+                            _bindings.end(),
+                            binding_id,
+                            BindingIdLess());
+  }
+
+  AoR::Binding* AoR::alloc_binding()
+  {
+    reserve_bindings(1);
+    Binding* b = _slots[_num_used++];
+    b->reset();
+    return b;
+  }
+
+  void AoR::free_binding(Binding* b)
+  {
+    // Swap the slot with the last one in use, so the slots in use stay at
+    // the front.  The Binding objects themselves don't move.
+    for (size_t ii = _num_used; ii > 0; --ii)
+    {
+      if (_slots[ii - 1] == b)
+      {
+        std::swap(_slots[ii - 1], _slots[_num_used - 1]);
+        --_num_used;
+        break;
+      }
+    }
+  }
+
+  void AoR::reserve_bindings(size_t count)
+  {
+    size_t num_free = _slots.size() - _num_used;
+    if (num_free < count)
+    {
+      // Allocate a block big enough for the request, and at least as big as
+      // all the previous blocks put together.
+      size_t block_size = std::max(std::max(count - num_free, _slots.size()),
+                                   MIN_BINDING_BLOCK);
+      Binding* block = new Binding[block_size];
+      _blocks.push_back(block);
+      _slots.reserve(_slots.size() + block_size);
+      for (size_t ii = 0; ii < block_size; ++ii)
+      {
+        _slots.push_back(&block[ii]);
+      }
+    }
+  }
+
   /// Expire any old bindings, and report the latest outstanding expiry time,
   /// or now if none.
   int Store::expire_bindings(AoR* aor_data,
@@ -140,16 +252,16 @@ namespace RegData {
                              /// the epoch.
   {
     int max_expires = now;
+    AoR::Bindings::iterator j = aor_data->_bindings.begin();
     for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
          i != aor_data->_bindings.end();
-      )
+         ++i)
     {
       AoR::Binding* b = i->second;
       if (b->_expires <= now)
       {
         // The binding has expired, so remove it.
-        delete i->second;
-        aor_data->_bindings.erase(i++);
+        aor_data->free_binding(b);
       }
       else
       {
@@ -157,9 +269,15 @@ namespace RegData {
         {
           max_expires = b->_expires;
         }
-        ++i;
+        if (j != i)
+        {
+          j->first.swap(i->first);
+          j->second = b;
+        }
+        ++j;
       }
     }
+    aor_data->_bindings.erase(j, aor_data->_bindings.end());
     return max_expires;
   }
 } // namespace RegData
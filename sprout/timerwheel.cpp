@@ -0,0 +1,188 @@
+/**
+ * @file @file timerwheel.cpp Hierarchical timer wheel keyed on expiry time
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "timerwheel.h"
+
+const int TimerWheel::SLOT_BITS;
+const int TimerWheel::SLOTS_PER_LEVEL;
+const int TimerWheel::NUM_LEVELS;
+
+TimerWheel::TimerWheel(int now) :
+  _now(now),
+  _size(0)
+{
+  for (int level = 0; level < NUM_LEVELS; ++level)
+  {
+    for (int slot = 0; slot < SLOTS_PER_LEVEL; ++slot)
+    {
+      _slots[level][slot].prev = &_slots[level][slot];
+      _slots[level][slot].next = &_slots[level][slot];
+    }
+  }
+}
+
+
+TimerWheel::~TimerWheel()
+{
+  clear();
+}
+
+
+TimerWheel::Timer* TimerWheel::schedule(const std::string& id, int expiry)
+{
+  Timer* timer = new Timer;
+  timer->id = id;
+  timer->expiry = expiry;
+  file(timer);
+  ++_size;
+  return timer;
+}
+
+
+void TimerWheel::cancel(Timer* timer)
+{
+  unlink(timer);
+  delete timer;
+  --_size;
+}
+
+
+void TimerWheel::pop_expired(int now, std::vector<std::string>& expired)
+{
+  if (_size == 0)
+  {
+    // Nothing to pop, so skip straight to the new time.  The slots a timer
+    // is filed in are chosen relative to _now, so this is safe.
+    _now = (now > _now) ? now : _now;
+  }
+
+  while (_now < now)
+  {
+    ++_now;
+
+    // When the lowest wheel wraps, cascade the next slot of the wheel above
+    // (and so on up), highest first so timers can fall through several
+    // levels in one go.
+    int level = 1;
+    while ((level < NUM_LEVELS) &&
+           ((_now & ((1 << (SLOT_BITS * level)) - 1)) == 0))
+    {
+      ++level;
+    }
+    while (--level > 0)
+    {
+      cascade(level);
+    }
+
+    Timer* head = &_slots[0][_now & (SLOTS_PER_LEVEL - 1)];
+    while (head->next != head)
+    {
+      Timer* timer = head->next;
+      expired.push_back(timer->id);
+      cancel(timer);
+    }
+  }
+}
+
+
+void TimerWheel::clear()
+{
+  for (int level = 0; level < NUM_LEVELS; ++level)
+  {
+    for (int slot = 0; slot < SLOTS_PER_LEVEL; ++slot)
+    {
+      Timer* head = &_slots[level][slot];
+      while (head->next != head)
+      {
+        cancel(head->next);
+      }
+    }
+  }
+}
+
+
+/// Put a timer in the right slot for its expiry time.
+void TimerWheel::file(Timer* timer)
+{
+  // Timers that are already due go in the slot for the next tick.
+  int expiry = (timer->expiry > _now) ? timer->expiry : _now + 1;
+  int delta = expiry - _now;
+
+  int level = 0;
+  while ((level < NUM_LEVELS - 1) &&
+         (delta >= (1 << (SLOT_BITS * (level + 1)))))
+  {
+    ++level;
+  }
+
+  if (delta >= (1 << (SLOT_BITS * NUM_LEVELS)))
+  {
+    // Beyond the top wheel, so park it as far out as possible.
+    expiry = _now + (1 << (SLOT_BITS * NUM_LEVELS)) - 1;
+  }
+
+  Timer* head = &_slots[level][(expiry >> (SLOT_BITS * level)) & (SLOTS_PER_LEVEL - 1)];
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+
+/// Re-file the timers in the current slot of a higher wheel.
+void TimerWheel::cascade(int level)
+{
+  Timer* head = &_slots[level][(_now >> (SLOT_BITS * level)) & (SLOTS_PER_LEVEL - 1)];
+  Timer* timer = head->next;
+  head->prev = head;
+  head->next = head;
+  while (timer != head)
+  {
+    Timer* next = timer->next;
+    file(timer);
+    timer = next;
+  }
+}
+
+
+void TimerWheel::unlink(Timer* timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+}
@@ -0,0 +1,420 @@
+/**
+ * @file triggerpoint.cpp Compiled iFC trigger points.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <map>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "log.h"
+#include "triggerpoint.h"
+
+using namespace rapidxml;
+
+const int TriggerPoint::MAX_MATCH_LENGTH;
+
+/// Compile a TriggerPoint element.  Returns NULL, having logged why, if it
+/// isn't valid.
+TriggerPoint* TriggerPoint::compile(xml_node<>* node)
+{
+  TriggerPoint* tp = new TriggerPoint();
+
+  xml_node<>* cnf = node->first_node("ConditionTypeCNF");
+  tp->_cnf = ((cnf != NULL) && (atoi(cnf->value()) != 0));
+
+  for (xml_node<>* spt_node = node->first_node("SPT");
+       spt_node != NULL;
+       spt_node = spt_node->next_sibling("SPT"))
+  {
+    Spt spt;
+    if (!compile_spt(spt_node, spt))
+    {
+      delete tp;
+      return NULL;
+    }
+    tp->_spts.push_back(spt);
+  }
+
+  // Put the cheapest SPTs first, so each group evaluates them first.
+  std::stable_sort(tp->_spts.begin(),
+                   tp->_spts.end(),
+                   [](const Spt& a, const Spt& b) { return a.type < b.type; });
+
+  std::map<int, std::vector<size_t> > groups;
+  for (size_t ii = 0; ii < tp->_spts.size(); ++ii)
+  {
+    for (size_t jj = 0; jj < tp->_spts[ii].groups.size(); ++jj)
+    {
+      groups[tp->_spts[ii].groups[jj]].push_back(ii);
+    }
+  }
+
+  // Lay the groups out one after another, then order them so that the
+  // groups needing only cheap SPTs come first.
+  for (std::map<int, std::vector<size_t> >::const_iterator i = groups.begin();
+       i != groups.end();
+       ++i)
+  {
+    Group group;
+    group.begin = tp->_members.size();
+    tp->_members.insert(tp->_members.end(), i->second.begin(), i->second.end());
+    group.end = tp->_members.size();
+    tp->_groups.push_back(group);
+  }
+  const std::vector<Spt>& spts = tp->_spts;
+  const std::vector<size_t>& members = tp->_members;
+  std::stable_sort(tp->_groups.begin(),
+                   tp->_groups.end(),
+                   [&](const Group& a, const Group& b)
+                   {
+                     return spts[members[a.end - 1]].type <
+                            spts[members[b.end - 1]].type;
+                   });
+
+  return tp;
+}
+
+/// Compile a single SPT.
+//
+// @returns false, having logged why, if it isn't valid.
+bool TriggerPoint::compile_spt(xml_node<>* node, Spt& spt)
+{
+  xml_node<>* negated = node->first_node("ConditionNegated");
+  spt.negated = ((negated != NULL) && (atoi(negated->value()) != 0));
+  spt.session_case = 0;
+  spt.has_content = false;
+
+  for (xml_node<>* group = node->first_node("Group");
+       group != NULL;
+       group = group->next_sibling("Group"))
+  {
+    spt.groups.push_back(atoi(group->value()));
+  }
+  if (spt.groups.empty())
+  {
+    spt.groups.push_back(0);
+  }
+
+  try
+  {
+    xml_node<>* n;
+    if ((n = node->first_node("Method")) != NULL)
+    {
+      spt.type = METHOD;
+      spt.method = n->value();
+    }
+    else if ((n = node->first_node("SessionCase")) != NULL)
+    {
+      spt.type = SESSION_CASE;
+      spt.session_case = atoi(n->value());
+    }
+    else if ((n = node->first_node("RequestURI")) != NULL)
+    {
+      spt.type = REQUEST_URI;
+      spt.content.assign(n->value(), boost::regex::optimize);
+      spt.has_content = true;
+    }
+    else if ((n = node->first_node("SIPHeader")) != NULL)
+    {
+      spt.type = SIP_HEADER;
+      xml_node<>* header = n->first_node("Header");
+      if (header == NULL)
+      {
+        LOG_WARNING("SIPHeader SPT has no Header");
+        return false;
+      }
+      spt.name.assign(header->value(), boost::regex::icase | boost::regex::optimize);
+      xml_node<>* content = n->first_node("Content");
+      if (content != NULL)
+      {
+        spt.content.assign(content->value(), boost::regex::optimize);
+        spt.has_content = true;
+      }
+    }
+    else if ((n = node->first_node("SessionDescription")) != NULL)
+    {
+      spt.type = SESSION_DESCRIPTION;
+      xml_node<>* line = n->first_node("Line");
+      if (line == NULL)
+      {
+        LOG_WARNING("SessionDescription SPT has no Line");
+        return false;
+      }
+      spt.name.assign(line->value(), boost::regex::optimize);
+      xml_node<>* content = n->first_node("Content");
+      if (content != NULL)
+      {
+        spt.content.assign(content->value(), boost::regex::optimize);
+        spt.has_content = true;
+      }
+    }
+    else
+    {
+      LOG_WARNING("Unsupported SPT");
+      return false;
+    }
+  }
+  catch (boost::regex_error& err)
+  {
+    LOG_WARNING("Invalid regular expression in SPT: %s", err.what());
+    return false;
+  }
+
+  return true;
+}
+
+/// Check whether an initial request matches the trigger point.
+bool TriggerPoint::matches(const SessionCase& session_case, pjsip_msg* msg) const
+{
+  // The results of the first 64 SPTs are remembered, as an SPT can be in
+  // several groups.
+  uint64_t evaluated = 0;
+  uint64_t results = 0;
+
+  for (std::vector<Group>::const_iterator group = _groups.begin();
+       group != _groups.end();
+       ++group)
+  {
+    // In CNF a group is true if any SPT is true.  In DNF it's true if
+    // every SPT is true.
+    bool group_result = !_cnf;
+    for (size_t ii = group->begin; ii < group->end; ++ii)
+    {
+      if (evaluate(_members[ii], session_case, msg, evaluated, results) == _cnf)
+      {
+        group_result = _cnf;
+        break;
+      }
+    }
+
+    // In CNF the trigger point is false as soon as any group is false.  In
+    // DNF it's true as soon as any group is true.
+    if (group_result != _cnf)
+    {
+      return !_cnf;
+    }
+  }
+
+  // A trigger point with no SPTs always matches.
+  return (_cnf || _groups.empty());
+}
+
+/// Evaluate an SPT, or use its earlier result.
+bool TriggerPoint::evaluate(size_t index,
+                            const SessionCase& session_case,
+                            pjsip_msg* msg,
+                            uint64_t& evaluated,
+                            uint64_t& results) const
+{
+  if (index >= 64)
+  {
+    return evaluate(_spts[index], session_case, msg);
+  }
+
+  uint64_t bit = 1ull << index;
+  if ((evaluated & bit) == 0)
+  {
+    evaluated |= bit;
+    if (evaluate(_spts[index], session_case, msg))
+    {
+      results |= bit;
+    }
+  }
+  return ((results & bit) != 0);
+}
+
+/// Evaluate an SPT against a request.
+bool TriggerPoint::evaluate(const Spt& spt,
+                            const SessionCase& session_case,
+                            pjsip_msg* msg)
+{
+  bool result = false;
+
+  switch (spt.type)
+  {
+  case METHOD:
+    {
+      const pj_str_t& method = msg->line.req.method.name;
+      result = ((spt.method.length() == (size_t)method.slen) &&
+                (memcmp(spt.method.data(), method.ptr, method.slen) == 0));
+    }
+    break;
+
+  case SESSION_CASE:
+    result = match_session_case(spt.session_case, session_case);
+    break;
+
+  case REQUEST_URI:
+    {
+      char buf[MAX_MATCH_LENGTH];
+      int len = pjsip_uri_print(PJSIP_URI_IN_REQ_URI,
+                                msg->line.req.uri,
+                                buf,
+                                sizeof(buf));
+      result = ((len > 0) &&
+                (boost::regex_search((const char*)buf,
+                                     (const char*)buf + len,
+                                     spt.content)));
+    }
+    break;
+
+  case SESSION_DESCRIPTION:
+    result = match_sdp(spt, msg);
+    break;
+
+  case SIP_HEADER:
+    result = match_header(spt, msg);
+    break;
+  }
+
+  return (result != spt.negated);
+}
+
+/// Check a SessionCase SPT against the session case being handled.  Sprout
+/// doesn't know whether the served user is registered, so the registered
+/// and unregistered cases both match.
+bool TriggerPoint::match_session_case(int spt_session_case,
+                                      const SessionCase& session_case)
+{
+  switch (spt_session_case)
+  {
+  case ORIGINATING_REGISTERED:
+  case ORIGINATING_UNREGISTERED:
+    return (&session_case == &SessionCase::Originating);
+
+  case TERMINATING_REGISTERED:
+  case TERMINATING_UNREGISTERED:
+    return (&session_case == &SessionCase::Terminating);
+
+  case ORIGINATING_CDIV:
+    return (&session_case == &SessionCase::OriginatingCdiv);
+
+  default:
+    return false;
+  }
+}
+
+/// Check whether the request has a header with a matching name and, if
+/// the SPT has content, a matching value.
+bool TriggerPoint::match_header(const Spt& spt, pjsip_msg* msg)
+{
+  for (pjsip_hdr* hdr = msg->hdr.next;
+       hdr != &msg->hdr;
+       hdr = hdr->next)
+  {
+    if ((!boost::regex_match((const char*)hdr->name.ptr,
+                             (const char*)hdr->name.ptr + hdr->name.slen,
+                             spt.name)) &&
+        ((hdr->sname.slen == 0) ||
+         (!boost::regex_match((const char*)hdr->sname.ptr,
+                              (const char*)hdr->sname.ptr + hdr->sname.slen,
+                              spt.name))))
+    {
+      continue;
+    }
+
+    if (!spt.has_content)
+    {
+      return true;
+    }
+
+    // Print the header, and match against the value after the name.
+    char buf[MAX_MATCH_LENGTH];
+    int len = pjsip_hdr_print_on(hdr, buf, sizeof(buf));
+    if (len > 0)
+    {
+      const char* end = buf + len;
+      const char* value = (const char*)memchr(buf, ':', len);
+      if (value != NULL)
+      {
+        for (++value; (value < end) && (*value == ' '); ++value);
+        if (boost::regex_search(value, end, spt.content))
+        {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+/// Check whether the request's SDP body has a line of a matching type and,
+/// if the SPT has content, a matching value.
+bool TriggerPoint::match_sdp(const Spt& spt, pjsip_msg* msg)
+{
+  static const pj_str_t STR_APPLICATION = pj_str("application");
+  static const pj_str_t STR_SDP = pj_str("sdp");
+
+  pjsip_msg_body* body = msg->body;
+  if ((body == NULL) ||
+      (pj_stricmp(&body->content_type.type, &STR_APPLICATION) != 0) ||
+      (pj_stricmp(&body->content_type.subtype, &STR_SDP) != 0))
+  {
+    return false;
+  }
+
+  const char* p = (const char*)body->data;
+  const char* body_end = p + body->len;
+  while (p < body_end)
+  {
+    const char* line_end = (const char*)memchr(p, '\n', body_end - p);
+    const char* next = (line_end != NULL) ? line_end + 1 : body_end;
+    if (line_end == NULL)
+    {
+      line_end = body_end;
+    }
+    if ((line_end > p) && (*(line_end - 1) == '\r'))
+    {
+      --line_end;
+    }
+
+    // SDP lines are <type>=<value>, where the type is a single character.
+    if ((line_end - p >= 2) &&
+        (p[1] == '=') &&
+        (boost::regex_match(p, p + 1, spt.name)) &&
+        ((!spt.has_content) ||
+         (boost::regex_search(p + 2, line_end, spt.content))))
+    {
+      return true;
+    }
+    p = next;
+  }
+
+  return false;
+}
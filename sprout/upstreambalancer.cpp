@@ -0,0 +1,446 @@
+/**
+ * @file upstreambalancer.cpp Balancing of requests over a server's addresses
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <string.h>
+#include <algorithm>
+
+#include "log.h"
+#include "upstreambalancer.h"
+
+const int UpstreamBalancer::RESOLVE_INTERVAL_MS;
+const double UpstreamBalancer::EWMA_WEIGHT = 0.1;
+const int UpstreamBalancer::MIN_SAMPLES;
+const double UpstreamBalancer::MAX_ERROR_RATE = 0.5;
+const double UpstreamBalancer::LATENCY_OUTLIER_FACTOR = 3.0;
+const int UpstreamBalancer::MIN_OUTLIER_LATENCY_MS;
+const int UpstreamBalancer::BASE_EJECTION_MS;
+const int UpstreamBalancer::MAX_EJECTION_MS;
+
+UpstreamBalancer::UpstreamBalancer(const std::string& server) :
+  _server(server),
+  _host(server),
+  _port(),
+  _targets(),
+  _terminating(false),
+  _rand(reinterpret_cast<unsigned long>(this))
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_resolver_cond, NULL);
+
+  // Split off the port, if there is one.  An IPv6 address must be in
+  // brackets to have a port.
+  size_t colon = server.rfind(':');
+  if ((server[0] == '[') &&
+      (server.find(']') != std::string::npos))
+  {
+    size_t close = server.find(']');
+    _host = server.substr(1, close - 1);
+    if ((colon != std::string::npos) && (colon > close))
+    {
+      _port = server.substr(colon + 1);
+    }
+  }
+  else if ((colon != std::string::npos) &&
+           (server.find(':') == colon))
+  {
+    _host = server.substr(0, colon);
+    _port = server.substr(colon + 1);
+  }
+
+  update_targets(resolve());
+
+  int rc = pthread_create(&_resolver, NULL, &resolver_thread, (void*)this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating resolver thread, %s will not be resolved again",
+              _server.c_str());
+    // LCOV_EXCL_STOP
+  }
+}
+
+UpstreamBalancer::~UpstreamBalancer()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_signal(&_resolver_cond);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_resolver, NULL);
+  pthread_cond_destroy(&_resolver_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+/// Choose a target, by the power of two choices: of two random targets,
+/// the one with the least outstanding work, allowing for how quickly it
+/// responds.  If an ejected target is due to be probed, it gets the
+/// request instead.
+std::shared_ptr<UpstreamBalancer::Target> UpstreamBalancer::select(const Target* avoid)
+{
+  uint64_t now = now_ms();
+  pthread_mutex_lock(&_lock);
+  std::shared_ptr<Target> chosen;
+  std::vector<std::shared_ptr<Target> > candidates;
+
+  for (std::map<std::string, std::shared_ptr<Target> >::const_iterator ii = _targets.begin();
+       ii != _targets.end();
+       ++ii)
+  {
+    const std::shared_ptr<Target>& target = ii->second;
+    if (target.get() == avoid)
+    {
+      continue;
+    }
+
+    if (target->ejected_until_ms == 0)
+    {
+      candidates.push_back(target);
+    }
+    else if ((chosen == NULL) &&
+             (!target->probing) &&
+             (now >= target->ejected_until_ms))
+    {
+      LOG_INFO("Probing %s", target->address.c_str());
+      target->probing = true;
+      chosen = target;
+    }
+  }
+
+  if (chosen == NULL)
+  {
+    if (candidates.empty())
+    {
+      // There are no targets we'd rather use, so use any of them rather
+      // than fail the request.
+      for (std::map<std::string, std::shared_ptr<Target> >::const_iterator ii = _targets.begin();
+           ii != _targets.end();
+           ++ii)
+      {
+        candidates.push_back(ii->second);
+      }
+    }
+
+    if (candidates.size() == 1)
+    {
+      chosen = candidates[0];
+    }
+    else
+    {
+      std::uniform_int_distribution<size_t> first(0, candidates.size() - 1);
+      std::uniform_int_distribution<size_t> second(0, candidates.size() - 2);
+      size_t a = first(_rand);
+      size_t b = second(_rand);
+      if (b >= a)
+      {
+        ++b;
+      }
+
+      // Allow 1ms for each request, so that targets with no latency
+      // measured yet still share requests out.
+      double cost_a = (candidates[a]->outstanding + 1) * (candidates[a]->latency_ms + 1.0);
+      double cost_b = (candidates[b]->outstanding + 1) * (candidates[b]->latency_ms + 1.0);
+      chosen = (cost_a <= cost_b) ? candidates[a] : candidates[b];
+    }
+  }
+
+  ++chosen->outstanding;
+  pthread_mutex_unlock(&_lock);
+
+  return chosen;
+}
+
+/// Update the target's averages, and eject or re-admit it accordingly.
+void UpstreamBalancer::complete(const std::shared_ptr<Target>& target,
+                                bool ok,
+                                double latency_ms)
+{
+  uint64_t now = now_ms();
+  pthread_mutex_lock(&_lock);
+  --target->outstanding;
+
+  if (target->probing)
+  {
+    target->probing = false;
+    if (ok)
+    {
+      LOG_STATUS("Re-admitting %s", target->address.c_str());
+      target->ejected_until_ms = 0;
+      target->ejections = 0;
+      target->samples = 0;
+      target->error_rate = 0.0;
+      target->latency_ms = latency_ms;
+    }
+    else
+    {
+      eject(*target, now);
+    }
+  }
+  else if (target->ejected_until_ms == 0)
+  {
+    // The first sample sets the latency outright.
+    double weight = (target->samples == 0) ? 1.0 : EWMA_WEIGHT;
+    target->latency_ms += weight * (latency_ms - target->latency_ms);
+    target->error_rate += EWMA_WEIGHT * ((ok ? 0.0 : 1.0) - target->error_rate);
+    ++target->samples;
+
+    if ((target->samples >= MIN_SAMPLES) &&
+        ((target->error_rate > MAX_ERROR_RATE) || is_outlier(*target)))
+    {
+      // Never eject more than half the targets, as then the rest would
+      // probably be overloaded too.
+      size_t ejected = 0;
+      for (std::map<std::string, std::shared_ptr<Target> >::const_iterator ii = _targets.begin();
+           ii != _targets.end();
+           ++ii)
+      {
+        if (ii->second->ejected_until_ms != 0)
+        {
+          ++ejected;
+        }
+      }
+
+      if ((ejected + 1) * 2 <= _targets.size())
+      {
+        eject(*target, now);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+std::vector<UpstreamBalancer::Target> UpstreamBalancer::targets()
+{
+  std::vector<Target> targets;
+  pthread_mutex_lock(&_lock);
+  for (std::map<std::string, std::shared_ptr<Target> >::const_iterator ii = _targets.begin();
+       ii != _targets.end();
+       ++ii)
+  {
+    targets.push_back(*ii->second);
+  }
+  pthread_mutex_unlock(&_lock);
+  return targets;
+}
+
+std::string UpstreamBalancer::state(const Target& target)
+{
+  return (target.ejected_until_ms == 0) ? "active" :
+         target.probing ? "probing" :
+         "ejected";
+}
+
+/// Resolve the server's host name to its IP addresses.
+std::vector<std::string> UpstreamBalancer::resolve()
+{
+  std::vector<std::string> ips;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* results;
+  int rc = getaddrinfo(_host.c_str(), NULL, &hints, &results);
+
+  if (rc != 0)
+  {
+    LOG_WARNING("Failed to resolve %s: %s", _host.c_str(), gai_strerror(rc));
+    return ips;
+  }
+
+  for (struct addrinfo* ai = results; ai != NULL; ai = ai->ai_next)
+  {
+    char buf[INET6_ADDRSTRLEN];
+    const void* addr = (ai->ai_family == AF_INET6) ?
+                       (const void*)&((struct sockaddr_in6*)ai->ai_addr)->sin6_addr :
+                       (const void*)&((struct sockaddr_in*)ai->ai_addr)->sin_addr;
+    inet_ntop(ai->ai_family, addr, buf, sizeof(buf));
+    std::string ip(buf);
+    if (std::find(ips.begin(), ips.end(), ip) == ips.end())
+    {
+      ips.push_back(ip);
+    }
+  }
+  freeaddrinfo(results);
+
+  return ips;
+}
+
+void* UpstreamBalancer::resolver_thread(void* p)
+{
+  ((UpstreamBalancer*)p)->resolver_loop();
+  return NULL;
+}
+
+/// Resolve the server's name every RESOLVE_INTERVAL_MS until terminated.
+/// The lock is not held while resolving, so requests carry on using the
+/// old targets meanwhile.
+void UpstreamBalancer::resolver_loop()
+{
+  pthread_mutex_lock(&_lock);
+  while (!_terminating)
+  {
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_sec += RESOLVE_INTERVAL_MS / 1000;
+    pthread_cond_timedwait(&_resolver_cond, &_lock, &next);
+
+    if (!_terminating)
+    {
+      pthread_mutex_unlock(&_lock);
+      update_targets(resolve());
+      pthread_mutex_lock(&_lock);
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+/// Update the targets to the IP addresses the server's name resolved to,
+/// keeping the state of any that are already targets.  If it didn't
+/// resolve, keep the current targets.
+void UpstreamBalancer::update_targets(const std::vector<std::string>& ips)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (!ips.empty())
+  {
+    std::map<std::string, std::shared_ptr<Target> > targets;
+
+    for (std::vector<std::string>::const_iterator ii = ips.begin();
+         ii != ips.end();
+         ++ii)
+    {
+      std::string address = (ii->find(':') != std::string::npos) ? ("[" + *ii + "]") : *ii;
+      if (!_port.empty())
+      {
+        address += ":" + _port;
+      }
+
+      std::map<std::string, std::shared_ptr<Target> >::const_iterator old = _targets.find(address);
+      if (old != _targets.end())
+      {
+        targets[address] = old->second;
+      }
+      else
+      {
+        LOG_STATUS("Adding %s as a target for %s", address.c_str(), _server.c_str());
+        targets[address] = new_target(address, *ii);
+      }
+    }
+
+    _targets.swap(targets);
+  }
+  else if (_targets.empty())
+  {
+    // Leave it to cURL to resolve the name.
+    _targets[_server] = new_target(_server, _host);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+std::shared_ptr<UpstreamBalancer::Target> UpstreamBalancer::new_target(const std::string& address,
+                                                                       const std::string& ip)
+{
+  std::shared_ptr<Target> target = std::make_shared<Target>();
+  target->address = address;
+  target->ip = ip;
+  target->outstanding = 0;
+  target->latency_ms = 0.0;
+  target->error_rate = 0.0;
+  target->samples = 0;
+  target->ejections = 0;
+  target->ejected_until_ms = 0;
+  target->probing = false;
+  return target;
+}
+
+/// Whether the target is much slower than the others.
+bool UpstreamBalancer::is_outlier(const Target& target)
+{
+  double total_ms = 0.0;
+  int others = 0;
+  for (std::map<std::string, std::shared_ptr<Target> >::const_iterator ii = _targets.begin();
+       ii != _targets.end();
+       ++ii)
+  {
+    const Target& other = *ii->second;
+    if ((&other != &target) &&
+        (other.ejected_until_ms == 0) &&
+        (other.samples >= MIN_SAMPLES))
+    {
+      total_ms += other.latency_ms;
+      ++others;
+    }
+  }
+
+  return ((others > 0) &&
+          (target.latency_ms > MIN_OUTLIER_LATENCY_MS) &&
+          (target.latency_ms > LATENCY_OUTLIER_FACTOR * total_ms / others));
+}
+
+/// Eject the target, for longer each time it's ejected in a row.
+void UpstreamBalancer::eject(Target& target, uint64_t now_ms)
+{
+  ++target.ejections;
+  uint64_t duration_ms = BASE_EJECTION_MS;
+  for (int ii = 1; (ii < target.ejections) && (duration_ms < (uint64_t)MAX_EJECTION_MS); ++ii)
+  {
+    duration_ms *= 2;
+  }
+  duration_ms = std::min(duration_ms, (uint64_t)MAX_EJECTION_MS);
+
+  LOG_WARNING("Ejecting %s for %lu ms: error rate %.2f, latency %.1f ms",
+              target.address.c_str(),
+              (unsigned long)duration_ms,
+              target.error_rate,
+              target.latency_ms);
+  target.ejected_until_ms = now_ms + duration_ms;
+}
+
+uint64_t UpstreamBalancer::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,413 @@
+/**
+ * @file aorcache_test.cpp UT for the registration data near-cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <map>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "aorcache.h"
+#include "memcachedstore.h"
+#include "statistic.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// In-memory stand-in for a memcached cluster, shared between stores so
+/// they behave like separate sprout nodes.
+struct FakeMemcached
+{
+  FakeMemcached() : next_cas(1), gets(0), sets(0) {}
+
+  std::map<std::string, std::pair<std::string, uint64_t> > records;
+  uint64_t next_cas;
+  int gets;
+  int sets;
+};
+
+/// MemcachedStore talking to a FakeMemcached rather than a real cluster.
+class FakeServerMemcachedStore : public MemcachedStore
+{
+public:
+  FakeServerMemcachedStore(FakeMemcached* server, AoRCache* cache) :
+    MemcachedStore(std::list<std::string>(1, "localhost:11209"), 1, cache),
+    _server(server)
+  {
+  }
+
+private:
+  MemcachedAoR* get_from_server(const std::string& aor_id)
+  {
+    _server->gets++;
+    MemcachedAoR* aor_data;
+    std::map<std::string, std::pair<std::string, uint64_t> >::iterator i =
+      _server->records.find(aor_id);
+    if (i != _server->records.end())
+    {
+      aor_data = deserialize_aor(i->second.first);
+      aor_data->set_cas(i->second.second);
+    }
+    else
+    {
+      aor_data = new MemcachedAoR();
+    }
+    return aor_data;
+  }
+
+  bool set_on_server(const std::string& aor_id, MemcachedAoR* aor_data)
+  {
+    _server->sets++;
+    std::map<std::string, std::pair<std::string, uint64_t> >::iterator i =
+      _server->records.find(aor_id);
+    uint64_t current_cas = (i != _server->records.end()) ? i->second.second : 0;
+    if (aor_data->get_cas() != current_cas)
+    {
+      return false;
+    }
+    aor_data->set_cas(_server->next_cas++);
+    _server->records[aor_id] = std::make_pair(serialize_aor(aor_data),
+                                              aor_data->get_cas());
+    return true;
+  }
+
+  FakeMemcached* _server;
+};
+
+/// Fixture for AoRCacheTest.
+class AoRCacheTest : public BaseTest
+{
+  AoRCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  virtual ~AoRCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  static void add_binding(AoR* aor_data, const std::string& contact, int expires)
+  {
+    AoR::Binding* b = aor_data->get_binding(contact);
+    b->_uri = contact;
+    b->_cid = "1";
+    b->_cseq = 1;
+    b->_expires = expires;
+    b->_priority = 1000;
+  }
+
+  /// Register a contact the way the registrar does - read, modify and
+  /// retry if the write is rejected.  Returns the number of attempts.
+  static int do_register(Store* store, const std::string& aor_id, const std::string& contact)
+  {
+    int attempts = 0;
+    bool done = false;
+    while (!done)
+    {
+      ++attempts;
+      AoR* aor_data = store->get_aor_data(aor_id);
+      add_binding(aor_data, contact, time(NULL) + 300);
+      done = store->set_aor_data(aor_id, aor_data);
+      delete aor_data;
+    }
+    return attempts;
+  }
+};
+
+TEST_F(AoRCacheTest, GetPut)
+{
+  AoRCache cache(100, 1000);
+
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+
+  MemcachedAoR aor_data1;
+  add_binding(&aor_data1, "sip:6505550231@192.168.0.1", 1000);
+  aor_data1.set_cas(7);
+  cache.put("sip:6505550231@homedomain", aor_data1);
+
+  // The cache hands out independent copies, with the CAS.
+  MemcachedAoR* aor_data2 = cache.get("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(7u, aor_data2->get_cas());
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  aor_data2->get_binding("sip:6505550231@192.168.0.2");
+  delete aor_data2;
+
+  aor_data2 = cache.get("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  delete aor_data2;
+
+  // Replacing the entry.
+  aor_data1.set_cas(8);
+  cache.put("sip:6505550231@homedomain", aor_data1);
+  aor_data2 = cache.get("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(8u, aor_data2->get_cas());
+  delete aor_data2;
+
+  AoRCache::Stats stats = cache.stats();
+  EXPECT_EQ(3u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(0u, stats.stale);
+  EXPECT_EQ(1u, stats.entries);
+
+  // Invalidating drops the entry and counts it as stale, but only if there
+  // was an entry.
+  cache.invalidate("sip:6505550231@homedomain");
+  cache.invalidate("sip:6505550231@homedomain");
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+  stats = cache.stats();
+  EXPECT_EQ(1u, stats.stale);
+  EXPECT_EQ(2u, stats.misses);
+  EXPECT_EQ(0u, stats.entries);
+
+  // Clearing drops everything.
+  cache.put("sip:6505550231@homedomain", aor_data1);
+  cache.put("sip:6505550232@homedomain", aor_data1);
+  EXPECT_EQ(2u, cache.stats().entries);
+  cache.clear();
+  EXPECT_EQ(0u, cache.stats().entries);
+  EXPECT_EQ(NULL, cache.get("sip:6505550232@homedomain"));
+}
+
+TEST_F(AoRCacheTest, Expiry)
+{
+  AoRCache cache(100, 1000);
+  MemcachedAoR aor_data1;
+  cache.put("sip:6505550231@homedomain", aor_data1);
+
+  cwtest_advance_time_ms(999);
+  MemcachedAoR* aor_data2 = cache.get("sip:6505550231@homedomain");
+  EXPECT_TRUE(aor_data2 != NULL);
+  delete aor_data2;
+
+  // Using an entry doesn't extend its life.
+  cwtest_advance_time_ms(1);
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+  EXPECT_EQ(0u, cache.stats().entries);
+}
+
+TEST_F(AoRCacheTest, Eviction)
+{
+  // One shard, so the bound is exact.
+  AoRCache cache(3, 1000, NULL, 1);
+  MemcachedAoR aor_data1;
+  cache.put("sip:1@homedomain", aor_data1);
+  cache.put("sip:2@homedomain", aor_data1);
+  cache.put("sip:3@homedomain", aor_data1);
+
+  // Use 1, so 2 is least recently used, then refresh 3.
+  delete cache.get("sip:1@homedomain");
+  cache.put("sip:3@homedomain", aor_data1);
+
+  cache.put("sip:4@homedomain", aor_data1);
+  EXPECT_EQ(3u, cache.stats().entries);
+  EXPECT_EQ(NULL, cache.get("sip:2@homedomain"));
+
+  MemcachedAoR* aor_data2 = cache.get("sip:1@homedomain");
+  EXPECT_TRUE(aor_data2 != NULL);
+  delete aor_data2;
+  aor_data2 = cache.get("sip:3@homedomain");
+  EXPECT_TRUE(aor_data2 != NULL);
+  delete aor_data2;
+  aor_data2 = cache.get("sip:4@homedomain");
+  EXPECT_TRUE(aor_data2 != NULL);
+  delete aor_data2;
+}
+
+TEST_F(AoRCacheTest, Statistic)
+{
+  Statistic stat("memstore_cache");
+  AoRCache cache(100, 1000, &stat);
+
+  // The first lookup reports, the next doesn't until the interval passes.
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+  uint64_t next_report = cache._next_report_ms;
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+  EXPECT_EQ(next_report, cache._next_report_ms);
+
+  cwtest_advance_time_ms(AoRCache::REPORT_INTERVAL_MS);
+  EXPECT_EQ(NULL, cache.get("sip:6505550231@homedomain"));
+  EXPECT_LT(next_report, cache._next_report_ms);
+}
+
+TEST_F(AoRCacheTest, StoreReadThrough)
+{
+  FakeMemcached server;
+  FakeServerMemcachedStore store(&server, new AoRCache(100, 1000));
+
+  EXPECT_EQ(1, do_register(&store, "sip:6505550231@homedomain", "sip:6505550231@192.168.0.1"));
+  EXPECT_EQ(1, server.gets);
+  EXPECT_EQ(1, server.sets);
+
+  // Reads now come from the cache, including the binding just written.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    AoR* aor_data = store.get_aor_data("sip:6505550231@homedomain");
+    ASSERT_TRUE(aor_data != NULL);
+    EXPECT_EQ(1u, aor_data->bindings().size());
+    delete aor_data;
+  }
+  EXPECT_EQ(1, server.gets);
+
+  // Bindings that expire while cached are dropped on the way out.
+  AoR* aor_data = store.get_aor_data("sip:6505550231@homedomain");
+  add_binding(aor_data, "sip:6505550231@192.168.0.2", time(NULL) - 1);
+  EXPECT_TRUE(store.set_aor_data("sip:6505550231@homedomain", aor_data));
+  delete aor_data;
+  aor_data = store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  // Once the entry expires we go back to the server.
+  cwtest_advance_time_ms(1000);
+  aor_data = store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+  EXPECT_EQ(2, server.gets);
+
+  // Flushing the store empties the cache.
+  store.flush_all();
+  EXPECT_EQ(0u, store._cache->stats().entries);
+}
+
+TEST_F(AoRCacheTest, StaleWrite)
+{
+  // Two nodes sharing the same memcached cluster, each with a cache.
+  FakeMemcached server;
+  FakeServerMemcachedStore store1(&server, new AoRCache(100, 1000));
+  FakeServerMemcachedStore store2(&server, new AoRCache(100, 1000));
+
+  EXPECT_EQ(1, do_register(&store1, "sip:6505550231@homedomain", "sip:6505550231@192.168.0.1"));
+
+  // Node 2 reads the AoR (caching it) then node 1 updates it, so node 2's
+  // cached copy is stale.  Node 1's cached copy has the CAS from its own
+  // write, so its update goes straight through.
+  delete store2.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1, do_register(&store1, "sip:6505550231@homedomain", "sip:6505550231@192.168.0.1"));
+  EXPECT_EQ(0u, store1._cache->stats().stale);
+
+  // A registration through node 2 is rejected once, then succeeds
+  // against a fresh read without losing node 1's binding.
+  EXPECT_EQ(2, do_register(&store2, "sip:6505550231@homedomain", "sip:6505550231@192.168.0.2"));
+  EXPECT_EQ(1u, store2._cache->stats().stale);
+
+  AoR* aor_data = store2.get_from_server("sip:6505550231@homedomain");
+  EXPECT_EQ(2u, aor_data->bindings().size());
+  delete aor_data;
+
+  // Node 1 sees node 2's binding once its cached copy is refreshed.
+  EXPECT_EQ(2, do_register(&store1, "sip:6505550231@homedomain", "sip:6505550231@192.168.0.3"));
+  aor_data = store1.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(3u, aor_data->bindings().size());
+  delete aor_data;
+}
+
+TEST_F(AoRCacheTest, CallMix)
+{
+  // A realistic mix of traffic for one node: 1000 subscribers
+  // re-registering every five minutes, and 100 call attempts a second
+  // skewed so that a fifth of the subscribers receive most of the calls.
+  // Each call does a terminating lookup when it arrives and again when it
+  // comes back from the terminating application server, 50ms later.
+  const int NUM_SUBSCRIBERS = 1000;
+  const int TICK_MS = 10;
+  const int RUN_MS = 300 * 1000;
+
+  FakeMemcached server;
+  FakeServerMemcachedStore store(&server, new AoRCache(10000, 1000));
+
+  char aor_id[64];
+  char contact[64];
+  for (int ii = 0; ii < NUM_SUBSCRIBERS; ++ii)
+  {
+    snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", ii);
+    snprintf(contact, sizeof(contact), "sip:%d@10.0.0.1", ii);
+    do_register(&store, aor_id, contact);
+  }
+
+  unsigned int seed = 1;
+  int lookups = 0;
+  int gets_before = server.gets;
+  std::list<std::pair<int, int> > pending;
+  for (int now = 0; now < RUN_MS; now += TICK_MS)
+  {
+    cwtest_advance_time_ms(TICK_MS);
+
+    // One call attempt per tick.
+    seed = seed * 1103515245 + 12345;
+    int subscriber = (seed >> 8) % NUM_SUBSCRIBERS;
+    if ((seed >> 20) % 10 < 8)
+    {
+      subscriber %= NUM_SUBSCRIBERS / 5;
+    }
+    pending.push_back(std::make_pair(now + 50, subscriber));
+    snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", subscriber);
+    delete store.get_aor_data(aor_id);
+    ++lookups;
+
+    while ((!pending.empty()) && (pending.front().first <= now))
+    {
+      snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", pending.front().second);
+      delete store.get_aor_data(aor_id);
+      ++lookups;
+      pending.pop_front();
+    }
+
+    // Re-registrations, spread evenly.
+    if ((now % (RUN_MS / NUM_SUBSCRIBERS)) == 0)
+    {
+      int reg = now / (RUN_MS / NUM_SUBSCRIBERS);
+      snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", reg);
+      snprintf(contact, sizeof(contact), "sip:%d@10.0.0.1", reg);
+      do_register(&store, aor_id, contact);
+      ++lookups;
+    }
+  }
+
+  // Well over half the lookups are now answered from local memory.
+  int server_gets = server.gets - gets_before;
+  AoRCache::Stats stats = store._cache->stats();
+  EXPECT_GT(stats.hits, (uint64_t)(lookups * 6 / 10));
+  EXPECT_LT(server_gets, lookups * 4 / 10);
+}
@@ -0,0 +1,332 @@
+/**
+ * @file aorcodec_test.cpp UT for the registration data record encoding.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <string.h>
+#include <pthread.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "aorcodec.h"
+#include "fakelogger.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// Fixture for AoRCodecTest.
+class AoRCodecTest : public ::testing::Test
+{
+  FakeLogger _log;
+
+  AoRCodecTest()
+  {
+  }
+
+  virtual ~AoRCodecTest()
+  {
+  }
+
+  /// Add a typical binding to the AoR.
+  static void add_binding(AoR* aor_data, const std::string& instance, int expires)
+  {
+    AoR::Binding* b = aor_data->get_binding("urn:uuid:" + instance + ":1");
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = expires;
+    b->_priority = 1000;
+    b->_params.push_back(std::make_pair("+sip.instance", "\"<urn:uuid:" + instance + ">\""));
+    b->_params.push_back(std::make_pair("reg-id", "1"));
+    b->_params.push_back(std::make_pair("+sip.ice", ""));
+    b->_path_headers.push_back("<sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob>");
+    b->_path_headers.push_back("<sip:P1.EXAMPLEVISITED.COM;lr>");
+  }
+
+  /// Write an AoR in the original unversioned format.
+  static std::string encode_legacy(AoR* aor_data)
+  {
+    std::string s;
+    append_int(s, aor_data->bindings().size());
+    for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      AoR::Binding* b = i->second;
+      s.append(i->first).push_back('\0');
+      s.append(b->_uri).push_back('\0');
+      s.append(b->_cid).push_back('\0');
+      append_int(s, b->_cseq);
+      append_int(s, b->_expires);
+      append_int(s, b->_priority);
+      append_int(s, b->_params.size());
+      for (AoR::Binding::Params::const_iterator j = b->_params.begin();
+           j != b->_params.end();
+           ++j)
+      {
+        s.append(j->first).push_back('\0');
+        s.append(j->second).push_back('\0');
+      }
+      append_int(s, b->_path_headers.size());
+      for (AoR::Binding::PathHeaders::const_iterator j = b->_path_headers.begin();
+           j != b->_path_headers.end();
+           ++j)
+      {
+        s.append(*j).push_back('\0');
+      }
+    }
+    return s;
+  }
+
+  static void append_int(std::string& s, int value)
+  {
+    s.append((const char*)&value, sizeof(int));
+  }
+
+  static void expect_same(AoR* aor_data1, AoR* aor_data2)
+  {
+    ASSERT_EQ(aor_data1->bindings().size(), aor_data2->bindings().size());
+    AoR::Bindings::const_iterator i1 = aor_data1->bindings().begin();
+    AoR::Bindings::const_iterator i2 = aor_data2->bindings().begin();
+    for (; i1 != aor_data1->bindings().end(); ++i1, ++i2)
+    {
+      EXPECT_EQ(i1->first, i2->first);
+      EXPECT_EQ(i1->second->_uri, i2->second->_uri);
+      EXPECT_EQ(i1->second->_cid, i2->second->_cid);
+      EXPECT_EQ(i1->second->_cseq, i2->second->_cseq);
+      EXPECT_EQ(i1->second->_expires, i2->second->_expires);
+      EXPECT_EQ(i1->second->_priority, i2->second->_priority);
+      EXPECT_EQ(i1->second->_params, i2->second->_params);
+      EXPECT_EQ(i1->second->_path_headers, i2->second->_path_headers);
+    }
+  }
+};
+
+TEST_F(AoRCodecTest, RoundTrip)
+{
+  AoR aor_data1;
+  add_binding(&aor_data1, "00000000-0000-0000-0000-b4dd32817622", 1700000300);
+  add_binding(&aor_data1, "00000000-0000-0000-0000-2867e5552dfc", 1700000183);
+
+  // Out-of-range values must survive too.
+  AoR::Binding* b = aor_data1.get_binding("odd");
+  b->_cseq = -1;
+  b->_expires = 0;
+  b->_priority = 0x7FFFFFFF;
+
+  std::string s;
+  AoRCodec::encode(&aor_data1, s);
+  EXPECT_EQ('\xFF', s[0]);
+  EXPECT_EQ(AoRCodec::VERSION, (uint8_t)s[3]);
+  EXPECT_EQ(0, s[4]);
+
+  AoR aor_data2;
+  EXPECT_TRUE(AoRCodec::decode(s.data(), s.length(), &aor_data2));
+  expect_same(&aor_data1, &aor_data2);
+}
+
+TEST_F(AoRCodecTest, Empty)
+{
+  AoR aor_data1;
+  std::string s;
+  AoRCodec::encode(&aor_data1, s);
+  EXPECT_EQ(6u, s.length());
+
+  AoR aor_data2;
+  EXPECT_TRUE(AoRCodec::decode(s.data(), s.length(), &aor_data2));
+  EXPECT_EQ(0u, aor_data2.bindings().size());
+}
+
+TEST_F(AoRCodecTest, Compressed)
+{
+  // Enough bindings, all sharing the same Path set, to make compression
+  // worthwhile.
+  AoR aor_data1;
+  char instance[64];
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    snprintf(instance, sizeof(instance), "00000000-0000-0000-0000-%012d", ii);
+    add_binding(&aor_data1, instance, 1700000000 + ii);
+  }
+
+  std::string s;
+  AoRCodec::encode(&aor_data1, s);
+  EXPECT_EQ(AoRCodec::FLAG_COMPRESSED, (uint8_t)s[4]);
+  EXPECT_GT(AoRCodec::COMPRESS_THRESHOLD, s.length());
+
+  AoR aor_data2;
+  EXPECT_TRUE(AoRCodec::decode(s.data(), s.length(), &aor_data2));
+  expect_same(&aor_data1, &aor_data2);
+
+  // Trailing junk after the deflate stream is rejected.
+  std::string bad = s + "x";
+  AoR aor_data3;
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data3));
+
+  // A corrupt deflate stream is rejected.
+  s[s.length() - 3] ^= 0x55;
+  EXPECT_FALSE(AoRCodec::decode(s.data(), s.length(), &aor_data3));
+
+  // So is an implausible uncompressed length.
+  bad = s.substr(0, 5) + "\xFF\xFF\xFF\x7F" + s.substr(8);
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data3));
+}
+
+/// Encode and decode a large record, so the calling thread sets up its
+/// zlib streams.
+static void* compress_on_thread(void* arg)
+{
+  AoR aor_data1;
+  char instance[64];
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    snprintf(instance, sizeof(instance), "00000000-0000-0000-0000-%012d", ii);
+    AoRCodecTest::add_binding(&aor_data1, instance, 1700000000 + ii);
+  }
+
+  std::string s;
+  AoRCodec::encode(&aor_data1, s);
+  AoR aor_data2;
+  *(bool*)arg = ((uint8_t)s[4] == AoRCodec::FLAG_COMPRESSED) &&
+                AoRCodec::decode(s.data(), s.length(), &aor_data2);
+  return NULL;
+}
+
+TEST_F(AoRCodecTest, CompressedOtherThread)
+{
+  // The per-thread zlib streams are released when the thread exits.
+  pthread_t thread;
+  bool success = false;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, compress_on_thread, &success));
+  pthread_join(thread, NULL);
+  EXPECT_TRUE(success);
+}
+
+TEST_F(AoRCodecTest, Legacy)
+{
+  AoR aor_data1;
+  add_binding(&aor_data1, "00000000-0000-0000-0000-b4dd32817622", 1700000300);
+  add_binding(&aor_data1, "00000000-0000-0000-0000-2867e5552dfc", 1700000183);
+  aor_data1.get_binding("bare")->_uri = "sip:bare@10.0.0.1";
+
+  std::string s = encode_legacy(&aor_data1);
+  AoR aor_data2;
+  EXPECT_TRUE(AoRCodec::decode(s.data(), s.length(), &aor_data2));
+  expect_same(&aor_data1, &aor_data2);
+
+  // An empty legacy record.
+  AoR aor_data3;
+  s = encode_legacy(&aor_data3);
+  EXPECT_TRUE(AoRCodec::decode(s.data(), s.length(), &aor_data3));
+  EXPECT_EQ(0u, aor_data3.bindings().size());
+}
+
+TEST_F(AoRCodecTest, LegacyMalformed)
+{
+  AoR aor_data1;
+  add_binding(&aor_data1, "00000000-0000-0000-0000-b4dd32817622", 1700000300);
+  std::string s = encode_legacy(&aor_data1);
+
+  // Every truncation of the record must be rejected.
+  for (size_t len = 0; len < s.length(); ++len)
+  {
+    AoR aor_data2;
+    EXPECT_FALSE(AoRCodec::decode(s.data(), len, &aor_data2)) << len;
+  }
+
+  // As must negative or implausibly large counts.
+  AoR aor_data2;
+  std::string bad = s;
+  int count = -1;
+  memcpy(&bad[0], &count, sizeof(int));
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+  count = 1000;
+  memcpy(&bad[0], &count, sizeof(int));
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+
+  // Param count follows the binding ID, URI, Call-ID and three ints.
+  size_t params_offset = sizeof(int) + s.find('\0', s.find('\0', s.find('\0', sizeof(int)) + 1) + 1) + 1 + 2 * sizeof(int);
+  bad = s;
+  count = -1;
+  memcpy(&bad[params_offset], &count, sizeof(int));
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+
+  // Path count follows the three params.
+  size_t paths_offset = params_offset + sizeof(int);
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    paths_offset = s.find('\0', paths_offset) + 1;
+  }
+  bad = s;
+  memcpy(&bad[paths_offset], &count, sizeof(int));
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+}
+
+TEST_F(AoRCodecTest, Malformed)
+{
+  AoR aor_data1;
+  add_binding(&aor_data1, "00000000-0000-0000-0000-b4dd32817622", 1700000300);
+  std::string s;
+  AoRCodec::encode(&aor_data1, s);
+
+  // Every truncation of the record must be rejected.
+  for (size_t len = 5; len < s.length(); ++len)
+  {
+    AoR aor_data2;
+    EXPECT_FALSE(AoRCodec::decode(s.data(), len, &aor_data2)) << len;
+  }
+
+  // As must trailing junk.
+  AoR aor_data2;
+  std::string bad = s + "x";
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+
+  // An over-long varint.
+  bad = s.substr(0, 5) + "\xFF\xFF\xFF\xFF\xFF\x01";
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+
+  // A binding count larger than the record could hold.
+  bad = s.substr(0, 5) + "\x7F" + s.substr(6);
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+
+  // An unknown version.
+  bad = s;
+  bad[3] = AoRCodec::VERSION + 1;
+  EXPECT_FALSE(AoRCodec::decode(bad.data(), bad.length(), &aor_data2));
+}
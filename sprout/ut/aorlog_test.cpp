@@ -0,0 +1,273 @@
+/**
+ * @file aorlog_test.cpp UT for the AoRLog class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "aorlog.h"
+#include "fakelogger.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// Fixture for AoRLogTest.
+class AoRLogTest : public ::testing::Test
+{
+  FakeLogger _log;
+  std::string _path;
+
+  AoRLogTest()
+  {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/aorlog_test.%d", getpid());
+    _path = path;
+    unlink(_path.c_str());
+  }
+
+  virtual ~AoRLogTest()
+  {
+    unlink(_path.c_str());
+    unlink((_path + ".tmp").c_str());
+  }
+
+  /// Write an AoR with a single binding.
+  static void write(AoRLog* log,
+                    const std::string& aor_id,
+                    const std::string& uri,
+                    int expires)
+  {
+    AoR aor_data;
+    AoR::Binding* b = aor_data.get_binding("<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1");
+    b->_uri = uri;
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_expires = expires;
+    log->write(aor_id, &aor_data);
+  }
+
+  /// Read the URI of an AoR's binding back, or an empty string if it can't
+  /// be read.
+  static std::string read(AoRLog* log, const std::string& aor_id)
+  {
+    AoR aor_data;
+    if ((!log->read(aor_id, &aor_data)) ||
+        (aor_data.bindings().size() != 1))
+    {
+      return "";
+    }
+    return aor_data.bindings()[0].second->_uri;
+  }
+
+  /// Get the AoR IDs and expiry times found in a log.
+  static std::map<std::string, int> load(AoRLog* log)
+  {
+    std::map<std::string, int> aors;
+    log->load([&aors](const std::string& aor_id, int next_expiry)
+              { aors[aor_id] = next_expiry; });
+    return aors;
+  }
+
+  /// A long URI that doesn't compress.
+  static std::string long_uri()
+  {
+    std::string user;
+    unsigned int seed = 1;
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      user.push_back('a' + rand_r(&seed) % 26);
+    }
+    return "sip:" + user + "@example.com";
+  }
+
+  size_t file_size()
+  {
+    struct stat st;
+    stat(_path.c_str(), &st);
+    return st.st_size;
+  }
+};
+
+TEST_F(AoRLogTest, Restart)
+{
+  AoRLog* log = new AoRLog(_path);
+  EXPECT_EQ(0u, load(log).size());
+  write(log, "sip:6505550231@homedomain", "sip:a@example.com", 1000);
+  write(log, "sip:6505550232@homedomain", "sip:b@example.com", 2000);
+  write(log, "sip:6505550233@homedomain", "sip:c@example.com", 3000);
+  write(log, "sip:6505550232@homedomain", "sip:d@example.com", 4000);
+  EXPECT_EQ("sip:d@example.com", read(log, "sip:6505550232@homedomain"));
+
+  // An AoR with no bindings is removed from the log.
+  AoR empty;
+  log->write("sip:6505550233@homedomain", &empty);
+  log->write("sip:6505550234@homedomain", &empty);
+  EXPECT_EQ("", read(log, "sip:6505550233@homedomain"));
+  delete log;
+
+  // The latest record for each AoR is there after a restart.
+  log = new AoRLog(_path);
+  std::map<std::string, int> aors = load(log);
+  ASSERT_EQ(2u, aors.size());
+  EXPECT_EQ(1000, aors["sip:6505550231@homedomain"]);
+  EXPECT_EQ(4000, aors["sip:6505550232@homedomain"]);
+  EXPECT_EQ("sip:a@example.com", read(log, "sip:6505550231@homedomain"));
+  EXPECT_EQ("sip:d@example.com", read(log, "sip:6505550232@homedomain"));
+
+  // Clearing the log empties it for good.
+  log->clear();
+  EXPECT_EQ(0u, load(log).size());
+  delete log;
+  log = new AoRLog(_path);
+  EXPECT_EQ(0u, load(log).size());
+  delete log;
+}
+
+TEST_F(AoRLogTest, Grow)
+{
+  // Write enough to need the file to grow a couple of times.
+  AoRLog* log = new AoRLog(_path);
+  std::string uri = long_uri();
+  for (int ii = 0; ii < 3000; ++ii)
+  {
+    write(log, "sip:" + std::to_string(ii) + "@homedomain", uri, 1000 + ii);
+  }
+  EXPECT_EQ(4 * AoRLog::INITIAL_SIZE, file_size());
+  delete log;
+
+  log = new AoRLog(_path);
+  EXPECT_EQ(3000u, load(log).size());
+  EXPECT_EQ(uri, read(log, "sip:2999@homedomain"));
+  delete log;
+}
+
+TEST_F(AoRLogTest, Compact)
+{
+  AoRLog* log = new AoRLog(_path);
+  std::string uri = long_uri();
+  write(log, "sip:6505550231@homedomain", "sip:a@example.com", 1000);
+  write(log, "sip:6505550232@homedomain", "sip:b@example.com", 3000);
+
+  // Nothing happens while the log is small.
+  size_t used = log->_used;
+  log->maybe_compact(2000);
+  EXPECT_EQ(used, log->_used);
+
+  // Rewriting the same AoR fills the log with superseded records, which
+  // compacting gets rid of, along with the AoRs that have expired.
+  for (int ii = 0; ii < 1500; ++ii)
+  {
+    write(log, "sip:6505550233@homedomain", uri, 3000 + ii);
+  }
+  EXPECT_LT(AoRLog::INITIAL_SIZE, log->_used);
+  log->maybe_compact(2000);
+  EXPECT_GT(4096u, log->_used);
+  EXPECT_EQ(AoRLog::INITIAL_SIZE, file_size());
+  EXPECT_EQ(2u, load(log).size());
+  EXPECT_EQ("sip:b@example.com", read(log, "sip:6505550232@homedomain"));
+  EXPECT_EQ(uri, read(log, "sip:6505550233@homedomain"));
+
+  // The compacted log carries on as normal.
+  write(log, "sip:6505550234@homedomain", "sip:c@example.com", 4000);
+  delete log;
+  log = new AoRLog(_path);
+  std::map<std::string, int> aors = load(log);
+  ASSERT_EQ(3u, aors.size());
+  EXPECT_EQ(4499, aors["sip:6505550233@homedomain"]);
+  EXPECT_EQ("sip:c@example.com", read(log, "sip:6505550234@homedomain"));
+  delete log;
+}
+
+TEST_F(AoRLogTest, Corrupt)
+{
+  AoRLog* log = new AoRLog(_path);
+  write(log, "sip:6505550231@homedomain", "sip:a@example.com", 1000);
+  write(log, "sip:6505550232@homedomain", "sip:b@example.com", 2000);
+  size_t offset = log->_index["sip:6505550232@homedomain"].offset;
+  write(log, "sip:6505550233@homedomain", "sip:c@example.com", 3000);
+
+  // Damage the value of the first record, and the header of the second.
+  log->_base[log->_index["sip:6505550231@homedomain"].offset + 100] ^= 1;
+  log->_base[offset + 12] ^= 1;
+  delete log;
+
+  // The log stops at the damaged header, and the first record can't be
+  // read.
+  log = new AoRLog(_path);
+  EXPECT_EQ(1u, load(log).size());
+  EXPECT_EQ("", read(log, "sip:6505550231@homedomain"));
+  EXPECT_EQ(offset, log->_used);
+
+  // The damaged records are wiped, so later writes are read back cleanly
+  // however they line up with the old ones.
+  write(log, "sip:6505550234@homedomain", "sip:d@example.com", 4000);
+  delete log;
+  log = new AoRLog(_path);
+  EXPECT_EQ(2u, load(log).size());
+  EXPECT_EQ("sip:d@example.com", read(log, "sip:6505550234@homedomain"));
+  delete log;
+
+  // A file that isn't a log is started afresh.
+  FILE* f = fopen(_path.c_str(), "w");
+  fputs("Not a registration log", f);
+  fclose(f);
+  log = new AoRLog(_path);
+  EXPECT_EQ(0u, load(log).size());
+  write(log, "sip:6505550231@homedomain", "sip:a@example.com", 1000);
+  EXPECT_EQ("sip:a@example.com", read(log, "sip:6505550231@homedomain"));
+  delete log;
+}
+
+TEST_F(AoRLogTest, NoFile)
+{
+  // If the file can't be opened the log does nothing.
+  AoRLog log("/nonexistent/aorlog");
+  write(&log, "sip:6505550231@homedomain", "sip:a@example.com", 1000);
+  EXPECT_EQ("", read(&log, "sip:6505550231@homedomain"));
+  EXPECT_EQ(0u, load(&log).size());
+  log.maybe_compact(0);
+  log.clear();
+}
@@ -0,0 +1,368 @@
+/**
+ * @file aorwriter_test.cpp UT for the AoRWriter class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "aorwriter.h"
+#include "localstore.h"
+#include "statistic.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// LocalStore that can be made to fail reads and writes, and to hold reads
+/// until released.
+class FaultyStore : public LocalStore
+{
+public:
+  FaultyStore() :
+    LocalStore(1),
+    gets(0),
+    sets(0),
+    fail_gets(false),
+    fail_sets(0),
+    held(false),
+    holding(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  virtual ~FaultyStore()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  AoR* get_aor_data(const std::string& aor_id)
+  {
+    pthread_mutex_lock(&lock);
+    ++gets;
+    holding = held;
+    pthread_cond_broadcast(&cond);
+    while (held)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    holding = false;
+    bool fail = fail_gets;
+    pthread_mutex_unlock(&lock);
+    return fail ? NULL : LocalStore::get_aor_data(aor_id);
+  }
+
+  bool set_aor_data(const std::string& aor_id, AoR* aor_data)
+  {
+    pthread_mutex_lock(&lock);
+    ++sets;
+    bool fail = (fail_sets > 0);
+    if (fail)
+    {
+      --fail_sets;
+    }
+    pthread_mutex_unlock(&lock);
+    return fail ? false : LocalStore::set_aor_data(aor_id, aor_data);
+  }
+
+  /// Hold reads from now on.
+  void hold()
+  {
+    pthread_mutex_lock(&lock);
+    held = true;
+    pthread_mutex_unlock(&lock);
+  }
+
+  /// Wait for a read to be held.
+  void wait_held()
+  {
+    pthread_mutex_lock(&lock);
+    while (!holding)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  /// Let reads proceed.
+  void release()
+  {
+    pthread_mutex_lock(&lock);
+    held = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int gets;
+  int sets;
+  bool fail_gets;
+  int fail_sets;
+  bool held;
+  bool holding;
+};
+
+/// Fixture for AoRWriterTest.
+class AoRWriterTest : public BaseTest
+{
+  AoRWriterTest()
+  {
+    cwtest_reset_time();
+  }
+
+  virtual ~AoRWriterTest()
+  {
+    cwtest_reset_time();
+  }
+
+  /// Update that adds a binding.
+  static AoRWriter::Update add_binding(const std::string& binding_id)
+  {
+    return [binding_id](AoR* aor_data)
+    {
+      aor_data->get_binding(binding_id)->_expires = time(NULL) + 300;
+    };
+  }
+
+  /// Number of updates queued for an AoR.
+  static size_t queued(AoRWriter& writer, const std::string& aor_id)
+  {
+    pthread_mutex_lock(&writer._lock);
+    size_t count = (writer._queues.count(aor_id) == 0) ?
+                     0 : writer._queues[aor_id].pending.size();
+    pthread_mutex_unlock(&writer._lock);
+    return count;
+  }
+};
+
+/// Arguments for an updating thread.
+struct UpdateArgs
+{
+  AoRWriter* writer;
+  std::string aor_id;
+  std::string binding_id;
+  size_t bindings;
+};
+
+static void* do_update(void* p)
+{
+  UpdateArgs* args = (UpdateArgs*)p;
+  AoR* aor_data = args->writer->update(args->aor_id,
+                                       AoRWriterTest::add_binding(args->binding_id));
+  args->bindings = (aor_data != NULL) ? aor_data->bindings().size() : 0;
+  delete aor_data;
+  return NULL;
+}
+
+TEST_F(AoRWriterTest, Update)
+{
+  FaultyStore store;
+  AoRWriter writer(&store);
+
+  AoR* aor_data = writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:1>"));
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  aor_data = store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  AoRWriter::Stats stats = writer.stats();
+  EXPECT_EQ(1u, stats.writes);
+  EXPECT_EQ(0u, stats.coalesced);
+  EXPECT_EQ(0u, stats.conflicts);
+  EXPECT_TRUE(writer._queues.empty());
+}
+
+TEST_F(AoRWriterTest, Coalesce)
+{
+  const int NUM_THREADS = 4;
+  FaultyStore store;
+  AoRWriter writer(&store);
+
+  // Hold the first thread's read, so the others queue up behind it.
+  store.hold();
+  pthread_t threads[NUM_THREADS];
+  UpdateArgs args[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    args[ii].writer = &writer;
+    args[ii].aor_id = "sip:6505550231@homedomain";
+    args[ii].binding_id = "<urn:uuid:" + std::to_string((long long)ii) + ">";
+    pthread_create(&threads[ii], NULL, do_update, &args[ii]);
+    if (ii == 0)
+    {
+      store.wait_held();
+    }
+  }
+  while (queued(writer, "sip:6505550231@homedomain") < NUM_THREADS - 1)
+  {
+    usleep(1000);
+  }
+  store.release();
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // The first write had one binding, the queued updates were all written
+  // together, and every thread got the AoR as written.
+  EXPECT_EQ(1u, args[0].bindings);
+  for (int ii = 1; ii < NUM_THREADS; ++ii)
+  {
+    EXPECT_EQ((size_t)NUM_THREADS, args[ii].bindings);
+  }
+  EXPECT_EQ(2, store.gets);
+  EXPECT_EQ(2, store.sets);
+
+  AoRWriter::Stats stats = writer.stats();
+  EXPECT_EQ(2u, stats.writes);
+  EXPECT_EQ((uint64_t)(NUM_THREADS - 2), stats.coalesced);
+  EXPECT_TRUE(writer._queues.empty());
+}
+
+TEST_F(AoRWriterTest, Concurrent)
+{
+  const int NUM_THREADS = 8;
+  const int NUM_WRITES = 50;
+  FaultyStore store;
+  AoRWriter writer(&store);
+
+  // Threads each add bindings to the same AoR, and none are lost.
+  pthread_t threads[NUM_THREADS];
+  std::vector<UpdateArgs> args(NUM_THREADS * NUM_WRITES);
+  for (int ii = 0; ii < NUM_THREADS * NUM_WRITES; ++ii)
+  {
+    args[ii].writer = &writer;
+    args[ii].aor_id = "sip:6505550231@homedomain";
+    args[ii].binding_id = "<urn:uuid:" + std::to_string((long long)ii) + ">";
+  }
+  for (int jj = 0; jj < NUM_WRITES; ++jj)
+  {
+    for (int ii = 0; ii < NUM_THREADS; ++ii)
+    {
+      pthread_create(&threads[ii], NULL, do_update, &args[jj * NUM_THREADS + ii]);
+    }
+    for (int ii = 0; ii < NUM_THREADS; ++ii)
+    {
+      pthread_join(threads[ii], NULL);
+    }
+  }
+
+  AoR* aor_data = store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ((size_t)(NUM_THREADS * NUM_WRITES), aor_data->bindings().size());
+  delete aor_data;
+
+  AoRWriter::Stats stats = writer.stats();
+  EXPECT_EQ((uint64_t)(NUM_THREADS * NUM_WRITES), stats.writes + stats.coalesced);
+  EXPECT_EQ(0u, stats.conflicts);
+  EXPECT_TRUE(writer._queues.empty());
+}
+
+TEST_F(AoRWriterTest, Conflict)
+{
+  FaultyStore store;
+  AoRWriter writer(&store, NULL, 3);
+
+  // Writes that conflict are retried with the AoR read afresh, so the
+  // update is applied to each read.
+  store.fail_sets = 2;
+  int applied = 0;
+  AoR* aor_data = writer.update("sip:6505550231@homedomain", [&](AoR* aor_data)
+  {
+    ++applied;
+    EXPECT_EQ(0u, aor_data->bindings().size());
+    aor_data->get_binding("<urn:uuid:1>")->_expires = time(NULL) + 300;
+  });
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+  EXPECT_EQ(3, applied);
+
+  AoRWriter::Stats stats = writer.stats();
+  EXPECT_EQ(1u, stats.writes);
+  EXPECT_EQ(2u, stats.conflicts);
+  EXPECT_EQ(2u, stats.retries);
+  EXPECT_EQ(0u, stats.failures);
+
+  // Give up after max_attempts.
+  store.fail_sets = 3;
+  EXPECT_EQ(NULL, writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:2>")));
+  stats = writer.stats();
+  EXPECT_EQ(1u, stats.writes);
+  EXPECT_EQ(5u, stats.conflicts);
+  EXPECT_EQ(4u, stats.retries);
+  EXPECT_EQ(1u, stats.failures);
+  EXPECT_TRUE(writer._queues.empty());
+}
+
+TEST_F(AoRWriterTest, ReadFailure)
+{
+  FaultyStore store;
+  AoRWriter writer(&store);
+
+  store.fail_gets = true;
+  EXPECT_EQ(NULL, writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:1>")));
+  EXPECT_EQ(0, store.sets);
+  EXPECT_EQ(1u, writer.stats().failures);
+}
+
+TEST_F(AoRWriterTest, Statistic)
+{
+  Statistic stat("registrar_writes");
+  FaultyStore store;
+  AoRWriter writer(&store, &stat);
+
+  // The first write reports, the next doesn't until the interval passes.
+  delete writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:1>"));
+  uint64_t next_report = writer._next_report_ms;
+  delete writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:2>"));
+  EXPECT_EQ(next_report, writer._next_report_ms);
+
+  cwtest_advance_time_ms(AoRWriter::REPORT_INTERVAL_MS);
+  delete writer.update("sip:6505550231@homedomain", add_binding("<urn:uuid:3>"));
+  EXPECT_LT(next_report, writer._next_report_ms);
+}
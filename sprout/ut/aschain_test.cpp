@@ -43,6 +43,7 @@
 #include "utils.h"
 #include "siptest.hpp"
 #include "fakelogger.hpp"
+#include "fakehssconnection.hpp"
 
 #include "ifchandler.h"
 #include "aschain.h"
@@ -95,3 +96,253 @@ TEST_F(AsChainTest, ServedUser)
 }
 
 
+
+TEST_F(AsChainTest, CachedIfcs)
+{
+  FakeHSSConnection hss;
+  IfcCache cache(100, 1000, 1000);
+  IfcHandler ifc_handler(&hss, &cache);
+  hss.set_user_ifc("sip:5755550018@homedomain",
+                   "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<ServiceProfile>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                   "      <DefaultHandling>0</DefaultHandling>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "</ServiceProfile>");
+
+  string str("INVITE sip:5755550099@homedomain SIP/2.0\n"
+             "Via: SIP/2.0/TCP 10.64.90.97:50693;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\n"
+             "Max-Forwards: 69\n"
+             "From: <sip:5755550018@homedomain>;tag=13919SIPpTag0011234\n"
+             "To: <sip:5755550099@homedomain>\n"
+             "Contact: <sip:5755550018@10.16.62.109:58309;transport=TCP;ob>\n"
+             "Call-ID: 1-13919@10.151.20.48\n"
+             "CSeq: 4 INVITE\n"
+             "Route: <sip:testnode;transport=TCP;lr;orig>\n"
+             "Content-Length: 0\n\n");
+  pjsip_rx_data* rdata = build_rxdata(str);
+  parse_rxdata(rdata);
+
+  string served_user;
+  vector<string> as_list;
+  ifc_handler.lookup_ifcs(SessionCase::Originating, rdata->msg_info.msg, 0, served_user, as_list);
+  EXPECT_EQ("sip:5755550018@homedomain", served_user);
+  ASSERT_EQ(1u, as_list.size());
+  EXPECT_EQ("sip:1.2.3.4:56789;transport=UDP", as_list[0]);
+
+  // The terminating user has no iFCs.
+  as_list.clear();
+  ifc_handler.lookup_ifcs(SessionCase::Terminating, rdata->msg_info.msg, 0, served_user, as_list);
+  EXPECT_EQ("sip:5755550099@homedomain", served_user);
+  EXPECT_EQ(0u, as_list.size());
+
+  // Both answers are cached, so changes to the service profiles aren't
+  // seen straight away.
+  hss.set_user_ifc("sip:5755550018@homedomain", "<ServiceProfile></ServiceProfile>");
+  hss.set_user_ifc("sip:5755550099@homedomain", "<ServiceProfile></ServiceProfile>");
+  as_list.clear();
+  ifc_handler.lookup_ifcs(SessionCase::Originating, rdata->msg_info.msg, 0, served_user, as_list);
+  EXPECT_EQ(1u, as_list.size());
+  as_list.clear();
+  ifc_handler.lookup_ifcs(SessionCase::Terminating, rdata->msg_info.msg, 0, served_user, as_list);
+  EXPECT_EQ(0u, as_list.size());
+
+  IfcCache::Stats stats = cache.stats();
+  EXPECT_EQ(2u, stats.hits);
+  EXPECT_EQ(2u, stats.misses);
+}
+
+TEST_F(AsChainTest, PrefetchedIfcs)
+{
+  FakeHSSConnection hss;
+  IfcHandler ifc_handler(&hss);
+  LookupPool pool(1);
+  hss.set_user_ifc("sip:5755550018@homedomain",
+                   "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<ServiceProfile>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                   "      <DefaultHandling>0</DefaultHandling>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "</ServiceProfile>");
+
+  string str("INVITE sip:5755550099@homedomain SIP/2.0\n"
+             "Via: SIP/2.0/TCP 10.64.90.97:50693;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\n"
+             "Max-Forwards: 69\n"
+             "From: <sip:5755550018@homedomain>;tag=13919SIPpTag0011234\n"
+             "To: <sip:5755550099@homedomain>\n"
+             "Contact: <sip:5755550018@10.16.62.109:58309;transport=TCP;ob>\n"
+             "Call-ID: 1-13919@10.151.20.48\n"
+             "CSeq: 4 INVITE\n"
+             "Route: <sip:testnode;transport=TCP;lr;orig>\n"
+             "Content-Length: 0\n\n");
+  pjsip_rx_data* rdata = build_rxdata(str);
+  parse_rxdata(rdata);
+
+  // The iFCs fetched in the background are used for the served user.
+  Lookup<std::shared_ptr<const Ifcs> > orig_lookup;
+  orig_lookup.start(&pool, "sip:5755550018@homedomain", [&ifc_handler]()
+  {
+    return ifc_handler.get_ifcs("sip:5755550018@homedomain", 0);
+  });
+  ASSERT_TRUE(orig_lookup.started());
+
+  string served_user;
+  vector<string> as_list;
+  ifc_handler.lookup_ifcs(SessionCase::Originating, rdata->msg_info.msg, 0, served_user, as_list, &orig_lookup);
+  EXPECT_EQ("sip:5755550018@homedomain", served_user);
+  ASSERT_EQ(1u, as_list.size());
+  EXPECT_EQ("sip:1.2.3.4:56789;transport=UDP", as_list[0]);
+
+  // iFCs fetched for someone else aren't.
+  as_list.clear();
+  ifc_handler.lookup_ifcs(SessionCase::Terminating, rdata->msg_info.msg, 0, served_user, as_list, &orig_lookup);
+  EXPECT_EQ("sip:5755550099@homedomain", served_user);
+  EXPECT_EQ(0u, as_list.size());
+}
+
+TEST_F(AsChainTest, IfcTriggers)
+{
+  FakeHSSConnection hss;
+  IfcHandler ifc_handler(&hss);
+  hss.set_user_ifc("sip:5755550018@homedomain",
+                   "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<ServiceProfile>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <Priority>2</Priority>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:second.example.com</ServerName>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <Priority>3</Priority>\n"
+                   "    <TriggerPoint>\n"
+                   "      <ConditionTypeCNF>0</ConditionTypeCNF>\n"
+                   "      <SPT><Group>0</Group><Method>MESSAGE</Method></SPT>\n"
+                   "    </TriggerPoint>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:messaging.example.com</ServerName>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <Priority>1</Priority>\n"
+                   "    <TriggerPoint>\n"
+                   "      <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+                   "      <SPT><Group>0</Group><Method>INVITE</Method></SPT>\n"
+                   "      <SPT><Group>1</Group><SessionCase>0</SessionCase></SPT>\n"
+                   "    </TriggerPoint>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:first.example.com</ServerName>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "  <InitialFilterCriteria>\n"
+                   "    <TriggerPoint>\n"
+                   "      <SPT><Group>0</Group><RequestURI>(</RequestURI></SPT>\n"
+                   "    </TriggerPoint>\n"
+                   "    <ApplicationServer>\n"
+                   "      <ServerName>sip:invalid.example.com</ServerName>\n"
+                   "    </ApplicationServer>\n"
+                   "  </InitialFilterCriteria>\n"
+                   "</ServiceProfile>");
+
+  string str("INVITE sip:5755550099@homedomain SIP/2.0\n"
+             "Via: SIP/2.0/TCP 10.64.90.97:50693;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\n"
+             "Max-Forwards: 69\n"
+             "From: <sip:5755550018@homedomain>;tag=13919SIPpTag0011234\n"
+             "To: <sip:5755550099@homedomain>\n"
+             "Contact: <sip:5755550018@10.16.62.109:58309;transport=TCP;ob>\n"
+             "Call-ID: 1-13919@10.151.20.48\n"
+             "CSeq: 4 INVITE\n"
+             "Route: <sip:testnode;transport=TCP;lr;orig>\n"
+             "Content-Length: 0\n\n");
+  pjsip_rx_data* rdata = build_rxdata(str);
+  parse_rxdata(rdata);
+
+  // Matching application servers are invoked in priority order, and the
+  // invalid iFC is ignored.
+  string served_user;
+  vector<string> as_list;
+  ifc_handler.lookup_ifcs(SessionCase::Originating, rdata->msg_info.msg, 0, served_user, as_list);
+  ASSERT_EQ(2u, as_list.size());
+  EXPECT_EQ("sip:first.example.com", as_list[0]);
+  EXPECT_EQ("sip:second.example.com", as_list[1]);
+  EXPECT_TRUE(_log.contains("Ignoring invalid iFC for sip:invalid.example.com"));
+
+  // The first AS is only for originating calls.
+  as_list.clear();
+  ifc_handler.lookup_ifcs(SessionCase::OriginatingCdiv, rdata->msg_info.msg, 0, served_user, as_list);
+  ASSERT_EQ(1u, as_list.size());
+  EXPECT_EQ("sip:second.example.com", as_list[0]);
+}
+
+TEST_F(AsChainTest, AsChainTable)
+{
+  AsChainTable table;
+  vector<string> as_list;
+  as_list.push_back("sip:pancommunicon.cw-ngv.com");
+  as_list.push_back("sip:mmtel.homedomain");
+
+  AsChainLink as_chain_link = AsChainLink::create_as_chain(&table, SessionCase::Originating, "sip:5755550018@homedomain", as_list);
+  ASSERT_TRUE(as_chain_link.is_set());
+  EXPECT_FALSE(as_chain_link.complete());
+  EXPECT_EQ("sip:5755550018@homedomain", as_chain_link.served_user());
+  EXPECT_EQ("orig AS 0", as_chain_link.to_string());
+
+  // Each AS gets its own ODI token.
+  vector<string> tokens = as_chain_link._as_chain->_odi_tokens;
+  ASSERT_EQ(2u, tokens.size());
+  EXPECT_EQ(0u, tokens[0].find("odi_"));
+  EXPECT_NE(tokens[0], tokens[1]);
+
+  // A request coming back from an AS resumes the chain at the next AS,
+  // and holds a reference to the chain.
+  AsChainLink as_chain_link1 = table.lookup(tokens[0]);
+  ASSERT_TRUE(as_chain_link1.is_set());
+  EXPECT_TRUE(as_chain_link1.session_case().is_originating());
+  EXPECT_EQ("orig AS 1", as_chain_link1.to_string());
+  EXPECT_FALSE(as_chain_link1.complete());
+  as_chain_link.release();
+  EXPECT_FALSE(as_chain_link.is_set());
+  EXPECT_EQ("None", as_chain_link.to_string());
+
+  AsChainLink as_chain_link2 = table.lookup(tokens[1]);
+  ASSERT_TRUE(as_chain_link2.is_set());
+  EXPECT_TRUE(as_chain_link2.complete());
+
+  // Copies of a link hold their own references, which go with them.
+  AsChain* as_chain = as_chain_link1._as_chain;
+  EXPECT_EQ(2, as_chain->_refs);
+  {
+    AsChainLink copy(as_chain_link1);
+    AsChainLink assigned;
+    assigned = as_chain_link2;
+    EXPECT_EQ("orig AS 1", copy.to_string());
+    EXPECT_TRUE(assigned.complete());
+    EXPECT_EQ(4, as_chain->_refs);
+    assigned = copy;
+    EXPECT_EQ(4, as_chain->_refs);
+  }
+  EXPECT_EQ(2, as_chain->_refs);
+
+  // The chain goes once the last reference to it does.
+  as_chain_link1.release();
+  {
+    AsChainLink last(as_chain_link2);
+    as_chain_link2.release();
+    EXPECT_TRUE(table.lookup(tokens[0]).is_set());
+  }
+  EXPECT_FALSE(table.lookup(tokens[0]).is_set());
+
+  AsChainTable::Stats stats = table.stats();
+  EXPECT_EQ(0u, stats.chains);
+  EXPECT_EQ(1u, stats.created);
+  EXPECT_EQ(2u, stats.application_servers);
+  EXPECT_EQ(2u, stats.longest);
+  EXPECT_EQ(3u, stats.resumed);
+  EXPECT_EQ(1u, stats.unknown);
+}
@@ -0,0 +1,183 @@
+/**
+ * @file circuitbreaker_test.cpp UT for CircuitBreaker.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "circuitbreaker.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for CircuitBreakerTest.
+class CircuitBreakerTest : public BaseTest
+{
+  CircuitBreaker _breaker;
+
+  CircuitBreakerTest() :
+    _breaker("homestead", 0.5)
+  {
+  }
+
+  virtual ~CircuitBreakerTest()
+  {
+    cwtest_reset_time();
+  }
+
+  /// Make a request, if the breaker allows it, and return whether it did.
+  bool request(bool ok)
+  {
+    bool trial;
+    if (!_breaker.allow(trial))
+    {
+      return false;
+    }
+    _breaker.complete(ok, trial);
+    return true;
+  }
+
+  /// Make requests until the breaker opens.
+  void open()
+  {
+    for (int ii = 0; ii < CircuitBreaker::MIN_REQUESTS; ++ii)
+    {
+      request(false);
+    }
+    ASSERT_EQ(CircuitBreaker::OPEN, _breaker.stats().state);
+  }
+
+  string state()
+  {
+    return CircuitBreaker::state_name(_breaker.stats().state);
+  }
+};
+
+TEST_F(CircuitBreakerTest, Open)
+{
+  // The breaker doesn't open until there are enough requests.
+  for (int ii = 1; ii < CircuitBreaker::MIN_REQUESTS; ++ii)
+  {
+    EXPECT_TRUE(request((ii % 2) == 0));
+  }
+  EXPECT_EQ("closed", state());
+
+  // Then it opens once enough of them have failed, and rejects requests.
+  EXPECT_TRUE(request(false));
+  EXPECT_EQ("open", state());
+  EXPECT_FALSE(request(true));
+  EXPECT_FALSE(request(true));
+
+  CircuitBreaker::Stats stats = _breaker.stats();
+  EXPECT_EQ(1u, stats.opened);
+  EXPECT_EQ(2u, stats.rejected);
+}
+
+TEST_F(CircuitBreakerTest, Window)
+{
+  // Requests from an earlier window don't count.
+  for (int ii = 0; ii < CircuitBreaker::MIN_REQUESTS - 1; ++ii)
+  {
+    request(false);
+  }
+  cwtest_advance_time_ms(CircuitBreaker::WINDOW_MS);
+  request(false);
+  EXPECT_EQ("closed", state());
+}
+
+TEST_F(CircuitBreakerTest, Recover)
+{
+  open();
+
+  // After a while, a single trial request is let through at a time.
+  cwtest_advance_time_ms(CircuitBreaker::OPEN_MS);
+  bool trial;
+  EXPECT_TRUE(_breaker.allow(trial));
+  EXPECT_TRUE(trial);
+  EXPECT_EQ("half-open", state());
+  bool trial2;
+  EXPECT_FALSE(_breaker.allow(trial2));
+
+  // The breaker closes once enough trials have succeeded, ignoring
+  // requests let through before it opened.
+  _breaker.complete(false, false);
+  _breaker.complete(true, trial);
+  for (int ii = 1; ii < CircuitBreaker::TRIAL_REQUESTS; ++ii)
+  {
+    EXPECT_EQ("half-open", state());
+    EXPECT_TRUE(request(true));
+  }
+  EXPECT_EQ("closed", state());
+
+  // Once closed, it starts counting afresh.
+  for (int ii = 1; ii < CircuitBreaker::MIN_REQUESTS; ++ii)
+  {
+    request(false);
+  }
+  EXPECT_EQ("closed", state());
+}
+
+TEST_F(CircuitBreakerTest, TrialFails)
+{
+  open();
+
+  // A failed trial opens the breaker again.
+  cwtest_advance_time_ms(CircuitBreaker::OPEN_MS);
+  EXPECT_TRUE(request(true));
+  EXPECT_TRUE(request(false));
+  EXPECT_EQ("open", state());
+  EXPECT_EQ(2u, _breaker.stats().opened);
+  EXPECT_FALSE(request(true));
+
+  cwtest_advance_time_ms(CircuitBreaker::OPEN_MS);
+  EXPECT_TRUE(request(true));
+}
+
+TEST_F(CircuitBreakerTest, Disabled)
+{
+  // With no failure ratio, the breaker never opens.
+  CircuitBreaker breaker("homer", 0);
+  bool trial;
+  for (int ii = 0; ii < 2 * CircuitBreaker::MIN_REQUESTS; ++ii)
+  {
+    EXPECT_TRUE(breaker.allow(trial));
+    breaker.complete(false, trial);
+  }
+  EXPECT_EQ(CircuitBreaker::CLOSED, breaker.stats().state);
+}
@@ -0,0 +1,116 @@
+/**
+ * @file digestcache_test.cpp UT for DigestCache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "digestcache.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for DigestCacheTest.
+class DigestCacheTest : public BaseTest
+{
+  DigestCacheTest() : _loads(0)
+  {
+    cwtest_reset_time();
+  }
+
+  virtual ~DigestCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  /// Look up a digest, counting the loads.  Digests name the private ID.
+  string get(DigestCache& cache,
+             const string& private_id,
+             const string& public_id = "sip:6505550231@homedomain",
+             const string& realm = "homedomain")
+  {
+    return cache.get(private_id, public_id, realm, [&](string& digest) -> DigestCache::LoadResult
+    {
+      ++_loads;
+      digest = "ha1-" + private_id;
+      return DigestCache::LOADED;
+    });
+  }
+
+  int _loads;
+};
+
+TEST_F(DigestCacheTest, Invalidate)
+{
+  DigestCache cache(100, 10000, 100);
+  get(cache, "6505550231@homedomain");
+  get(cache, "6505550231@homedomain", "sip:6505550232@homedomain");
+  get(cache, "6505550231@homedomain", "sip:6505550231@homedomain", "otherdomain");
+  get(cache, "6505550231@homedomainx");
+  EXPECT_EQ(4, _loads);
+
+  // Invalidating a private ID drops all its digests, whatever the public
+  // ID and realm, and only its digests.
+  cwtest_advance_time_ms(DigestCache::MIN_INVALIDATE_AGE_MS);
+  cache.invalidate("6505550231@homedomain");
+  EXPECT_EQ(1u, cache.stats().entries);
+  EXPECT_EQ(3u, cache.stats().invalidated);
+
+  get(cache, "6505550231@homedomain");
+  get(cache, "6505550231@homedomainx");
+  EXPECT_EQ(5, _loads);
+}
+
+TEST_F(DigestCacheTest, MinInvalidateAge)
+{
+  DigestCache cache(100, 10000, 100);
+  get(cache, "6505550231@homedomain");
+
+  // Digests loaded very recently aren't invalidated.
+  cwtest_advance_time_ms(DigestCache::MIN_INVALIDATE_AGE_MS - 1);
+  cache.invalidate("6505550231@homedomain");
+  EXPECT_EQ(1u, cache.stats().entries);
+  EXPECT_EQ(0u, cache.stats().invalidated);
+
+  cwtest_advance_time_ms(1);
+  cache.invalidate("6505550231@homedomain");
+  EXPECT_EQ(0u, cache.stats().entries);
+  get(cache, "6505550231@homedomain");
+  EXPECT_EQ(2, _loads);
+}
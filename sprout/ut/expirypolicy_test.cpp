@@ -0,0 +1,197 @@
+/**
+ * @file expirypolicy_test.cpp UT for the ExpiryPolicy class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <string>
+#include <unistd.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "expirypolicy.h"
+#include "statistic.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for ExpiryPolicyTest.
+class ExpiryPolicyTest : public BaseTest
+{
+  ExpiryPolicyTest()
+  {
+    cwtest_reset_time();
+  }
+
+  virtual ~ExpiryPolicyTest()
+  {
+    cwtest_reset_time();
+  }
+};
+
+TEST_F(ExpiryPolicyTest, Cap)
+{
+  ExpiryPolicy policy;
+  EXPECT_EQ(300, policy.max_expires());
+  EXPECT_EQ(300, policy.grant(3600));
+  EXPECT_EQ(120, policy.grant(120));
+  EXPECT_EQ(0, policy.grant(0));
+}
+
+TEST_F(ExpiryPolicyTest, Jitter)
+{
+  ExpiryPolicy policy(300, 300, 20);
+
+  // Expiries are shortened by up to 20%, and not all by the same amount.
+  int min = 300;
+  int max = 0;
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    int expiry = policy.grant(3600);
+    EXPECT_LE(240, expiry);
+    EXPECT_GE(300, expiry);
+    min = std::min(min, expiry);
+    max = std::max(max, expiry);
+  }
+  EXPECT_GT(max, min);
+
+  // Short requests are never lengthened, and deregistrations stay 0.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    EXPECT_GE(10, policy.grant(10));
+    EXPECT_LE(8, policy.grant(10));
+  }
+  EXPECT_EQ(0, policy.grant(0));
+}
+
+TEST_F(ExpiryPolicyTest, Overload)
+{
+  ExpiryPolicy policy(300, 600);
+
+  // Latency under the low threshold leaves the maximum alone.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy.record(ExpiryPolicy::LOW_LATENCY_MS);
+  }
+  EXPECT_EQ(300, policy.max_expires());
+
+  // Sustained latency over the high threshold raises it to the overload
+  // maximum, but never beyond what was asked for.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy.record(2 * ExpiryPolicy::HIGH_LATENCY_MS);
+  }
+  EXPECT_EQ(600, policy.max_expires());
+  EXPECT_EQ(600, policy.grant(3600));
+  EXPECT_EQ(400, policy.grant(400));
+
+  // In between, it scales.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy.record((ExpiryPolicy::LOW_LATENCY_MS + ExpiryPolicy::HIGH_LATENCY_MS) / 2);
+  }
+  EXPECT_LT(400, policy.max_expires());
+  EXPECT_GT(500, policy.max_expires());
+
+  // And falls back once the load goes.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy.record(-1);
+  }
+  EXPECT_EQ(300, policy.max_expires());
+
+  // The overload maximum can't be less than the normal one.
+  ExpiryPolicy policy2(300, 100);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy2.record(2 * ExpiryPolicy::HIGH_LATENCY_MS);
+  }
+  EXPECT_EQ(300, policy2.max_expires());
+}
+
+TEST_F(ExpiryPolicyTest, Statistic)
+{
+  Statistic stat("registration_rate");
+  ExpiryPolicy policy(300, 600, 0, &stat);
+
+  // The rate is reported once the interval passes, and the count then
+  // starts again.
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    policy.record(0);
+  }
+  EXPECT_EQ(50u, policy._registers);
+
+  cwtest_advance_time_ms(ExpiryPolicy::REPORT_INTERVAL_MS);
+  policy.record(0);
+  EXPECT_EQ(0u, policy._registers);
+  policy.record(0);
+  EXPECT_EQ(1u, policy._registers);
+}
+
+TEST_F(ExpiryPolicyTest, StatisticIdle)
+{
+  Statistic stat("registration_rate");
+  ExpiryPolicy policy(300, 600, 0, &stat);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    policy.record(2 * ExpiryPolicy::HIGH_LATENCY_MS);
+  }
+  EXPECT_EQ(600, policy.max_expires());
+
+  // Once REGISTERs stop, the reporting thread still reports the rate, and
+  // after a whole interval without any the latency and maximum expiry fall
+  // back.  Wake the thread rather than waiting for it.
+  for (int report = 0; report < 2; ++report)
+  {
+    cwtest_advance_time_ms(ExpiryPolicy::REPORT_INTERVAL_MS);
+    pthread_mutex_lock(&policy._lock);
+    uint64_t last_report_ms = policy._last_report_ms;
+    for (int ii = 0; (ii < 100) && (policy._last_report_ms == last_report_ms); ++ii)
+    {
+      pthread_cond_signal(&policy._reporter_cond);
+      pthread_mutex_unlock(&policy._lock);
+      usleep(10000);
+      pthread_mutex_lock(&policy._lock);
+    }
+    EXPECT_NE(last_report_ms, policy._last_report_ms);
+    EXPECT_EQ(0u, policy._registers);
+    pthread_mutex_unlock(&policy._lock);
+  }
+  EXPECT_EQ(300, policy.max_expires());
+}
@@ -40,6 +40,8 @@
 
 #include <cstdarg>
 #include <stdexcept>
+#include <vector>
+#include <poll.h>
 
 using namespace std;
 
@@ -58,6 +60,7 @@ class FakeCurl
   string _username;
   string _password;
   bool _fresh;
+  long _timeout_ms;
 
   datafn_ty _readfn;
   void* _readdata; //^ user data; not owned by this object
@@ -67,16 +70,20 @@ class FakeCurl
 
   void* _private;
 
+  long _response_code;
+
   FakeCurl() :
     _method("GET"),
     _failonerror(false),
     _httpauth(0L),
     _fresh(false),
+    _timeout_ms(0L),
     _readfn(NULL),
     _readdata(NULL),
     _writefn(NULL),
     _writedata(NULL),
-    _private(NULL)
+    _private(NULL),
+    _response_code(0L)
   {
   }
 
@@ -93,6 +100,9 @@ map<string,Response> fakecurl_responses;
 /// Requests received, by URL.
 map<string,Request> fakecurl_requests;
 
+/// Held while cURL multi handles are driven.
+pthread_mutex_t fakecurl_multi_lock = PTHREAD_MUTEX_INITIALIZER;
+
 CURLcode FakeCurl::easy_perform()
 {
   // Save off the request.
@@ -103,6 +113,7 @@ CURLcode FakeCurl::easy_perform()
   req._username = _username;
   req._password = _password;
   req._fresh = _fresh;
+  req._timeout_ms = _timeout_ms;
   req._body = "";
 
   if (_readfn != NULL)
@@ -154,6 +165,10 @@ CURLcode FakeCurl::easy_perform()
     }
   }
 
+  // There's only a response code if there was a response.  The real code
+  // of an error response isn't known, so use 500.
+  _response_code = (rc == CURLE_OK) ? 200L : (rc == CURLE_HTTP_RETURNED_ERROR) ? 500L : 0L;
+
   return rc;
 }
 
@@ -192,7 +207,14 @@ CURLcode curl_easy_setopt(CURL* handle, CURLoption option, ...)
   {
     struct curl_slist* headers = va_arg(args, struct curl_slist*);
     list<string>* truelist = (list<string>*)headers;
-    curl->_headers = *truelist;
+    if (truelist != NULL)
+    {
+      curl->_headers = *truelist;
+    }
+    else
+    {
+      curl->_headers.clear();
+    }
   }
   break;
   case CURLOPT_URL:
@@ -258,8 +280,12 @@ CURLcode curl_easy_setopt(CURL* handle, CURLoption option, ...)
     curl->_fresh = !!va_arg(args, long);
   }
   break;
-  case CURLOPT_MAXCONNECTS:
   case CURLOPT_TIMEOUT_MS:
+  {
+    curl->_timeout_ms = va_arg(args, long);
+  }
+  break;
+  case CURLOPT_MAXCONNECTS:
   case CURLOPT_CONNECTTIMEOUT_MS:
   case CURLOPT_DNS_CACHE_TIMEOUT:
   case CURLOPT_TCP_NODELAY:
@@ -305,6 +331,12 @@ CURLcode curl_easy_getinfo(CURL* handle, CURLINFO info, ...)
     *dataptr = ip;
   }
   break;
+  case CURLINFO_RESPONSE_CODE:
+  {
+    long* dataptr = va_arg(args, long*);
+    *dataptr = curl->_response_code;
+  }
+  break;
   default:
   {
     throw runtime_error("cURL info unknown to FakeCurl");
@@ -343,3 +375,121 @@ const char* curl_easy_strerror(CURLcode errnum)
 {
   return "Insert error string here";
 }
+
+/// Object representing a single fake cURL multi handle.  Requests added
+/// to it are performed, one after another, the next time it's driven,
+/// except that requests for URLs with no response yet are left running.
+class FakeCurlMulti
+{
+public:
+  list<FakeCurl*> _added;
+  list<CURLMsg> _done;
+  CURLMsg _msg;
+};
+
+CURLM* curl_multi_init()
+{
+  FakeCurlMulti* multi = new FakeCurlMulti();
+  return (CURLM*)multi;
+}
+
+CURLMcode curl_multi_cleanup(CURLM* multi_handle)
+{
+  FakeCurlMulti* multi = (FakeCurlMulti*)multi_handle;
+  delete multi;
+  return CURLM_OK;
+}
+
+CURLMcode curl_multi_setopt(CURLM* multi_handle, CURLMoption option, ...)
+{
+  switch (option)
+  {
+  case CURLMOPT_MAX_HOST_CONNECTIONS:
+  {
+    // ignore
+  }
+  break;
+  default:
+  {
+    throw runtime_error("cURL multi option unknown to FakeCurl");
+  }
+  }
+  return CURLM_OK;
+}
+
+CURLMcode curl_multi_add_handle(CURLM* multi_handle, CURL* handle)
+{
+  FakeCurlMulti* multi = (FakeCurlMulti*)multi_handle;
+  multi->_added.push_back((FakeCurl*)handle);
+  return CURLM_OK;
+}
+
+CURLMcode curl_multi_remove_handle(CURLM* multi_handle, CURL* handle)
+{
+  FakeCurlMulti* multi = (FakeCurlMulti*)multi_handle;
+  multi->_added.remove((FakeCurl*)handle);
+  return CURLM_OK;
+}
+
+CURLMcode curl_multi_perform(CURLM* multi_handle, int* running_handles)
+{
+  FakeCurlMulti* multi = (FakeCurlMulti*)multi_handle;
+  pthread_mutex_lock(&fakecurl_multi_lock);
+  list<FakeCurl*>::iterator i = multi->_added.begin();
+  while (i != multi->_added.end())
+  {
+    FakeCurl* curl = *i;
+    if (fakecurl_responses.find(curl->_url) == fakecurl_responses.end())
+    {
+      ++i;
+      continue;
+    }
+    i = multi->_added.erase(i);
+
+    CURLMsg msg;
+    msg.msg = CURLMSG_DONE;
+    msg.easy_handle = (CURL*)curl;
+    msg.data.result = curl->easy_perform();
+    multi->_done.push_back(msg);
+  }
+  *running_handles = multi->_added.size();
+  pthread_mutex_unlock(&fakecurl_multi_lock);
+  return CURLM_OK;
+}
+
+CURLMsg* curl_multi_info_read(CURLM* multi_handle, int* msgs_in_queue)
+{
+  FakeCurlMulti* multi = (FakeCurlMulti*)multi_handle;
+  if (multi->_done.empty())
+  {
+    *msgs_in_queue = 0;
+    return NULL;
+  }
+  multi->_msg = multi->_done.front();
+  multi->_done.pop_front();
+  *msgs_in_queue = multi->_done.size();
+  return &multi->_msg;
+}
+
+CURLMcode curl_multi_wait(CURLM* multi_handle,
+                          struct curl_waitfd extra_fds[],
+                          unsigned int extra_nfds,
+                          int timeout_ms,
+                          int* numfds)
+{
+  // No sockets of our own, so just wait on the caller's.
+  std::vector<struct pollfd> fds(extra_nfds);
+  for (unsigned int ii = 0; ii < extra_nfds; ++ii)
+  {
+    fds[ii].fd = extra_fds[ii].fd;
+    fds[ii].events = (extra_fds[ii].events & CURL_WAIT_POLLIN) ? POLLIN : 0;
+    fds[ii].revents = 0;
+  }
+  int rc = poll(fds.data(), fds.size(), timeout_ms);
+  for (unsigned int ii = 0; ii < extra_nfds; ++ii)
+  {
+    extra_fds[ii].revents = (fds[ii].revents & POLLIN) ? CURL_WAIT_POLLIN : 0;
+  }
+  *numfds = (rc > 0) ? rc : 0;
+  return CURLM_OK;
+}
@@ -39,6 +39,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <pthread.h>
 
 #include <curl/curl.h>
 
@@ -53,6 +54,7 @@ public:
   std::string _username;
   std::string _password;
   bool _fresh;
+  long _timeout_ms;
 };
 
 /// The content of a response.
@@ -104,3 +106,7 @@ extern std::map<std::string,Response> fakecurl_responses;
 
 /// Requests received, by URL.
 extern std::map<std::string,Request> fakecurl_requests;
+
+/// Held while cURL multi handles are driven.  Hold it to add responses
+/// while an engine is running.
+extern pthread_mutex_t fakecurl_multi_lock;
@@ -57,14 +57,17 @@ void FakeHSSConnection::flush_all()
   _ifc_db.clear();
 }
 
-Json::Value* FakeHSSConnection::get_object(const std::string& url, SAS::TrailId trail)
+HTTPCode FakeHSSConnection::get_object(const std::string& url, Json::Value*& object, SAS::TrailId trail)
 {
   std::map<std::string, Json::Value>::iterator i = _json_db.find(url);
   if (i != _json_db.end())
   {
-    return &i->second;
+    // The caller owns the object.
+    object = new Json::Value(i->second);
+    return HTTP_OK;
   }
-  return NULL;
+  object = NULL;
+  return HTTP_NOT_FOUND;
 }
 
 void FakeHSSConnection::set_object(const std::string& url, Json::Value& object, SAS::TrailId trail)
@@ -72,17 +75,17 @@ void FakeHSSConnection::set_object(const std::string& url, Json::Value& object,
   _json_db[url] = object;
 }
 
-bool FakeHSSConnection::get_user_ifc(const std::string& public_user_identity,
-                                     std::string& xml_data,
-                                     SAS::TrailId trail)
+HTTPCode FakeHSSConnection::get_user_ifc(const std::string& public_user_identity,
+                                         std::string& xml_data,
+                                         SAS::TrailId trail)
 {
   std::map<std::string, std::string>::iterator i = _ifc_db.find(public_user_identity);
   if (i != _ifc_db.end())
   {
     xml_data = i->second;
-    return true;
+    return HTTP_OK;
   }
-  return false;
+  return HTTP_NOT_FOUND;
 }
 
 void FakeHSSConnection::set_user_ifc(const std::string& public_user_identity,
@@ -51,15 +51,15 @@ public:
 
   void flush_all();
 
-  bool get_user_ifc(const std::string& public_user_identity,
-                    std::string& xml_data,
-                    SAS::TrailId trail);
+  HTTPCode get_user_ifc(const std::string& public_user_identity,
+                        std::string& xml_data,
+                        SAS::TrailId trail);
 
   void set_user_ifc(const std::string& public_user_identity,
                     const std::string& xml_data);
 
 private:
-  Json::Value* get_object(const std::string& url, SAS::TrailId trail);
+  HTTPCode get_object(const std::string& url, Json::Value*& object, SAS::TrailId trail);
   void set_object(const std::string& url, Json::Value& object, SAS::TrailId trail);
 
   std::map<std::string, Json::Value> _json_db;
@@ -41,7 +41,7 @@
 using namespace std;
 
 FakeHttpConnection::FakeHttpConnection() :
-  HttpConnection("localhost", true, 0, "connected_homesteads")  // dummy values
+  HttpConnection("localhost", true, 0, "connected_homesteads", "homestead_gets", "homestead_breaker")  // dummy values
 {
 }
 
@@ -55,15 +55,15 @@ void FakeHttpConnection::flush_all()
   _db.clear();
 }
 
-bool FakeHttpConnection::get(const std::string& uri, std::string& doc, const std::string& username, SAS::TrailId trail)
+HTTPCode FakeHttpConnection::get(const std::string& uri, std::string& doc, const std::string& username, SAS::TrailId trail)
 {
   std::map<std::string, std::string>::iterator i = _db.find(uri);
   if (i != _db.end())
   {
     doc = i->second;
-    return true;
+    return HTTP_OK;
   }
-  return false;
+  return HTTP_NOT_FOUND;
 }
 
 bool FakeHttpConnection::put(const std::string& uri, const std::string& doc, const std::string& username, SAS::TrailId trail)
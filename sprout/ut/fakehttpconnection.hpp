@@ -52,7 +52,7 @@ public:
 
   void flush_all();
 
-  virtual bool get(const std::string& uri, std::string& doc, const std::string& username, SAS::TrailId trail);
+  virtual HTTPCode get(const std::string& uri, std::string& doc, const std::string& username, SAS::TrailId trail);
   bool put(const std::string& uri, const std::string& doc, const std::string& username, SAS::TrailId trail);
   bool del(const std::string& uri, const std::string& username, SAS::TrailId trail);
 
@@ -0,0 +1,341 @@
+/**
+ * @file @file fakememcachedserver.cpp In-process memcached server for UT
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "fakememcachedserver.hpp"
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <endian.h>
+
+/// Arguments for a connection thread.
+struct ConnectionArgs
+{
+  FakeMemcachedServer* server;
+  int fd;
+};
+
+FakeMemcachedServer::FakeMemcachedServer() :
+  _delay_ms(0),
+  _corrupt(false),
+  _next_cas(1),
+  _connections(0),
+  _requests(0),
+  _terminating(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+  listen(_listen_fd, 16);
+  socklen_t len = sizeof(addr);
+  getsockname(_listen_fd, (struct sockaddr*)&addr, &len);
+  _address = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+
+  pthread_create(&_accept_thread, NULL, &accept_thread, this);
+}
+
+FakeMemcachedServer::~FakeMemcachedServer()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_mutex_unlock(&_lock);
+  shutdown(_listen_fd, SHUT_RDWR);
+  pthread_join(_accept_thread, NULL);
+  close(_listen_fd);
+
+  drop_connections();
+  for (size_t ii = 0; ii < _threads.size(); ++ii)
+  {
+    pthread_join(_threads[ii], NULL);
+  }
+  pthread_mutex_destroy(&_lock);
+}
+
+void FakeMemcachedServer::drop_connections()
+{
+  pthread_mutex_lock(&_lock);
+  for (size_t ii = 0; ii < _fds.size(); ++ii)
+  {
+    shutdown(_fds[ii], SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+int FakeMemcachedServer::connections()
+{
+  pthread_mutex_lock(&_lock);
+  int connections = _connections;
+  pthread_mutex_unlock(&_lock);
+  return connections;
+}
+
+int FakeMemcachedServer::requests()
+{
+  pthread_mutex_lock(&_lock);
+  int requests = _requests;
+  pthread_mutex_unlock(&_lock);
+  return requests;
+}
+
+std::pair<std::string, uint64_t> FakeMemcachedServer::record(const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+  std::pair<std::string, uint64_t> record = _records[key];
+  pthread_mutex_unlock(&_lock);
+  return record;
+}
+
+void* FakeMemcachedServer::accept_thread(void* p)
+{
+  ((FakeMemcachedServer*)p)->accept_loop();
+  return NULL;
+}
+
+void* FakeMemcachedServer::connection_thread(void* p)
+{
+  ConnectionArgs* args = (ConnectionArgs*)p;
+  args->server->serve(args->fd);
+  delete args;
+  return NULL;
+}
+
+void FakeMemcachedServer::accept_loop()
+{
+  while (true)
+  {
+    int fd = accept(_listen_fd, NULL, NULL);
+    pthread_mutex_lock(&_lock);
+    if ((fd < 0) || (_terminating))
+    {
+      pthread_mutex_unlock(&_lock);
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      break;
+    }
+    _connections++;
+    _fds.push_back(fd);
+    ConnectionArgs* args = new ConnectionArgs;
+    args->server = this;
+    args->fd = fd;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &connection_thread, args);
+    _threads.push_back(thread);
+    pthread_mutex_unlock(&_lock);
+  }
+}
+
+static bool recv_all(int fd, char* buf, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t n = recv(fd, buf, length, 0);
+    if (n <= 0)
+    {
+      return false;
+    }
+    buf += n;
+    length -= n;
+  }
+  return true;
+}
+
+void FakeMemcachedServer::serve(int fd)
+{
+  char header[24];
+  while (recv_all(fd, header, sizeof(header)))
+  {
+    uint16_t key_length;
+    uint32_t body_length;
+    uint32_t opaque;
+    uint64_t cas;
+    memcpy(&key_length, header + 2, 2);
+    memcpy(&body_length, header + 8, 4);
+    memcpy(&opaque, header + 12, 4);
+    memcpy(&cas, header + 16, 8);
+    key_length = ntohs(key_length);
+    body_length = ntohl(body_length);
+    uint8_t extras_length = header[4];
+
+    std::string body(body_length, '\0');
+    if ((body_length > 0) && (!recv_all(fd, &body[0], body_length)))
+    {
+      break;
+    }
+
+    if (_delay_ms > 0)
+    {
+      usleep(_delay_ms * 1000);
+    }
+
+    std::string rsp = handle(header[1],
+                             opaque,
+                             be64toh(cas),
+                             body.substr(0, extras_length),
+                             body.substr(extras_length, key_length),
+                             body.substr(extras_length + key_length));
+    if ((_corrupt) && (!rsp.empty()))
+    {
+      rsp[0] = 0;
+    }
+    if ((!rsp.empty()) &&
+        (send(fd, rsp.data(), rsp.length(), MSG_NOSIGNAL) != (ssize_t)rsp.length()))
+    {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&_lock);
+  for (size_t ii = 0; ii < _fds.size(); ++ii)
+  {
+    if (_fds[ii] == fd)
+    {
+      _fds.erase(_fds.begin() + ii);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  close(fd);
+}
+
+/// Build a response.
+static std::string response(uint8_t opcode,
+                            uint16_t status,
+                            uint32_t opaque,
+                            uint64_t cas,
+                            const std::string& extras,
+                            const std::string& key,
+                            const std::string& value)
+{
+  std::string rsp(24, '\0');
+  rsp.append(extras).append(key).append(value);
+  uint16_t net_key_length = htons(key.length());
+  uint16_t net_status = htons(status);
+  uint32_t net_body_length = htonl(rsp.length() - 24);
+  uint64_t net_cas = htobe64(cas);
+  rsp[0] = (char)0x81;
+  rsp[1] = opcode;
+  memcpy(&rsp[2], &net_key_length, 2);
+  rsp[4] = extras.length();
+  memcpy(&rsp[6], &net_status, 2);
+  memcpy(&rsp[8], &net_body_length, 4);
+  memcpy(&rsp[12], &opaque, 4);
+  memcpy(&rsp[16], &net_cas, 8);
+  return rsp;
+}
+
+std::string FakeMemcachedServer::handle(uint8_t opcode,
+                                        uint32_t opaque,
+                                        uint64_t cas,
+                                        const std::string& extras,
+                                        const std::string& key,
+                                        const std::string& value)
+{
+  std::string rsp;
+  pthread_mutex_lock(&_lock);
+  _requests++;
+  std::map<std::string, std::pair<std::string, uint64_t> >::iterator i = _records.find(key);
+
+  switch (opcode)
+  {
+    case 0x00: // GET
+    case 0x09: // GETQ
+    case 0x0c: // GETK
+    case 0x0d: // GETKQ
+    {
+      bool quiet = (opcode == 0x09) || (opcode == 0x0d);
+      std::string rsp_key = ((opcode == 0x0c) || (opcode == 0x0d)) ? key : "";
+      if (i != _records.end())
+      {
+        rsp = response(opcode, 0, opaque, i->second.second, std::string(4, '\0'), rsp_key, i->second.first);
+      }
+      else if (!quiet)
+      {
+        rsp = response(opcode, 1, opaque, 0, "", rsp_key, "Not found");
+      }
+      break;
+    }
+
+    case 0x01: // SET
+    case 0x02: // ADD
+      if ((opcode == 0x02) && (i != _records.end()))
+      {
+        rsp = response(opcode, 2, opaque, 0, "", "", "Data exists for key.");
+      }
+      else if ((cas != 0) && (i == _records.end()))
+      {
+        rsp = response(opcode, 1, opaque, 0, "", "", "Not found");
+      }
+      else if ((cas != 0) && (i->second.second != cas))
+      {
+        rsp = response(opcode, 2, opaque, 0, "", "", "Data exists for key.");
+      }
+      else
+      {
+        _records[key] = std::make_pair(value, _next_cas);
+        rsp = response(opcode, 0, opaque, _next_cas++, "", "", "");
+      }
+      break;
+
+    case 0x08: // FLUSH
+      _records.clear();
+      rsp = response(opcode, 0, opaque, 0, "", "", "");
+      break;
+
+    case 0x0a: // NOOP
+      rsp = response(opcode, 0, opaque, 0, "", "", "");
+      break;
+
+    default:
+      rsp = response(opcode, 0x81, opaque, 0, "", "", "Unknown command");
+      break;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return rsp;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file @file fakememcachedserver.hpp In-process memcached server for UT
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+/// A minimal memcached server speaking the binary protocol on a loopback
+/// port, so the real client code can be tested.  Supports get (and its
+/// quiet and key-returning variants), set, add, flush and noop.
+class FakeMemcachedServer
+{
+public:
+  FakeMemcachedServer();
+  ~FakeMemcachedServer();
+
+  /// The server's address, as host:port.
+  std::string address() const { return _address; }
+
+  /// Delay every response by this long.
+  void set_delay_ms(int delay_ms) { _delay_ms = delay_ms; }
+
+  /// Send garbage instead of proper responses.
+  void set_corrupt(bool corrupt) { _corrupt = corrupt; }
+
+  /// Close every open connection, as if the server had restarted.
+  void drop_connections();
+
+  /// The number of connections accepted so far.
+  int connections();
+
+  /// The number of requests received so far.
+  int requests();
+
+  /// The stored value and CAS for a key, or an empty value and zero CAS.
+  std::pair<std::string, uint64_t> record(const std::string& key);
+
+private:
+  static void* accept_thread(void* p);
+  static void* connection_thread(void* p);
+  void accept_loop();
+  void serve(int fd);
+  std::string handle(uint8_t opcode,
+                     uint32_t opaque,
+                     uint64_t cas,
+                     const std::string& extras,
+                     const std::string& key,
+                     const std::string& value);
+
+  int _listen_fd;
+  std::string _address;
+  volatile int _delay_ms;
+  volatile bool _corrupt;
+
+  pthread_mutex_t _lock;
+  std::map<std::string, std::pair<std::string, uint64_t> > _records;
+  uint64_t _next_cas;
+  int _connections;
+  int _requests;
+  std::vector<int> _fds;
+  std::vector<pthread_t> _threads;
+  pthread_t _accept_thread;
+  bool _terminating;
+};
@@ -0,0 +1,156 @@
+/**
+ * @file flowindex_test.cpp UT for the FlowIndex class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "flowindex.h"
+
+using namespace std;
+using namespace RegData;
+
+/// Expiry time for bindings that don't expire during a test.
+static const int FUTURE = 0x7fffffff;
+
+/// Fixture for FlowIndexTest.
+class FlowIndexTest : public ::testing::Test
+{
+  FlowIndexTest()
+  {
+  }
+
+  virtual ~FlowIndexTest()
+  {
+  }
+};
+
+TEST_F(FlowIndexTest, AddTake)
+{
+  FlowIndex index;
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:1>", FUTURE);
+  index.add("flow1", "sip:2@homedomain", "<urn:uuid:2>", FUTURE);
+  index.add("flow2", "sip:1@homedomain", "<urn:uuid:3>", FUTURE);
+  EXPECT_EQ(3u, index.size());
+  EXPECT_EQ("flow1", index.flow("sip:1@homedomain", "<urn:uuid:1>"));
+  EXPECT_EQ("", index.flow("sip:1@homedomain", "<urn:uuid:2>"));
+  EXPECT_EQ("", index.flow("sip:3@homedomain", "<urn:uuid:1>"));
+
+  // Taking a flow returns all its bindings, and only those.
+  vector<FlowIndex::BindingKey> bindings = index.take("flow1");
+  ASSERT_EQ(2u, bindings.size());
+  EXPECT_EQ(FlowIndex::BindingKey("sip:1@homedomain", "<urn:uuid:1>"), bindings[0]);
+  EXPECT_EQ(FlowIndex::BindingKey("sip:2@homedomain", "<urn:uuid:2>"), bindings[1]);
+  EXPECT_EQ(1u, index.size());
+  EXPECT_EQ("", index.flow("sip:1@homedomain", "<urn:uuid:1>"));
+  EXPECT_TRUE(index.take("flow1").empty());
+
+  bindings = index.take("flow2");
+  ASSERT_EQ(1u, bindings.size());
+  EXPECT_EQ(0u, index.size());
+  EXPECT_TRUE(index._flows.empty());
+  EXPECT_TRUE(index._aors.empty());
+}
+
+TEST_F(FlowIndexTest, Move)
+{
+  FlowIndex index;
+
+  // A binding re-registered over another flow moves to it.
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:1>", FUTURE);
+  index.add("flow2", "sip:1@homedomain", "<urn:uuid:1>", FUTURE);
+  EXPECT_EQ(1u, index.size());
+  EXPECT_EQ("flow2", index.flow("sip:1@homedomain", "<urn:uuid:1>"));
+  EXPECT_TRUE(index.take("flow1").empty());
+  EXPECT_EQ(1u, index.take("flow2").size());
+}
+
+TEST_F(FlowIndexTest, Remove)
+{
+  FlowIndex index;
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:1>", FUTURE);
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:2>", FUTURE);
+  index.add("flow2", "sip:1@homedomain", "<urn:uuid:3>", FUTURE);
+  index.add("flow2", "sip:2@homedomain", "<urn:uuid:1>", FUTURE);
+
+  // Removing bindings that aren't indexed does nothing.
+  index.remove("sip:3@homedomain", "<urn:uuid:1>");
+  index.remove("sip:1@homedomain", "<urn:uuid:4>");
+  index.remove_aor("sip:3@homedomain");
+  EXPECT_EQ(4u, index.size());
+
+  index.remove("sip:1@homedomain", "<urn:uuid:1>");
+  EXPECT_EQ(3u, index.size());
+  EXPECT_EQ("", index.flow("sip:1@homedomain", "<urn:uuid:1>"));
+
+  index.remove_aor("sip:1@homedomain");
+  EXPECT_EQ(1u, index.size());
+  EXPECT_EQ("flow2", index.flow("sip:2@homedomain", "<urn:uuid:1>"));
+  EXPECT_EQ(0u, index._flows.count("flow1"));
+  EXPECT_EQ(0u, index._aors.count("sip:1@homedomain"));
+}
+
+TEST_F(FlowIndexTest, Expiry)
+{
+  FlowIndex index;
+  int now = time(NULL);
+  index.add("flow2", "sip:2@homedomain", "<urn:uuid:1>", now - 1);
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:1>", now - 1);
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:2>", now + 300);
+
+  // Adding a binding sweeps those that have already expired.
+  EXPECT_EQ(1u, index.size());
+  EXPECT_EQ("", index.flow("sip:1@homedomain", "<urn:uuid:1>"));
+  EXPECT_EQ(0u, index._aors.count("sip:2@homedomain"));
+
+  // Re-registering a binding extends its expiry, and taking a flow doesn't
+  // return bindings that have expired since they were added.
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:2>", now - 1);
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:3>", now + 300);
+  index.add("flow1", "sip:1@homedomain", "<urn:uuid:3>", now + 600);
+  EXPECT_EQ(1u, index._expiries.size());
+  vector<FlowIndex::BindingKey> bindings = index.take("flow1");
+  ASSERT_EQ(1u, bindings.size());
+  EXPECT_EQ(FlowIndex::BindingKey("sip:1@homedomain", "<urn:uuid:3>"), bindings[0]);
+  EXPECT_TRUE(index._flows.empty());
+  EXPECT_TRUE(index._aors.empty());
+  EXPECT_TRUE(index._expiries.empty());
+}
@@ -90,7 +90,9 @@ class HssConnectionTest : public BaseTest
 
 TEST_F(HssConnectionTest, SimpleDigest)
 {
-  Json::Value* actual = _hss.get_digest_data("pubid42", "privid69", 0);
+  Json::Value* actual;
+  HTTPCode res = _hss.get_digest_data("pubid42", "privid69", actual, 0);
+  EXPECT_EQ(HTTP_OK, res);
   ASSERT_TRUE(actual != NULL);
   EXPECT_EQ("myhashhere", actual->get("digest", "").asString());
   delete actual;
@@ -98,7 +100,9 @@ TEST_F(HssConnectionTest, SimpleDigest)
 
 TEST_F(HssConnectionTest, CorruptDigest)
 {
-  Json::Value* actual = _hss.get_digest_data("pubid42", "privid_corrupt", 0);
+  Json::Value* actual;
+  HTTPCode res = _hss.get_digest_data("pubid42", "privid_corrupt", actual, 0);
+  EXPECT_EQ(HTTP_SERVER_ERROR, res);
   ASSERT_TRUE(actual == NULL);
   EXPECT_TRUE(_log.contains("Failed to parse Homestead response"));
   delete actual;
@@ -107,15 +111,15 @@ TEST_F(HssConnectionTest, CorruptDigest)
 TEST_F(HssConnectionTest, SimpleIfc)
 {
   std::string actual;
-  bool res = _hss.get_user_ifc("pubid42", actual, 0);
-  EXPECT_TRUE(res);
+  HTTPCode res = _hss.get_user_ifc("pubid42", actual, 0);
+  EXPECT_EQ(HTTP_OK, res);
   EXPECT_EQ(fakecurl_responses["http://narcissus/filtercriteria/pubid42"]._body, actual);
 }
 
 TEST_F(HssConnectionTest, ServerFailure)
 {
   std::string actual;
-  bool res = _hss.get_user_ifc("pubid44", actual, 0);
-  EXPECT_FALSE(res);
+  HTTPCode res = _hss.get_user_ifc("pubid44", actual, 0);
+  EXPECT_EQ(HTTP_NOT_FOUND, res);
   EXPECT_TRUE(_log.contains("HTTP error response"));
 }
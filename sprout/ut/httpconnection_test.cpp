@@ -38,6 +38,7 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -59,7 +60,7 @@ class HttpConnectionTest : public BaseTest
   HttpConnection _http;
 
   HttpConnectionTest() :
-    _http("cyrus", true, SASEvent::TX_XDM_GET_BASE, "connected_homers")
+    _http("cyrus", true, SASEvent::TX_XDM_GET_BASE, "connected_homers", "homer_gets", "homer_breaker")
   {
     fakecurl_responses.clear();
     fakecurl_responses["http://cyrus/blah/blah/blah"] = "<?xml version=\"1.0\" encoding=\"UTF-8\"><boring>Document</boring>";
@@ -83,8 +84,8 @@ class HttpConnectionTest : public BaseTest
 TEST_F(HttpConnectionTest, SimpleKeyAuthGet)
 {
   string output;
-  bool ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
-  EXPECT_TRUE(ret);
+  HTTPCode ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
   EXPECT_EQ("<?xml version=\"1.0\" encoding=\"UTF-8\"><boring>Document</boring>", output);
   Request& req = fakecurl_requests["http://cyrus/blah/blah/blah"];
   EXPECT_EQ("GET", req._method);
@@ -93,11 +94,40 @@ TEST_F(HttpConnectionTest, SimpleKeyAuthGet)
   EXPECT_EQ("", req._password);
 }
 
+TEST_F(HttpConnectionTest, GetStats)
+{
+  fakecurl_responses["http://cyrus/up?down"] = "<message>sideways</message>";
+
+  string output;
+  _http.get("/blah/blah/blah", output, "gandalf", 0);
+  _http.get("/blah/blah/wot", output, "gandalf", 0);
+  _http.get("/up/up/up", output, "gandalf", 0);
+  _http.get("/up?down", output, "gandalf", 0);
+
+  // GETs made one after another aren't coalesced.
+  map<string, HttpConnection::GetStats> stats = _http.get_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_EQ(2u, stats["blah"].requests);
+  EXPECT_EQ(0u, stats["blah"].coalesced);
+  EXPECT_EQ(2u, stats["up"].requests);
+  EXPECT_EQ(0u, stats["up"].coalesced);
+}
+
 TEST_F(HttpConnectionTest, SimpleGetFailure)
 {
   string output;
-  bool ret = _http.get("/blah/blah/wot", output, "gandalf", 0);
-  EXPECT_FALSE(ret);
+  HTTPCode ret = _http.get("/blah/blah/wot", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_NOT_FOUND, ret);
+}
+
+TEST_F(HttpConnectionTest, GetErrorCodes)
+{
+  // Failures without a response from the server are reported as if a
+  // gateway had responded.
+  fakecurl_responses["http://cyrus/slow/slow"] = CURLE_OPERATION_TIMEDOUT;
+  string output;
+  EXPECT_EQ(HTTP_GATEWAY_TIMEOUT, _http.get("/slow/slow", output, "gandalf", 0));
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, _http.get("/up/up/down", output, "gandalf", 0));
 }
 
 TEST_F(HttpConnectionTest, SimpleGetRetry)
@@ -105,21 +135,136 @@ TEST_F(HttpConnectionTest, SimpleGetRetry)
   string output;
 
   // Warm up the connection.
-  bool ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
-  EXPECT_TRUE(ret);
+  HTTPCode ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
 
   // Get a failure on the connection and retry it.
   ret = _http.get("/down/around", output, "gandalf", 0);
-  EXPECT_TRUE(ret);
+  EXPECT_EQ(HTTP_OK, ret);
   EXPECT_EQ("<message>Gotcha!</message>", output);
 }
 
+TEST_F(HttpConnectionTest, ResolvedServer)
+{
+  // Requests go to the address the server's name resolves to, naming the
+  // server in the Host header.
+  cwtest_add_host_mapping("cyrus.invalid", "10.42.42.42");
+  HttpConnection http("cyrus.invalid:7888", true, SASEvent::TX_XDM_GET_BASE, "connected_homers", "homer_gets", "homer_breaker");
+  cwtest_clear_host_mapping();
+  fakecurl_responses["http://10.42.42.42:7888/blah/blah/blah"] = "<message>direct</message>";
+
+  string output;
+  EXPECT_EQ(HTTP_OK, http.get("/blah/blah/blah", output, "gandalf", 0));
+  EXPECT_EQ("<message>direct</message>", output);
+  Request& req = fakecurl_requests["http://10.42.42.42:7888/blah/blah/blah"];
+  ASSERT_EQ(2u, req._headers.size());
+  EXPECT_EQ("X-XCAP-Asserted-Identity: gandalf", req._headers.front());
+  EXPECT_EQ("Host: cyrus.invalid:7888", req._headers.back());
+}
+
+TEST_F(HttpConnectionTest, RetryElsewhere)
+{
+  // Warm up the connection.
+  string output;
+  EXPECT_EQ(HTTP_OK, _http.get("/blah/blah/blah", output, "gandalf", 0));
+
+  // A request that fails is retried on another of the server's addresses.
+  vector<string> ips;
+  ips.push_back("10.0.0.1");
+  ips.push_back("10.0.0.2");
+  _http._balancer.update_targets(ips);
+  fakecurl_responses["http://10.0.0.1/down/around"] = CURLE_SEND_ERROR;
+  fakecurl_responses["http://10.0.0.2/down/around"] = "<message>elsewhere</message>";
+
+  // Make sure the first attempt goes to the failing address.
+  _http._balancer._targets["10.0.0.2"]->outstanding = 5;
+
+  EXPECT_EQ(HTTP_OK, _http.get("/down/around", output, "gandalf", 0));
+  EXPECT_EQ("<message>elsewhere</message>", output);
+  EXPECT_EQ(1u, fakecurl_requests.count("http://10.0.0.1/down/around"));
+
+  vector<UpstreamBalancer::Target> targets = _http._balancer.targets();
+  ASSERT_EQ(2u, targets.size());
+  EXPECT_EQ(1, targets[0].samples);
+  EXPECT_EQ(1, targets[1].samples);
+  EXPECT_DOUBLE_EQ(0.1, targets[0].error_rate);
+  EXPECT_DOUBLE_EQ(0.0, targets[1].error_rate);
+}
+
+TEST_F(HttpConnectionTest, AdaptiveTimeout)
+{
+  // Until we know how quickly the server responds, we wait the full time.
+  string output;
+  _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(500, fakecurl_requests["http://cyrus/blah/blah/blah"]._timeout_ms);
+
+  // Then we wait for a multiple of how long it usually takes, within
+  // limits.
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    _http._latencies.add(40.0);
+  }
+  _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(120, fakecurl_requests["http://cyrus/blah/blah/blah"]._timeout_ms);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    _http._latencies.add(1.0);
+  }
+  _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(100, fakecurl_requests["http://cyrus/blah/blah/blah"]._timeout_ms);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    _http._latencies.add(400.0);
+  }
+  _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(500, fakecurl_requests["http://cyrus/blah/blah/blah"]._timeout_ms);
+}
+
+TEST_F(HttpConnectionTest, CircuitBreaker)
+{
+  fakecurl_responses["http://cyrus/blah/blah/none"] = CURLE_HTTP_RETURNED_ERROR;
+  string output;
+
+  // Error responses show the server is working, so don't open the breaker.
+  for (int ii = 0; ii < CircuitBreaker::MIN_REQUESTS; ++ii)
+  {
+    EXPECT_EQ(HTTP_SERVER_ERROR, _http.get("/blah/blah/none", output, "gandalf", 0));
+  }
+  EXPECT_TRUE(_http.available());
+
+  // Failures do.
+  cwtest_advance_time_ms(CircuitBreaker::WINDOW_MS);
+  for (int ii = 0; ii < CircuitBreaker::MIN_REQUESTS; ++ii)
+  {
+    EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, _http.get("/up/up/down", output, "gandalf", 0));
+  }
+  EXPECT_FALSE(_http.available());
+
+  // While it's open, GETs fail without being sent.
+  fakecurl_requests.clear();
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, _http.get("/blah/blah/blah", output, "gandalf", 0));
+  EXPECT_EQ("", output);
+  EXPECT_EQ(0u, fakecurl_requests.size());
+  EXPECT_EQ(1u, _http._breaker.stats().rejected);
+
+  // Later, trial GETs are sent, and once they succeed, all GETs are.
+  cwtest_advance_time_ms(CircuitBreaker::OPEN_MS);
+  for (int ii = 0; ii < CircuitBreaker::TRIAL_REQUESTS; ++ii)
+  {
+    EXPECT_FALSE(_http.available());
+    EXPECT_EQ(HTTP_OK, _http.get("/blah/blah/blah", output, "gandalf", 0));
+  }
+  EXPECT_TRUE(_http.available());
+}
+
 TEST_F(HttpConnectionTest, ConnectionRecycle)
 {
   // Warm up.
   string output;
-  bool ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
-  EXPECT_TRUE(ret);
+  HTTPCode ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
 
   // Wait a very short time.
   cwtest_advance_time_ms(10L);
@@ -128,7 +273,7 @@ TEST_F(HttpConnectionTest, ConnectionRecycle)
   // unlikely (~2e-4) that we'll choose to recycle already - let's
   // just take the risk of an occasional spurious test failure).
   ret = _http.get("/up/up/up", output, "legolas", 0);
-  EXPECT_TRUE(ret);
+  EXPECT_EQ(HTTP_OK, ret);
   Request& req = fakecurl_requests["http://cyrus/up/up/up"];
   EXPECT_FALSE(req._fresh);
 
@@ -140,7 +285,7 @@ TEST_F(HttpConnectionTest, ConnectionRecycle)
   // a tiny chance (~5e-5) we'll fail here because we're still using
   // the same connection, but we'll take the risk.
   ret = _http.get("/down/down/down", output, "gimli", 0);
-  EXPECT_TRUE(ret);
+  EXPECT_EQ(HTTP_OK, ret);
   Request& req2 = fakecurl_requests["http://cyrus/down/down/down"];
   EXPECT_TRUE(req2._fresh);
 
@@ -148,3 +293,204 @@ TEST_F(HttpConnectionTest, ConnectionRecycle)
   EXPECT_EQ(1u, _http._serverCount.size());
   EXPECT_EQ(1, _http._serverCount["10.42.42.42"]);
 }
+
+/// Fixture for test using an HttpEngine.
+class HttpConnectionEngineTest : public BaseTest
+{
+  HttpEngine _engine;
+  HttpConnection _http;
+
+  HttpConnectionEngineTest() :
+    _engine(1),  // FakeCurl isn't thread-safe, so only use one thread.
+    _http("cyrus", true, SASEvent::TX_XDM_GET_BASE, "connected_homers", "homer_gets", "homer_breaker", &_engine)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    fakecurl_responses.clear();
+    fakecurl_responses["http://cyrus/blah/blah/blah"] = "<?xml version=\"1.0\" encoding=\"UTF-8\"><boring>Document</boring>";
+    fakecurl_responses["http://cyrus/blah/blah/wot"] = CURLE_REMOTE_FILE_NOT_FOUND;
+    fakecurl_responses["http://cyrus/up/up/up"] = "<message>ok, whatever...</message>";
+    fakecurl_responses["http://cyrus/down/around"] = Response(CURLE_SEND_ERROR, "<message>Gotcha!</message>");
+  }
+
+  virtual ~HttpConnectionEngineTest()
+  {
+    fakecurl_responses.clear();
+    fakecurl_requests.clear();
+    cwtest_reset_time();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  map<string, string> _docs;
+};
+
+TEST_F(HttpConnectionEngineTest, SimpleGet)
+{
+  string output;
+  HTTPCode ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
+  EXPECT_EQ("<?xml version=\"1.0\" encoding=\"UTF-8\"><boring>Document</boring>", output);
+  Request& req = fakecurl_requests["http://cyrus/blah/blah/blah"];
+  EXPECT_EQ("GET", req._method);
+  ASSERT_EQ(1u, req._headers.size());
+  EXPECT_EQ("X-XCAP-Asserted-Identity: gandalf", req._headers.front());
+
+  ret = _http.get("/blah/blah/wot", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_NOT_FOUND, ret);
+
+  // The requests were made one after another, so shared a handle.
+  EXPECT_EQ(1u, _http._free_handles.size());
+}
+
+TEST_F(HttpConnectionEngineTest, GetRetry)
+{
+  string output;
+
+  // Warm up the connection.
+  HTTPCode ret = _http.get("/blah/blah/blah", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
+
+  // Get a failure on the connection and retry it on a fresh one.
+  ret = _http.get("/down/around", output, "gandalf", 0);
+  EXPECT_EQ(HTTP_OK, ret);
+  EXPECT_EQ("<message>Gotcha!</message>", output);
+  EXPECT_TRUE(fakecurl_requests["http://cyrus/down/around"]._fresh);
+}
+
+TEST_F(HttpConnectionEngineTest, AsyncGet)
+{
+  // Several requests can be in progress at once, each completing with
+  // its own document.
+  const char* paths[] = {"/blah/blah/blah", "/up/up/up", "/blah/blah/wot"};
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    string path = paths[ii];
+    _http.get_async(path, "gandalf", 0, [this, path](HTTPCode rc, const string& doc)
+    {
+      pthread_mutex_lock(&_lock);
+      _docs[path] = (rc == HTTP_OK) ? doc : "failed";
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_lock);
+    });
+  }
+
+  pthread_mutex_lock(&_lock);
+  while (_docs.size() < 3)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  EXPECT_EQ("<?xml version=\"1.0\" encoding=\"UTF-8\"><boring>Document</boring>", _docs["/blah/blah/blah"]);
+  EXPECT_EQ("<message>ok, whatever...</message>", _docs["/up/up/up"]);
+  EXPECT_EQ("failed", _docs["/blah/blah/wot"]);
+}
+
+TEST_F(HttpConnectionEngineTest, CoalescedGet)
+{
+  // Make GETs while the first is still in progress.  Only those for a
+  // different path or user are sent to the server.
+  const char* gets[][2] = {{"/slow/slow", "gandalf"},
+                           {"/slow/slow", "gandalf"},
+                           {"/slow/slow", "legolas"},
+                           {"/slow/down", "gandalf"},
+                           {"/slow/slow", "gandalf"}};
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    string id = std::to_string((long long)ii);
+    _http.get_async(gets[ii][0], gets[ii][1], 0, [this, id](HTTPCode rc, const string& doc)
+    {
+      pthread_mutex_lock(&_lock);
+      _docs[id] = (rc == HTTP_OK) ? doc : "failed";
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_lock);
+    });
+  }
+
+  map<string, HttpConnection::GetStats> stats = _http.get_stats();
+  EXPECT_EQ(3u, stats["slow"].requests);
+  EXPECT_EQ(2u, stats["slow"].coalesced);
+
+  // Now let the requests complete.
+  pthread_mutex_lock(&fakecurl_multi_lock);
+  fakecurl_responses["http://cyrus/slow/slow"] = "<message>at last</message>";
+  fakecurl_responses["http://cyrus/slow/down"] = CURLE_REMOTE_FILE_NOT_FOUND;
+  pthread_mutex_unlock(&fakecurl_multi_lock);
+
+  pthread_mutex_lock(&_lock);
+  while (_docs.size() < 5)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  EXPECT_EQ("<message>at last</message>", _docs["0"]);
+  EXPECT_EQ("<message>at last</message>", _docs["1"]);
+  EXPECT_EQ("<message>at last</message>", _docs["2"]);
+  EXPECT_EQ("failed", _docs["3"]);
+  EXPECT_EQ("<message>at last</message>", _docs["4"]);
+  EXPECT_TRUE(_http._in_flight.empty());
+
+  // Once the GET has completed, an identical one is sent afresh.
+  string output;
+  EXPECT_EQ(HTTP_OK, _http.get("/slow/slow", output, "gandalf", 0));
+  EXPECT_EQ(4u, _http.get_stats()["slow"].requests);
+}
+
+TEST_F(HttpConnectionEngineTest, Hedge)
+{
+  // The server usually responds quickly, but one of its addresses is
+  // stuck.  Make sure the first request goes there.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _http._latencies.add(1.0);
+  }
+  vector<string> ips;
+  ips.push_back("10.0.0.1");
+  ips.push_back("10.0.0.2");
+  _http._balancer.update_targets(ips);
+  _http._balancer._targets["10.0.0.2"]->outstanding = 5;
+  pthread_mutex_lock(&fakecurl_multi_lock);
+  fakecurl_responses["http://10.0.0.2/slow/slow"] = "<message>hedged</message>";
+  pthread_mutex_unlock(&fakecurl_multi_lock);
+
+  // The request is hedged, and the hedge's response used.
+  string output;
+  EXPECT_EQ(HTTP_OK, _http.get("/slow/slow", output, "gandalf", 0));
+  EXPECT_EQ("<message>hedged</message>", output);
+  EXPECT_EQ(1u, _http.get_stats()["slow"].hedged);
+  EXPECT_TRUE(_http._in_flight.empty());
+
+  // Let the first request complete too.  Its response is ignored.
+  pthread_mutex_lock(&fakecurl_multi_lock);
+  fakecurl_responses["http://10.0.0.1/slow/slow"] = "<message>late</message>";
+  pthread_mutex_unlock(&fakecurl_multi_lock);
+  size_t free_handles = 0;
+  while (free_handles < 2)
+  {
+    usleep(1000);
+    pthread_mutex_lock(&_http._lock);
+    free_handles = _http._free_handles.size();
+    pthread_mutex_unlock(&_http._lock);
+  }
+}
+
+TEST_F(HttpConnectionEngineTest, HedgeBudget)
+{
+  // Requests are hedged straight away, but there's no budget for it.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _http._latencies.add(0.0);
+  }
+  _http._saved_hedges = 0.5;
+
+  string output;
+  EXPECT_EQ(HTTP_OK, _http.get("/blah/blah/blah", output, "gandalf", 0));
+  EXPECT_EQ(0u, _http.get_stats()["blah"].hedged);
+
+  // Each request adds to the budget.
+  EXPECT_DOUBLE_EQ(0.6, _http._saved_hedges);
+}
@@ -0,0 +1,145 @@
+/**
+ * @file httpengine_test.cpp UT for the HttpEngine class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "httpengine.h"
+#include "basetest.hpp"
+#include "fakecurl.hpp"
+
+using namespace std;
+
+/// Fixture for HttpEngineTest.
+class HttpEngineTest : public BaseTest
+{
+  HttpEngineTest()
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    fakecurl_responses.clear();
+    fakecurl_responses["http://cyrus/blah/blah/blah"] = "<boring>Document</boring>";
+    fakecurl_responses["http://cyrus/blah/blah/wot"] = CURLE_REMOTE_FILE_NOT_FOUND;
+  }
+
+  virtual ~HttpEngineTest()
+  {
+    for (size_t ii = 0; ii < _handles.size(); ++ii)
+    {
+      curl_easy_cleanup(_handles[ii]);
+    }
+    fakecurl_responses.clear();
+    fakecurl_requests.clear();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  /// Create a handle for a request to the URL.
+  CURL* handle(const string& url)
+  {
+    CURL* curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    _handles.push_back(curl);
+    return curl;
+  }
+
+  /// Record the result of a request.
+  void completed(CURLcode rc)
+  {
+    pthread_mutex_lock(&_lock);
+    _results.push_back(rc);
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /// Wait for the given number of requests to complete.
+  void wait_for(size_t completed)
+  {
+    pthread_mutex_lock(&_lock);
+    while (_results.size() < completed)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+  vector<CURL*> _handles;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  vector<CURLcode> _results;
+};
+
+TEST_F(HttpEngineTest, Perform)
+{
+  // FakeCurl isn't thread-safe, so only use one thread.
+  HttpEngine engine(1);
+
+  // Each request completes with its own result.
+  engine.perform(handle("http://cyrus/blah/blah/blah"), [this](CURLcode rc) { completed(rc); });
+  engine.perform(handle("http://cyrus/blah/blah/blah"), [this](CURLcode rc) { completed(rc); });
+  engine.perform(handle("http://cyrus/blah/blah/wot"), [this](CURLcode rc) { completed(rc); });
+  wait_for(3);
+  EXPECT_EQ(2, count(_results.begin(), _results.end(), CURLE_OK));
+  EXPECT_EQ(1, count(_results.begin(), _results.end(), CURLE_REMOTE_FILE_NOT_FOUND));
+}
+
+TEST_F(HttpEngineTest, Abort)
+{
+  {
+    HttpEngine engine(1);
+
+    // A request that doesn't complete is aborted when the engine is
+    // destroyed, as is any request made then.  Waiting for the request
+    // made after it ensures it's in progress.
+    CURL* retry = handle("http://cyrus/blah/blah/blah");
+    engine.perform(handle("http://cyrus/slow"), [this, &engine, retry](CURLcode rc)
+    {
+      completed(rc);
+      engine.perform(retry, [this](CURLcode rc) { completed(rc); });
+    });
+    engine.perform(handle("http://cyrus/blah/blah/blah"), [this](CURLcode rc) { completed(rc); });
+    wait_for(1);
+  }
+
+  ASSERT_EQ(3u, _results.size());
+  EXPECT_EQ(CURLE_OK, _results[0]);
+  EXPECT_EQ(CURLE_ABORTED_BY_CALLBACK, _results[1]);
+  EXPECT_EQ(CURLE_ABORTED_BY_CALLBACK, _results[2]);
+}
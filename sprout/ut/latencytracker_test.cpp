@@ -0,0 +1,98 @@
+/**
+ * @file latencytracker_test.cpp UT for LatencyTracker.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include "gtest/gtest.h"
+
+#include "latencytracker.h"
+#include "basetest.hpp"
+
+using namespace std;
+
+/// Fixture for LatencyTrackerTest.
+class LatencyTrackerTest : public BaseTest
+{
+};
+
+TEST_F(LatencyTrackerTest, Percentiles)
+{
+  LatencyTracker tracker;
+
+  // Until there are enough latencies, there are no percentiles.
+  for (size_t ii = 1; ii < LatencyTracker::MIN_SAMPLES; ++ii)
+  {
+    tracker.add(ii);
+  }
+  EXPECT_EQ(-1.0, tracker.percentile(50));
+
+  for (int ii = LatencyTracker::MIN_SAMPLES; ii <= 100; ++ii)
+  {
+    tracker.add(ii);
+  }
+  EXPECT_EQ(1.0, tracker.percentile(0));
+  EXPECT_EQ(50.0, tracker.percentile(50));
+  EXPECT_EQ(95.0, tracker.percentile(95));
+  EXPECT_EQ(100.0, tracker.percentile(100));
+}
+
+TEST_F(LatencyTrackerTest, Window)
+{
+  // Only the most recent latencies count, and once there are plenty the
+  // percentiles are only recalculated periodically.
+  LatencyTracker tracker(200);
+  for (int ii = 0; ii < 200; ++ii)
+  {
+    tracker.add(100);
+  }
+  EXPECT_EQ(100.0, tracker.percentile(50));
+
+  for (size_t ii = 1; ii < LatencyTracker::RECALCULATE_INTERVAL; ++ii)
+  {
+    tracker.add(10);
+  }
+  EXPECT_EQ(100.0, tracker.percentile(50));
+  tracker.add(10);
+  EXPECT_EQ(10.0, tracker.percentile(50));
+  EXPECT_EQ(100.0, tracker.percentile(99));
+
+  for (size_t ii = 0; ii < LatencyTracker::RECALCULATE_INTERVAL; ++ii)
+  {
+    tracker.add(10);
+  }
+  EXPECT_EQ(10.0, tracker.percentile(99));
+}
@@ -0,0 +1,422 @@
+/**
+ * @file localstore_test.cpp UT for the LocalStore class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "localstore.h"
+#include "fakelogger.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// Read-modify-write an AoR until the write succeeds, adding a binding
+/// with the given ID.  Returns the number of attempts taken.
+static int add_binding(Store* store,
+                       const std::string& aor_id,
+                       const std::string& binding_id,
+                       int expires)
+{
+  int attempts = 0;
+  bool set_rc;
+  do
+  {
+    AoR* aor_data = store->get_aor_data(aor_id);
+    aor_data->get_binding(binding_id)->_expires = expires;
+    set_rc = store->set_aor_data(aor_id, aor_data);
+    delete aor_data;
+    ++attempts;
+  }
+  while (!set_rc);
+  return attempts;
+}
+
+/// Fixture for LocalStoreTest.
+class LocalStoreTest : public ::testing::Test
+{
+  FakeLogger _log;
+
+  LocalStoreTest()
+  {
+  }
+
+  virtual ~LocalStoreTest()
+  {
+  }
+};
+
+/// Arguments for a thread in the Concurrent test.
+struct ConcurrentArgs
+{
+  Store* store;
+  int thread_num;
+  int num_aors;
+  int num_writes;
+  int expires;
+};
+
+static void* concurrent_writer(void* p)
+{
+  ConcurrentArgs* args = (ConcurrentArgs*)p;
+  for (int ii = 0; ii < args->num_writes; ++ii)
+  {
+    char aor_id[32];
+    char binding_id[32];
+    snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", ii % args->num_aors);
+    snprintf(binding_id, sizeof(binding_id), "<urn:uuid:%d-%d>", args->thread_num, ii);
+    add_binding(args->store, aor_id, binding_id, args->expires);
+  }
+  return NULL;
+}
+
+TEST_F(LocalStoreTest, CAS)
+{
+  LocalStore store(4);
+  int expires = time(NULL) + 300;
+
+  // A new AoR has no CAS, and a write through it creates it.
+  LocalAoR* aor_data1 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  LocalAoR* aor_data3 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data1->get_cas());
+  aor_data1->get_binding("a")->_expires = expires;
+  EXPECT_TRUE(store.set_aor_data("sip:6505550231@homedomain", aor_data1));
+  EXPECT_NE(0u, aor_data1->get_cas());
+
+  // Someone else trying to create the AoR at the same time fails.
+  aor_data3->get_binding("x")->_expires = expires;
+  EXPECT_FALSE(store.set_aor_data("sip:6505550231@homedomain", aor_data3));
+
+  // A second read sees the write, and the written copy has the new CAS.
+  LocalAoR* aor_data2 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  EXPECT_EQ(aor_data1->get_cas(), aor_data2->get_cas());
+
+  // Writing through a stale copy fails.
+  aor_data2->get_binding("b")->_expires = expires;
+  EXPECT_TRUE(store.set_aor_data("sip:6505550231@homedomain", aor_data2));
+  aor_data1->get_binding("c")->_expires = expires;
+  EXPECT_FALSE(store.set_aor_data("sip:6505550231@homedomain", aor_data1));
+  delete aor_data2;
+  aor_data2 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(2u, aor_data2->bindings().size());
+
+  // Writes to an AoR that doesn't exist any more fail, as do NULL writes.
+  EXPECT_FALSE(store.set_aor_data("sip:6505550232@homedomain", aor_data1));
+  EXPECT_FALSE(store.set_aor_data("sip:6505550231@homedomain", NULL));
+
+  // Writing an AoR with no live bindings removes it.
+  aor_data2->get_binding("a")->_expires = 0;
+  aor_data2->get_binding("b")->_expires = 0;
+  EXPECT_TRUE(store.set_aor_data("sip:6505550231@homedomain", aor_data2));
+  delete aor_data2;
+  aor_data2 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  EXPECT_EQ(0u, aor_data2->get_cas());
+
+  // Once flushed, the AoR is empty again.
+  add_binding(&store, "sip:6505550231@homedomain", "a", expires);
+  store.flush_all();
+  delete aor_data2;
+  aor_data2 = (LocalAoR*)store.get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+
+  delete aor_data3;
+  delete aor_data2;
+  delete aor_data1;
+}
+
+/// Expiry listener that records what it is told.
+class RecordingListener : public Store::ExpiryListener
+{
+public:
+  RecordingListener()
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~RecordingListener()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void binding_expired(const std::string& aor_id,
+                       const std::string& binding_id,
+                       const AoR::Binding& binding)
+  {
+    pthread_mutex_lock(&_lock);
+    _expired.push_back(aor_id + " " + binding_id + " " + binding._uri);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  std::vector<std::string> expired()
+  {
+    pthread_mutex_lock(&_lock);
+    std::vector<std::string> expired = _expired;
+    _expired.clear();
+    pthread_mutex_unlock(&_lock);
+    return expired;
+  }
+
+private:
+  pthread_mutex_t _lock;
+  std::vector<std::string> _expired;
+};
+
+TEST_F(LocalStoreTest, Expiry)
+{
+  LocalStore store(1);
+  RecordingListener listener;
+  store.set_expiry_listener(&listener);
+  int now = time(NULL);
+  LocalStore::Shard* shard = store._shards[0];
+
+  add_binding(&store, "sip:6505550231@homedomain", "a", now + 300);
+  add_binding(&store, "sip:6505550232@homedomain", "a", now + 300);
+  add_binding(&store, "sip:6505550232@homedomain", "b", now + 10);
+  add_binding(&store, "sip:6505550233@homedomain", "c", now + 10);
+  AoR* aor_data = store.get_aor_data("sip:6505550233@homedomain");
+  aor_data->get_binding("c")->_uri = "sip:c@example.com";
+  EXPECT_TRUE(store.set_aor_data("sip:6505550233@homedomain", aor_data));
+  delete aor_data;
+  EXPECT_EQ(3u, shard->db.size());
+  EXPECT_EQ(3u, shard->timers->size());
+
+  // Each AoR's timer is for its earliest binding.
+  EXPECT_EQ(now + 10, shard->db["sip:6505550232@homedomain"].timer->expiry);
+
+  // Nothing happens until a binding expires.
+  store.expire_all(now + 9);
+  EXPECT_EQ(0u, listener.expired().size());
+  EXPECT_EQ(3u, shard->db.size());
+
+  // Then the expired bindings are removed, along with AoRs that have none
+  // left, and the listener hears about them.
+  store.expire_all(now + 10);
+  std::vector<std::string> expired = listener.expired();
+  ASSERT_EQ(2u, expired.size());
+  EXPECT_EQ("sip:6505550232@homedomain b ", expired[0]);
+  EXPECT_EQ("sip:6505550233@homedomain c sip:c@example.com", expired[1]);
+  EXPECT_EQ(2u, shard->db.size());
+  EXPECT_EQ(2u, shard->timers->size());
+  EXPECT_EQ(now + 300, shard->db["sip:6505550232@homedomain"].timer->expiry);
+
+  aor_data = store.get_aor_data("sip:6505550232@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+  aor_data = store.get_aor_data("sip:6505550233@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+
+  // Without a listener, expired bindings just go.
+  store.set_expiry_listener(NULL);
+  store.expire_all(now + 300);
+  EXPECT_EQ(0u, shard->db.size());
+  EXPECT_EQ(0u, shard->timers->size());
+}
+
+TEST_F(LocalStoreTest, BackgroundExpiry)
+{
+  LocalStore store(1);
+  RecordingListener listener;
+  store.set_expiry_listener(&listener);
+
+  // The background thread removes the binding within a couple of seconds,
+  // without anyone reading it.
+  add_binding(&store, "sip:6505550231@homedomain", "a", time(NULL) + 1);
+  std::vector<std::string> expired;
+  for (int ii = 0; (ii < 30) && (expired.empty()); ++ii)
+  {
+    usleep(100 * 1000);
+    expired = listener.expired();
+  }
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("sip:6505550231@homedomain a ", expired[0]);
+}
+
+TEST_F(LocalStoreTest, Concurrent)
+{
+  const int NUM_THREADS = 8;
+  const int NUM_AORS = 5;
+  const int NUM_WRITES = 200;
+  LocalStore store(2);
+  int expires = time(NULL) + 300;
+
+  // Several threads add bindings to the same few AoRs at once.
+  pthread_t threads[NUM_THREADS];
+  ConcurrentArgs args[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    args[ii].store = &store;
+    args[ii].thread_num = ii;
+    args[ii].num_aors = NUM_AORS;
+    args[ii].num_writes = NUM_WRITES;
+    args[ii].expires = expires;
+    pthread_create(&threads[ii], NULL, concurrent_writer, &args[ii]);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // No update was lost.
+  size_t total = 0;
+  for (int ii = 0; ii < NUM_AORS; ++ii)
+  {
+    char aor_id[32];
+    snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", ii);
+    AoR* aor_data = store.get_aor_data(aor_id);
+    total += aor_data->bindings().size();
+    delete aor_data;
+  }
+  EXPECT_EQ((size_t)(NUM_THREADS * NUM_WRITES), total);
+}
+
+TEST_F(LocalStoreTest, Restart)
+{
+  char log_file[64];
+  snprintf(log_file, sizeof(log_file), "/tmp/localstore_test.%d", getpid());
+  unlink(log_file);
+  int now = time(NULL);
+
+  LocalStore* store = new LocalStore(1, log_file);
+  add_binding(store, "sip:6505550231@homedomain", "a", now + 300);
+  add_binding(store, "sip:6505550232@homedomain", "a", now + 300);
+  add_binding(store, "sip:6505550232@homedomain", "b", now + 10);
+  add_binding(store, "sip:6505550233@homedomain", "a", now + 300);
+  add_binding(store, "sip:6505550234@homedomain", "a", now + 300);
+  AoR* aor_data = store->get_aor_data("sip:6505550233@homedomain");
+  aor_data->get_binding("a")->_expires = 0;
+  EXPECT_TRUE(store->set_aor_data("sip:6505550233@homedomain", aor_data));
+  delete aor_data;
+  delete store;
+
+  // After a restart the AoRs are all there, with their timers set, but
+  // they aren't read in until they're used.
+  store = new LocalStore(1, log_file);
+  RecordingListener listener;
+  store->set_expiry_listener(&listener);
+  LocalStore::Shard* shard = store->_shards[0];
+  EXPECT_EQ(3u, shard->db.size());
+  EXPECT_EQ(3u, shard->timers->size());
+  EXPECT_FALSE(shard->db["sip:6505550231@homedomain"].loaded);
+  EXPECT_EQ(now + 10, shard->db["sip:6505550232@homedomain"].timer->expiry);
+
+  LocalAoR* local_aor_data = (LocalAoR*)store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_TRUE(shard->db["sip:6505550231@homedomain"].loaded);
+  EXPECT_EQ(1u, local_aor_data->bindings().size());
+  EXPECT_NE(0u, local_aor_data->get_cas());
+  local_aor_data->get_binding("b")->_expires = now + 300;
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", local_aor_data));
+  delete local_aor_data;
+
+  // A binding that expires is reported as usual.
+  store->expire_all(now + 10);
+  std::vector<std::string> expired = listener.expired();
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("sip:6505550232@homedomain b ", expired[0]);
+
+  // An AoR whose record can't be read is dropped.
+  size_t offset = store->_log->_index["sip:6505550234@homedomain"].offset;
+  offset += sizeof(AoRLog::RecordHeader) + strlen("sip:6505550234@homedomain");
+  store->_log->_base[offset] ^= 1;
+  aor_data = store->get_aor_data("sip:6505550234@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+  EXPECT_EQ(2u, shard->db.size());
+  delete store;
+
+  // All the changes made since the restart are kept.
+  store = new LocalStore(1, log_file);
+  shard = store->_shards[0];
+  EXPECT_EQ(2u, shard->db.size());
+  aor_data = store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(2u, aor_data->bindings().size());
+  delete aor_data;
+  aor_data = store->get_aor_data("sip:6505550232@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  // Flushing the store empties the file too.
+  store->flush_all();
+  delete store;
+  store = new LocalStore(1, log_file);
+  EXPECT_EQ(0u, store->_shards[0]->db.size());
+  delete store;
+  unlink(log_file);
+}
+
+TEST_F(LocalStoreTest, BackgroundCompaction)
+{
+  char log_file[64];
+  snprintf(log_file, sizeof(log_file), "/tmp/localstore_test.%d", getpid());
+  unlink(log_file);
+  LocalStore store(1, log_file);
+  int expires = time(NULL) + 300;
+  AoRLog* log = store._log;
+  auto used = [log]() -> size_t
+  {
+    pthread_mutex_lock(&log->_lock);
+    size_t used = log->_used;
+    pthread_mutex_unlock(&log->_lock);
+    return used;
+  };
+
+  // Keep rewriting an AoR until the log is big enough to compact, then
+  // wait for the background thread to do so.
+  for (int ii = 0; used() <= AoRLog::INITIAL_SIZE; ++ii)
+  {
+    add_binding(&store,
+                "sip:6505550231@homedomain",
+                "<urn:uuid:" + std::to_string(ii % 10) + ">",
+                expires);
+  }
+  for (int ii = 0; (ii < 30) && (used() > AoRLog::INITIAL_SIZE); ++ii)
+  {
+    usleep(100 * 1000);
+  }
+  EXPECT_GT(AoRLog::INITIAL_SIZE, used());
+  unlink(log_file);
+}
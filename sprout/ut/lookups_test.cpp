@@ -0,0 +1,198 @@
+/**
+ * @file lookups_test.cpp UT for the LookupPool and Lookup classes.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "lookups.h"
+#include "basetest.hpp"
+
+using namespace std;
+
+/// Fixture for LookupsTest.
+class LookupsTest : public BaseTest
+{
+  LookupsTest() : _started(0), _released(false)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+
+  virtual ~LookupsTest()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  /// A lookup that doesn't finish until there are the given number of
+  /// lookups running at once, or the lookups are released.  Returns
+  /// whether there were.
+  bool lookup(int concurrent)
+  {
+    pthread_mutex_lock(&_lock);
+    ++_started;
+    pthread_cond_broadcast(&_cond);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    while ((_started < concurrent) && (!_released))
+    {
+      if (pthread_cond_timedwait(&_cond, &_lock, &deadline) != 0)
+      {
+        break;
+      }
+    }
+    bool rc = (_started >= concurrent);
+    pthread_mutex_unlock(&_lock);
+    return rc;
+  }
+
+  /// Wait for the given number of lookups to start.
+  void wait_for(int started)
+  {
+    pthread_mutex_lock(&_lock);
+    while (_started < started)
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /// Let the waiting lookups finish.
+  void release()
+  {
+    pthread_mutex_lock(&_lock);
+    _released = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  int _started;
+  bool _released;
+};
+
+TEST_F(LookupsTest, Concurrent)
+{
+  LookupPool pool(3);
+  Lookup<bool> lookups[3];
+
+  // Each lookup only succeeds if all three run at once.
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    lookups[ii].start(&pool, "sip:6505550231@homedomain", [this]() { return lookup(3); });
+    EXPECT_TRUE(lookups[ii].started());
+  }
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    EXPECT_TRUE(lookups[ii].get("sip:6505550231@homedomain", []() { return false; }));
+  }
+}
+
+TEST_F(LookupsTest, OtherKey)
+{
+  LookupPool pool(1);
+  Lookup<string> lookup;
+
+  // The result is only used if it's for the right key.
+  lookup.start(&pool, "sip:6505550231@homedomain", []() { return string("speculative"); });
+  EXPECT_EQ("needed", lookup.get("sip:6505550232@homedomain", []() { return string("needed"); }));
+  EXPECT_EQ("speculative", lookup.get("sip:6505550231@homedomain", []() { return string("needed"); }));
+}
+
+TEST_F(LookupsTest, NoPool)
+{
+  Lookup<string> lookup;
+
+  // Without a pool, the lookup is done when its result is needed.
+  lookup.start(NULL, "sip:6505550231@homedomain", []() { return string("speculative"); });
+  EXPECT_FALSE(lookup.started());
+  EXPECT_EQ("needed", lookup.get("sip:6505550231@homedomain", []() { return string("needed"); }));
+}
+
+TEST_F(LookupsTest, NoThreads)
+{
+  LookupPool pool(0);
+  Lookup<string> lookup;
+  int calls = 0;
+
+  // A pool without threads does the lookup as soon as it's started.
+  lookup.start(&pool, "sip:6505550231@homedomain", [&calls]() { ++calls; return string("speculative"); });
+  EXPECT_TRUE(lookup.started());
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ("speculative", lookup.get("sip:6505550231@homedomain", []() { return string("needed"); }));
+}
+
+TEST_F(LookupsTest, Busy)
+{
+  LookupPool pool(1, 1);
+  Lookup<bool> running;
+  Lookup<bool> queued;
+  Lookup<bool> busy;
+
+  // One lookup runs and one waits for the thread, so there's no room for
+  // another, which is left until it's needed.
+  running.start(&pool, "sip:6505550231@homedomain", [this]() { return lookup(2); });
+  wait_for(1);
+  queued.start(&pool, "sip:6505550232@homedomain", [this]() { return lookup(2); });
+  busy.start(&pool, "sip:6505550233@homedomain", [this]() { return true; });
+  EXPECT_TRUE(running.started());
+  EXPECT_TRUE(queued.started());
+  EXPECT_FALSE(busy.started());
+
+  release();
+  EXPECT_FALSE(running.get("sip:6505550231@homedomain", []() { return true; }));
+  EXPECT_TRUE(queued.get("sip:6505550232@homedomain", []() { return false; }));
+  EXPECT_FALSE(busy.get("sip:6505550233@homedomain", []() { return false; }));
+}
+
+TEST_F(LookupsTest, Discarded)
+{
+  LookupPool pool(1);
+
+  // A lookup whose result is never needed finishes in the background.
+  {
+    Lookup<bool> unused;
+    unused.start(&pool, "sip:6505550231@homedomain", [this]() { return lookup(2); });
+    wait_for(1);
+  }
+  release();
+}
@@ -0,0 +1,831 @@
+/**
+ * @file @file memcachedclient_test.cpp UT for the MemcachedClient class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <list>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unistd.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "memcachedclient.h"
+#include "fakememcachedserver.hpp"
+#include "fakelogger.hpp"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for MemcachedClientTest.
+class MemcachedClientTest : public ::testing::Test
+{
+  FakeLogger _log;
+
+  MemcachedClientTest()
+  {
+  }
+
+  virtual ~MemcachedClientTest()
+  {
+    cwtest_reset_time();
+  }
+
+  static std::list<std::string> servers(const FakeMemcachedServer& server)
+  {
+    std::list<std::string> servers;
+    servers.push_back(server.address());
+    return servers;
+  }
+};
+
+/// Counts completed asynchronous requests, checking each returned the
+/// expected value.
+class Counter
+{
+public:
+  Counter(int expected) :
+    _expected(expected),
+    _done(0),
+    _mismatches(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~Counter()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  MemcachedClient::GetCallback callback(const std::string& expected_value)
+  {
+    return [this, expected_value](MemcachedClient::Status status,
+                                  const char* value,
+                                  size_t length,
+                                  uint64_t cas)
+    {
+      pthread_mutex_lock(&_lock);
+      if ((status != MemcachedClient::OK) ||
+          (std::string(value, length) != expected_value))
+      {
+        _mismatches++;
+      }
+      bool done = (++_done == _expected);
+      pthread_mutex_unlock(&_lock);
+      if (done)
+      {
+        _completion.complete();
+      }
+    };
+  }
+
+  int _expected;
+  int _done;
+  int _mismatches;
+  pthread_mutex_t _lock;
+  MemcachedClient::Completion _completion;
+};
+
+TEST_F(MemcachedClientTest, GetStore)
+{
+  FakeMemcachedServer server;
+  MemcachedClient client(servers(server), 1);
+  std::string value;
+  uint64_t cas = 0;
+
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+
+  // Adding creates the key, once only.  Values may contain anything.
+  std::string value1("one\0one", 7);
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", value1, 0, cas));
+  EXPECT_NE(0u, cas);
+  uint64_t cas1 = cas;
+  cas = 0;
+  EXPECT_EQ(MemcachedClient::EXISTS, client.store("key", "other", 0, cas));
+
+  cas = 0;
+  EXPECT_EQ(MemcachedClient::OK, client.get("key", value, cas));
+  EXPECT_EQ(value1, value);
+  EXPECT_EQ(cas1, cas);
+
+  // Updates only succeed with the current CAS.
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "two", 0, cas));
+  EXPECT_NE(cas1, cas);
+  cas = cas1;
+  EXPECT_EQ(MemcachedClient::EXISTS, client.store("key", "three", 0, cas));
+  EXPECT_EQ(cas1, cas);
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.store("nokey", "three", 0, cas));
+  EXPECT_EQ("two", server.record("key").first);
+
+  // Values bigger than a single read are reassembled.
+  std::string big(100000, 'x');
+  cas = 0;
+  EXPECT_EQ(MemcachedClient::OK, client.store("big", big, 0, cas));
+  EXPECT_EQ(MemcachedClient::OK, client.get("big", value, cas));
+  EXPECT_EQ(big, value);
+
+  // Flushing removes everything.
+  EXPECT_EQ(MemcachedClient::OK, client.flush_all());
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+
+  // The server rejects requests it doesn't understand.
+  MemcachedClient::Completion completion;
+  MemcachedClient::Status status = MemcachedClient::OK;
+  std::string msg;
+  MemcachedClient::append_request(msg, 0x7f, "", "", "", 0);
+  std::vector<MemcachedClient::Request> requests(1);
+  requests[0].store_callback = [&](MemcachedClient::Status s, uint64_t) { status = s; completion.complete(); };
+  EXPECT_TRUE(client._servers[server.address()]->connections[0]->send(msg, requests));
+  completion.wait();
+  EXPECT_EQ(MemcachedClient::ERROR, status);
+}
+
+TEST_F(MemcachedClientTest, Pipelining)
+{
+  const int NUM_KEYS = 50;
+  const int NUM_REQUESTS = 2000;
+  FakeMemcachedServer server;
+  MemcachedClient client(servers(server), 2);
+
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    uint64_t cas = 0;
+    client.store("key" + std::to_string(ii), "value" + std::to_string(ii), 0, cas);
+  }
+
+  // Lots of requests outstanding at once, over just two connections, each
+  // matched up with its own response.
+  Counter counter(NUM_REQUESTS);
+  for (int ii = 0; ii < NUM_REQUESTS; ++ii)
+  {
+    int key = ii % NUM_KEYS;
+    client.get("key" + std::to_string(key), counter.callback("value" + std::to_string(key)));
+  }
+  counter._completion.wait();
+  EXPECT_EQ(0, counter._mismatches);
+  EXPECT_EQ(2, server.connections());
+  EXPECT_EQ(NUM_KEYS + NUM_REQUESTS, server.requests());
+}
+
+TEST_F(MemcachedClientTest, MultipleServers)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+  MemcachedClient client(servers, 1);
+
+  // Keys are spread across the servers.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    uint64_t cas = 0;
+    EXPECT_EQ(MemcachedClient::OK, client.store("key" + std::to_string(ii), "value", 0, cas));
+  }
+  EXPECT_LT(0, server1.requests());
+  EXPECT_LT(0, server2.requests());
+  EXPECT_EQ(20, server1.requests() + server2.requests());
+
+  // Flushing goes to both.
+  EXPECT_EQ(MemcachedClient::OK, client.flush_all());
+  EXPECT_EQ(22, server1.requests() + server2.requests());
+  std::string value;
+  uint64_t cas;
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key0", value, cas));
+}
+
+TEST_F(MemcachedClientTest, GetMulti)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+  MemcachedClient client(servers, 2);
+
+  std::vector<std::string> keys;
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    keys.push_back("key" + std::to_string(ii));
+    if (ii % 2 == 0)
+    {
+      uint64_t cas = 0;
+      client.store(keys.back(), "value" + std::to_string(ii), 0, cas);
+    }
+  }
+  int requests = server1.requests() + server2.requests();
+
+  // Every key gets one result, hits and misses alike, and each server gets
+  // one batch: a request per key and a no-op.
+  std::map<std::string, std::string> results;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  MemcachedClient::Completion completion;
+  client.get_multi(keys, [&](const std::string& key,
+                             MemcachedClient::Status status,
+                             const char* value,
+                             size_t length,
+                             uint64_t cas)
+  {
+    pthread_mutex_lock(&lock);
+    results[key] = (status == MemcachedClient::OK) ? std::string(value, length) :
+                   (status == MemcachedClient::NOT_FOUND) ? "missing" : "error";
+    bool done = (results.size() == 20);
+    pthread_mutex_unlock(&lock);
+    if (done)
+    {
+      completion.complete();
+    }
+  });
+  completion.wait();
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    EXPECT_EQ((ii % 2 == 0) ? "value" + std::to_string(ii) : "missing",
+              results["key" + std::to_string(ii)]);
+  }
+  EXPECT_EQ(requests + 22, server1.requests() + server2.requests());
+
+  // Servers with no keys are sent nothing.
+  client.get_multi(std::vector<std::string>(), [&](const std::string& key,
+                                                   MemcachedClient::Status status,
+                                                   const char* value,
+                                                   size_t length,
+                                                   uint64_t cas)
+  {
+    ADD_FAILURE();
+  });
+  EXPECT_EQ(requests + 22, server1.requests() + server2.requests());
+
+  // Keys for an unreachable server fail straight away.
+  std::list<std::string> servers2;
+  {
+    FakeMemcachedServer server3;
+    servers2.push_back(server3.address());
+  }
+  MemcachedClient client2(servers2, 1);
+  int errors = 0;
+  client2.get_multi(keys, [&](const std::string& key,
+                              MemcachedClient::Status status,
+                              const char* value,
+                              size_t length,
+                              uint64_t cas)
+  {
+    if (status == MemcachedClient::ERROR)
+    {
+      errors++;
+    }
+  });
+  EXPECT_EQ(20, errors);
+}
+
+TEST_F(MemcachedClientTest, OpaqueWrap)
+{
+  FakeMemcachedServer server;
+  MemcachedClient client(servers(server), 1);
+  std::vector<std::string> keys;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    keys.push_back("key" + std::to_string(ii));
+    if (ii % 2 == 0)
+    {
+      uint64_t cas = 0;
+      client.store(keys.back(), "value" + std::to_string(ii), 0, cas);
+    }
+  }
+
+  // Quiet gets either side of the 32-bit opaque ID wrapping still match up
+  // with their responses, and only the real misses are reported as such.
+  client._servers[server.address()]->connections[0]->_next_seq = 0xfffffffcULL;
+  std::map<std::string, std::string> results;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  MemcachedClient::Completion completion;
+  client.get_multi(keys, [&](const std::string& key,
+                             MemcachedClient::Status status,
+                             const char* value,
+                             size_t length,
+                             uint64_t cas)
+  {
+    pthread_mutex_lock(&lock);
+    results[key] = (status == MemcachedClient::OK) ? std::string(value, length) :
+                   (status == MemcachedClient::NOT_FOUND) ? "missing" : "error";
+    bool done = (results.size() == 10);
+    pthread_mutex_unlock(&lock);
+    if (done)
+    {
+      completion.complete();
+    }
+  });
+  completion.wait();
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_EQ((ii % 2 == 0) ? "value" + std::to_string(ii) : "missing",
+              results["key" + std::to_string(ii)]);
+  }
+
+  std::string value;
+  uint64_t cas;
+  EXPECT_EQ(MemcachedClient::OK, client.get("key0", value, cas));
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key1", value, cas));
+}
+
+TEST_F(MemcachedClientTest, ConsistentHashing)
+{
+  std::list<std::string> servers;
+  for (int ii = 1; ii <= 4; ++ii)
+  {
+    servers.push_back("10.0.0." + std::to_string(ii));
+  }
+  MemcachedClient client(servers, 1, 100, 2);
+  std::map<std::string, std::string> primaries;
+  std::map<std::string, int> counts;
+  for (int ii = 0; ii < 4000; ++ii)
+  {
+    std::string key = "key" + std::to_string(ii);
+    MemcachedClient::Route route = client.route(key);
+    ASSERT_EQ(2u, route.replicas);
+    ASSERT_EQ(2u, route.servers.size());
+    EXPECT_NE(route.servers[0], route.servers[1]);
+    primaries[key] = route.servers[0]->name;
+    counts[route.servers[0]->name]++;
+  }
+
+  // The keys are spread evenly.
+  EXPECT_EQ(4u, counts.size());
+  for (std::map<std::string, int>::iterator i = counts.begin(); i != counts.end(); ++i)
+  {
+    EXPECT_LT(700, i->second) << i->first;
+    EXPECT_GT(1300, i->second) << i->first;
+  }
+
+  // Adding a server only moves keys onto it, and takes about its share.
+  servers.push_back("10.0.0.5");
+  client.set_servers(servers, 0);
+  int moved = 0;
+  for (int ii = 0; ii < 4000; ++ii)
+  {
+    std::string key = "key" + std::to_string(ii);
+    MemcachedClient::Route route = client.route(key);
+    EXPECT_EQ(2u, route.servers.size());
+    if (route.servers[0]->name != primaries[key])
+    {
+      EXPECT_EQ("10.0.0.5", route.servers[0]->name);
+      moved++;
+    }
+  }
+  EXPECT_LT(500, moved);
+  EXPECT_GT(1100, moved);
+
+  // There can't be more replicas than servers.
+  std::list<std::string> one_server(1, "10.0.0.1");
+  client.set_servers(one_server, 0);
+  EXPECT_EQ(1u, client.route("key").servers.size());
+}
+
+/// Find the fake server that is the index'th replica for a key.
+static FakeMemcachedServer* replica(MemcachedClient& client,
+                                   const std::string& key,
+                                   size_t index,
+                                   std::vector<FakeMemcachedServer*>& servers)
+{
+  std::string name = client.route(key).servers[index]->name;
+  for (size_t ii = 0; ii < servers.size(); ++ii)
+  {
+    if (servers[ii]->address() == name)
+    {
+      return servers[ii];
+    }
+  }
+  return NULL; // LCOV_EXCL_LINE
+}
+
+TEST_F(MemcachedClientTest, Replication)
+{
+  std::vector<FakeMemcachedServer*> servers;
+  std::list<std::string> names;
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    servers.push_back(new FakeMemcachedServer());
+    names.push_back(servers.back()->address());
+  }
+  MemcachedClient client(names, 1, 100, 2);
+  std::string value;
+  uint64_t cas = 0;
+
+  // Writes go to both replicas.
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "one", 0, cas));
+  FakeMemcachedServer* primary = replica(client, "key", 0, servers);
+  FakeMemcachedServer* backup = replica(client, "key", 1, servers);
+  EXPECT_EQ("one", primary->record("key").first);
+  EXPECT_EQ("one", backup->record("key").first);
+  EXPECT_EQ(cas, primary->record("key").second);
+
+  // If the primary loses the key, it is read from the backup with no CAS,
+  // and writing it puts it back.
+  std::list<std::string> primary_name(1, primary->address());
+  MemcachedClient(primary_name, 1).flush_all();
+  EXPECT_EQ(MemcachedClient::OK, client.get("key", value, cas));
+  EXPECT_EQ("one", value);
+  EXPECT_EQ(0u, cas);
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "two", 0, cas));
+  EXPECT_EQ("two", primary->record("key").first);
+  EXPECT_EQ("two", backup->record("key").first);
+
+  // If the backup goes away, writes still succeed.
+  servers.erase(std::find(servers.begin(), servers.end(), backup));
+  delete backup;
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "three", 0, cas));
+  EXPECT_EQ("three", primary->record("key").first);
+
+  // If the primary goes away too, reads and writes fail.
+  servers.erase(std::find(servers.begin(), servers.end(), primary));
+  delete primary;
+  EXPECT_EQ(MemcachedClient::ERROR, client.get("key", value, cas));
+  EXPECT_EQ(MemcachedClient::ERROR, client.store("key", "four", 0, cas));
+
+  delete servers[0];
+}
+
+TEST_F(MemcachedClientTest, Failover)
+{
+  std::vector<FakeMemcachedServer*> servers;
+  std::list<std::string> names;
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    servers.push_back(new FakeMemcachedServer());
+    names.push_back(servers.back()->address());
+  }
+  MemcachedClient client(names, 1, 100, 2);
+  std::string value;
+  uint64_t cas = 0;
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "one", 0, cas));
+
+  // If the primary can't be reached, the backup is read and written
+  // instead, with its own CAS.
+  FakeMemcachedServer* primary = replica(client, "key", 0, servers);
+  FakeMemcachedServer* backup = replica(client, "key", 1, servers);
+  delete primary;
+  EXPECT_EQ(MemcachedClient::OK, client.get("key", value, cas));
+  EXPECT_EQ("one", value);
+  EXPECT_EQ(backup->record("key").second, cas);
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "two", 0, cas));
+  EXPECT_EQ("two", backup->record("key").first);
+
+  // Keys that are on neither server aren't found.
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("nokey", value, cas));
+
+  delete backup;
+}
+
+TEST_F(MemcachedClientTest, Migration)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  FakeMemcachedServer server3;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+  MemcachedClient client(servers, 1);
+
+  std::vector<std::string> keys;
+  for (int ii = 0; ii < 60; ++ii)
+  {
+    keys.push_back("key" + std::to_string(ii));
+    uint64_t cas = 0;
+    client.store(keys.back(), "value" + std::to_string(ii), 0, cas);
+  }
+
+  // Add a server.  The keys that now belong on it are still found, on
+  // their old servers, but with no CAS.
+  servers.push_back(server3.address());
+  client.set_servers(servers, 60000);
+  std::vector<std::string> moved;
+  for (int ii = 0; ii < 60; ++ii)
+  {
+    std::string value;
+    uint64_t cas;
+    EXPECT_EQ(MemcachedClient::OK, client.get(keys[ii], value, cas));
+    EXPECT_EQ("value" + std::to_string(ii), value);
+    if (client.route(keys[ii]).servers[0]->name == server3.address())
+    {
+      EXPECT_EQ(0u, cas);
+      moved.push_back(keys[ii]);
+    }
+    else
+    {
+      EXPECT_NE(0u, cas);
+    }
+  }
+  EXPECT_LT(5u, moved.size());
+  EXPECT_GT(35u, moved.size());
+
+  // Fetching several keys at once finds them too.
+  int found = 0;
+  int results = 0;
+  MemcachedClient::Completion completion;
+  client.get_multi(keys, [&](const std::string& key,
+                             MemcachedClient::Status status,
+                             const char* value,
+                             size_t length,
+                             uint64_t cas)
+  {
+    if (status == MemcachedClient::OK)
+    {
+      __sync_fetch_and_add(&found, 1);
+    }
+    if (__sync_add_and_fetch(&results, 1) == 60)
+    {
+      completion.complete();
+    }
+  });
+  completion.wait();
+  EXPECT_EQ(60, found);
+
+  // Writing a moved key adds it to its new server.
+  uint64_t cas = 0;
+  EXPECT_EQ(MemcachedClient::OK, client.store(moved[0], "new", 0, cas));
+  EXPECT_EQ("new", server3.record(moved[0]).first);
+
+  // Flushing during a migration clears the old servers too.
+  EXPECT_EQ(MemcachedClient::OK, client.flush_all());
+  std::string value;
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get(moved[1], value, cas));
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get(keys[0], value, cas));
+
+  // Once the migration ends, the old servers aren't consulted.
+  cas = 0;
+  client.set_servers(std::list<std::string>(1, server1.address()), 60000);
+  EXPECT_EQ(MemcachedClient::OK, client.store("key", "value", 0, cas));
+  client.set_servers(std::list<std::string>(1, server2.address()), 0);
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+}
+
+/// libmemcached's default hash (one-at-a-time), which with its default
+/// modulo distribution picked each key's server.
+static uint32_t libmemcached_hash(const std::string& key)
+{
+  uint32_t value = 0;
+  for (size_t ii = 0; ii < key.length(); ++ii)
+  {
+    value += (uint32_t)key[ii];
+    value += (value << 10);
+    value ^= (value >> 6);
+  }
+  value += (value << 3);
+  value ^= (value >> 11);
+  value += (value << 15);
+  return value;
+}
+
+TEST_F(MemcachedClientTest, ModuloMigration)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+
+  // Store the keys where libmemcached would have.
+  MemcachedClient client1(MemcachedClientTest::servers(server1), 1);
+  MemcachedClient client2(MemcachedClientTest::servers(server2), 1);
+  std::vector<std::string> keys;
+  for (int ii = 0; ii < 40; ++ii)
+  {
+    keys.push_back("key" + std::to_string(ii));
+    uint64_t cas = 0;
+    MemcachedClient& legacy = (libmemcached_hash(keys.back()) % 2 == 0) ? client1 : client2;
+    EXPECT_EQ(MemcachedClient::OK, legacy.store(keys.back(), "value" + std::to_string(ii), 0, cas));
+  }
+
+  // They are all found during the migration, those that have moved with
+  // no CAS so that the next write adds them to their new server.
+  MemcachedClient client(servers, 1);
+  client.migrate_from_modulo(60000);
+  int moved = 0;
+  for (int ii = 0; ii < 40; ++ii)
+  {
+    std::string value;
+    uint64_t cas;
+    EXPECT_EQ(MemcachedClient::OK, client.get(keys[ii], value, cas));
+    EXPECT_EQ("value" + std::to_string(ii), value);
+    if (cas == 0)
+    {
+      moved++;
+      EXPECT_EQ(MemcachedClient::OK, client.store(keys[ii], value, 0, cas));
+    }
+  }
+  EXPECT_LT(5, moved);
+  EXPECT_GT(35, moved);
+
+  // Once it's over, the rewritten keys are still found.
+  client.set_servers(servers, 0);
+  for (int ii = 0; ii < 40; ++ii)
+  {
+    std::string value;
+    uint64_t cas;
+    EXPECT_EQ(MemcachedClient::OK, client.get(keys[ii], value, cas));
+    EXPECT_NE(0u, cas);
+  }
+}
+
+TEST_F(MemcachedClientTest, RetireServers)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  MemcachedClient client(servers(server1), 1);
+  std::string value;
+  uint64_t cas = 0;
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+
+  // A removed server is kept during the migration.
+  client.set_servers(servers(server2), 60000);
+  client.get("key", value, cas);
+  EXPECT_EQ(2u, client._servers.size());
+
+  // Once it ends, the server is retired, and destroyed a while later.
+  cwtest_advance_time_ms(60000);
+  client.get("key", value, cas);
+  EXPECT_EQ(1u, client._servers.size());
+  EXPECT_EQ(1u, client._retired.size());
+  cwtest_advance_time_ms(MemcachedClient::RETIRE_DELAY_MS);
+  client.get("key", value, cas);
+  EXPECT_TRUE(client._retired.empty());
+
+  // A server dropped again before its migration ends is retired straight
+  // away.
+  client.set_servers(servers(server1), 60000);
+  client.set_servers(servers(server1), 60000);
+  EXPECT_EQ(1u, client._servers.size());
+  EXPECT_EQ(1u, client._retired.size());
+}
+
+TEST_F(MemcachedClientTest, Timeout)
+{
+  FakeMemcachedServer server;
+  MemcachedClient client(servers(server), 1, 100);
+  std::string value;
+  uint64_t cas = 0;
+
+  // A slow server fails the request, and the connection is dropped.
+  server.set_delay_ms(300);
+  EXPECT_EQ(MemcachedClient::ERROR, client.get("key", value, cas));
+  EXPECT_EQ(-1, client._servers[server.address()]->connections[0]->_fd);
+
+  // Once it recovers, the next request reconnects.
+  server.set_delay_ms(0);
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+  EXPECT_EQ(2, server.connections());
+}
+
+TEST_F(MemcachedClientTest, ConnectionFailures)
+{
+  FakeMemcachedServer server;
+  MemcachedClient* client = new MemcachedClient(servers(server), 1);
+  std::string value;
+  uint64_t cas = 0;
+
+  // A dropped connection is noticed and reconnected.
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client->get("key", value, cas));
+  server.drop_connections();
+  MemcachedClient::Connection* connection = client->_servers[server.address()]->connections[0];
+  bool connected = true;
+  while (connected)
+  {
+    usleep(10000);
+    pthread_mutex_lock(&connection->_lock);
+    connected = (connection->_fd >= 0);
+    pthread_mutex_unlock(&connection->_lock);
+  }
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client->get("key", value, cas));
+  EXPECT_EQ(2, server.connections());
+
+  // A garbled response fails the request and drops the connection.
+  server.set_corrupt(true);
+  EXPECT_EQ(MemcachedClient::ERROR, client->get("key", value, cas));
+  server.set_corrupt(false);
+
+  // Requests still outstanding when the client goes away fail.
+  server.set_delay_ms(200);
+  MemcachedClient::Status status = MemcachedClient::OK;
+  client->store("key", "value", 0, 0, [&](MemcachedClient::Status s, uint64_t) { status = s; });
+  delete client;
+  EXPECT_EQ(MemcachedClient::ERROR, status);
+}
+
+TEST_F(MemcachedClientTest, Unreachable)
+{
+  std::list<std::string> servers;
+  {
+    // Find a port with nothing listening on it.
+    FakeMemcachedServer server;
+    servers.push_back(server.address());
+  }
+  servers.push_back(":11211");
+  MemcachedClient client(servers, 1);
+
+  // Requests fail without waiting, and we don't retry straight away.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    std::string key = "key" + std::to_string(ii);
+    std::string value;
+    uint64_t cas = 0;
+    EXPECT_EQ(MemcachedClient::ERROR, client.get(key, value, cas));
+    EXPECT_EQ(MemcachedClient::ERROR, client.store(key, value, 0, cas));
+  }
+  EXPECT_EQ(MemcachedClient::ERROR, client.flush_all());
+}
+
+TEST_F(MemcachedClientTest, Connecting)
+{
+  FakeMemcachedServer server;
+  MemcachedClient client(servers(server), 1);
+  MemcachedClient::Connection* connection = client._servers[server.address()]->connections[0];
+  std::string value;
+  uint64_t cas = 0;
+
+  // While another thread is connecting, requests fail straight away
+  // rather than waiting for it.
+  connection->_connecting = true;
+  EXPECT_EQ(MemcachedClient::ERROR, client.get("key", value, cas));
+  EXPECT_EQ(0, server.connections());
+
+  connection->_connecting = false;
+  EXPECT_EQ(MemcachedClient::NOT_FOUND, client.get("key", value, cas));
+  EXPECT_EQ(1, server.connections());
+}
+
+TEST_F(MemcachedClientTest, NoServers)
+{
+  MemcachedClient client(std::list<std::string>(), 1);
+  std::string value;
+  uint64_t cas = 0;
+  EXPECT_EQ(MemcachedClient::ERROR, client.get("key", value, cas));
+  EXPECT_EQ(MemcachedClient::ERROR, client.store("key", value, 0, cas));
+  int errors = 0;
+  client.get_multi(std::vector<std::string>(2, "key"), [&](const std::string& key,
+                                                           MemcachedClient::Status status,
+                                                           const char* value,
+                                                           size_t length,
+                                                           uint64_t cas)
+  {
+    EXPECT_EQ(MemcachedClient::ERROR, status);
+    errors++;
+  });
+  EXPECT_EQ(2, errors);
+}
+
+TEST_F(MemcachedClientTest, ServerNames)
+{
+  std::list<std::string> servers;
+  servers.push_back("localhost");
+  servers.push_back("10.0.0.1:11212");
+  servers.push_back("[::1]:11213");
+  servers.push_back("[::1]");
+  MemcachedClient client(servers, 1);
+
+  EXPECT_EQ("localhost", client._servers["localhost"]->connections[0]->_host);
+  EXPECT_EQ("11211", client._servers["localhost"]->connections[0]->_port);
+  EXPECT_EQ("10.0.0.1", client._servers["10.0.0.1:11212"]->connections[0]->_host);
+  EXPECT_EQ("11212", client._servers["10.0.0.1:11212"]->connections[0]->_port);
+  EXPECT_EQ("::1", client._servers["[::1]:11213"]->connections[0]->_host);
+  EXPECT_EQ("11213", client._servers["[::1]:11213"]->connections[0]->_port);
+  EXPECT_EQ("::1", client._servers["[::1]"]->connections[0]->_host);
+  EXPECT_EQ("11211", client._servers["[::1]"]->connections[0]->_port);
+}
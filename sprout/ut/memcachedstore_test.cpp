@@ -38,6 +38,7 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <map>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -48,6 +49,8 @@
 #include "memcachedstorefactory.h"
 #include "localstore.h"
 #include "localstorefactory.h"
+#include "aorcache.h"
+#include "fakememcachedserver.hpp"
 #include "fakelogger.hpp"
 #include "test_utils.hpp"
 
@@ -126,7 +129,9 @@ TEST_F(MemcachedStoreTest, Serialization)
   b1->_path_headers.push_back("<sip:P1.EXAMPLEVISITED.COM;lr>");
   s = MemcachedStore::serialize_aor((MemcachedAoR*)aor_data1);
 
-  EXPECT_EQ(4ul + 48 + 54 + 33 + 4 + 4 + 4 + 4 + 4 + (9 + 1) + (7 + 2) + (14 + 50) + (28 + 31), s.length());
+  // Header, binding count, binding ID, URI, Call-ID, CSeq, expiry (five
+  // bytes until 2038), priority, params and path headers.
+  EXPECT_EQ(5ul + 1 + (1 + 47) + (1 + 53) + (1 + 32) + 3 + 5 + 1 + (1 + (1 + 13) + (1 + 49) + (1 + 6) + (1 + 1) + (1 + 8) + 1) + (1 + (1 + 27) + (1 + 30)), s.length());
 
   aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
 
@@ -154,7 +159,7 @@ TEST_F(MemcachedStoreTest, Serialization)
   b1->_params.push_back(std::make_pair("+sip.ice", ""));
   s = MemcachedStore::serialize_aor((MemcachedAoR*)aor_data1);
 
-  EXPECT_EQ(4ul + 50 + 56 + 35 + 4 + 4 + 4 + 4 + 4 + (9 + 1) + (8 + 2) + (14 + 51), s.length());
+  EXPECT_EQ(5ul + 1 + (1 + 49) + (1 + 55) + (1 + 34) + 3 + 5 + 1 + (1 + (1 + 13) + (1 + 50) + (1 + 7) + (1 + 1) + (1 + 8) + 1) + 1, s.length());
 
   aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
 
@@ -210,6 +215,95 @@ TEST_F(MemcachedStoreTest, Serialization)
 
   delete aor_data1;
   delete aor_data2;
+
+  // Test 1.4 - a truncated record is discarded rather than half-read.
+  s.resize(s.length() - 10);
+  aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  delete aor_data2;
+}
+
+/// Test the flat binding storage - independent of actual server.
+TEST_F(MemcachedStoreTest, BindingStorage)
+{
+  AoR aor_data1;
+  AoR::Binding* b1;
+  AoR::Binding* b2;
+  char binding_id[32];
+
+  // Bindings are kept in binding ID order, whatever order they're added in,
+  // and pointers to them stay valid as more are added.
+  b1 = aor_data1.get_binding("b");
+  b1->_uri = "sip:b@example.com";
+  b1->_expires = 100;
+  aor_data1.get_binding("c")->_expires = 200;
+  aor_data1.get_binding("a")->_expires = 300;
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    snprintf(binding_id, sizeof(binding_id), "z%02d", ii);
+    aor_data1.get_binding(binding_id)->_expires = 400 + ii;
+  }
+  EXPECT_EQ(23u, aor_data1.bindings().size());
+  EXPECT_EQ("a", aor_data1.bindings()[0].first);
+  EXPECT_EQ("b", aor_data1.bindings()[1].first);
+  EXPECT_EQ("c", aor_data1.bindings()[2].first);
+  EXPECT_EQ(b1, aor_data1.get_binding("b"));
+  EXPECT_EQ("sip:b@example.com", b1->_uri);
+
+  // A removed binding's storage is reused, but the new binding starts out
+  // empty.
+  aor_data1.remove_binding("b");
+  EXPECT_EQ(22u, aor_data1.bindings().size());
+  b2 = aor_data1.get_binding("d");
+  EXPECT_EQ(b1, b2);
+  EXPECT_EQ("", b2->_uri);
+  EXPECT_EQ(0, b2->_expires);
+  EXPECT_EQ(0u, b2->_params.size());
+  EXPECT_EQ("d", aor_data1.bindings()[2].first);
+
+  // Expiry removes exactly the expired bindings, keeping the order.
+  Store* store = create_local_store();
+  EXPECT_EQ(419, store->expire_bindings(&aor_data1, 250));
+  EXPECT_EQ(21u, aor_data1.bindings().size());
+  EXPECT_EQ("a", aor_data1.bindings()[0].first);
+  EXPECT_EQ("z00", aor_data1.bindings()[1].first);
+  EXPECT_EQ("z19", aor_data1.bindings()[20].first);
+  destroy_local_store(store);
+
+  // Copying into an AoR with spare storage reuses it.
+  AoR aor_data2;
+  aor_data2.get_binding("x");
+  aor_data2.clear();
+  EXPECT_EQ(0u, aor_data2.bindings().size());
+  aor_data2 = aor_data1;
+  do_expect_eq(&aor_data1, &aor_data2);
+
+  // Moving takes over the storage, leaving the source empty.
+  b1 = aor_data2.get_binding("a");
+  AoR aor_data3(std::move(aor_data2));
+  EXPECT_EQ(0u, aor_data2.bindings().size());
+  EXPECT_EQ(b1, aor_data3.get_binding("a"));
+  do_expect_eq(&aor_data1, &aor_data3);
+
+  aor_data2 = std::move(aor_data3);
+  EXPECT_EQ(0u, aor_data3.bindings().size());
+  EXPECT_EQ(b1, aor_data2.get_binding("a"));
+
+  // Self-assignment does nothing.
+  AoR& aor_data4 = aor_data2;
+  aor_data2 = aor_data4;
+  aor_data2 = std::move(aor_data4);
+  do_expect_eq(&aor_data1, &aor_data2);
+
+  // The moved-from AoR is still usable.
+  aor_data3.get_binding("y")->_uri = "sip:y@example.com";
+  EXPECT_EQ(1u, aor_data3.bindings().size());
+
+  // A fresh copy holds all its bindings in one block.
+  AoR* aor_data5 = new AoR(aor_data1);
+  do_expect_eq(&aor_data1, aor_data5);
+  EXPECT_EQ(1u, aor_data5->_blocks.size());
+  delete aor_data5;
 }
 
 /// Test the local fake server.
@@ -222,16 +316,17 @@ TEST_F(MemcachedStoreTest, SimpleLocal)
   destroy_local_store(store);
 }
 
-/// Test the real memcached server.  Disabled because we don't have a real memcached server to test against at UT time.
-TEST_F(MemcachedStoreTest, DISABLED_SimpleMemcached)
+/// Test the memcached store against a fake memcached server.
+TEST_F(MemcachedStoreTest, SimpleMemcached)
 {
   SCOPED_TRACE("memcached");
+  FakeMemcachedServer server;
   Store* store;
 
   // Test 2.1 - create a MemcachedStore instance and connect to a single server.
   std::list<std::string> servers;
-  servers.push_back(std::string("localhost:11211"));
-  store = create_memcached_store(servers, 10);
+  servers.push_back(server.address());
+  store = create_memcached_store(servers, 2);
 
   do_test_simple(*store);
 
@@ -239,6 +334,257 @@ TEST_F(MemcachedStoreTest, DISABLED_SimpleMemcached)
   destroy_memcached_store(store);
 }
 
+/// Collects the results of asynchronous store operations.
+class AsyncResult
+{
+public:
+  AsyncResult() : aor_data(NULL), success(false) {}
+
+  Store::GetCallback get_callback()
+  {
+    return [this](AoR* data) { aor_data = data; completion.complete(); };
+  }
+
+  Store::SetCallback set_callback()
+  {
+    return [this](bool rc) { success = rc; completion.complete(); };
+  }
+
+  AoR* aor_data;
+  bool success;
+  MemcachedClient::Completion completion;
+};
+
+/// Run a get/modify/set cycle through the asynchronous API.
+static void do_test_async(Store& store)
+{
+  int now = time(NULL);
+  std::string aor_id("5102175698@ngc.thewholeelephant.com");
+
+  AsyncResult r1;
+  store.get_aor_data_async(aor_id, r1.get_callback());
+  r1.completion.wait();
+  ASSERT_TRUE(r1.aor_data != NULL);
+  EXPECT_EQ(0u, r1.aor_data->bindings().size());
+
+  AoR::Binding* b1 = r1.aor_data->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+  b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b1->_cseq = 17038;
+  b1->_expires = now + 300;
+
+  AsyncResult r2;
+  store.set_aor_data_async(aor_id, r1.aor_data, r2.set_callback());
+  r2.completion.wait();
+  EXPECT_TRUE(r2.success);
+
+  // A second write of the same data succeeds without re-reading.
+  b1->_cseq = 17039;
+  AsyncResult r3;
+  store.set_aor_data_async(aor_id, r1.aor_data, r3.set_callback());
+  r3.completion.wait();
+  EXPECT_TRUE(r3.success);
+
+  AsyncResult r4;
+  store.get_aor_data_async(aor_id, r4.get_callback());
+  r4.completion.wait();
+  ASSERT_TRUE(r4.aor_data != NULL);
+  EXPECT_EQ(1u, r4.aor_data->bindings().size());
+  EXPECT_EQ(17039, r4.aor_data->bindings().begin()->second->_cseq);
+
+  // A write based on the stale copy fails.
+  AsyncResult r5;
+  store.set_aor_data_async(aor_id, r1.aor_data, r5.set_callback());
+  r5.completion.wait();
+  EXPECT_TRUE(r5.success);
+  r4.aor_data->bindings().begin()->second->_cseq = 17040;
+  AsyncResult r6;
+  store.set_aor_data_async(aor_id, r4.aor_data, r6.set_callback());
+  r6.completion.wait();
+  EXPECT_FALSE(r6.success);
+
+  delete r1.aor_data;
+  delete r4.aor_data;
+}
+
+/// Test the asynchronous API of the local store.
+TEST_F(MemcachedStoreTest, AsyncLocal)
+{
+  Store* store = create_local_store();
+  do_test_async(*store);
+  destroy_local_store(store);
+}
+
+/// Test the asynchronous API of the memcached store, with and without a
+/// near-cache.
+TEST_F(MemcachedStoreTest, AsyncMemcached)
+{
+  FakeMemcachedServer server;
+  std::list<std::string> servers;
+  servers.push_back(server.address());
+
+  Store* store = create_memcached_store(servers, 2);
+  do_test_async(*store);
+  destroy_memcached_store(store);
+
+  store = create_memcached_store(servers, 2, new AoRCache(10, 60000));
+  store->flush_all();
+  do_test_async(*store);
+
+  // The failed write dropped the cached entry, so the first read goes to
+  // the server and the second is served from the cache.
+  int requests = server.requests();
+  AsyncResult r1;
+  store->get_aor_data_async("5102175698@ngc.thewholeelephant.com", r1.get_callback());
+  r1.completion.wait();
+  ASSERT_TRUE(r1.aor_data != NULL);
+  EXPECT_EQ(requests + 1, server.requests());
+  AsyncResult r2;
+  store->get_aor_data_async("5102175698@ngc.thewholeelephant.com", r2.get_callback());
+  r2.completion.wait();
+  ASSERT_TRUE(r2.aor_data != NULL);
+  EXPECT_EQ(requests + 1, server.requests());
+  EXPECT_EQ(17039, r2.aor_data->bindings().begin()->second->_cseq);
+  delete r1.aor_data;
+  delete r2.aor_data;
+  destroy_memcached_store(store);
+}
+
+/// Fetch ten AoRs at once, of which the even ones have a binding.
+static void do_test_multi(Store& store)
+{
+  int now = time(NULL);
+  std::vector<std::string> aor_ids;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    aor_ids.push_back("aor" + std::to_string(ii) + "@ngc.thewholeelephant.com");
+    if (ii % 2 == 0)
+    {
+      AoR* aor_data = store.get_aor_data(aor_ids.back());
+      AoR::Binding* b1 = aor_data->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+      b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+      b1->_cseq = ii;
+      b1->_expires = now + 300;
+      EXPECT_TRUE(store.set_aor_data(aor_ids.back(), aor_data));
+      delete aor_data;
+    }
+  }
+
+  std::map<std::string, AoR*> results;
+  store.get_aor_data_multi(aor_ids, [&](const std::string& aor_id, AoR* aor_data)
+  {
+    EXPECT_EQ(0u, results.count(aor_id));
+    results[aor_id] = aor_data;
+  });
+
+  EXPECT_EQ(10u, results.size());
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    AoR* aor_data = results[aor_ids[ii]];
+    ASSERT_TRUE(aor_data != NULL);
+    if (ii % 2 == 0)
+    {
+      ASSERT_EQ(1u, aor_data->bindings().size());
+      EXPECT_EQ(ii, aor_data->bindings().begin()->second->_cseq);
+    }
+    else
+    {
+      EXPECT_EQ(0u, aor_data->bindings().size());
+    }
+    delete aor_data;
+  }
+}
+
+/// Test fetching several AoRs at once from the local store.
+TEST_F(MemcachedStoreTest, MultiLocal)
+{
+  Store* store = create_local_store();
+  do_test_multi(*store);
+  destroy_local_store(store);
+}
+
+/// Test fetching several AoRs at once from several memcached servers, with
+/// and without a near-cache.
+TEST_F(MemcachedStoreTest, MultiMemcached)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+
+  Store* store = create_memcached_store(servers, 2);
+  do_test_multi(*store);
+  destroy_memcached_store(store);
+
+  // With a near-cache, the AoRs just written are served from the cache and
+  // only the rest go to the servers, in one batch per server.  (With no
+  // migration from the modulo layout, so misses only go to one server.)
+  store = create_memcached_store(servers, 2, new AoRCache(10, 60000), 1, 0);
+  store->flush_all();
+  int requests = server1.requests() + server2.requests();
+  do_test_multi(*store);
+  EXPECT_EQ(requests + 10 + 5 + 2, server1.requests() + server2.requests());
+  destroy_memcached_store(store);
+
+  // Everything fails if the servers are unreachable.
+  std::list<std::string> no_servers;
+  {
+    FakeMemcachedServer server3;
+    no_servers.push_back(server3.address());
+  }
+  store = create_memcached_store(no_servers, 1);
+  std::vector<std::string> aor_ids(3, "aor@ngc.thewholeelephant.com");
+  int failures = 0;
+  store->get_aor_data_multi(aor_ids, [&](const std::string& aor_id, AoR* aor_data)
+  {
+    EXPECT_TRUE(aor_data == NULL);
+    failures++;
+  });
+  EXPECT_EQ(3, failures);
+  destroy_memcached_store(store);
+}
+
+/// Test replicating AoRs across servers and adding a server, with a
+/// near-cache.
+TEST_F(MemcachedStoreTest, ReplicasAndResize)
+{
+  FakeMemcachedServer server1;
+  FakeMemcachedServer server2;
+  FakeMemcachedServer server3;
+  std::list<std::string> servers;
+  servers.push_back(server1.address());
+  servers.push_back(server2.address());
+  Store* store = create_memcached_store(servers, 1, new AoRCache(10, 60000), 2);
+
+  // Each AoR is written to both servers.
+  do_test_multi(*store);
+  std::string aor_id("aor0@ngc.thewholeelephant.com");
+  EXPECT_NE("", server1.record(aor_id).first);
+  EXPECT_EQ(server1.record(aor_id).first, server2.record(aor_id).first);
+
+  // After adding a server, every AoR can still be read and updated.
+  servers.push_back(server3.address());
+  set_memcached_store_servers(store, servers);
+  for (int ii = 0; ii < 10; ii += 2)
+  {
+    std::string aor_id = "aor" + std::to_string(ii) + "@ngc.thewholeelephant.com";
+    AoR* aor_data = store->get_aor_data(aor_id);
+    ASSERT_TRUE(aor_data != NULL);
+    ASSERT_EQ(1u, aor_data->bindings().size());
+    aor_data->bindings().begin()->second->_cseq++;
+    EXPECT_TRUE(store->set_aor_data(aor_id, aor_data));
+    delete aor_data;
+  }
+  EXPECT_NE("", server3.record("aor0@ngc.thewholeelephant.com").first +
+                server3.record("aor2@ngc.thewholeelephant.com").first +
+                server3.record("aor4@ngc.thewholeelephant.com").first +
+                server3.record("aor6@ngc.thewholeelephant.com").first +
+                server3.record("aor8@ngc.thewholeelephant.com").first);
+
+  destroy_memcached_store(store);
+}
+
 /// Test the real memcached server.  Alternate version that doesn't expect to work.
 TEST_F(MemcachedStoreTest, SimpleMemcachedAlt)
 {
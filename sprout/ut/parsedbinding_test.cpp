@@ -0,0 +1,154 @@
+/**
+ * @file parsedbinding_test.cpp UT for the ParsedBinding class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "utils.h"
+#include "siptest.hpp"
+#include "fakelogger.hpp"
+#include "pjutils.h"
+
+#include "parsedbinding.h"
+
+using namespace std;
+
+/// Fixture
+class ParsedBindingTest : public SipTest
+{
+public:
+  FakeLogger _log;
+
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  ParsedBindingTest() : SipTest(NULL)
+  {
+  }
+
+  ~ParsedBindingTest()
+  {
+  }
+};
+
+TEST_F(ParsedBindingTest, Parse)
+{
+  RegData::AoR::Binding::PathHeaders paths;
+  paths.push_back("sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob");
+  paths.push_back("<sip:scscf.homedomain;lr>");
+  std::shared_ptr<const ParsedBinding> parsed =
+    ParsedBinding::parse("sip:6505550231@192.168.0.1:5061;transport=tcp;ob", paths);
+  ASSERT_TRUE(parsed != NULL);
+  EXPECT_TRUE(parsed->matches("sip:6505550231@192.168.0.1:5061;transport=tcp;ob", paths));
+  EXPECT_FALSE(parsed->matches("sip:6505550231@192.168.0.2:5061;transport=tcp;ob", paths));
+  EXPECT_FALSE(parsed->matches("sip:6505550231@192.168.0.1:5061;transport=tcp;ob",
+                               RegData::AoR::Binding::PathHeaders()));
+
+  // The URIs are cloned into the pool they're asked for.
+  pjsip_uri* uri = parsed->uri(stack_data.pool);
+  EXPECT_EQ("sip:6505550231@192.168.0.1:5061;transport=tcp;ob",
+            PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri));
+  std::list<pjsip_uri*> path_uris;
+  parsed->paths(stack_data.pool, path_uris);
+  ASSERT_EQ(2u, path_uris.size());
+  EXPECT_EQ("sip:scscf.homedomain;lr",
+            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                   (pjsip_uri*)pjsip_uri_get_uri(path_uris.back())));
+}
+
+TEST_F(ParsedBindingTest, BadlyFormed)
+{
+  RegData::AoR::Binding::PathHeaders paths;
+  EXPECT_TRUE(ParsedBinding::parse("sip:6505550231@", paths) == NULL);
+  EXPECT_TRUE(_log.contains("Badly formed contact URI"));
+
+  paths.push_back("<sip:scscf.homedomain;lr");
+  EXPECT_TRUE(ParsedBinding::parse("sip:6505550231@192.168.0.1", paths) == NULL);
+  EXPECT_TRUE(_log.contains("Badly formed path header"));
+}
+
+TEST_F(ParsedBindingTest, Binding)
+{
+  RegData::AoR aor;
+  RegData::AoR::Binding* binding = aor.get_binding("<urn:uuid:1>");
+  binding->_uri = "sip:6505550231@192.168.0.1";
+  binding->_path_headers.push_back("sip:scscf.homedomain;lr");
+
+  // A binding that hasn't been parsed is parsed straight into the pool,
+  // and isn't kept.
+  pjsip_uri* uri = ParsedBinding::binding_uri(binding, stack_data.pool);
+  ASSERT_TRUE(uri != NULL);
+  EXPECT_EQ("sip:6505550231@192.168.0.1",
+            PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri));
+  std::list<pjsip_uri*> path_uris;
+  EXPECT_TRUE(ParsedBinding::binding_paths(binding, stack_data.pool, path_uris));
+  EXPECT_EQ(1u, path_uris.size());
+  EXPECT_TRUE(binding->_parsed == NULL);
+
+  // A parsed binding is cloned from its parsed form.
+  binding->_parsed = ParsedBinding::parse(binding->_uri, binding->_path_headers);
+  ASSERT_TRUE(binding->_parsed != NULL);
+  uri = ParsedBinding::binding_uri(binding, stack_data.pool);
+  ASSERT_TRUE(uri != NULL);
+  EXPECT_NE(binding->_parsed->_uri, uri);
+  EXPECT_EQ("sip:6505550231@192.168.0.1",
+            PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri));
+
+  // The parsed form is ignored if the binding has changed since.
+  binding->_uri = "sip:6505550231@192.168.0.2";
+  uri = ParsedBinding::binding_uri(binding, stack_data.pool);
+  ASSERT_TRUE(uri != NULL);
+  EXPECT_EQ("sip:6505550231@192.168.0.2",
+            PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri));
+
+  // Badly formed bindings can't be parsed.
+  binding->_uri = "sip:6505550231@";
+  EXPECT_TRUE(ParsedBinding::binding_uri(binding, stack_data.pool) == NULL);
+  binding->_path_headers.push_back("<sip:scscf.homedomain;lr");
+  path_uris.clear();
+  EXPECT_FALSE(ParsedBinding::binding_paths(binding, stack_data.pool, path_uris));
+}
@@ -38,11 +38,13 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <unistd.h>
 #include "gtest/gtest.h"
 
 #include "siptest.hpp"
 #include "utils.h"
 #include "localstorefactory.h"
+#include "localstore.h"
 #include "analyticslogger.h"
 #include "registrar.h"
 #include "fakelogger.hpp"
@@ -63,7 +65,8 @@ public:
     _analytics = new AnalyticsLogger("foo");
     delete _analytics->_logger;
     _analytics->_logger = NULL;
-    pj_status_t ret = init_registrar(_store, _analytics);
+    _expiry_policy = new ExpiryPolicy();
+    pj_status_t ret = init_registrar(_store, _analytics, _expiry_policy);
     ASSERT_EQ(PJ_SUCCESS, ret);
   }
 
@@ -72,6 +75,7 @@ public:
     destroy_registrar();
     RegData::destroy_local_store(_store);
     delete _analytics;
+    delete _expiry_policy;
 
     SipTest::TearDownTestCase();
   }
@@ -90,10 +94,12 @@ public:
 protected:
   static RegData::Store* _store;
   static AnalyticsLogger* _analytics;
+  static ExpiryPolicy* _expiry_policy;
 };
 
 RegData::Store* RegistrarTest::_store;
 AnalyticsLogger* RegistrarTest::_analytics;
+ExpiryPolicy* RegistrarTest::_expiry_policy;
 
 class Message
 {
@@ -108,6 +114,7 @@ public:
   string _contact_params;
   string _expires;
   string _path;
+  string _edge_via;
 
   Message() :
     _method("REGISTER"),
@@ -117,7 +124,8 @@ public:
     _contact_instance(";+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\""),
     _contact_params(";expires=3600;+sip.ice;reg-id=1"),
     _expires(""),
-    _path("Path: sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob")
+    _path("Path: sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob"),
+    _edge_via("Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI")
   {
   }
 
@@ -131,7 +139,7 @@ string Message::get()
   int n = snprintf(buf, sizeof(buf),
                    "%1$s sip:%3$s SIP/2.0\r\n"
                    "%10$s"
-                   "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+                   "%12$s"
                    "Via: SIP/2.0/TCP 10.114.61.213:5061;received=23.20.193.43;branch=z9hG4bK+7f6b263a983ef39b0bbda2135ee454871+sip+1+a64de9f6\r\n"
                    "From: <sip:%2$s@%3$s>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
                    "Supported: outbound, path\r\n"
@@ -158,7 +166,8 @@ string Message::get()
                    /*  8 */ (_contact == "*") ? "*" : string("<").append(_contact).append(">").c_str(),
                    /*  9 */ _contact_instance.c_str(),
                    /* 10 */ _path.empty() ? "" : string(_path).append("\r\n").c_str(),
-                   /* 11 */ _expires.empty() ? "" : string(_expires).append("\r\n").c_str()
+                   /* 11 */ _expires.empty() ? "" : string(_expires).append("\r\n").c_str(),
+                   /* 12 */ _edge_via.empty() ? "" : string(_edge_via).append("\r\n").c_str()
     );
 
   EXPECT_LT(n, (int)sizeof(buf));
@@ -349,3 +358,147 @@ TEST_F(RegistrarTest, NoPath)
   free_txdata();
 }
 
+
+/// REGISTERs whose bindings couldn't be routed to are rejected, rather
+/// than stored.
+TEST_F(RegistrarTest, BadlyFormedPath)
+{
+  Message msg;
+  msg._path = "Path: <sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(400, current_txdata()->msg->line.status.code);
+  free_txdata();
+
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+}
+
+/// Bindings the store expires by itself are logged as deregistrations.
+TEST_F(RegistrarTest, ExpiryAnalytics)
+{
+  Message msg;
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  EXPECT_TRUE(_log.contains("EXPIRES=300"));
+
+  ((RegData::LocalStore*)_store)->expire_all(time(NULL) + 301);
+  EXPECT_TRUE(_log.contains("Registration: USER_URI=sip:6505550231@homedomain"));
+  EXPECT_TRUE(_log.contains("CONTACT_URI=sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213:5061;transport=tcp;ob EXPIRES=0"));
+}
+
+/// Bindings registered directly over a TCP connection are removed as soon
+/// as it disconnects.
+TEST_F(RegistrarTest, TransportDisconnect)
+{
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        TransportFlow::Trust::UNTRUSTED,
+                                        "10.114.61.213",
+                                        5061);
+  Message msg;
+  msg._path = "";
+  msg._edge_via = "";
+  inject_msg(msg.get(), tp);
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  delete tp;
+
+  // The bindings are removed on the registrar's flow thread, so wait for it.
+  size_t num_bindings = 1;
+  for (int ii = 0; (ii < 100) && (num_bindings > 0); ++ii)
+  {
+    usleep(10000);
+    aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+    num_bindings = aor_data->bindings().size();
+    delete aor_data;
+  }
+  EXPECT_EQ(0u, num_bindings);
+  EXPECT_TRUE(_log.contains("CONTACT_URI=sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213:5061;transport=tcp;ob EXPIRES=0"));
+}
+
+/// A TCP connection from a proxy that doesn't add Path headers may carry
+/// many UEs' registrations, so they aren't removed when it disconnects.
+TEST_F(RegistrarTest, TransportDisconnectNotFirstHop)
+{
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        TransportFlow::Trust::UNTRUSTED,
+                                        "10.83.18.38",
+                                        36530);
+  Message msg;
+  msg._path = "";
+  inject_msg(msg.get(), tp);
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+
+  delete tp;
+
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+}
+
+/// When a request fails because a binding's flow has failed, every binding
+/// registered over that flow is removed.
+TEST_F(RegistrarTest, FlowFailed)
+{
+  // Two AoRs register over the same flow, and one of them over another
+  // flow as well.
+  Message msg;
+  inject_msg(msg.get());
+  free_txdata();
+
+  msg._user = "6505550232";
+  inject_msg(msg.get());
+  free_txdata();
+
+  msg._contact_instance = ";+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-a55444444440>\"";
+  msg._path = "Path: sip:XxxxxxxXXXXXXAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-119.compute-1.amazonaws.com:5060;lr;ob";
+  inject_msg(msg.get());
+  free_txdata();
+
+  // A third AoR registers over the first flow, but then (as if through
+  // another node) over another flow.
+  Message msg2;
+  msg2._user = "6505550233";
+  inject_msg(msg2.get());
+  free_txdata();
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550233@homedomain");
+  aor_data->bindings().begin()->second->_path_headers.front() = "sip:YyyyyyyYYYYYY@ec2-107-22-156-119.compute-1.amazonaws.com:5060;lr;ob";
+  EXPECT_TRUE(_store->set_aor_data("sip:6505550233@homedomain", aor_data));
+  delete aor_data;
+
+  registrar_flow_failed("sip:6505550231@homedomain", "<urn:uuid:00000000-0000-0000-0000-b665231f1213>");
+
+  aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+  EXPECT_TRUE(_log.contains("Registration: USER_URI=sip:6505550232@homedomain"));
+  EXPECT_TRUE(_log.contains("EXPIRES=0"));
+  aor_data = _store->get_aor_data("sip:6505550232@homedomain");
+  ASSERT_EQ(1u, aor_data->bindings().size());
+  EXPECT_EQ("<urn:uuid:00000000-0000-0000-0000-a55444444440>", aor_data->bindings().begin()->first);
+  delete aor_data;
+  aor_data = _store->get_aor_data("sip:6505550233@homedomain");
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+
+  // A binding that wasn't registered through this node is still removed.
+  registrar_flow_failed("sip:6505550232@homedomain", "<urn:uuid:00000000-0000-0000-0000-a55444444440>");
+  registrar_flow_failed("sip:6505550233@homedomain", "<urn:uuid:00000000-0000-0000-0000-b665231f1213>");
+  aor_data = _store->get_aor_data("sip:6505550232@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+  aor_data = _store->get_aor_data("sip:6505550233@homedomain");
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+}
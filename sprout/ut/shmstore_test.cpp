@@ -0,0 +1,403 @@
+/**
+ * @file shmstore_test.cpp UT for the ShmStore class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "shmstore.h"
+#include "shmstorefactory.h"
+#include "fakelogger.hpp"
+#include "test_utils.hpp"
+
+using namespace std;
+using namespace RegData;
+
+/// Fixture for ShmStoreTest.
+class ShmStoreTest : public ::testing::Test
+{
+  FakeLogger _log;
+  std::string _name;
+
+  ShmStoreTest()
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "/shmstore_test.%d", getpid());
+    _name = name;
+    shm_unlink(_name.c_str());
+  }
+
+  virtual ~ShmStoreTest()
+  {
+    shm_unlink(_name.c_str());
+  }
+
+  /// Read-modify-write an AoR until the write succeeds, adding a binding
+  /// with the given ID.
+  static void add_binding(Store* store,
+                          const std::string& aor_id,
+                          const std::string& binding_id,
+                          int expires)
+  {
+    bool set_rc;
+    do
+    {
+      AoR* aor_data = store->get_aor_data(aor_id);
+      aor_data->get_binding(binding_id)->_expires = expires;
+      set_rc = store->set_aor_data(aor_id, aor_data);
+      delete aor_data;
+    }
+    while (!set_rc);
+  }
+
+  /// Set a binding's URI to a random string of the given length, which
+  /// won't compress much.
+  static bool set_uri(Store* store, const std::string& aor_id, size_t length)
+  {
+    AoR* aor_data = store->get_aor_data(aor_id);
+    std::string& uri = aor_data->get_binding("a")->_uri;
+    unsigned int seed = 1;
+    uri.clear();
+    while (uri.length() < length)
+    {
+      uri.push_back('a' + rand_r(&seed) % 26);
+    }
+    bool rc = store->set_aor_data(aor_id, aor_data);
+    delete aor_data;
+    return rc;
+  }
+
+  static size_t num_bindings(Store* store, const std::string& aor_id)
+  {
+    AoR* aor_data = store->get_aor_data(aor_id);
+    size_t num = aor_data->bindings().size();
+    delete aor_data;
+    return num;
+  }
+};
+
+TEST_F(ShmStoreTest, CAS)
+{
+  Store* store = create_shm_store(_name);
+  ASSERT_TRUE(store != NULL);
+  int expires = time(NULL) + 300;
+
+  // A new AoR has no CAS, and a write through it creates it.
+  ShmAoR* aor_data1 = (ShmAoR*)store->get_aor_data("sip:6505550231@homedomain");
+  ShmAoR* aor_data3 = (ShmAoR*)store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data1->get_cas());
+  aor_data1->get_binding("a")->_expires = expires;
+  aor_data1->get_binding("a")->_uri = "sip:a@example.com";
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data1));
+  EXPECT_NE(0u, aor_data1->get_cas());
+
+  // Someone else trying to create the AoR at the same time fails.
+  aor_data3->get_binding("x")->_expires = expires;
+  EXPECT_FALSE(store->set_aor_data("sip:6505550231@homedomain", aor_data3));
+
+  // A second read sees the write, with the new CAS.
+  ShmAoR* aor_data2 = (ShmAoR*)store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_EQ(1u, aor_data2->bindings().size());
+  EXPECT_EQ("sip:a@example.com", aor_data2->bindings()[0].second->_uri);
+  EXPECT_EQ(aor_data1->get_cas(), aor_data2->get_cas());
+
+  // Writing through a stale copy fails.
+  aor_data2->get_binding("b")->_expires = expires;
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data2));
+  aor_data1->get_binding("c")->_expires = expires;
+  EXPECT_FALSE(store->set_aor_data("sip:6505550231@homedomain", aor_data1));
+  EXPECT_EQ(2u, num_bindings(store, "sip:6505550231@homedomain"));
+
+  // Writes to an AoR that doesn't exist any more fail, as do NULL writes.
+  EXPECT_FALSE(store->set_aor_data("sip:6505550232@homedomain", aor_data1));
+  EXPECT_FALSE(store->set_aor_data("sip:6505550231@homedomain", NULL));
+
+  // Writing an AoR with no live bindings removes it.
+  aor_data2->get_binding("a")->_expires = 0;
+  aor_data2->get_binding("b")->_expires = 0;
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data2));
+  delete aor_data2;
+  aor_data2 = (ShmAoR*)store->get_aor_data("sip:6505550231@homedomain");
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  EXPECT_EQ(0u, aor_data2->get_cas());
+
+  // Writing an empty AoR that doesn't exist does nothing.
+  EXPECT_TRUE(store->set_aor_data("sip:6505550231@homedomain", aor_data2));
+
+  // Once flushed, the AoR is empty again.
+  add_binding(store, "sip:6505550231@homedomain", "a", expires);
+  store->flush_all();
+  EXPECT_EQ(0u, num_bindings(store, "sip:6505550231@homedomain"));
+
+  delete aor_data3;
+  delete aor_data2;
+  delete aor_data1;
+  destroy_shm_store(store);
+}
+
+TEST_F(ShmStoreTest, Shared)
+{
+  // Two stores on the same segment see each other's writes, as would two
+  // processes, and the data outlives them.
+  int expires = time(NULL) + 300;
+  ShmStore* store1 = new ShmStore(_name, 64, 64 * 1024);
+  ShmStore* store2 = new ShmStore(_name);
+  ASSERT_TRUE(store2->ready());
+  add_binding(store1, "sip:6505550231@homedomain", "a", expires);
+  add_binding(store2, "sip:6505550231@homedomain", "b", expires);
+  EXPECT_EQ(2u, num_bindings(store1, "sip:6505550231@homedomain"));
+  delete store1;
+  delete store2;
+
+  // The segment keeps the size it was created with.
+  store1 = new ShmStore(_name);
+  EXPECT_GT(1024u * 1024u, store1->_size);
+  EXPECT_EQ(2u, num_bindings(store1, "sip:6505550231@homedomain"));
+
+  // A process that dies part way through a write doesn't stop the others.
+  // The AoR it was writing is lost.
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    ShmStore store(_name);
+    store.lock();
+    store.begin_write(&store.buckets()[0]);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  add_binding(store1, "sip:6505550232@homedomain", "a", expires);
+  EXPECT_EQ(1u, num_bindings(store1, "sip:6505550232@homedomain"));
+  EXPECT_EQ(ShmStore::DELETED, store1->buckets()[0].state);
+  EXPECT_EQ(0u, store1->buckets()[0].seq % 2);
+
+  // The same again, but between writes.
+  pid = fork();
+  if (pid == 0)
+  {
+    ShmStore store(_name);
+    store.lock();
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  add_binding(store1, "sip:6505550232@homedomain", "b", expires);
+  EXPECT_EQ(2u, num_bindings(store1, "sip:6505550232@homedomain"));
+  delete store1;
+}
+
+TEST_F(ShmStoreTest, Full)
+{
+  // Fill a small table.
+  int expires = time(NULL) + 300;
+  ShmStore store(_name, 4, 64 * 1024);
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    add_binding(&store, "sip:" + std::to_string(ii) + "@homedomain", "a", expires);
+  }
+  AoR* aor_data = store.get_aor_data("sip:4@homedomain");
+  aor_data->get_binding("a")->_expires = expires;
+  EXPECT_FALSE(store.set_aor_data("sip:4@homedomain", aor_data));
+  delete aor_data;
+  EXPECT_EQ(0u, num_bindings(&store, "sip:4@homedomain"));
+
+  // Existing AoRs can still be updated, and removing one makes room.
+  add_binding(&store, "sip:0@homedomain", "b", expires);
+  aor_data = store.get_aor_data("sip:1@homedomain");
+  aor_data->get_binding("a")->_expires = 0;
+  EXPECT_TRUE(store.set_aor_data("sip:1@homedomain", aor_data));
+  delete aor_data;
+  add_binding(&store, "sip:4@homedomain", "a", expires);
+  EXPECT_EQ(1u, num_bindings(&store, "sip:4@homedomain"));
+  EXPECT_EQ(2u, num_bindings(&store, "sip:0@homedomain"));
+
+  // An AoR too big for any block can't be written, nor can one once the
+  // data area is used up.
+  EXPECT_FALSE(set_uri(&store, "sip:0@homedomain", 4 * 1024 * 1024));
+  EXPECT_FALSE(set_uri(&store, "sip:0@homedomain", 200 * 1024));
+  EXPECT_TRUE(set_uri(&store, "sip:0@homedomain", 1024));
+  EXPECT_EQ(2u, num_bindings(&store, "sip:0@homedomain"));
+}
+
+TEST_F(ShmStoreTest, Expiry)
+{
+  ShmStore store(_name, 64, 64 * 1024);
+  int now = time(NULL);
+  add_binding(&store, "sip:6505550231@homedomain", "a", now + 300);
+  add_binding(&store, "sip:6505550231@homedomain", "b", now + 10);
+  add_binding(&store, "sip:6505550232@homedomain", "a", now + 10);
+
+  // Expired bindings aren't returned, and AoRs with none left are removed
+  // by the sweep.
+  store.expire_all(now + 9);
+  EXPECT_EQ(2u, num_bindings(&store, "sip:6505550231@homedomain"));
+  EXPECT_EQ(1u, num_bindings(&store, "sip:6505550232@homedomain"));
+  store.expire_all(now + 10);
+  EXPECT_EQ(0u, num_bindings(&store, "sip:6505550232@homedomain"));
+  size_t used = 0;
+  for (uint32_t ii = 0; ii < 64; ++ii)
+  {
+    used += (store.buckets()[ii].state == ShmStore::USED) ? 1 : 0;
+  }
+  EXPECT_EQ(1u, used);
+
+  // The background thread sweeps too.
+  add_binding(&store, "sip:6505550233@homedomain", "a", time(NULL) + 1);
+  for (int ii = 0; (ii < 30) && (store.buckets()[ShmStore::hash_key("sip:6505550233@homedomain") % 64].state == ShmStore::USED); ++ii)
+  {
+    usleep(100 * 1000);
+  }
+  EXPECT_NE(ShmStore::USED, store.buckets()[ShmStore::hash_key("sip:6505550233@homedomain") % 64].state);
+}
+
+TEST_F(ShmStoreTest, Corrupt)
+{
+  ShmStore store(_name, 64, 64 * 1024);
+  add_binding(&store, "sip:6505550231@homedomain", "a", time(NULL) + 300);
+
+  // An AoR that can't be decoded reads as empty, so can be overwritten.
+  ShmStore::Bucket* b = &store.buckets()[ShmStore::hash_key("sip:6505550231@homedomain") % 64];
+  memset((char*)store._header + b->block + b->key_length, 0xff, b->value_length);
+  EXPECT_EQ(0u, num_bindings(&store, "sip:6505550231@homedomain"));
+  add_binding(&store, "sip:6505550231@homedomain", "b", time(NULL) + 300);
+  EXPECT_EQ(1u, num_bindings(&store, "sip:6505550231@homedomain"));
+
+  // A bucket pointing outside the segment is ignored.
+  b->block = store._size;
+  EXPECT_EQ(0u, num_bindings(&store, "sip:6505550231@homedomain"));
+}
+
+TEST_F(ShmStoreTest, BadSegment)
+{
+  // A segment that isn't a store can't be used.
+  std::string junk(4096, 'x');
+  int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT, 0600);
+  ASSERT_EQ((ssize_t)junk.length(), write(fd, junk.data(), junk.length()));
+  close(fd);
+  EXPECT_TRUE(create_shm_store(_name) == NULL);
+
+  // Nor can one that's too small, or one with a bad name.
+  ASSERT_EQ(0, shm_unlink(_name.c_str()));
+  fd = shm_open(_name.c_str(), O_RDWR | O_CREAT, 0600);
+  ASSERT_EQ(8, write(fd, junk.data(), 8));
+  close(fd);
+  EXPECT_TRUE(create_shm_store(_name) == NULL);
+  ShmStore store("/bad/name");
+  EXPECT_FALSE(store.ready());
+  EXPECT_TRUE(store.get_aor_data("sip:6505550231@homedomain") == NULL);
+  EXPECT_FALSE(store.set_aor_data("sip:6505550231@homedomain", NULL));
+  store.flush_all();
+  store.expire_all(0);
+}
+
+/// Arguments for a thread in the Concurrent test.
+struct ConcurrentArgs
+{
+  Store* store;
+  int thread_num;
+  int num_writes;
+  int expires;
+};
+
+static void* concurrent_writer(void* p)
+{
+  ConcurrentArgs* args = (ConcurrentArgs*)p;
+  for (int ii = 0; ii < args->num_writes; ++ii)
+  {
+    char aor_id[32];
+    char binding_id[32];
+    snprintf(aor_id, sizeof(aor_id), "sip:%d@homedomain", ii % 5);
+    snprintf(binding_id, sizeof(binding_id), "<urn:uuid:%d-%d>", args->thread_num, ii);
+    bool set_rc;
+    do
+    {
+      AoR* aor_data = args->store->get_aor_data(aor_id);
+      aor_data->get_binding(binding_id)->_expires = args->expires;
+      set_rc = args->store->set_aor_data(aor_id, aor_data);
+      delete aor_data;
+    }
+    while (!set_rc);
+  }
+  return NULL;
+}
+
+TEST_F(ShmStoreTest, Concurrent)
+{
+  // Several threads, each with its own mapping, add bindings to the same
+  // few AoRs at once.
+  const int NUM_THREADS = 4;
+  const int NUM_WRITES = 100;
+  ShmStore* stores[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  ConcurrentArgs args[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    stores[ii] = new ShmStore(_name, 64, 16 * 1024 * 1024);
+    args[ii].store = stores[ii];
+    args[ii].thread_num = ii;
+    args[ii].num_writes = NUM_WRITES;
+    args[ii].expires = time(NULL) + 300;
+    pthread_create(&threads[ii], NULL, concurrent_writer, &args[ii]);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // No update was lost.
+  size_t total = 0;
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    total += num_bindings(stores[0], "sip:" + std::to_string(ii) + "@homedomain");
+  }
+  EXPECT_EQ((size_t)(NUM_THREADS * NUM_WRITES), total);
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    delete stores[ii];
+  }
+}
@@ -36,6 +36,7 @@
 
 #include <string>
 #include <sstream>
+#include <list>
 #include "gtest/gtest.h"
 #include <json/reader.h>
 
@@ -218,6 +218,9 @@ public:
     // implementation doesn't matter.
     _enum_service = new JSONEnumService(string(UT_DIR).append("/test_stateful_proxy_enum.json"));
     _bgcf_service = new BgcfService(string(UT_DIR).append("/test_stateful_proxy_bgcf.json"));
+    // A pool without threads does its lookups as soon as they're started,
+    // which keeps the tests deterministic.
+    _lookup_pool = new LookupPool(0);
     _edge_upstream_proxy = edge_upstream_proxy;
     _ibcf_trusted_hosts = ibcf_trusted_hosts;
     pj_status_t ret = init_stateful_proxy(_store,
@@ -231,7 +234,8 @@ public:
                                           _ibcf_trusted_hosts.c_str(),
                                           _analytics,
                                           _enum_service,
-                                          _bgcf_service);
+                                          _bgcf_service,
+                                          _lookup_pool);
     ASSERT_EQ(PJ_SUCCESS, ret) << PjStatus(ret);
 
     // Schedule timers.
@@ -251,6 +255,7 @@ public:
     delete _hss_connection; _hss_connection = NULL;
     delete _enum_service; _enum_service = NULL;
     delete _bgcf_service; _bgcf_service = NULL;
+    delete _lookup_pool; _lookup_pool = NULL;
     SipTest::TearDownTestCase();
   }
 
@@ -306,6 +311,7 @@ protected:
   static IfcHandler* _ifc_handler;
   static EnumService* _enum_service;
   static BgcfService* _bgcf_service;
+  static LookupPool* _lookup_pool;
   static string _edge_upstream_proxy;
   static string _ibcf_trusted_hosts;
 
@@ -327,6 +333,7 @@ CallServices* StatefulProxyTestBase::_call_services;
 IfcHandler* StatefulProxyTestBase::_ifc_handler;
 EnumService* StatefulProxyTestBase::_enum_service;
 BgcfService* StatefulProxyTestBase::_bgcf_service;
+LookupPool* StatefulProxyTestBase::_lookup_pool;
 string StatefulProxyTestBase::_edge_upstream_proxy;
 string StatefulProxyTestBase::_ibcf_trusted_hosts;
 
@@ -2127,11 +2134,102 @@ TEST_F(IscTest, SimpleMainline)
 
   tpAS.expect_target(current_txdata(), false);
   EXPECT_EQ("sip:6505551234@homedomain", r1.uri());
-  EXPECT_EQ("Route: <sip:1.2.3.4:56789;transport=UDP;lr>\r\nRoute: <sip:odi_unity@testnode:5058;transport=UDP;lr;orig>", get_headers(out, "Route"));
+  EXPECT_THAT(get_headers(out, "Route"),
+              MatchesRegex("Route: <sip:1.2.3.4:56789;transport=UDP;lr>\r\nRoute: <sip:odi_[+/A-Za-z0-9]+@testnode:5058;transport=UDP;lr;orig>"));
 
   free_txdata();
 }
 
+// Test a request passing along a chain of two ASs.
+TEST_F(IscTest, AsChain)
+{
+  register_uri(_store, "6505551234", "homedomain", "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob");
+  _hss_connection->set_user_ifc("sip:6505551000@homedomain",
+                                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                "<ServiceProfile>\n"
+                                "  <InitialFilterCriteria>\n"
+                                "    <Priority>2</Priority>\n"
+                                "    <ApplicationServer>\n"
+                                "      <ServerName>sip:5.6.7.8:56789;transport=UDP</ServerName>\n"
+                                "    </ApplicationServer>\n"
+                                "  </InitialFilterCriteria>\n"
+                                "  <InitialFilterCriteria>\n"
+                                "    <Priority>1</Priority>\n"
+                                "    <ApplicationServer>\n"
+                                "      <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                                "    </ApplicationServer>\n"
+                                "  </InitialFilterCriteria>\n"
+                                "</ServiceProfile>");
+
+  TransportFlow tpBono(TransportFlow::Protocol::TCP, TransportFlow::Trust::UNTRUSTED, "10.99.88.11", 12345);
+  TransportFlow tpAS1(TransportFlow::Protocol::UDP, TransportFlow::Trust::TRUSTED, "1.2.3.4", 56789);
+  TransportFlow tpAS2(TransportFlow::Protocol::UDP, TransportFlow::Trust::TRUSTED, "5.6.7.8", 56789);
+
+  // INVITE from bono goes to the first AS.
+  Message msg;
+  msg._via = "10.99.88.11:12345;transport=TCP";
+  msg._to = "homedomain;orig";
+  msg._todomain = "";
+  msg._route = "sip:6505551234@homedomain";
+  inject_msg(msg.get_request(), &tpBono);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+  free_txdata();
+
+  SCOPED_TRACE("INVITE (AS1)");
+  pjsip_msg* out = current_txdata()->msg;
+  ReqMatcher r1("INVITE");
+  ASSERT_NO_FATAL_FAILURE(r1.matches(out));
+  tpAS1.expect_target(current_txdata(), false);
+  string routes = get_headers(out, "Route");
+  EXPECT_THAT(routes, MatchesRegex("Route: <sip:1.2.3.4:56789;transport=UDP;lr>\r\nRoute: <sip:odi_[+/A-Za-z0-9]+@testnode:5058;transport=UDP;lr;orig>"));
+  string odi_route1 = routes.substr(routes.find("\r\n") + 2);
+  free_txdata();
+
+  // The service profile changes, but the request carries on down the
+  // chain it started on without looking it up again.
+  _hss_connection->set_user_ifc("sip:6505551000@homedomain",
+                                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                "<ServiceProfile>\n"
+                                "</ServiceProfile>");
+
+  // The first AS passes the INVITE back, and it goes to the second AS.
+  Message msg2;
+  msg2._via = "1.2.3.4:56789";
+  msg2._extra = odi_route1;
+  inject_msg(msg2.get_request(), &tpAS1);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+  free_txdata();
+
+  SCOPED_TRACE("INVITE (AS2)");
+  out = current_txdata()->msg;
+  ASSERT_NO_FATAL_FAILURE(r1.matches(out));
+  tpAS2.expect_target(current_txdata(), false);
+  routes = get_headers(out, "Route");
+  EXPECT_THAT(routes, MatchesRegex("Route: <sip:5.6.7.8:56789;transport=UDP;lr>\r\nRoute: <sip:odi_[+/A-Za-z0-9]+@testnode:5058;transport=UDP;lr;orig>"));
+  string odi_route2 = routes.substr(routes.find("\r\n") + 2);
+  EXPECT_NE(odi_route1, odi_route2);
+  free_txdata();
+
+  // The second AS passes the INVITE back, and the originating chain is
+  // complete, so it goes to the callee.
+  Message msg3;
+  msg3._via = "5.6.7.8:56789";
+  msg3._extra = odi_route2;
+  inject_msg(msg3.get_request(), &tpAS2);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+  free_txdata();
+
+  SCOPED_TRACE("INVITE (callee)");
+  out = current_txdata()->msg;
+  ASSERT_NO_FATAL_FAILURE(r1.matches(out));
+  expect_target("TCP", "10.114.61.213", 5061, current_txdata());
+  EXPECT_EQ("sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob", r1.uri());
+  free_txdata();
+}
+
 // @@@ WS stuff
 
 // @@@ integrity-protected handling (includes find_flow_data); relationship to auth
@@ -0,0 +1,182 @@
+/**
+ * @file @file timerwheel_test.cpp UT for the TimerWheel class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "timerwheel.h"
+
+using namespace std;
+
+/// Fixture for TimerWheelTest.
+class TimerWheelTest : public ::testing::Test
+{
+  TimerWheelTest()
+  {
+  }
+
+  virtual ~TimerWheelTest()
+  {
+  }
+};
+
+TEST_F(TimerWheelTest, Levels)
+{
+  const int START = 1000000007;
+  TimerWheel wheel(START);
+  std::vector<std::string> expired;
+
+  // Timers due on each wheel, on the boundaries between them, and beyond
+  // the top one.
+  int offsets[] = {1, 2, 63, 64, 65, 4095, 4096, 4097, 300000, 262143, 262144,
+                   16777215, 16777216, 20000000};
+  int num_offsets = sizeof(offsets) / sizeof(offsets[0]);
+  for (int ii = 0; ii < num_offsets; ++ii)
+  {
+    wheel.schedule(std::to_string(offsets[ii]), START + offsets[ii]);
+  }
+  EXPECT_EQ((size_t)num_offsets, wheel.size());
+
+  std::map<int, int> sorted;
+  for (int ii = 0; ii < num_offsets; ++ii)
+  {
+    sorted[offsets[ii]] = ii;
+  }
+
+  // Each pops in the second it is due, and not before.
+  for (std::map<int, int>::iterator i = sorted.begin(); i != sorted.end(); ++i)
+  {
+    wheel.pop_expired(START + i->first - 1, expired);
+    EXPECT_EQ(0u, expired.size()) << i->first;
+    wheel.pop_expired(START + i->first, expired);
+    ASSERT_EQ(1u, expired.size()) << i->first;
+    EXPECT_EQ(std::to_string(i->first), expired[0]);
+    expired.clear();
+  }
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST_F(TimerWheelTest, Random)
+{
+  const int START = 1381363200;
+  TimerWheel wheel(START);
+  std::map<std::string, int> expiries;
+  unsigned int seed = 42;
+
+  // Lots of timers, some already due, popped in uneven steps.
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    std::string id = std::to_string(ii);
+    int expiry = START - 5 + rand_r(&seed) % 20000;
+    expiries[id] = expiry;
+    wheel.schedule(id, expiry);
+  }
+
+  int now = START;
+  std::vector<std::string> expired;
+  while (wheel.size() > 0)
+  {
+    int prev = now;
+    now += 1 + rand_r(&seed) % 300;
+    wheel.pop_expired(now, expired);
+    for (size_t ii = 0; ii < expired.size(); ++ii)
+    {
+      int expiry = expiries[expired[ii]];
+      EXPECT_LE(expiry, now);
+      EXPECT_TRUE((expiry > prev) || (prev == START)) << expired[ii];
+      expiries.erase(expired[ii]);
+    }
+    expired.clear();
+
+    // Everything still outstanding is due later.
+    for (std::map<std::string, int>::iterator i = expiries.begin();
+         i != expiries.end();
+         ++i)
+    {
+      ASSERT_GT(i->second, now) << i->first;
+    }
+  }
+  EXPECT_EQ(0u, expiries.size());
+}
+
+TEST_F(TimerWheelTest, Cancel)
+{
+  TimerWheel wheel(1000);
+  std::vector<std::string> expired;
+
+  TimerWheel::Timer* t1 = wheel.schedule("a", 1010);
+  wheel.schedule("b", 1010);
+  TimerWheel::Timer* t3 = wheel.schedule("c", 5000);
+  EXPECT_EQ(3u, wheel.size());
+
+  wheel.cancel(t1);
+  wheel.cancel(t3);
+  EXPECT_EQ(1u, wheel.size());
+  wheel.pop_expired(6000, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("b", expired[0]);
+
+  // Clearing drops everything.
+  wheel.schedule("d", 6010);
+  wheel.schedule("e", 100000);
+  wheel.clear();
+  EXPECT_EQ(0u, wheel.size());
+  expired.clear();
+  wheel.pop_expired(200000, expired);
+  EXPECT_EQ(0u, expired.size());
+
+  // An empty wheel skips straight to the new time, so timers scheduled
+  // afterwards are filed relative to it.
+  wheel.schedule("f", 200001);
+  wheel.pop_expired(200001, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("f", expired[0]);
+
+  // Going backwards in time does nothing.
+  expired.clear();
+  wheel.schedule("g", 100);
+  wheel.pop_expired(150, expired);
+  EXPECT_EQ(0u, expired.size());
+  wheel.pop_expired(200002, expired);
+  EXPECT_EQ(1u, expired.size());
+}
@@ -0,0 +1,205 @@
+/**
+ * @file triggerpoint_test.cpp UT for compiled iFC trigger points.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "fakelogger.hpp"
+
+#include "triggerpoint.h"
+
+using namespace std;
+using namespace rapidxml;
+
+/// Fixture for TriggerPointTest.
+class TriggerPointTest : public SipTest
+{
+public:
+  FakeLogger _log;
+
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  TriggerPointTest() : SipTest(NULL)
+  {
+    string str("INVITE sip:6505551234@homedomain;user=phone SIP/2.0\n"
+               "Via: SIP/2.0/TCP 10.64.90.97:50693;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\n"
+               "Max-Forwards: 69\n"
+               "From: <sip:6505551000@homedomain>;tag=13919SIPpTag0011234\n"
+               "To: <sip:6505551234@homedomain>\n"
+               "Contact: <sip:6505551000@10.16.62.109:58309;transport=TCP;ob>\n"
+               "Accept-Contact: *;+g.3gpp.icsi-ref=\"urn%3Aurn-7%3A3gpp-service.ims.icsi.mmtel\"\n"
+               "Call-ID: 1-13919@10.151.20.48\n"
+               "CSeq: 4 INVITE\n"
+               "Content-Type: application/sdp\n"
+               "Content-Length: 83\n\n"
+               "v=0\r\n"
+               "o=- 1 1 IN IP4 10.16.62.109\r\n"
+               "m=audio 4000 RTP/AVP 0\r\n"
+               "m=video 4002 RTP/AVP 96\r\n");
+    pjsip_rx_data* rdata = build_rxdata(str);
+    parse_rxdata(rdata);
+    _msg = rdata->msg_info.msg;
+  }
+
+  ~TriggerPointTest()
+  {
+  }
+
+  /// Compile a trigger point and check it against the INVITE.
+  bool matches(const string& xml, const SessionCase& session_case = SessionCase::Originating)
+  {
+    TriggerPoint* tp = compile(xml);
+    EXPECT_TRUE(tp != NULL);
+    bool result = ((tp != NULL) && (tp->matches(session_case, _msg)));
+    delete tp;
+    return result;
+  }
+
+  static TriggerPoint* compile(const string& xml)
+  {
+    xml_document<> doc;
+    doc.parse<0>(doc.allocate_string(xml.c_str()));
+    return TriggerPoint::compile(doc.first_node("TriggerPoint"));
+  }
+
+  static string spt(int group, const string& condition, bool negated = false)
+  {
+    return "<SPT><ConditionNegated>" + string(negated ? "1" : "0") + "</ConditionNegated>" +
+           "<Group>" + to_string((long long)group) + "</Group>" + condition + "</SPT>";
+  }
+
+  static string tp(bool cnf, const string& spts)
+  {
+    return "<TriggerPoint><ConditionTypeCNF>" + string(cnf ? "1" : "0") +
+           "</ConditionTypeCNF>" + spts + "</TriggerPoint>";
+  }
+
+  pjsip_msg* _msg;
+};
+
+TEST_F(TriggerPointTest, Method)
+{
+  EXPECT_TRUE(matches(tp(false, spt(0, "<Method>INVITE</Method>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<Method>MESSAGE</Method>"))));
+  EXPECT_TRUE(matches(tp(false, spt(0, "<Method>MESSAGE</Method>", true))));
+}
+
+TEST_F(TriggerPointTest, SessionCase)
+{
+  string orig = tp(false, spt(0, "<SessionCase>0</SessionCase>"));
+  string term = tp(false, spt(0, "<SessionCase>2</SessionCase>"));
+  string cdiv = tp(false, spt(0, "<SessionCase>4</SessionCase>"));
+  EXPECT_TRUE(matches(orig, SessionCase::Originating));
+  EXPECT_FALSE(matches(orig, SessionCase::Terminating));
+  EXPECT_TRUE(matches(term, SessionCase::Terminating));
+  EXPECT_FALSE(matches(term, SessionCase::OriginatingCdiv));
+  EXPECT_TRUE(matches(cdiv, SessionCase::OriginatingCdiv));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<SessionCase>5</SessionCase>"))));
+}
+
+TEST_F(TriggerPointTest, RequestURI)
+{
+  EXPECT_TRUE(matches(tp(false, spt(0, "<RequestURI>^sip:650555[0-9]+@</RequestURI>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<RequestURI>^tel:</RequestURI>"))));
+}
+
+TEST_F(TriggerPointTest, SIPHeader)
+{
+  // Header names match either form, ignoring case.
+  EXPECT_TRUE(matches(tp(false, spt(0, "<SIPHeader><Header>accept-contact</Header><Content>mmtel</Content></SIPHeader>"))));
+  EXPECT_TRUE(matches(tp(false, spt(0, "<SIPHeader><Header>f</Header><Content>^&lt;sip:6505551000@</Content></SIPHeader>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<SIPHeader><Header>From</Header><Content>^sip:</Content></SIPHeader>"))));
+  EXPECT_TRUE(matches(tp(false, spt(0, "<SIPHeader><Header>Contact</Header></SIPHeader>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<SIPHeader><Header>Privacy</Header></SIPHeader>"))));
+}
+
+TEST_F(TriggerPointTest, SessionDescription)
+{
+  EXPECT_TRUE(matches(tp(false, spt(0, "<SessionDescription><Line>m</Line><Content>^video</Content></SessionDescription>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<SessionDescription><Line>m</Line><Content>^image</Content></SessionDescription>"))));
+  EXPECT_TRUE(matches(tp(false, spt(0, "<SessionDescription><Line>o</Line></SessionDescription>"))));
+  EXPECT_FALSE(matches(tp(false, spt(0, "<SessionDescription><Line>b</Line></SessionDescription>"))));
+}
+
+TEST_F(TriggerPointTest, Groups)
+{
+  // No SPTs always matches.
+  EXPECT_TRUE(matches(tp(false, "")));
+  EXPECT_TRUE(matches(tp(true, "")));
+
+  // (INVITE and terminating) or MESSAGE.
+  string dnf = tp(false,
+                  spt(0, "<Method>INVITE</Method>") +
+                  spt(0, "<SessionCase>1</SessionCase>") +
+                  spt(1, "<Method>MESSAGE</Method>"));
+  EXPECT_FALSE(matches(dnf, SessionCase::Originating));
+  EXPECT_TRUE(matches(dnf, SessionCase::Terminating));
+
+  // (INVITE or MESSAGE) and (originating or originating-cdiv).
+  string cnf = tp(true,
+                  spt(0, "<Method>INVITE</Method>") +
+                  spt(0, "<Method>MESSAGE</Method>") +
+                  spt(1, "<SessionCase>0</SessionCase>") +
+                  spt(1, "<SessionCase>4</SessionCase>"));
+  EXPECT_TRUE(matches(cnf, SessionCase::Originating));
+  EXPECT_TRUE(matches(cnf, SessionCase::OriginatingCdiv));
+  EXPECT_FALSE(matches(cnf, SessionCase::Terminating));
+
+  // An SPT can be in several groups.
+  EXPECT_TRUE(matches(tp(true,
+                         "<SPT><Group>0</Group><Group>1</Group><Method>INVITE</Method></SPT>" +
+                         spt(1, "<Method>BYE</Method>"))));
+}
+
+TEST_F(TriggerPointTest, Invalid)
+{
+  EXPECT_TRUE(compile(tp(false, spt(0, "<RequestURI>[</RequestURI>"))) == NULL);
+  EXPECT_TRUE(compile(tp(false, spt(0, "<SIPHeader><Content>x</Content></SIPHeader>"))) == NULL);
+  EXPECT_TRUE(compile(tp(false, spt(0, "<SessionDescription><Content>x</Content></SessionDescription>"))) == NULL);
+  EXPECT_TRUE(compile(tp(false, spt(0, "<Unknown>x</Unknown>"))) == NULL);
+}
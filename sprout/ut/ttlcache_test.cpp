@@ -0,0 +1,258 @@
+/**
+ * @file ttlcache_test.cpp UT for the TTL cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <unistd.h>
+#include <pthread.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "ttlcache.h"
+#include "statistic.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+typedef TtlCache<string> StringCache;
+
+/// Fixture for TtlCacheTest.
+class TtlCacheTest : public BaseTest
+{
+  TtlCacheTest() : _loads(0), _fail(false)
+  {
+    cwtest_reset_time();
+  }
+
+  virtual ~TtlCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  /// Look up a key, counting the loads.  Keys starting "none" have no
+  /// value; the others' values name them.  Loads fail if _fail is set.
+  string get(StringCache& cache, const string& key)
+  {
+    return cache.get(key, [&](string& value) -> StringCache::LoadResult
+    {
+      ++_loads;
+      if (_fail)
+      {
+        return StringCache::FAILED;
+      }
+      if (key.compare(0, 4, "none") == 0)
+      {
+        return StringCache::NOT_FOUND;
+      }
+      value = "value-" + key;
+      return StringCache::LOADED;
+    });
+  }
+
+  int _loads;
+  bool _fail;
+};
+
+TEST_F(TtlCacheTest, Get)
+{
+  StringCache cache(100, 1000, 100);
+
+  EXPECT_EQ("value-key1", get(cache, "key1"));
+  EXPECT_EQ(1, _loads);
+
+  // Further lookups use the loaded value.
+  EXPECT_EQ("value-key1", get(cache, "key1"));
+  EXPECT_EQ(1, _loads);
+
+  StringCache::Stats stats = cache.stats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(0u, stats.coalesced);
+  EXPECT_EQ(1u, stats.entries);
+}
+
+TEST_F(TtlCacheTest, Expiry)
+{
+  StringCache cache(100, 1000, 100);
+  get(cache, "key1");
+
+  cwtest_advance_time_ms(999);
+  get(cache, "key1");
+  EXPECT_EQ(1, _loads);
+
+  // Using an entry doesn't extend its life.
+  cwtest_advance_time_ms(1);
+  get(cache, "key1");
+  EXPECT_EQ(2, _loads);
+  EXPECT_EQ(1u, cache.stats().entries);
+}
+
+TEST_F(TtlCacheTest, NotFound)
+{
+  StringCache cache(100, 1000, 100);
+
+  // Keys with no value are remembered, for the shorter TTL.
+  EXPECT_EQ("", get(cache, "none1"));
+  cwtest_advance_time_ms(99);
+  EXPECT_EQ("", get(cache, "none1"));
+  EXPECT_EQ(1, _loads);
+
+  cwtest_advance_time_ms(1);
+  EXPECT_EQ("", get(cache, "none1"));
+  EXPECT_EQ(2, _loads);
+}
+
+TEST_F(TtlCacheTest, LoadFailed)
+{
+  StringCache cache(100, 1000, 100);
+  get(cache, "key1");
+
+  // If the value can't be loaded, the expired one is used, and nothing is
+  // cached, so each lookup tries again.
+  _fail = true;
+  cwtest_advance_time_ms(1000);
+  EXPECT_EQ("value-key1", get(cache, "key1"));
+  EXPECT_EQ("value-key1", get(cache, "key1"));
+  EXPECT_EQ(3, _loads);
+  EXPECT_EQ(2u, cache.stats().stale);
+
+  // With no expired value, there is none.
+  EXPECT_EQ("", get(cache, "key2"));
+  EXPECT_EQ("", get(cache, "key2"));
+  EXPECT_EQ(5, _loads);
+  EXPECT_EQ(2u, cache.stats().stale);
+  EXPECT_EQ(1u, cache.stats().entries);
+
+  // Once the value can be loaded again, it's cached again.
+  _fail = false;
+  get(cache, "key1");
+  get(cache, "key1");
+  EXPECT_EQ(6, _loads);
+  EXPECT_EQ(1u, cache.stats().entries);
+}
+
+TEST_F(TtlCacheTest, Eviction)
+{
+  // One shard, so the bound is exact.
+  StringCache cache(3, 1000, 1000, NULL, 1);
+  get(cache, "key1");
+  get(cache, "key2");
+  get(cache, "key3");
+
+  // Use 1, so 2 is least recently used.
+  get(cache, "key1");
+  get(cache, "key4");
+  EXPECT_EQ(3u, cache.stats().entries);
+  EXPECT_EQ(4, _loads);
+
+  get(cache, "key1");
+  get(cache, "key3");
+  get(cache, "key4");
+  EXPECT_EQ(4, _loads);
+  get(cache, "key2");
+  EXPECT_EQ(5, _loads);
+}
+
+struct Waiter
+{
+  pthread_t thread;
+  StringCache* cache;
+  string value;
+};
+
+static void* wait_for_value(void* p)
+{
+  Waiter* w = (Waiter*)p;
+  w->value = w->cache->get("key1", [](string& value) -> StringCache::LoadResult
+  {
+    ADD_FAILURE() << "Loaded a value that was already being loaded";
+    return StringCache::NOT_FOUND;
+  });
+  return NULL;
+}
+
+TEST_F(TtlCacheTest, SingleFlight)
+{
+  StringCache cache(100, 1000, 100);
+  Waiter waiters[3];
+
+  // The first lookup holds up its load until the other lookups are
+  // waiting for it, and they all get its result.
+  string value = cache.get("key1", [&](string& loaded) -> StringCache::LoadResult
+  {
+    for (int ii = 0; ii < 3; ++ii)
+    {
+      waiters[ii].cache = &cache;
+      pthread_create(&waiters[ii].thread, NULL, wait_for_value, &waiters[ii]);
+    }
+    while (cache.stats().coalesced < 3)
+    {
+      usleep(1000);
+    }
+    loaded = "loaded";
+    return StringCache::LOADED;
+  });
+
+  EXPECT_EQ("loaded", value);
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    pthread_join(waiters[ii].thread, NULL);
+    EXPECT_EQ("loaded", waiters[ii].value);
+  }
+  StringCache::Stats stats = cache.stats();
+  EXPECT_EQ(0u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(3u, stats.coalesced);
+}
+
+TEST_F(TtlCacheTest, Statistic)
+{
+  Statistic stat("ifc_cache");
+  StringCache cache(100, 1000, 100, &stat);
+
+  // The first lookup reports, the next doesn't until the interval passes.
+  get(cache, "key1");
+  uint64_t next_report = cache._next_report_ms;
+  get(cache, "key1");
+  EXPECT_EQ(next_report, cache._next_report_ms);
+
+  cwtest_advance_time_ms(StringCache::REPORT_INTERVAL_MS);
+  get(cache, "key1");
+  EXPECT_LT(next_report, cache._next_report_ms);
+}
@@ -0,0 +1,313 @@
+/**
+ * @file upstreambalancer_test.cpp UT for UpstreamBalancer.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "upstreambalancer.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for UpstreamBalancerTest.  The server's name doesn't resolve,
+/// so the tests set the targets themselves.
+class UpstreamBalancerTest : public BaseTest
+{
+  UpstreamBalancer _balancer;
+
+  UpstreamBalancerTest() :
+    _balancer("homestead:8888")
+  {
+  }
+
+  virtual ~UpstreamBalancerTest()
+  {
+    cwtest_reset_time();
+    cwtest_clear_host_mapping();
+  }
+
+  void set_targets(const string& ip1, const string& ip2, const string& ip3 = "")
+  {
+    vector<string> ips;
+    ips.push_back(ip1);
+    ips.push_back(ip2);
+    if (!ip3.empty())
+    {
+      ips.push_back(ip3);
+    }
+    _balancer.update_targets(ips);
+  }
+
+  UpstreamBalancer::Target& target(const string& address)
+  {
+    return *_balancer._targets[address];
+  }
+
+  /// Complete a request to the target.
+  void request(const string& address, bool ok, double latency_ms)
+  {
+    shared_ptr<UpstreamBalancer::Target> target = _balancer._targets[address];
+    ++target->outstanding;
+    _balancer.complete(target, ok, latency_ms);
+  }
+
+  /// Send a request, completing it straight away, and return the address
+  /// it went to.
+  string select_and_complete()
+  {
+    shared_ptr<UpstreamBalancer::Target> target = _balancer.select();
+    _balancer.complete(target, true, 1.0);
+    return target->address;
+  }
+};
+
+TEST_F(UpstreamBalancerTest, Unresolved)
+{
+  // The server's name is the only target.
+  vector<UpstreamBalancer::Target> targets = _balancer.targets();
+  ASSERT_EQ(1u, targets.size());
+  EXPECT_EQ("homestead:8888", targets[0].address);
+  EXPECT_EQ("homestead", targets[0].ip);
+  EXPECT_EQ("active", UpstreamBalancer::state(targets[0]));
+  EXPECT_EQ("homestead:8888", select_and_complete());
+
+  // A target that's the only one is never ejected.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    request("homestead:8888", false, 500.0);
+  }
+  EXPECT_EQ("active", UpstreamBalancer::state(target("homestead:8888")));
+}
+
+TEST_F(UpstreamBalancerTest, Resolved)
+{
+  cwtest_add_host_mapping("homestead.invalid", "10.42.42.42");
+  UpstreamBalancer balancer("homestead.invalid:8888");
+  vector<UpstreamBalancer::Target> targets = balancer.targets();
+  ASSERT_EQ(1u, targets.size());
+  EXPECT_EQ("10.42.42.42:8888", targets[0].address);
+  EXPECT_EQ("10.42.42.42", targets[0].ip);
+
+  UpstreamBalancer balancer2("[::1]:8888");
+  targets = balancer2.targets();
+  ASSERT_EQ(1u, targets.size());
+  EXPECT_EQ("[::1]:8888", targets[0].address);
+  EXPECT_EQ("::1", targets[0].ip);
+
+  UpstreamBalancer balancer3("10.1.2.3");
+  targets = balancer3.targets();
+  ASSERT_EQ(1u, targets.size());
+  EXPECT_EQ("10.1.2.3", targets[0].address);
+
+  // Choosing a target never resolves the name, however long it's been.
+  cwtest_add_host_mapping("homestead.invalid", "10.42.42.43");
+  cwtest_advance_time_ms(UpstreamBalancer::RESOLVE_INTERVAL_MS);
+  EXPECT_EQ("10.42.42.42:8888", balancer.select()->address);
+
+  // Resolving again, as the resolver thread does, picks up the change.
+  balancer.update_targets(balancer.resolve());
+  EXPECT_EQ("10.42.42.43:8888", balancer.select()->address);
+
+  // If the name stops resolving, the targets are kept.
+  cwtest_clear_host_mapping();
+  balancer.update_targets(balancer.resolve());
+  EXPECT_EQ("10.42.42.43:8888", balancer.select()->address);
+}
+
+TEST_F(UpstreamBalancerTest, ReResolve)
+{
+  set_targets("10.0.0.1", "10.0.0.2");
+  request("10.0.0.1:8888", true, 3.0);
+
+  // Targets that remain keep their state.
+  set_targets("10.0.0.1", "10.0.0.3");
+  vector<UpstreamBalancer::Target> targets = _balancer.targets();
+  ASSERT_EQ(2u, targets.size());
+  EXPECT_EQ("10.0.0.1:8888", targets[0].address);
+  EXPECT_EQ(1, targets[0].samples);
+  EXPECT_EQ("10.0.0.3:8888", targets[1].address);
+  EXPECT_EQ(0, targets[1].samples);
+}
+
+TEST_F(UpstreamBalancerTest, Outstanding)
+{
+  // Requests go to the target with fewer outstanding.
+  set_targets("10.0.0.1", "10.0.0.2");
+  shared_ptr<UpstreamBalancer::Target> first = _balancer.select();
+  shared_ptr<UpstreamBalancer::Target> second = _balancer.select();
+  EXPECT_NE(first, second);
+  EXPECT_EQ(1, first->outstanding);
+  EXPECT_EQ(1, second->outstanding);
+  _balancer.complete(first, true, 1.0);
+  _balancer.complete(second, true, 1.0);
+  EXPECT_EQ(0, first->outstanding);
+  EXPECT_EQ(0, second->outstanding);
+}
+
+TEST_F(UpstreamBalancerTest, Latency)
+{
+  // Requests go to the faster target.
+  set_targets("10.0.0.1", "10.0.0.2");
+  request("10.0.0.1:8888", true, 1.0);
+  request("10.0.0.2:8888", true, 40.0);
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_EQ("10.0.0.1:8888", select_and_complete());
+  }
+
+  // The latency is a moving average.
+  request("10.0.0.2:8888", true, 30.0);
+  EXPECT_DOUBLE_EQ(39.0, target("10.0.0.2:8888").latency_ms);
+}
+
+TEST_F(UpstreamBalancerTest, Avoid)
+{
+  set_targets("10.0.0.1", "10.0.0.2");
+  UpstreamBalancer::Target* avoid = _balancer._targets["10.0.0.1:8888"].get();
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    shared_ptr<UpstreamBalancer::Target> target = _balancer.select(avoid);
+    EXPECT_EQ("10.0.0.2:8888", target->address);
+    _balancer.complete(target, true, 1.0);
+  }
+
+  // If there's nowhere else to send the request, it goes to the avoided
+  // target anyway.
+  UpstreamBalancer::Target* only = _balancer._targets["10.0.0.2:8888"].get();
+  vector<string> ips(1, "10.0.0.2");
+  _balancer.update_targets(ips);
+  EXPECT_EQ("10.0.0.2:8888", _balancer.select(only)->address);
+}
+
+TEST_F(UpstreamBalancerTest, EjectErrors)
+{
+  set_targets("10.0.0.1", "10.0.0.2", "10.0.0.3");
+
+  // A target isn't ejected until it has completed enough requests.
+  for (int ii = 0; ii < UpstreamBalancer::MIN_SAMPLES - 1; ++ii)
+  {
+    request("10.0.0.1:8888", false, 100.0);
+  }
+  EXPECT_EQ("active", UpstreamBalancer::state(target("10.0.0.1:8888")));
+
+  // Keep failing until its error rate is too high.
+  while (target("10.0.0.1:8888").ejected_until_ms == 0)
+  {
+    request("10.0.0.1:8888", false, 100.0);
+  }
+  EXPECT_GT(target("10.0.0.1:8888").error_rate, UpstreamBalancer::MAX_ERROR_RATE);
+  EXPECT_EQ("ejected", UpstreamBalancer::state(target("10.0.0.1:8888")));
+
+  // Requests stop going to it, and late responses from it are ignored.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    EXPECT_NE("10.0.0.1:8888", select_and_complete());
+  }
+  request("10.0.0.1:8888", true, 1.0);
+  EXPECT_EQ("ejected", UpstreamBalancer::state(target("10.0.0.1:8888")));
+
+  // Once the ejection's over, the next request probes it, and the others
+  // don't until that completes.
+  cwtest_advance_time_ms(UpstreamBalancer::BASE_EJECTION_MS);
+  shared_ptr<UpstreamBalancer::Target> probe = _balancer.select();
+  EXPECT_EQ("10.0.0.1:8888", probe->address);
+  EXPECT_EQ("probing", UpstreamBalancer::state(*probe));
+  EXPECT_NE("10.0.0.1:8888", select_and_complete());
+
+  // The probe fails, so it's ejected for twice as long.
+  _balancer.complete(probe, false, 500.0);
+  EXPECT_EQ("ejected", UpstreamBalancer::state(*probe));
+  EXPECT_EQ(2, probe->ejections);
+  cwtest_advance_time_ms(UpstreamBalancer::BASE_EJECTION_MS);
+  EXPECT_NE("10.0.0.1:8888", select_and_complete());
+  cwtest_advance_time_ms(UpstreamBalancer::BASE_EJECTION_MS);
+
+  // This time the probe succeeds, so it's re-admitted.
+  probe = _balancer.select();
+  EXPECT_EQ("10.0.0.1:8888", probe->address);
+  _balancer.complete(probe, true, 2.0);
+  EXPECT_EQ("active", UpstreamBalancer::state(*probe));
+  EXPECT_EQ(0, probe->ejections);
+  EXPECT_EQ(0.0, probe->error_rate);
+  EXPECT_EQ(2.0, probe->latency_ms);
+}
+
+TEST_F(UpstreamBalancerTest, EjectMaximum)
+{
+  // Repeated ejections are capped in length.
+  set_targets("10.0.0.1", "10.0.0.2", "10.0.0.3");
+  target("10.0.0.1:8888").ejections = 20;
+  target("10.0.0.1:8888").samples = UpstreamBalancer::MIN_SAMPLES;
+  request("10.0.0.1:8888", false, 100.0);
+  target("10.0.0.1:8888").error_rate = 1.0;
+  request("10.0.0.1:8888", false, 100.0);
+  EXPECT_EQ(21, target("10.0.0.1:8888").ejections);
+  uint64_t remaining_ms = target("10.0.0.1:8888").ejected_until_ms - UpstreamBalancer::now_ms();
+  EXPECT_LE(remaining_ms, (uint64_t)UpstreamBalancer::MAX_EJECTION_MS);
+  EXPECT_GT(remaining_ms, (uint64_t)UpstreamBalancer::MAX_EJECTION_MS - 1000);
+
+  // No more than half the targets are ejected.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    request("10.0.0.2:8888", false, 100.0);
+  }
+  EXPECT_EQ("active", UpstreamBalancer::state(target("10.0.0.2:8888")));
+}
+
+TEST_F(UpstreamBalancerTest, EjectSlow)
+{
+  set_targets("10.0.0.1", "10.0.0.2", "10.0.0.3");
+
+  // A target that's slow, but no slower than the others, stays.
+  for (int ii = 0; ii < UpstreamBalancer::MIN_SAMPLES; ++ii)
+  {
+    request("10.0.0.1:8888", true, 60.0);
+    request("10.0.0.2:8888", true, 60.0);
+  }
+  EXPECT_EQ("active", UpstreamBalancer::state(target("10.0.0.1:8888")));
+
+  // One that's much slower than the others is ejected.
+  for (int ii = 0; ii < UpstreamBalancer::MIN_SAMPLES; ++ii)
+  {
+    request("10.0.0.3:8888", true, 400.0);
+  }
+  EXPECT_EQ("ejected", UpstreamBalancer::state(target("10.0.0.3:8888")));
+  EXPECT_EQ("active", UpstreamBalancer::state(target("10.0.0.2:8888")));
+}
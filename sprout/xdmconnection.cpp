@@ -48,11 +48,17 @@
 #include "xdmconnection.h"
 
 /// Main constructor.
-XDMConnection::XDMConnection(const std::string& server) :
+XDMConnection::XDMConnection(const std::string& server,
+                             HttpEngine* engine,
+                             double failure_ratio) :
   _http(new HttpConnection(server,
                            true,
                            SASEvent::TX_XDM_GET_BASE,
-                           "connected_homers"))
+                           "connected_homers",
+                           "homer_gets",
+                           "homer_breaker",
+                           engine,
+                           failure_ratio))
 {
 }
 
@@ -74,6 +80,6 @@ bool XDMConnection::get_simservs(const std::string& user,
                                  const std::string& password,
                                  SAS::TrailId trail)
 {
-  return _http->get("/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml", xml_data, user, trail);
+  return (_http->get("/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml", xml_data, user, trail) == HTTP_OK);
 }
 
@@ -0,0 +1,235 @@
+/**
+ * @file aorcodec_bench.cpp
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Microbenchmark comparing the AoRCodec record format with the original
+// iostream-based serialization used by the memcached store.
+//
+// Usage: aorcodec_bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <sstream>
+
+#include "regdata.h"
+#include "aorcodec.h"
+
+using namespace RegData;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Build an AoR holding the specified number of typical bindings.
+static void build_aor(AoR* aor_data, int num_bindings, int num_paths)
+{
+  char instance[64];
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    snprintf(instance, sizeof(instance), "00000000-0000-0000-0000-%012d", ii);
+    AoR::Binding* b = aor_data->get_binding(std::string("urn:uuid:") + instance + ":1");
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038 + ii;
+    b->_expires = time(NULL) + 300;
+    b->_priority = 0;
+    b->_params.push_back(std::make_pair("+sip.instance", std::string("\"<urn:uuid:") + instance + ">\""));
+    b->_params.push_back(std::make_pair("reg-id", "1"));
+    b->_params.push_back(std::make_pair("+sip.ice", ""));
+    for (int jj = 0; jj < num_paths; ++jj)
+    {
+      b->_path_headers.push_back("<sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob>");
+    }
+  }
+}
+
+/// The original serialization, kept here for comparison.
+static std::string legacy_serialize(AoR* aor_data)
+{
+  std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
+
+  int num_bindings = aor_data->bindings().size();
+  oss.write((const char *)&num_bindings, sizeof(int));
+
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    oss << i->first << '\0';
+
+    AoR::Binding* b = i->second;
+    oss << b->_uri << '\0';
+    oss << b->_cid << '\0';
+    oss.write((const char *)&b->_cseq, sizeof(int));
+    oss.write((const char *)&b->_expires, sizeof(int));
+    oss.write((const char *)&b->_priority, sizeof(int));
+    int num_params = b->_params.size();
+    oss.write((const char *)&num_params, sizeof(int));
+    for (AoR::Binding::Params::const_iterator i = b->_params.begin();
+         i != b->_params.end();
+         ++i)
+    {
+      oss << i->first << '\0' << i->second << '\0';
+    }
+    int num_path_hdrs = b->_path_headers.size();
+    oss.write((const char *)&num_path_hdrs, sizeof(int));
+    for (AoR::Binding::PathHeaders::const_iterator i = b->_path_headers.begin();
+         i != b->_path_headers.end();
+         ++i)
+    {
+      oss << *i << '\0';
+    }
+  }
+
+  return oss.str();
+}
+
+/// The original deserialization, kept here for comparison.
+static void legacy_deserialize(const std::string& s, AoR* aor_data)
+{
+  std::istringstream iss(s, std::istringstream::in|std::istringstream::binary);
+
+  int num_bindings;
+  iss.read((char *)&num_bindings, sizeof(int));
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    std::string binding_id;
+    getline(iss, binding_id, '\0');
+
+    AoR::Binding* b = aor_data->get_binding(binding_id);
+    getline(iss, b->_uri, '\0');
+    getline(iss, b->_cid, '\0');
+    iss.read((char *)&b->_cseq, sizeof(int));
+    iss.read((char *)&b->_expires, sizeof(int));
+    iss.read((char *)&b->_priority, sizeof(int));
+
+    int num_params;
+    iss.read((char *)&num_params, sizeof(int));
+    b->_params.resize(num_params);
+    for (AoR::Binding::Params::iterator i = b->_params.begin();
+         i != b->_params.end();
+         ++i)
+    {
+      getline(iss, i->first, '\0');
+      getline(iss, i->second, '\0');
+    }
+
+    int num_paths = 0;
+    iss.read((char *)&num_paths, sizeof(int));
+    b->_path_headers.resize(num_paths);
+    for (AoR::Binding::PathHeaders::iterator i = b->_path_headers.begin();
+         i != b->_path_headers.end();
+         ++i)
+    {
+      getline(iss, *i, '\0');
+    }
+  }
+}
+
+static void run(int num_bindings, int num_paths, int iterations)
+{
+  AoR aor_data;
+  build_aor(&aor_data, num_bindings, num_paths);
+
+  std::string legacy;
+  std::string encoded;
+  uint64_t start;
+  uint64_t legacy_enc_ns;
+  uint64_t codec_enc_ns;
+  uint64_t legacy_dec_ns;
+  uint64_t codec_dec_ns;
+
+  start = now_ns();
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    legacy = legacy_serialize(&aor_data);
+  }
+  legacy_enc_ns = now_ns() - start;
+
+  start = now_ns();
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    AoRCodec::encode(&aor_data, encoded);
+  }
+  codec_enc_ns = now_ns() - start;
+
+  start = now_ns();
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    AoR decoded;
+    legacy_deserialize(legacy, &decoded);
+  }
+  legacy_dec_ns = now_ns() - start;
+
+  start = now_ns();
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    AoR decoded;
+    if (!AoRCodec::decode(encoded.data(), encoded.length(), &decoded))
+    {
+      fprintf(stderr, "Failed to decode record\n");
+      exit(1);
+    }
+  }
+  codec_dec_ns = now_ns() - start;
+
+  double per = (double)iterations * num_bindings;
+  printf("%8d %5d | %8lu %8lu | %8.0f %8.0f | %8.0f %8.0f\n",
+         num_bindings, num_paths,
+         (unsigned long)legacy.length(), (unsigned long)encoded.length(),
+         legacy_enc_ns / per, codec_enc_ns / per,
+         legacy_dec_ns / per, codec_dec_ns / per);
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+
+  printf("                     bytes per record    encode ns/binding   decode ns/binding\n");
+  printf("bindings paths |   legacy    codec |   legacy    codec |   legacy    codec\n");
+  run(1, 1, iterations);
+  run(1, 4, iterations);
+  run(4, 1, iterations);
+  run(4, 4, iterations / 4);
+  run(16, 2, iterations / 16);
+
+  return 0;
+}
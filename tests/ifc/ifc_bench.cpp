@@ -0,0 +1,245 @@
+/**
+ * @file ifc_bench.cpp Microbenchmark for compiled iFC trigger points.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Microbenchmark for iFC trigger point evaluation.  Each iFC set is
+// evaluated repeatedly against a typical MMTel INVITE with SDP, both as
+// compiled trigger points and (for comparison) parsing and compiling the
+// XML for every request, as handling the ServiceProfile per request would.
+//
+// Usage: ifc_bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <pjlib.h>
+#include <pjsip.h>
+}
+
+#include "rapidxml/rapidxml.hpp"
+#include "triggerpoint.h"
+#include "sessioncase.h"
+
+using namespace rapidxml;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char* INVITE =
+  "INVITE sip:6505551234@homedomain;user=phone SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.64.90.97:50693;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\r\n"
+  "Max-Forwards: 69\r\n"
+  "From: <sip:6505551000@homedomain>;tag=13919SIPpTag0011234\r\n"
+  "To: <sip:6505551234@homedomain>\r\n"
+  "Contact: <sip:6505551000@10.16.62.109:58309;transport=TCP;ob>\r\n"
+  "Accept-Contact: *;+g.3gpp.icsi-ref=\"urn%3Aurn-7%3A3gpp-service.ims.icsi.mmtel\"\r\n"
+  "P-Asserted-Identity: <sip:6505551000@homedomain>\r\n"
+  "Supported: 100rel, timer, gruu\r\n"
+  "Allow: INVITE, ACK, CANCEL, BYE, UPDATE, PRACK, MESSAGE, REFER, NOTIFY, INFO\r\n"
+  "Call-ID: 1-13919@10.151.20.48\r\n"
+  "CSeq: 4 INVITE\r\n"
+  "Content-Type: application/sdp\r\n"
+  "Content-Length: 173\r\n"
+  "\r\n"
+  "v=0\r\n"
+  "o=- 1 1 IN IP4 10.16.62.109\r\n"
+  "s=-\r\n"
+  "c=IN IP4 10.16.62.109\r\n"
+  "t=0 0\r\n"
+  "m=audio 4000 RTP/AVP 0 8 96\r\n"
+  "a=rtpmap:96 AMR-WB/16000\r\n"
+  "m=video 4002 RTP/AVP 97\r\n"
+  "a=rtpmap:97 H264/90000\r\n";
+
+static std::string spt(int group, const std::string& condition, bool negated = false)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "<SPT><ConditionNegated>%d</ConditionNegated><Group>%d</Group>",
+           negated ? 1 : 0, group);
+  return buf + condition + "</SPT>";
+}
+
+static std::string tp(bool cnf, const std::string& spts)
+{
+  return std::string("<TriggerPoint><ConditionTypeCNF>") + (cnf ? "1" : "0") +
+         "</ConditionTypeCNF>" + spts + "</TriggerPoint>";
+}
+
+struct IfcSet
+{
+  const char* name;
+  std::vector<std::string> xml;
+  std::vector<TriggerPoint*> compiled;
+};
+
+static std::vector<IfcSet> build_sets()
+{
+  std::vector<IfcSet> sets;
+
+  // A single MMTel AS, triggered on originating and terminating INVITEs.
+  IfcSet mmtel;
+  mmtel.name = "mmtel";
+  mmtel.xml.push_back(tp(true,
+                         spt(0, "<Method>INVITE</Method>") +
+                         spt(1, "<SessionCase>0</SessionCase>") +
+                         spt(1, "<SessionCase>1</SessionCase>") +
+                         spt(2, "<SIPHeader><Header>Accept-Contact</Header><Content>3gpp-service.ims.icsi.mmtel</Content></SIPHeader>")));
+  sets.push_back(mmtel);
+
+  // A typical subscriber: MMTel, voicemail on some numbers, video
+  // recording, messaging and an unconditional charging AS.
+  IfcSet typical = mmtel;
+  typical.name = "typical";
+  typical.xml.push_back(tp(false,
+                           spt(0, "<Method>INVITE</Method>") +
+                           spt(0, "<SessionCase>2</SessionCase>") +
+                           spt(0, "<RequestURI>^sip:650555[0-9]{4}@</RequestURI>")));
+  typical.xml.push_back(tp(false,
+                           spt(0, "<Method>INVITE</Method>") +
+                           spt(0, "<SessionDescription><Line>m</Line><Content>^video</Content></SessionDescription>")));
+  typical.xml.push_back(tp(false,
+                           spt(0, "<Method>MESSAGE</Method>") +
+                           spt(1, "<SIPHeader><Header>Content-Type</Header><Content>application/vnd.3gpp.sms</Content></SIPHeader>")));
+  typical.xml.push_back(tp(false, ""));
+  sets.push_back(typical);
+
+  // Many criteria that need a full scan of the headers and fail.
+  IfcSet worst;
+  worst.name = "worst";
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    char header[128];
+    snprintf(header, sizeof(header),
+             "<SIPHeader><Header>X-Service-%d</Header><Content>enabled</Content></SIPHeader>", ii);
+    worst.xml.push_back(tp(false,
+                           spt(0, "<Method>INVITE</Method>") +
+                           spt(0, header)));
+  }
+  sets.push_back(worst);
+
+  return sets;
+}
+
+static TriggerPoint* compile(const std::string& xml)
+{
+  xml_document<> doc;
+  doc.parse<0>(doc.allocate_string(xml.c_str()));
+  return TriggerPoint::compile(doc.first_node("TriggerPoint"));
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+
+  pj_init();
+  pj_caching_pool cp;
+  pj_caching_pool_init(&cp, NULL, 0);
+  pjsip_endpoint* endpt;
+  pjsip_endpt_create(&cp.factory, "ifc_bench", &endpt);
+  pj_pool_t* pool = pjsip_endpt_create_pool(endpt, "ifc_bench", 4000, 4000);
+
+  std::string invite(INVITE);
+  pjsip_parser_err_report err;
+  pj_list_init(&err);
+  pjsip_msg* msg = pjsip_parse_msg(pool, &invite[0], invite.length(), &err);
+  if (msg == NULL)
+  {
+    fprintf(stderr, "Failed to parse INVITE\n");
+    return 1;
+  }
+
+  std::vector<IfcSet> sets = build_sets();
+  printf("iFC set  iFCs | matched | compiled ns/req | per-request XML ns/req\n");
+  for (size_t ii = 0; ii < sets.size(); ++ii)
+  {
+    IfcSet& set = sets[ii];
+    for (size_t jj = 0; jj < set.xml.size(); ++jj)
+    {
+      set.compiled.push_back(compile(set.xml[jj]));
+    }
+
+    // Originating and terminating alternately, as sprout sees them.
+    int matched = 0;
+    uint64_t start = now_ns();
+    for (int kk = 0; kk < iterations; ++kk)
+    {
+      const SessionCase& session_case = (kk & 1) ? SessionCase::Terminating : SessionCase::Originating;
+      for (size_t jj = 0; jj < set.compiled.size(); ++jj)
+      {
+        matched += set.compiled[jj]->matches(session_case, msg) ? 1 : 0;
+      }
+    }
+    double compiled_ns = (double)(now_ns() - start) / iterations;
+
+    int xml_iterations = iterations / 100 + 1;
+    start = now_ns();
+    for (int kk = 0; kk < xml_iterations; ++kk)
+    {
+      const SessionCase& session_case = (kk & 1) ? SessionCase::Terminating : SessionCase::Originating;
+      for (size_t jj = 0; jj < set.xml.size(); ++jj)
+      {
+        TriggerPoint* tp = compile(set.xml[jj]);
+        tp->matches(session_case, msg);
+        delete tp;
+      }
+    }
+    double xml_ns = (double)(now_ns() - start) / xml_iterations;
+
+    printf("%-8s %5d | %7.2f | %15.0f | %22.0f\n",
+           set.name,
+           (int)set.xml.size(),
+           (double)matched / iterations,
+           compiled_ns,
+           xml_ns);
+
+    for (size_t jj = 0; jj < set.compiled.size(); ++jj)
+    {
+      delete set.compiled[jj];
+    }
+  }
+
+  pj_pool_release(pool);
+  pjsip_endpt_destroy(endpt);
+  pj_caching_pool_destroy(&cp);
+  return 0;
+}
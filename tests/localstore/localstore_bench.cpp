@@ -0,0 +1,163 @@
+/**
+ * @file @file localstore_bench.cpp Contention benchmark for the LocalStore class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Contention benchmark for the local registration store.  Each thread
+// repeatedly refreshes a binding on a randomly chosen subscriber, using
+// the same get/modify/set loop as the registrar, and the total throughput
+// is compared for a single shard (equivalent to one global lock) and the
+// default number of shards.
+//
+// Usage: localstore_bench [seconds per run] [subscribers]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "regdata.h"
+#include "localstore.h"
+
+using namespace RegData;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct Worker
+{
+  pthread_t thread;
+  Store* store;
+  const std::vector<std::string>* aor_ids;
+  unsigned int seed;
+  volatile bool* stop;
+  uint64_t registers;
+  uint64_t retries;
+};
+
+static void* run_worker(void* p)
+{
+  Worker* w = (Worker*)p;
+  while (!*w->stop)
+  {
+    const std::string& aor_id = (*w->aor_ids)[rand_r(&w->seed) % w->aor_ids->size()];
+    bool set_rc;
+    do
+    {
+      AoR* aor_data = w->store->get_aor_data(aor_id);
+      AoR::Binding* b = aor_data->get_binding("<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1");
+      b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+      b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+      b->_cseq++;
+      b->_expires = time(NULL) + 300;
+      set_rc = w->store->set_aor_data(aor_id, aor_data);
+      delete aor_data;
+      if (!set_rc)
+      {
+        w->retries++;
+      }
+    }
+    while (!set_rc);
+    w->registers++;
+  }
+  return NULL;
+}
+
+static void run(int num_shards,
+                int num_threads,
+                int seconds,
+                const std::vector<std::string>& aor_ids)
+{
+  LocalStore store(num_shards);
+  volatile bool stop = false;
+  std::vector<Worker> workers(num_threads);
+
+  uint64_t start = now_ns();
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    Worker& w = workers[ii];
+    w.store = &store;
+    w.aor_ids = &aor_ids;
+    w.seed = ii + 1;
+    w.stop = &stop;
+    w.registers = 0;
+    w.retries = 0;
+    pthread_create(&w.thread, NULL, run_worker, &w);
+  }
+  sleep(seconds);
+  stop = true;
+
+  uint64_t registers = 0;
+  uint64_t retries = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(workers[ii].thread, NULL);
+    registers += workers[ii].registers;
+    retries += workers[ii].retries;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%6d %7d | %12.0f | %8lu\n",
+         num_shards, num_threads, registers / elapsed, (unsigned long)retries);
+}
+
+int main(int argc, char* argv[])
+{
+  int seconds = (argc > 1) ? atoi(argv[1]) : 2;
+  int num_subscribers = (argc > 2) ? atoi(argv[2]) : 10000;
+
+  std::vector<std::string> aor_ids;
+  char aor_id[64];
+  for (int ii = 0; ii < num_subscribers; ++ii)
+  {
+    snprintf(aor_id, sizeof(aor_id), "sip:65055%05d@homedomain", ii);
+    aor_ids.push_back(aor_id);
+  }
+
+  printf("shards threads | registers/s  | retries\n");
+  for (int num_threads = 1; num_threads <= 16; num_threads *= 2)
+  {
+    run(1, num_threads, seconds, aor_ids);
+    run(LocalStore::DEFAULT_SHARDS, num_threads, seconds, aor_ids);
+  }
+
+  return 0;
+}
@@ -0,0 +1,590 @@
+/**
+ * @file store_bench.cpp Throughput, latency and contention benchmark for the registration stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Benchmark for the registration stores.  Each thread repeatedly picks a
+// subscriber and either reads its bindings or refreshes one of them, using
+// the same get/modify/set loop as the registrar, for each of a range of
+// thread counts.  Subscribers can be chosen with a zipfian skew, so that a
+// few hot AoRs take most of the traffic.  For each run it reports the
+// throughput, the latency percentiles of reads and writes (a write's
+// latency includes its retries), and the proportion of writes rejected
+// because another thread changed the AoR first.
+//
+// The memcached store runs against the servers given with --memcached, or
+// otherwise against an in-process stand-in speaking the same protocol over
+// loopback, which measures the client and store code rather than memcached.
+//
+// Usage: store_bench [--store local|shm|memcached|all]
+//                    [--memcached <host:port>[,<host:port>...]]
+//                    [--cache <entries>]
+//                    [--threads <n>[,<n>...]]
+//                    [--seconds <seconds per run>]
+//                    [--subscribers <n>]
+//                    [--skew <zipf exponent, 0 for uniform>]
+//                    [--bindings <bindings per subscriber>]
+//                    [--reads <percentage of operations that are reads>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+#include "regdata.h"
+#include "localstore.h"
+#include "shmstorefactory.h"
+#include "memcachedstorefactory.h"
+#include "aorcache.h"
+#include "statistic.h"
+#include "utils.h"
+#include "fakememcachedserver.hpp"
+
+using namespace RegData;
+
+// The benchmark doesn't publish statistics, so the near-cache's are
+// discarded.
+Statistic::Statistic(std::string statname) :
+  _statname(statname),
+  _publisher(NULL),
+  _stat_q(MAX_Q_DEPTH)
+{
+}
+
+Statistic::~Statistic()
+{
+}
+
+void Statistic::report_change(std::vector<std::string> new_value)
+{
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Latency histogram with 16 buckets per power of two, so percentiles are
+/// accurate to about 6% whatever the range of latencies.
+class Histogram
+{
+public:
+  Histogram() : _counts(NUM_BUCKETS, 0), _total(0) {}
+
+  void record(uint64_t ns)
+  {
+    _counts[bucket(ns)]++;
+    _total++;
+  }
+
+  void merge(const Histogram& other)
+  {
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+    {
+      _counts[ii] += other._counts[ii];
+    }
+    _total += other._total;
+  }
+
+  uint64_t total() const { return _total; }
+
+  /// The latency (in nanoseconds) that the given fraction of samples are
+  /// no slower than.
+  uint64_t percentile(double fraction) const
+  {
+    uint64_t target = (uint64_t)ceil(fraction * _total);
+    uint64_t seen = 0;
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+    {
+      seen += _counts[ii];
+      if ((seen >= target) && (seen > 0))
+      {
+        return value(ii);
+      }
+    }
+    return 0;
+  }
+
+private:
+  static const int SUB_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  static int bucket(uint64_t ns)
+  {
+    if (ns < SUB_BUCKETS)
+    {
+      return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  }
+
+  static uint64_t value(int bucket)
+  {
+    if (bucket < SUB_BUCKETS)
+    {
+      return bucket;
+    }
+    int msb = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    int sub = bucket % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + sub) << (msb - SUB_BITS);
+  }
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total;
+};
+
+/// Picks subscribers with probability proportional to 1 / rank^skew.
+class ZipfChooser
+{
+public:
+  ZipfChooser(int n, double skew) : _cdf(n)
+  {
+    double sum = 0.0;
+    for (int ii = 0; ii < n; ++ii)
+    {
+      sum += 1.0 / pow(ii + 1, skew);
+      _cdf[ii] = sum;
+    }
+    for (int ii = 0; ii < n; ++ii)
+    {
+      _cdf[ii] /= sum;
+    }
+  }
+
+  int choose(unsigned int* seed) const
+  {
+    double r = (double)rand_r(seed) / ((double)RAND_MAX + 1.0);
+    int index = std::upper_bound(_cdf.begin(), _cdf.end(), r) - _cdf.begin();
+    return std::min(index, (int)_cdf.size() - 1);
+  }
+
+private:
+  std::vector<double> _cdf;
+};
+
+struct Config
+{
+  std::string store;
+  std::list<std::string> memcached_servers;
+  int cache_entries;
+  std::vector<int> threads;
+  int seconds;
+  int subscribers;
+  double skew;
+  int bindings;
+  int read_percent;
+};
+
+struct Worker
+{
+  pthread_t thread;
+  Store* store;
+  const Config* config;
+  const std::vector<std::string>* aor_ids;
+  const ZipfChooser* chooser;
+  unsigned int seed;
+  volatile bool* stop;
+  Histogram reads;
+  Histogram writes;
+  uint64_t write_attempts;
+  uint64_t conflicts;
+};
+
+static std::string binding_id(int index)
+{
+  char id[64];
+  snprintf(id, sizeof(id), "<urn:uuid:00000000-0000-0000-0000-%012d>:1", index);
+  return id;
+}
+
+static void refresh_binding(AoR* aor_data, int index, int now)
+{
+  AoR::Binding* b = aor_data->get_binding(binding_id(index));
+  char uri[64];
+  snprintf(uri, sizeof(uri), "<sip:6505550231@192.91.191.%d:59934;transport=tcp;ob>", index % 256);
+  b->_uri = uri;
+  b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+  b->_cseq++;
+  b->_expires = now + 300;
+  b->_priority = 0;
+  b->_path_headers.clear();
+  b->_path_headers.push_back("<sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob>");
+}
+
+static void* run_worker(void* p)
+{
+  Worker* w = (Worker*)p;
+  while (!*w->stop)
+  {
+    const std::string& aor_id = (*w->aor_ids)[w->chooser->choose(&w->seed)];
+    bool read = ((int)(rand_r(&w->seed) % 100) < w->config->read_percent);
+    uint64_t start = now_ns();
+
+    if (read)
+    {
+      AoR* aor_data = w->store->get_aor_data(aor_id);
+      delete aor_data;
+      w->reads.record(now_ns() - start);
+    }
+    else
+    {
+      int index = rand_r(&w->seed) % w->config->bindings;
+      bool set_rc;
+      do
+      {
+        AoR* aor_data = w->store->get_aor_data(aor_id);
+        if (aor_data == NULL)
+        {
+          // The store failed, so there's nothing to retry.
+          break;
+        }
+        refresh_binding(aor_data, index, time(NULL));
+        set_rc = w->store->set_aor_data(aor_id, aor_data);
+        delete aor_data;
+        w->write_attempts++;
+        if (!set_rc)
+        {
+          w->conflicts++;
+        }
+      }
+      while (!set_rc);
+      w->writes.record(now_ns() - start);
+    }
+  }
+  return NULL;
+}
+
+static Store* create_store(const Config& config,
+                           const std::string& name,
+                           FakeMemcachedServer** server,
+                           AoRCache** cache)
+{
+  *server = NULL;
+  *cache = NULL;
+  if (name == "local")
+  {
+    return new LocalStore();
+  }
+  else if (name == "shm")
+  {
+    return create_shm_store("/sprout-store-bench");
+  }
+  else
+  {
+    std::list<std::string> servers = config.memcached_servers;
+    if (servers.empty())
+    {
+      *server = new FakeMemcachedServer();
+      servers.push_back((*server)->address());
+    }
+    if (config.cache_entries > 0)
+    {
+      *cache = new AoRCache(config.cache_entries, 1000);
+    }
+    return create_memcached_store(servers, 4, *cache);
+  }
+}
+
+static void destroy_store(const std::string& name,
+                          Store* store,
+                          FakeMemcachedServer* server)
+{
+  if (name == "local")
+  {
+    delete store;
+  }
+  else if (name == "shm")
+  {
+    destroy_shm_store(store);
+  }
+  else
+  {
+    destroy_memcached_store(store);
+    delete server;
+  }
+}
+
+/// Give every subscriber its full set of bindings, so that reads and
+/// writes see AoRs of the configured size from the start.
+static void populate(Store* store,
+                     const Config& config,
+                     const std::vector<std::string>& aor_ids)
+{
+  int now = time(NULL);
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    AoR* aor_data = store->get_aor_data(aor_ids[ii]);
+    if (aor_data != NULL)
+    {
+      for (int jj = 0; jj < config.bindings; ++jj)
+      {
+        refresh_binding(aor_data, jj, now);
+      }
+      store->set_aor_data(aor_ids[ii], aor_data);
+      delete aor_data;
+    }
+  }
+}
+
+static void run(const Config& config,
+                const std::string& name,
+                int num_threads,
+                const std::vector<std::string>& aor_ids,
+                const ZipfChooser& chooser)
+{
+  FakeMemcachedServer* server;
+  AoRCache* cache;
+  Store* store = create_store(config, name, &server, &cache);
+  if (store == NULL)
+  {
+    printf("%-9s %7d | store could not be created\n", name.c_str(), num_threads);
+    return;
+  }
+  store->flush_all();
+  populate(store, config, aor_ids);
+
+  volatile bool stop = false;
+  std::vector<Worker> workers(num_threads);
+  uint64_t start = now_ns();
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    Worker& w = workers[ii];
+    w.store = store;
+    w.config = &config;
+    w.aor_ids = &aor_ids;
+    w.chooser = &chooser;
+    w.seed = ii + 1;
+    w.stop = &stop;
+    w.write_attempts = 0;
+    w.conflicts = 0;
+    pthread_create(&w.thread, NULL, run_worker, &w);
+  }
+  sleep(config.seconds);
+  stop = true;
+
+  Histogram reads;
+  Histogram writes;
+  uint64_t write_attempts = 0;
+  uint64_t conflicts = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(workers[ii].thread, NULL);
+    reads.merge(workers[ii].reads);
+    writes.merge(workers[ii].writes);
+    write_attempts += workers[ii].write_attempts;
+    conflicts += workers[ii].conflicts;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%-9s %7d | %10.0f | %7.0f %7.0f %7.0f | %7.0f %7.0f %7.0f | %6.2f%%",
+         name.c_str(),
+         num_threads,
+         (reads.total() + writes.total()) / elapsed,
+         reads.percentile(0.5) / 1e3,
+         reads.percentile(0.99) / 1e3,
+         reads.percentile(0.999) / 1e3,
+         writes.percentile(0.5) / 1e3,
+         writes.percentile(0.99) / 1e3,
+         writes.percentile(0.999) / 1e3,
+         (write_attempts > 0) ? (100.0 * conflicts / write_attempts) : 0.0);
+  if (cache != NULL)
+  {
+    AoRCache::Stats stats = cache->stats();
+    uint64_t lookups = stats.hits + stats.misses;
+    printf(" | %5.1f%%", (lookups > 0) ? (100.0 * stats.hits / lookups) : 0.0);
+  }
+  printf("\n");
+
+  // The memcached store owns its cache.
+  destroy_store(name, store, server);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: store_bench [options]\n"
+          " --store <local|shm|memcached|all>  Store(s) to benchmark (default all)\n"
+          " --memcached <host:port>[,...]      Memcached servers (default an in-process stand-in)\n"
+          " --cache <entries>                  Size of the memcached store's near-cache (default 0)\n"
+          " --threads <n>[,<n>...]             Thread counts to run with (default 1,4,16,64)\n"
+          " --seconds <seconds>                Length of each run (default 2)\n"
+          " --subscribers <n>                  Number of subscribers (default 10000)\n"
+          " --skew <exponent>                  Zipf exponent, 0 for uniform (default 0.99)\n"
+          " --bindings <n>                     Bindings per subscriber (default 2)\n"
+          " --reads <percent>                  Percentage of operations that are reads (default 50)\n");
+}
+
+int main(int argc, char* argv[])
+{
+  Config config;
+  config.store = "all";
+  config.cache_entries = 0;
+  config.seconds = 2;
+  config.subscribers = 10000;
+  config.skew = 0.99;
+  config.bindings = 2;
+  config.read_percent = 50;
+  std::string threads = "1,4,16,64";
+
+  static struct option long_opts[] = {
+    {"store",       required_argument, 0, 's'},
+    {"memcached",   required_argument, 0, 'm'},
+    {"cache",       required_argument, 0, 'c'},
+    {"threads",     required_argument, 0, 't'},
+    {"seconds",     required_argument, 0, 'd'},
+    {"subscribers", required_argument, 0, 'n'},
+    {"skew",        required_argument, 0, 'z'},
+    {"bindings",    required_argument, 0, 'b'},
+    {"reads",       required_argument, 0, 'r'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1)
+  {
+    switch (c)
+    {
+    case 's':
+      config.store = optarg;
+      break;
+
+    case 'm':
+      Utils::split_string(optarg, ',', config.memcached_servers, 0, true);
+      break;
+
+    case 'c':
+      config.cache_entries = atoi(optarg);
+      break;
+
+    case 't':
+      threads = optarg;
+      break;
+
+    case 'd':
+      config.seconds = atoi(optarg);
+      break;
+
+    case 'n':
+      config.subscribers = atoi(optarg);
+      break;
+
+    case 'z':
+      config.skew = atof(optarg);
+      break;
+
+    case 'b':
+      config.bindings = atoi(optarg);
+      break;
+
+    case 'r':
+      config.read_percent = atoi(optarg);
+      break;
+
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  std::list<std::string> thread_counts;
+  Utils::split_string(threads, ',', thread_counts, 0, true);
+  for (std::list<std::string>::const_iterator i = thread_counts.begin();
+       i != thread_counts.end();
+       ++i)
+  {
+    config.threads.push_back(atoi(i->c_str()));
+  }
+
+  std::vector<std::string> stores;
+  if (config.store == "all")
+  {
+    stores.push_back("local");
+    stores.push_back("shm");
+    stores.push_back("memcached");
+  }
+  else if ((config.store == "local") ||
+           (config.store == "shm") ||
+           (config.store == "memcached"))
+  {
+    stores.push_back(config.store);
+  }
+
+  if ((stores.empty()) ||
+      (config.threads.empty()) ||
+      (config.subscribers <= 0) ||
+      (config.bindings <= 0))
+  {
+    usage();
+    return 1;
+  }
+
+  std::vector<std::string> aor_ids;
+  char aor_id[64];
+  for (int ii = 0; ii < config.subscribers; ++ii)
+  {
+    snprintf(aor_id, sizeof(aor_id), "sip:65055%05d@homedomain", ii);
+    aor_ids.push_back(aor_id);
+  }
+  ZipfChooser chooser(config.subscribers, config.skew);
+
+  printf("%d subscribers, skew %.2f, %d bindings each, %d%% reads, %ds per run\n",
+         config.subscribers, config.skew, config.bindings, config.read_percent, config.seconds);
+  printf("store     threads |      ops/s |   read latency (us)     |  write latency (us)     |    CAS%s\n",
+         (config.cache_entries > 0) ? "    | cache" : "");
+  printf("                  |            |     p50     p99   p99.9 |     p50     p99   p99.9 | conflicts%s\n",
+         (config.cache_entries > 0) ? " |  hits" : "");
+  for (size_t ii = 0; ii < stores.size(); ++ii)
+  {
+    for (size_t jj = 0; jj < config.threads.size(); ++jj)
+    {
+      run(config, stores[ii], config.threads[jj], aor_ids, chooser);
+    }
+  }
+
+  return 0;
+}